@@ -0,0 +1,87 @@
+/* Helpers shared by the benchmarks: a clock, corpus loading and reporting */
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "unrealircd.h"
+
+/* Lines of a corpus file, newline stripped */
+typedef struct BenchLines {
+	char **line;
+	size_t count;
+} BenchLines;
+
+static inline uint64_t bench_nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** Read a whole file, NUL terminated. Returns NULL (and prints why) on error. */
+static inline char *bench_read_file(const char *path, size_t *len)
+{
+	FILE *f = fopen(path, "rb");
+	char *buf;
+	long size;
+
+	if (!f)
+	{
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	buf = safe_alloc(size + 1);
+	if (size && fread(buf, 1, size, f) != (size_t)size)
+	{
+		fprintf(stderr, "%s: short read\n", path);
+		fclose(f);
+		free(buf);
+		return NULL;
+	}
+	fclose(f);
+	*len = size;
+	return buf;
+}
+
+/** Split a file into lines. Returns 0 on error. */
+static inline int bench_read_lines(const char *path, BenchLines *lines)
+{
+	size_t len, alloc = 0;
+	char *buf = bench_read_file(path, &len);
+	char *p, *nl;
+
+	if (!buf)
+		return 0;
+	lines->line = NULL;
+	lines->count = 0;
+	for (p = buf; *p; p = nl + 1)
+	{
+		if (!(nl = strchr(p, '\n')))
+			nl = p + strlen(p) - 1;
+		else
+			*nl = '\0';
+		if (lines->count == alloc)
+		{
+			alloc = alloc ? alloc * 2 : 1024;
+			lines->line = realloc(lines->line, alloc * sizeof(char *));
+		}
+		/* Cut like the server does, a message never gets longer than this */
+		if (strlen(p) >= BUFSIZE)
+			p[BUFSIZE - 1] = '\0';
+		lines->line[lines->count++] = p;
+		if (!nl[1])
+			break;
+	}
+	return 1;
+}
+
+/** Print one result line: total time and time per operation. */
+static inline void bench_report(const char *name, uint64_t ns, size_t ops)
+{
+	printf("%-40s %10.2f ms %10.1f ns/op  (%zu ops)\n", name, ns / 1e6, ops ? (double)ns / ops : 0.0, ops);
+}
+
+#endif
@@ -0,0 +1,119 @@
+/* Benchmarks for the obsidianirc.c account index: loading it from the
+ * database and from a snapshot, lookups by name, and account2json().
+ *
+ * Usage: bench_accounts accounts.db
+ */
+#include "../obsidianirc.c"
+#include "bench.h"
+
+#define LOOKUPS 1000000
+#define JSON_ACCOUNTS 100000
+
+/** Names to look up: ones from the index, and the same with a suffix nobody registered */
+static char **pick_names(int miss)
+{
+	char **names = safe_alloc(sizeof(char *) * LOOKUPS);
+	size_t i;
+
+	for (i = 0; i < LOOKUPS; i++)
+	{
+		Account *acc = accounts_by_id.items[getrandom32() % accounts_by_id.count];
+		char buf[ACCOUNTLEN + 8];
+
+		snprintf(buf, sizeof(buf), "%s%s", acc->name, miss ? "_0x" : "");
+		/* Clients rarely type names in the case they were registered in */
+		if (getrandom8() & 1)
+			buf[0] = toupper((unsigned char)buf[0]);
+		names[i] = strdup(buf);
+	}
+	return names;
+}
+
+static void bench_lookups(const char *label, int miss)
+{
+	char **names = pick_names(miss);
+	size_t found = 0, i;
+	uint64_t start = bench_nsec();
+
+	for (i = 0; i < LOOKUPS; i++)
+	{
+		if (find_account(names[i]))
+			found++;
+	}
+	bench_report(label, bench_nsec() - start, LOOKUPS);
+	printf("  %zu found\n", found);
+	for (i = 0; i < LOOKUPS; i++)
+		free(names[i]);
+	free(names);
+}
+
+static void bench_account2json(void)
+{
+	size_t bytes = 0, i, n = MIN(accounts_by_id.count, JSON_ACCOUNTS);
+	uint64_t start = bench_nsec();
+
+	for (i = 0; i < n; i++)
+	{
+		json_t *j = account2json(accounts_by_id.items[i]);
+		char *str = json_dumps(j, JSON_COMPACT);
+
+		bytes += strlen(str);
+		free(str);
+		json_decref(j);
+	}
+	bench_report("account2json + json_dumps", bench_nsec() - start, n);
+	printf("  %zu bytes of JSON\n", bytes);
+}
+
+int main(int argc, char **argv)
+{
+	char snapshot[PATH_MAX];
+	uint64_t start;
+
+	if (argc < 2)
+	{
+		fprintf(stderr, "Usage: %s accounts.db\n", argv[0]);
+		return 1;
+	}
+	siphash_generate_key(account_hashkey);
+	if (open_database(argv[1]) != SQLITE_OK)
+	{
+		fprintf(stderr, "%s: could not open the database\n", argv[1]);
+		return 1;
+	}
+
+	if (!load_account_cache())
+		return 1;
+	bench_report(account_stats.cache_from_snapshot ? "load_account_cache (from " OBSIDIAN_SNAPSHOT ")" : "load_account_cache (from the db)",
+	             account_stats.cache_load_ns, account_count);
+	if (!account_count)
+	{
+		fprintf(stderr, "%s: no accounts\n", argv[1]);
+		return 1;
+	}
+
+	snprintf(snapshot, sizeof(snapshot), "%s.snap", argv[1]);
+	start = bench_nsec();
+	if (!write_account_snapshot(snapshot))
+	{
+		fprintf(stderr, "%s: %s\n", snapshot, strerror(errno));
+		return 1;
+	}
+	bench_report("write_account_snapshot", bench_nsec() - start, account_count);
+	free_account_cache();
+	start = bench_nsec();
+	if (!load_account_snapshot(snapshot))
+	{
+		fprintf(stderr, "%s: not usable\n", snapshot);
+		return 1;
+	}
+	bench_report("load_account_snapshot", bench_nsec() - start, account_count);
+
+	bench_lookups("find_account (hit)", 0);
+	bench_lookups("find_account (miss)", 1);
+	bench_account2json();
+
+	free_account_cache();
+	close_database();
+	return 0;
+}
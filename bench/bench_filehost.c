@@ -0,0 +1,152 @@
+/* Benchmarks for the o-filehost.c hot paths: finding the URL in every
+ * channel message and scanning the <head> of fetched pages.
+ * extract_url_from_message() is compared against what it did before
+ * the find_url_candidate() pre-filter: the URL regex on every message.
+ *
+ * Usage: bench_filehost chat.txt [head.html ...]
+ */
+#include "../o-filehost.c"
+#include "bench.h"
+
+#define CHAT_PASSES 20
+#define HEAD_PASSES 2000
+
+static void free_html_head(HtmlHeadInfo *info)
+{
+	safe_free(info->title);
+	safe_free(info->description);
+	safe_free(info->og_description);
+	safe_free(info->og_image);
+	safe_free(info->twitter_image);
+}
+
+/** extract_url_from_message() without the pre-filter, the regex runs on every message */
+static char *extract_url_regex_only(const char *text)
+{
+	return regex_capture(LP_RE_URL, text, 0, MAX_URL_LENGTH);
+}
+
+/** The floor for any scan: one strlen() pass over the message, never finds anything */
+static char *single_pass(const char *text)
+{
+	volatile size_t len = strlen(text);
+
+	(void)len;
+	return NULL;
+}
+
+/** Time one extractor over a set of messages, like link_preview_chanmsg() calls it. Returns how many had a URL. */
+static size_t time_extract(const char *name, char *(*extract)(const char *), char **lines, size_t count)
+{
+	size_t found = 0, i;
+	int pass;
+	uint64_t start = bench_nsec();
+
+	for (pass = 0; pass < CHAT_PASSES; pass++)
+	{
+		for (i = 0; i < count; i++)
+		{
+			char *url = extract(lines[i]);
+
+			if (url)
+			{
+				found++;
+				free(url);
+			}
+		}
+	}
+	bench_report(name, bench_nsec() - start, count * CHAT_PASSES);
+	return found / CHAT_PASSES;
+}
+
+static void bench_extract_url(const BenchLines *chat)
+{
+	char **plain = safe_alloc(sizeof(char *) * chat->count);
+	char **links = safe_alloc(sizeof(char *) * chat->count);
+	size_t nplain = 0, nlinks = 0, mismatches = 0, bytes = 0, i;
+
+	/* Both must find the same URL in every message, or the timings mean nothing */
+	for (i = 0; i < chat->count; i++)
+	{
+		char *old = extract_url_regex_only(chat->line[i]);
+		char *new = extract_url_from_message(chat->line[i]);
+
+		if ((!old != !new) || (old && strcmp(old, new)))
+			mismatches++;
+		if (old)
+			links[nlinks++] = chat->line[i];
+		else
+			plain[nplain++] = chat->line[i];
+		bytes += strlen(chat->line[i]);
+		safe_free(old);
+		safe_free(new);
+	}
+	printf("%zu messages, %zu with a URL, %.1f bytes on average\n", chat->count, nlinks, (double)bytes / chat->count);
+	if (mismatches)
+		printf("  WARNING: %zu messages where the two disagree\n", mismatches);
+
+	time_extract("regex only (all messages)", extract_url_regex_only, chat->line, chat->count);
+	time_extract("extract_url_from_message (all messages)", extract_url_from_message, chat->line, chat->count);
+	time_extract("one strlen() pass (no URL)", single_pass, plain, nplain);
+	time_extract("regex only (no URL)", extract_url_regex_only, plain, nplain);
+	time_extract("extract_url_from_message (no URL)", extract_url_from_message, plain, nplain);
+	time_extract("regex only (with a URL)", extract_url_regex_only, links, nlinks);
+	time_extract("extract_url_from_message (with a URL)", extract_url_from_message, links, nlinks);
+	free(plain);
+	free(links);
+}
+
+static void bench_parse_html_head(int count, char **paths)
+{
+	uint64_t total = 0;
+	size_t ops = 0;
+	int i, pass;
+
+	for (i = 0; i < count; i++)
+	{
+		HtmlHeadInfo info;
+		size_t len;
+		char *html = bench_read_file(paths[i], &len);
+		uint64_t start;
+
+		if (!html)
+			continue;
+		start = bench_nsec();
+		for (pass = 0; pass < HEAD_PASSES; pass++)
+		{
+			memset(&info, 0, sizeof(info));
+			parse_html_head(html, len, &info);
+			free_html_head(&info);
+		}
+		total += bench_nsec() - start;
+		ops += HEAD_PASSES;
+
+		memset(&info, 0, sizeof(info));
+		parse_html_head(html, len, &info);
+		printf("  %s: %zu bytes, %s title, image %s\n", unreal_getfilename(paths[i]), len,
+		       info.title ? "has a" : "no", info.og_image ? info.og_image : info.twitter_image ? info.twitter_image : "none");
+		free_html_head(&info);
+		free(html);
+	}
+	bench_report("parse_html_head", total, ops);
+}
+
+int main(int argc, char **argv)
+{
+	BenchLines chat;
+
+	if (argc < 2)
+	{
+		fprintf(stderr, "Usage: %s chat.txt [head.html ...]\n", argv[0]);
+		return 1;
+	}
+	if (!compile_link_preview_regexes() || !bench_read_lines(argv[1], &chat))
+		return 1;
+
+	bench_extract_url(&chat);
+	if (argc > 2)
+		bench_parse_html_head(argc - 2, argv + 2);
+
+	free_link_preview_regexes();
+	return 0;
+}
@@ -0,0 +1,52 @@
+#!/usr/bin/env python3
+"""Creates an accounts database with the given number of rows.
+
+Only the original accounts table is created, obsidianirc.c migrates the
+rest when it opens the file, like it does for an old server. Every account
+has the same argon2id hash (of "benchmark"): the benchmarks never verify
+passwords, and hashing a million of them would take hours. Seeded, so the
+same row count always gives the same names.
+
+Usage: gen_accounts.py rows file.db
+"""
+import random
+import sqlite3
+import sys
+
+HASH = "$argon2id$v=19$m=65536,t=3,p=1$YmVuY2htYXJrc2FsdA$0Cq3Q5bL0y7w0o3m8cR3n2Kx0pQ1Smh2kqY5nZ2Jb6U"
+SYLLABLES = ["ka", "ri", "to", "mo", "ne", "zu", "la", "shi", "en", "or", "ax", "el", "dra", "kin", "vo", "ny"]
+DOMAINS = ["gmail.com", "outlook.com", "proton.me", "yahoo.com", "example.org", "fastmail.com", "gmx.de", "mail.ru"]
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit(__doc__.strip())
+    rows = int(sys.argv[1])
+    rng = random.Random(rows)
+    db = sqlite3.connect(sys.argv[2])
+    db.execute("CREATE TABLE accounts (id INTEGER PRIMARY KEY AUTOINCREMENT, name TEXT, email TEXT, "
+               "password TEXT, time_registered INTEGER, verified INTEGER)")
+    seen = set()
+    batch = []
+    registered = 1500000000
+    while len(seen) < rows:
+        name = "".join(rng.choice(SYLLABLES) for _ in range(rng.randint(2, 4)))
+        if rng.random() < 0.4:
+            name += str(rng.randint(0, 9999))
+        if rng.random() < 0.2:
+            name = name.capitalize()
+        if name.lower() in seen or len(name) > 30:
+            continue
+        seen.add(name.lower())
+        registered += rng.randint(1, 300)
+        batch.append((name, "%s@%s" % (name.lower(), rng.choice(DOMAINS)), HASH, registered, int(rng.random() < 0.8)))
+        if len(batch) == 10000:
+            db.executemany("INSERT INTO accounts (name, email, password, time_registered, verified) VALUES (?, ?, ?, ?, ?)", batch)
+            batch = []
+    db.executemany("INSERT INTO accounts (name, email, password, time_registered, verified) VALUES (?, ?, ?, ?, ?)", batch)
+    db.commit()
+    db.close()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,83 @@
+#!/usr/bin/env python3
+"""Writes a synthetic channel log, one message per line, to stdout.
+
+Modelled on busy public channels: mostly short lines, some long ones,
+times, smileys and the odd "foo:bar" that is not a link, and a URL in
+about one message out of fifteen. Seeded, so every run gives the same file.
+
+Usage: gen_chat.py [lines]
+"""
+import random
+import sys
+
+WORDS = """the a to and is it that of you i in for on this with be have but not
+what so just was are at if can do my me we no yes ok lol like get all there
+about out up one think know how when thanks now some time would they will
+anyone here still works build server client channel nick ping release bug
+patch commit branch merge config error warning docker module sasl account
+password login lag netsplit topic mode op voice ban kick quit ircv3 tls cert
+""".split()
+STARTS = ["", "", "", "", "hey ", "btw ", "so ", "ok ", "hmm ", "well "]
+ENDS = ["", "", "", "", ".", "?", "!", " :)", " :D", " :P", " ^^", " xD", "..."]
+NICKS = ["alice", "bob", "carol", "dave", "erin", "frank", "grace", "heidi", "ivan", "judy", "mallory", "oscar", "peggy", "trent", "victor", "walter"]
+NOTURLS = [
+    "at 12:30", "see line 80:12", "ratio 16:9", "std::string", "mailto:x", "C:\\Users\\foo",
+    "re: yesterday", "note: not a link", "10:45:01", "ipv6 [::1]", "ftp:// is dead", "http: 500",
+]
+HOSTS = ["github.com", "en.wikipedia.org", "www.youtube.com", "youtu.be", "news.ycombinator.com",
+         "www.reddit.com", "docs.python.org", "example.org", "i.imgur.com", "gitlab.com",
+         "www.bbc.co.uk", "stackoverflow.com", "twitter.com", "x.com", "pastebin.com"]
+PATHS = ["", "/", "/obsidianirc/UnrealIRCd-Modules/pull/42", "/wiki/Internet_Relay_Chat",
+         "/watch?v=dQw4w9WgXcQ", "/item?id=38291045", "/r/irc/comments/abc123/some_title/",
+         "/3/library/re.html#module-re", "/a/B9f2x.png", "/questions/1234567/how-to-x",
+         "/news/technology-67890123", "/status/1728391029384756", "/raw/Xy12Ab34",
+         "/search?q=unrealircd+modules&ref=chat&utm_source=irc", "/blob/main/README.md#L10-L20"]
+
+
+def sentence(rng, n):
+    return " ".join(rng.choice(WORDS) for _ in range(n))
+
+
+def url(rng):
+    scheme = "https" if rng.random() < 0.9 else "http"
+    return "%s://%s%s" % (scheme, rng.choice(HOSTS), rng.choice(PATHS))
+
+
+def line(rng):
+    r = rng.random()
+    if r < 0.55:
+        text = sentence(rng, rng.randint(1, 8))
+    elif r < 0.85:
+        text = sentence(rng, rng.randint(8, 25))
+    else:
+        text = sentence(rng, rng.randint(25, 70))
+    if rng.random() < 0.25:
+        text = rng.choice(NICKS) + ": " + text
+    if rng.random() < 0.06:
+        words = text.split(" ")
+        words.insert(rng.randint(0, len(words)), rng.choice(NOTURLS))
+        text = " ".join(words)
+    if rng.random() < 0.065:
+        words = text.split(" ")
+        where = rng.random()
+        u = url(rng)
+        if where < 0.4:
+            words.append(u)
+        elif where < 0.6:
+            words.insert(0, u)
+        else:
+            words.insert(rng.randint(0, len(words)), "<%s>" % u if rng.random() < 0.1 else u)
+        text = " ".join(words)
+    return rng.choice(STARTS) + text + rng.choice(ENDS)
+
+
+def main():
+    count = int(sys.argv[1]) if len(sys.argv) > 1 else 200000
+    rng = random.Random(0x0b51d1a)
+    out = sys.stdout
+    for _ in range(count):
+        out.write(line(rng) + "\n")
+
+
+if __name__ == "__main__":
+    main()
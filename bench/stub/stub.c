@@ -0,0 +1,372 @@
+/* The server side of bench/stub/unrealircd.h. What a benchmark actually
+ * reaches (SipHash, the string helpers, config_error() and friends) works
+ * like it does in UnrealIRCd, everything else does nothing and returns 0
+ * or NULL so the modules link.
+ */
+#include "unrealircd.h"
+#include <sys/random.h>
+
+TKL *tklines[TKL_NAME + 1];
+Configuration iConf;
+Client me = { .name = "bench.local", .id = "001" };
+struct list_head client_list, lclient_list, server_list;
+int loop_ircstats;
+time_t timeofday;
+struct timeval timeofday_tv;
+
+/* Errors and warnings, printed so a failed setup says why */
+
+static void vreport(const char *prefix, const char *fmt, va_list vl)
+{
+	fprintf(stderr, "%s", prefix);
+	vfprintf(stderr, fmt, vl);
+	fputc('\n', stderr);
+}
+
+void config_error(const char *fmt, ...)
+{
+	va_list vl;
+
+	va_start(vl, fmt);
+	vreport("error: ", fmt, vl);
+	va_end(vl);
+}
+
+void config_warn(const char *fmt, ...)
+{
+	va_list vl;
+
+	va_start(vl, fmt);
+	vreport("warning: ", fmt, vl);
+	va_end(vl);
+}
+
+void config_status(const char *fmt, ...)
+{
+	va_list vl;
+
+	va_start(vl, fmt);
+	vreport("", fmt, vl);
+	va_end(vl);
+}
+
+void outofmemory(size_t bytes)
+{
+	fprintf(stderr, "out of memory allocating %zu bytes\n", bytes);
+	abort();
+}
+
+/* SipHash-2-4, as in src/hash.c */
+
+#define ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+#define U8TO64_LE(p) \
+	(((uint64_t)((p)[0])) | ((uint64_t)((p)[1]) << 8) | ((uint64_t)((p)[2]) << 16) | ((uint64_t)((p)[3]) << 24) | \
+	 ((uint64_t)((p)[4]) << 32) | ((uint64_t)((p)[5]) << 40) | ((uint64_t)((p)[6]) << 48) | ((uint64_t)((p)[7]) << 56))
+#define SIPROUND \
+	do { \
+		v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32); \
+		v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; \
+		v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; \
+		v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32); \
+	} while(0)
+
+uint64_t siphash_raw(const char *in, size_t len, const char *k)
+{
+	const unsigned char *p = (const unsigned char *)in;
+	const unsigned char *key = (const unsigned char *)k;
+	uint64_t k0 = U8TO64_LE(key);
+	uint64_t k1 = U8TO64_LE(key + 8);
+	uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+	uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+	uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+	uint64_t v3 = 0x7465646279746573ULL ^ k1;
+	uint64_t b = ((uint64_t)len) << 56;
+	const unsigned char *end = p + len - (len % 8);
+	uint64_t m;
+
+	for (; p != end; p += 8)
+	{
+		m = U8TO64_LE(p);
+		v3 ^= m;
+		SIPROUND;
+		SIPROUND;
+		v0 ^= m;
+	}
+	switch (len & 7)
+	{
+		case 7: b |= ((uint64_t)p[6]) << 48; /* fallthrough */
+		case 6: b |= ((uint64_t)p[5]) << 40; /* fallthrough */
+		case 5: b |= ((uint64_t)p[4]) << 32; /* fallthrough */
+		case 4: b |= ((uint64_t)p[3]) << 24; /* fallthrough */
+		case 3: b |= ((uint64_t)p[2]) << 16; /* fallthrough */
+		case 2: b |= ((uint64_t)p[1]) << 8; /* fallthrough */
+		case 1: b |= ((uint64_t)p[0]); break;
+		case 0: break;
+	}
+	v3 ^= b;
+	SIPROUND;
+	SIPROUND;
+	v0 ^= b;
+	v2 ^= 0xff;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+uint64_t siphash(const char *in, const char *k)
+{
+	return siphash_raw(in, strlen(in), k);
+}
+
+uint64_t siphash_nocase(const char *in, const char *k)
+{
+	char buf[512];
+	size_t len = strlen(in);
+	size_t i;
+
+	if (len >= sizeof(buf))
+		len = sizeof(buf) - 1;
+	for (i = 0; i < len; i++)
+		buf[i] = tolower((unsigned char)in[i]);
+	return siphash_raw(buf, len, k);
+}
+
+void siphash_generate_key(char *k)
+{
+	int i;
+
+	for (i = 0; i < SIPHASH_KEY_LENGTH; i++)
+		k[i] = getrandom8();
+}
+
+unsigned int getrandom32(void)
+{
+	unsigned int v;
+
+	if (getrandom(&v, sizeof(v), 0) != sizeof(v))
+		v = (unsigned int)random();
+	return v;
+}
+
+unsigned char getrandom8(void)
+{
+	return getrandom32() & 0xff;
+}
+
+void gen_random_alnum(char *buf, int numbytes)
+{
+	static const char chars[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+
+	for (; numbytes > 0; numbytes--)
+		*buf++ = chars[getrandom32() % (sizeof(chars) - 1)];
+	*buf = '\0';
+}
+
+/* Strings */
+
+size_t strlcpy(char *dst, const char *src, size_t size)
+{
+	size_t len = strlen(src);
+
+	if (size)
+	{
+		size_t n = len >= size ? size - 1 : len;
+		memcpy(dst, src, n);
+		dst[n] = '\0';
+	}
+	return len;
+}
+
+size_t strlcat(char *dst, const char *src, size_t size)
+{
+	size_t dlen = strnlen(dst, size);
+
+	if (dlen == size)
+		return size + strlen(src);
+	return dlen + strlcpy(dst + dlen, src, size - dlen);
+}
+
+char *strtoken(char **save, char *str, const char *fs)
+{
+	char *pos = *save;
+	char *tmp;
+
+	if (str)
+		pos = str;
+	while (pos && *pos && strchr(fs, *pos))
+		pos++;
+	if (!pos || !*pos)
+		return (pos = *save = NULL);
+	tmp = pos;
+	while (*pos && !strchr(fs, *pos))
+		pos++;
+	if (*pos)
+		*pos++ = '\0';
+	else
+		pos = NULL;
+	*save = pos;
+	return tmp;
+}
+
+char *our_strcasestr(const char *haystack, const char *needle)
+{
+	return strcasestr(haystack, needle);
+}
+
+int match_simple(const char *mask, const char *name)
+{
+	return !strcasecmp(mask, name);
+}
+
+void addmultiline(MultiLine **l, const char *line)
+{
+	MultiLine *m = safe_alloc(sizeof(MultiLine));
+	MultiLine *last;
+
+	m->line = strdup(line);
+	if (!*l)
+	{
+		*l = m;
+		return;
+	}
+	for (last = *l; last->next; last = last->next)
+		;
+	last->next = m;
+	m->prev = last;
+}
+
+void freemultiline(MultiLine *l)
+{
+	MultiLine *next;
+
+	for (; l; l = next)
+	{
+		next = l->next;
+		free(l->line);
+		free(l);
+	}
+}
+
+const char *json_object_get_string(json_t *j, const char *name)
+{
+	json_t *v = j ? json_object_get(j, name) : NULL;
+
+	return json_is_string(v) ? json_string_value(v) : NULL;
+}
+
+json_int_t json_object_get_integer(json_t *j, const char *name, json_int_t default_value)
+{
+	json_t *v = j ? json_object_get(j, name) : NULL;
+
+	return json_is_integer(v) ? json_integer_value(v) : default_value;
+}
+
+int json_object_get_boolean(json_t *j, const char *name, int default_value)
+{
+	json_t *v = j ? json_object_get(j, name) : NULL;
+
+	if (json_is_true(v))
+		return 1;
+	if (json_is_false(v))
+		return 0;
+	return default_value;
+}
+
+time_t TStime(void)
+{
+	return time(NULL);
+}
+
+char *unreal_getfilename(char *path)
+{
+	char *p = strrchr(path, '/');
+
+	return p ? p + 1 : path;
+}
+
+/* Everything below is server state the benchmarks never get to */
+
+int tkl_hash(unsigned int c) { (void)c; return 0; }
+int TKLIsNameBan(TKL *tkl) { (void)tkl; return 0; }
+int IsServer(Client *c) { (void)c; return 0; }
+int IsULine(Client *c) { (void)c; return 0; }
+int IsMe(Client *c) { return c == &me; }
+int IsDead(Client *c) { (void)c; return 0; }
+int IsLoggedIn(Client *c) { return c && c->user && *c->user->account && strcmp(c->user->account, "0"); }
+int IsUser(Client *c) { return c && c->user; }
+int IsOper(Client *c) { (void)c; return 0; }
+int IsSecure(Client *c) { (void)c; return 0; }
+int ValidatePermissionsForPath(const char *path, Client *c, Client *v, Channel *ch, const void *x) { (void)path; (void)c; (void)v; (void)ch; (void)x; return 0; }
+long config_checkval(const char *value, unsigned short flags) { (void)flags; return value ? atol(value) : 0; }
+int config_parse_flood(const char *s, int *a, int *b) { (void)s; *a = *b = 0; return 0; }
+ModDataInfo *ModDataAdd(Module *m, ModDataInfo req)
+{
+	static int slot;
+	ModDataInfo *md = safe_alloc(sizeof(ModDataInfo));
+
+	(void)m;
+	*md = req;
+	md->slot = slot++ % 32;
+	return md;
+}
+int moddata_client_set(Client *c, const char *name, const char *value) { (void)c; (void)name; (void)value; return 0; }
+const char *moddata_client_get(Client *c, const char *name) { (void)c; (void)name; return NULL; }
+ClientCapability *ClientCapabilityAdd(Module *m, ClientCapabilityInfo *i, long *cap) { (void)m; (void)i; if (cap) *cap = 0; return NULL; }
+long ClientCapabilityBit(const char *name) { (void)name; return 0; }
+int HasCapability(Client *c, const char *name) { (void)c; (void)name; return 0; }
+void *HookAddMain(Module *m, int type, int prio, void *func) { (void)m; (void)type; (void)prio; (void)func; return NULL; }
+void *CommandAdd(Module *m, const char *cmd, void (*func)(Client *, MessageTag *, int, const char *[]), int params, int flags) { (void)m; (void)cmd; (void)func; (void)params; (void)flags; return NULL; }
+int RPCHandlerAdd(Module *m, RPCHandlerInfo *r) { (void)m; (void)r; return 0; }
+void *MessageTagHandlerAdd(Module *m, MessageTagHandlerInfo *mtag) { (void)m; (void)mtag; return NULL; }
+Event *EventAdd(Module *m, const char *name, void (*event)(void *), void *data, long every_msec, int count) { (void)m; (void)name; (void)event; (void)data; (void)every_msec; (void)count; return NULL; }
+void EventDel(Event *e) { (void)e; }
+ISupport *ISupportAdd(Module *m, const char *token, const char *value) { (void)m; (void)token; (void)value; return NULL; }
+void ModuleSetOptions(Module *m, int options, int action) { (void)m; (void)options; (void)action; }
+int RegisterApiCallbackWebResponse(Module *m, const char *name, void (*func)(OutgoingWebRequest *, OutgoingWebResponse *)) { (void)m; (void)name; (void)func; return 0; }
+void url_start_async(OutgoingWebRequest *r) { (void)r; }
+void add_nvplist(NameValuePrioList **l, int prio, const char *name, const char *value) { (void)l; (void)prio; (void)name; (void)value; }
+void sendto_one(Client *to, MessageTag *mtags, const char *pattern, ...) { (void)to; (void)mtags; (void)pattern; }
+void sendnumeric(Client *to, int numeric, ...) { (void)to; (void)numeric; }
+void sendnumericfmt(Client *to, int numeric, const char *pattern, ...) { (void)to; (void)numeric; (void)pattern; }
+void sendnotice(Client *to, const char *pattern, ...) { (void)to; (void)pattern; }
+void sendtxtnumeric(Client *to, const char *pattern, ...) { (void)to; (void)pattern; }
+void sendto_server(Client *one, unsigned long caps, unsigned long nocaps, MessageTag *mtags, const char *pattern, ...) { (void)one; (void)caps; (void)nocaps; (void)mtags; (void)pattern; }
+void sendto_channel(Channel *ch, Client *from, Client *skip, const char *prefix, long cap, int sendflags, MessageTag *mtags, const char *pattern, ...) { (void)ch; (void)from; (void)skip; (void)prefix; (void)cap; (void)sendflags; (void)mtags; (void)pattern; }
+void sendto_local_common_channels(Client *user, Client *skip, long cap, MessageTag *mtags, const char *pattern, ...) { (void)user; (void)skip; (void)cap; (void)mtags; (void)pattern; }
+void new_message(Client *sender, MessageTag *recv_mtags, MessageTag **mtag_list) { (void)sender; (void)recv_mtags; *mtag_list = NULL; }
+void new_message_special(Client *sender, MessageTag *recv_mtags, MessageTag **mtag_list, const char *pattern, ...) { (void)sender; (void)recv_mtags; (void)pattern; *mtag_list = NULL; }
+void free_message_tags(MessageTag *m) { (void)m; }
+MessageTag *find_mtag(MessageTag *mtags, const char *token) { (void)mtags; (void)token; return NULL; }
+Channel *find_channel(const char *name) { (void)name; return NULL; }
+Client *find_client(const char *name, Client *requester) { (void)name; (void)requester; return NULL; }
+Client *find_user(const char *name, Client *requester) { (void)name; (void)requester; return NULL; }
+Client *find_server(const char *name, Client *requester) { (void)name; (void)requester; return NULL; }
+Client *hash_find_id(const char *id, Client *cptr) { (void)id; (void)cptr; return NULL; }
+void user_account_login(MessageTag *recv_mtags, Client *client) { (void)recv_mtags; (void)client; }
+void add_fake_lag(Client *client, long msec) { (void)client; (void)msec; }
+int decode_authenticate_plain(const char *param, char **authorization_id, char **authentication_id, char **passwd) { (void)param; (void)authorization_id; (void)authentication_id; (void)passwd; return 0; }
+const char *Auth_Hash(int type, const char *text) { (void)type; (void)text; return NULL; }
+void unreal_log(int loglevel, const char *subsystem, const char *event_id, Client *client, const char *msg, ...) { (void)loglevel; (void)subsystem; (void)event_id; (void)client; (void)msg; }
+LogData *log_data_string(const char *key, const char *str) { (void)key; (void)str; return NULL; }
+LogData *log_data_integer(const char *key, int64_t integer) { (void)key; (void)integer; return NULL; }
+LogData *log_data_client(const char *key, Client *client) { (void)key; (void)client; return NULL; }
+void rpc_error(Client *client, json_t *request, int error_code, const char *error_message) { (void)client; (void)request; (void)error_code; (void)error_message; }
+void rpc_error_fmt(Client *client, json_t *request, int error_code, const char *fmt, ...) { (void)client; (void)request; (void)error_code; (void)fmt; }
+void rpc_response(Client *client, json_t *request, json_t *result) { (void)client; (void)request; (void)result; }
+void json_expand_client(json_t *j, const char *key, Client *client, int detail) { (void)j; (void)key; (void)client; (void)detail; }
+int fd_open(int fd, const char *desc, int close_flags) { (void)desc; (void)close_flags; return fd; }
+void fd_close(int fd) { close(fd); }
+void fd_setselect(int fd, int flags, void (*iocb)(int, int, void *), void *data) { (void)fd; (void)flags; (void)iocb; (void)data; }
+int b64_encode(unsigned char const *src, size_t srclength, char *target, size_t targsize) { (void)src; (void)srclength; (void)target; (void)targsize; return -1; }
+int b64_decode(char const *src, unsigned char *target, size_t targsize) { (void)src; (void)target; (void)targsize; return -1; }
+int do_nick_name(char *nick) { return nick && *nick; }
+void add_history(Client *client, int online, int type) { (void)client; (void)online; (void)type; }
+void del_from_client_hash_table(const char *name, Client *client) { (void)name; (void)client; }
+void add_to_client_hash_table(const char *name, Client *client) { (void)name; (void)client; }
+void hash_check_watch(Client *client, int reply) { (void)client; (void)reply; }
+const char *get_client_name(Client *client, int showip) { (void)showip; return client ? client->name : "*"; }
+const char *GetIP(Client *client) { return client && client->ip ? client->ip : "255.255.255.255"; }
+int is_valid_ip(const char *str) { struct in6_addr a; return str && (inet_pton(AF_INET, str, &a) == 1 || inet_pton(AF_INET6, str, &a) == 1); }
+void do_cmd(Client *client, MessageTag *mtags, const char *cmd, int parc, const char **parv) { (void)client; (void)mtags; (void)cmd; (void)parc; (void)parv; }
@@ -0,0 +1,274 @@
+/* Just enough of the UnrealIRCd 6 module API to build o-filehost.c and
+ * obsidianirc.c outside a server, for the benchmarks in bench/. Types only
+ * have the fields the modules use, and stub.c implements the functions:
+ * the few a benchmark reaches for real, the rest as no-ops.
+ */
+#ifndef BENCH_UNREALIRCD_H
+#define BENCH_UNREALIRCD_H
+
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <limits.h>
+
+/* The real libraries the modules build against */
+#define PCRE2_CODE_UNIT_WIDTH 8
+#include <pcre2.h>
+#include <jansson.h>
+#include <argon2.h>
+
+#define BUFSIZE 512
+#define NICKLEN 30
+#define ACCOUNTLEN 30
+#define IDLEN 12
+#define HOSTLEN 63
+#define MAXPARA 15
+#define HOST_HASH_TABLE_SIZE 2048
+
+typedef union ModData { int i; long l; char *str; void *ptr; } ModData;
+struct list_head { struct list_head *next, *prev; };
+#define list_for_each_entry(pos, head, member) for (pos = (void *)(head)->next; pos; pos = NULL)
+#define list_for_each_entry_safe(pos, n, head, member) for (pos = (void *)(head)->next, n = pos; pos; pos = NULL)
+
+typedef struct NameValuePrioList NameValuePrioList;
+typedef struct MessageTag { struct MessageTag *prev, *next; char *name; char *value; } MessageTag;
+typedef struct dbuf { unsigned int length; } dbuf;
+#define DBufLength(d) ((d)->length)
+typedef struct LocalClient { dbuf sendQ; int sasl_complete; int sasl_out; time_t sasl_sent_time; int fd; long caps; time_t creationtime; } LocalClient;
+typedef struct ClientUser { char account[ACCOUNTLEN+1]; char username[12]; char realhost[HOSTLEN+1]; } ClientUser;
+typedef struct Client Client;
+struct Client { struct list_head client_node; struct list_head lclient_node; LocalClient *local; ClientUser *user; char name[NICKLEN+1]; char id[IDLEN+1]; Client *direction; Client *uplink; char *ip; time_t lastnick; int status; void *server; ModData moddata[32]; };
+typedef struct Member { struct Member *next; Client *client; } Member;
+typedef struct Channel { char *name; Member *members; int users; ModData moddata[32]; } Channel;
+typedef enum ModDataType { MODDATATYPE_LOCAL_VARIABLE=1, MODDATATYPE_GLOBAL_VARIABLE, MODDATATYPE_CLIENT, MODDATATYPE_LOCAL_CLIENT, MODDATATYPE_CHANNEL, MODDATATYPE_MEMBER, MODDATATYPE_MEMBERSHIP } ModDataType;
+typedef struct ModDataInfo { char *name; ModDataType type; void (*free)(ModData *); const char *(*serialize)(ModData *); void (*unserialize)(const char *, ModData *); int sync; int remote_write; int self_write; int slot; } ModDataInfo;
+typedef struct Module Module;
+typedef struct ModuleInfo { Module *handle; } ModuleInfo;
+typedef struct ModuleHeader { char *name, *version, *description, *author, *modversion; } ModuleHeader;
+typedef struct MultiLine { struct MultiLine *prev, *next; char *line; } MultiLine;
+typedef struct ConfigFile { char *filename; } ConfigFile;
+typedef struct ConfigEntry { char *name; char *value; struct ConfigEntry *next; struct ConfigEntry *items; ConfigFile *file; int line_number; } ConfigEntry;
+typedef struct ISupport ISupport;
+typedef struct ClientCapabilityInfo { const char *name; int flags; int (*visible)(Client *); const char *(*parameter)(Client *); } ClientCapabilityInfo;
+typedef struct ClientCapability ClientCapability;
+typedef struct MessageTagHandlerInfo { char *name; int flags; int (*is_ok)(Client *, const char *, const char *); } MessageTagHandlerInfo;
+typedef struct RPCHandlerInfo { char *method; int loglevel; void (*call)(Client *, json_t *, json_t *); } RPCHandlerInfo;
+typedef struct Event Event;
+typedef struct Cmode Cmode;
+typedef struct { char *name; } ServerTKL;
+typedef struct { char *name; int hold; char *reason; } NameBan;
+typedef struct TKL { struct TKL *prev, *next; int type; time_t set_at, expire_at; char *set_by; union { NameBan *nameban; void *other; } ptr; } TKL;
+extern TKL *tklines[];
+int tkl_hash(unsigned int);
+int TKLIsNameBan(TKL *);
+typedef enum HttpMethod { HTTP_METHOD_NONE=0, HTTP_METHOD_GET=1, HTTP_METHOD_POST=2, HTTP_METHOD_HEAD=3 } HttpMethod;
+typedef struct OutgoingWebRequest { char *url; HttpMethod http_method; NameValuePrioList *headers; char *body; char *apicallback; void *callback_data; int max_redirects; time_t cachetime; } OutgoingWebRequest;
+typedef struct OutgoingWebResponse { char *memory; int memory_len; char *errorbuf; int cached; char *file; } OutgoingWebResponse;
+typedef enum SendType { SEND_TYPE_PRIVMSG=0, SEND_TYPE_NOTICE=1, SEND_TYPE_TAGMSG=2 } SendType;
+typedef struct IRCStatistics { int me_clients; } IRCStatistics;
+typedef struct Configuration { char *sasl_server; } Configuration;
+extern Configuration iConf;
+extern Client me;
+extern struct list_head client_list, lclient_list, server_list;
+extern int loop_ircstats;
+#define SASL_SERVER (iConf.sasl_server)
+#define MyConnect(x) ((x)->local != NULL)
+#define MyUser(x) (MyConnect(x) && IsUser(x))
+int IsServer(Client *); int IsULine(Client *); int IsMe(Client *); int IsDead(Client *); int IsLoggedIn(Client *); int IsUser(Client *); int IsOper(Client *); int IsSecure(Client *); int ValidatePermissionsForPath(const char *, Client *, Client *, Channel *, const void *);
+#define IsSynched(x) 1
+#define BadPtr(x) (!(x) || (*(x) == '\0'))
+#define safe_alloc(x) calloc(1, x)
+#define safe_free(x) do { if (x) free(x); x = NULL; } while(0)
+#define safe_strdup(dst,str) do { if (dst) free(dst); if (!(str)) dst = NULL; else dst = strdup(str); } while(0)
+#define AddListItem(item,list) do { (item)->next = (list); (list) = (item); } while(0)
+#define DelListItem(item,list) do { (void)(item); } while(0)
+#define CMD_FUNC(x) void (x)(Client *client, MessageTag *recv_mtags, int parc, const char *parv[])
+#define RPC_CALL_FUNC(x) void (x)(Client *client, json_t *request, json_t *params)
+#define EVENT(x) void (x)(void *data)
+#define MOD_TEST() int Mod_Test(ModuleInfo *modinfo)
+#define MOD_INIT() int Mod_Init(ModuleInfo *modinfo)
+#define MOD_LOAD() int Mod_Load(ModuleInfo *modinfo)
+#define MOD_UNLOAD() int Mod_Unload(ModuleInfo *modinfo)
+#define MOD_HEADER Mod_Header
+#define MOD_SUCCESS 0
+#define MOD_FAILED -1
+#define MOD_OPT_PERM_RELOADABLE 2
+#define CMD_USER 1
+#define CMD_UNREGISTERED 2
+#define CMD_OPER 4
+#define CMD_SERVER 8
+#define CONFIG_MAIN 1
+#define CFG_YESNO 1
+#define CFG_TIME 2
+#define CFG_SIZE 3
+#define ULOG_DEBUG 0
+#define ULOG_INFO 1
+#define ULOG_WARNING 2
+#define ULOG_ERROR 3
+#define HOOKTYPE_SASL_MECHS 1
+#define HOOKTYPE_SASL_AUTHENTICATE 2
+#define HOOKTYPE_CONFIGRUN 3
+#define HOOKTYPE_CONFIGTEST 4
+#define HOOKTYPE_CHANMSG 5
+#define HOOKTYPE_ACCOUNT_LOGIN 6
+#define HOOKTYPE_TKL_ADD 7
+#define HOOKTYPE_TKL_DEL 8
+#define HOOKTYPE_STATS 9
+#define HOOKTYPE_POST_LOCAL_NICKCHANGE 10
+#define HOOKTYPE_LOCAL_CONNECT 11
+#define HOOKTYPE_LOCAL_NICKCHANGE 12
+#define HOOKTYPE_SERVER_SYNC 13
+#define HOOKTYPE_LOCAL_QUIT 14
+#define HOOKTYPE_REMOTE_QUIT 15
+#define HOOKTYPE_CONFIGPOSTTEST 16
+#define HOOKTYPE_REHASH 17
+#define HOOKTYPE_SERVER_SYNCED 18
+#define HOOKTYPE_PRE_LOCAL_CONNECT 19
+#define HOOKTYPE_POST_LOCAL_CONNECT 20
+#define HOOKTYPE_REMOTE_NICKCHANGE 21
+#define MTAG_HANDLER_FLAGS_NO_CAP_NEEDED 1
+#define JSON_RPC_ERROR_INTERNAL_ERROR -32603
+#define JSON_RPC_ERROR_NOT_FOUND -1000
+#define JSON_RPC_ERROR_INVALID_PARAMS -32602
+#define JSON_RPC_ERROR_ALREADY_EXISTS -1001
+#define RPL_SASLSUCCESS 903
+#define ERR_SASLFAIL 904
+#define ERR_SASLABORTED 906
+#define ERR_NOPRIVILEGES 481
+#define ERR_NEEDMOREPARAMS 461
+#define RPL_TEXT 304
+#define SEND_LOCAL 1
+#define SEND_REMOTE 2
+#define SEND_ALL 3
+#define FD_SELECT_READ 1
+#define FD_SELECT_WRITE 2
+#define FDCLOSE_NONE 0
+#define TKL_NAME 0x10
+#define WHOWAS_EVENT_NICK_CHANGE 1
+#define SIPHASH_KEY_LENGTH 16
+#define REQUIRE_PARAM_STRING(name, varname) do { varname = json_object_get_string(params, name); if (!varname) { rpc_error_fmt(client, request, JSON_RPC_ERROR_INVALID_PARAMS, "Missing parameter: '%s'", name); return; } } while(0)
+#define OPTIONAL_PARAM_STRING(name, varname) varname = json_object_get_string(params, name)
+#define OPTIONAL_PARAM_INTEGER(name, varname, defaultvalue) varname = json_object_get_integer(params, name, defaultvalue)
+#define OPTIONAL_PARAM_BOOLEAN(name, varname, defaultvalue) varname = json_object_get_boolean(params, name, defaultvalue)
+#define moddata_client(acptr, md) (acptr->moddata[md->slot])
+#define moddata_channel(channel, md) (channel->moddata[md->slot])
+#define LoadPersistentPointer(modinfo, var, freefunc) do { var = NULL; } while(0)
+#define SavePersistentPointer(modinfo, var) do { (void)var; } while(0)
+#define LoadPersistentLong(modinfo, var) do { var = 0; } while(0)
+#define SavePersistentLong(modinfo, var) do { (void)var; } while(0)
+#define LoadPersistentInt(modinfo, var) do { var = 0; } while(0)
+#define SavePersistentInt(modinfo, var) do { (void)var; } while(0)
+#define STATS_ARGS
+const char *json_object_get_string(json_t *, const char *);
+json_int_t json_object_get_integer(json_t *, const char *, json_int_t);
+int json_object_get_boolean(json_t *, const char *, int);
+void config_error(const char *, ...); void config_warn(const char *, ...); void config_status(const char *, ...);
+long config_checkval(const char *, unsigned short);
+int config_parse_flood(const char *, int *, int *);
+ModDataInfo *ModDataAdd(Module *, ModDataInfo);
+int moddata_client_set(Client *, const char *, const char *);
+const char *moddata_client_get(Client *, const char *);
+ClientCapability *ClientCapabilityAdd(Module *, ClientCapabilityInfo *, long *);
+long ClientCapabilityBit(const char *);
+int HasCapability(Client *, const char *);
+#define HookAdd(mod, type, prio, func) HookAddMain(mod, type, prio, (void*)func)
+#define HookAddConstString(mod, type, prio, func) HookAddMain(mod, type, prio, (void*)func)
+void *HookAddMain(Module *, int, int, void *);
+#define RunHook(type, ...) do { } while(0)
+void *CommandAdd(Module *, const char *, void (*)(Client *, MessageTag *, int, const char *[]), int, int);
+int RPCHandlerAdd(Module *, RPCHandlerInfo *);
+void *MessageTagHandlerAdd(Module *, MessageTagHandlerInfo *);
+Event *EventAdd(Module *, const char *, void (*)(void *), void *, long, int);
+void EventDel(Event *);
+ISupport *ISupportAdd(Module *, const char *, const char *);
+void ModuleSetOptions(Module *, int, int);
+int RegisterApiCallbackWebResponse(Module *, const char *, void (*)(OutgoingWebRequest *, OutgoingWebResponse *));
+void url_start_async(OutgoingWebRequest *);
+void add_nvplist(NameValuePrioList **, int, const char *, const char *);
+void sendto_one(Client *, MessageTag *, const char *, ...);
+void sendnumeric(Client *, int, ...);
+void sendnumericfmt(Client *, int, const char *, ...);
+void sendnotice(Client *, const char *, ...);
+void sendto_server(Client *, unsigned long, unsigned long, MessageTag *, const char *, ...);
+void sendto_channel(Channel *, Client *, Client *, const char *, long, int, MessageTag *, const char *, ...);
+void sendto_local_common_channels(Client *, Client *, long, MessageTag *, const char *, ...);
+void new_message(Client *, MessageTag *, MessageTag **);
+void new_message_special(Client *, MessageTag *, MessageTag **, const char *, ...);
+void free_message_tags(MessageTag *);
+MessageTag *find_mtag(MessageTag *, const char *);
+Channel *find_channel(const char *);
+Client *find_client(const char *, Client *);
+Client *find_user(const char *, Client *);
+Client *find_server(const char *, Client *);
+Client *hash_find_id(const char *, Client *);
+void user_account_login(MessageTag *, Client *);
+void add_fake_lag(Client *, long);
+int decode_authenticate_plain(const char *, char **, char **, char **);
+const char *Auth_Hash(int, const char *);
+void unreal_log(int, const char *, const char *, Client *, const char *, ...);
+typedef struct LogData LogData;
+LogData *log_data_string(const char *, const char *);
+LogData *log_data_integer(const char *, int64_t);
+LogData *log_data_client(const char *, Client *);
+void rpc_error(Client *, json_t *, int, const char *);
+void rpc_error_fmt(Client *, json_t *, int, const char *, ...);
+void rpc_response(Client *, json_t *, json_t *);
+void json_expand_client(json_t *, const char *, Client *, int);
+void addmultiline(MultiLine **, const char *);
+void freemultiline(MultiLine *);
+int match_simple(const char *, const char *);
+uint64_t siphash(const char *, const char *);
+uint64_t siphash_nocase(const char *, const char *);
+uint64_t siphash_raw(const char *, size_t, const char *);
+void siphash_generate_key(char *);
+char *strtoken(char **, char *, const char *);
+size_t strlcpy(char *, const char *, size_t);
+size_t strlcat(char *, const char *, size_t);
+char *our_strcasestr(const char *, const char *);
+int fd_open(int, const char *, int);
+void fd_close(int);
+void fd_setselect(int, int, void (*)(int, int, void *), void *);
+unsigned int getrandom32(void);
+unsigned char getrandom8(void);
+void gen_random_alnum(char *, int);
+int b64_encode(unsigned char const *, size_t, char *, size_t);
+int b64_decode(char const *, unsigned char *, size_t);
+int do_nick_name(char *);
+void add_history(Client *, int, int);
+void del_from_client_hash_table(const char *, Client *);
+void add_to_client_hash_table(const char *, Client *);
+void hash_check_watch(Client *, int);
+const char *get_client_name(Client *, int);
+const char *GetIP(Client *);
+int is_valid_ip(const char *);
+time_t TStime(void);
+extern time_t timeofday;
+extern struct timeval timeofday_tv;
+char *unreal_getfilename(char *);
+
+void sendtxtnumeric(Client *, const char *, ...);
+#define ARRAY_SIZEOF(x) (sizeof((x))/sizeof((x)[0]))
+void outofmemory(size_t);
+#define MIN(a,b) ((a)<(b)?(a):(b))
+#define MAX(a,b) ((a)>(b)?(a):(b))
+#define HOOKTYPE_REHASH_COMPLETE 99
+#define PERMDATADIR "data"
+void do_cmd(Client *, MessageTag *, const char *, int, const char **);
+
+#endif
@@ -0,0 +1,292 @@
+#!/usr/bin/env python3
+"""Load test for the ObsidianIRC modules, run against the docker compose setup.
+
+Modes:
+  seed      Fill the account database with generated rows (run with the
+            server stopped, e.g. docker compose run --rm --entrypoint ...)
+  register  REGISTER new accounts over many connections
+  sasl      Reconnect storm doing SASL PLAIN, with a share of bad passwords
+  urls      Clients in one channel pasting URL-heavy chat lines
+
+After a run, --oper NAME PASS prints STATS accounts and STATS linkpreview
+so the server side timings can be compared between builds.
+
+Only the Python standard library is used.
+"""
+
+import argparse
+import asyncio
+import base64
+import os
+import random
+import sqlite3
+import ssl
+import string
+import sys
+import time
+
+# Lines modelled after real chat: mostly plain text, some with one or more links
+CHAT_LINES = [
+    "hey, anyone around?",
+    "lol that's exactly what happened to me yesterday",
+    "check this out {url}",
+    "{url} <- this is the one I meant",
+    "did you read {url} already? also {url}",
+    "brb",
+    "the docs say otherwise: {url}#configuration",
+    "no idea, try asking in the support channel",
+    "here's the log: {url}?raw=1",
+]
+
+# Pages with ordinary <head>s: og tags, twitter cards, very long titles, none at all
+DEFAULT_URLS = [
+    "https://github.com/ObsidianIRC/UnrealIRCd-Modules",
+    "https://www.unrealircd.org/docs/Main_Page",
+    "https://en.wikipedia.org/wiki/Internet_Relay_Chat",
+    "https://news.ycombinator.com/",
+    "https://www.youtube.com/watch?v=dQw4w9WgXcQ",
+    "https://www.bbc.com/news",
+    "https://ircv3.net/specs/extensions/sasl-3.2",
+    "https://example.com/",
+]
+
+
+class Stats:
+    def __init__(self):
+        self.latencies = []
+        self.outcomes = {}
+
+    def add(self, outcome, started=None):
+        self.outcomes[outcome] = self.outcomes.get(outcome, 0) + 1
+        if started is not None:
+            self.latencies.append(time.monotonic() - started)
+
+    def report(self, what, elapsed):
+        total = sum(self.outcomes.values())
+        print("%s: %d in %.1fs (%.1f/s)" % (what, total, elapsed, total / elapsed if elapsed else 0))
+        for outcome, count in sorted(self.outcomes.items()):
+            print("  %s: %d" % (outcome, count))
+        if self.latencies:
+            lat = sorted(self.latencies)
+            pick = lambda p: lat[min(len(lat) - 1, int(len(lat) * p / 100))] * 1000
+            print("  latency ms: p50 %.1f, p90 %.1f, p99 %.1f, max %.1f" % (pick(50), pick(90), pick(99), lat[-1] * 1000))
+
+
+class Connection:
+    def __init__(self, reader, writer):
+        self.reader = reader
+        self.writer = writer
+
+    @classmethod
+    async def open(cls, args):
+        ctx = None
+        if args.tls:
+            ctx = ssl.create_default_context()
+            ctx.check_hostname = False
+            ctx.verify_mode = ssl.CERT_NONE
+        reader, writer = await asyncio.open_connection(args.host, args.port, ssl=ctx)
+        return cls(reader, writer)
+
+    def send(self, line):
+        self.writer.write((line + "\r\n").encode())
+
+    async def lines(self, timeout):
+        """Yield parsed (command, params) pairs, answering PINGs on the way."""
+        while True:
+            raw = await asyncio.wait_for(self.reader.readline(), timeout)
+            if not raw:
+                return
+            line = raw.decode(errors="replace").rstrip("\r\n")
+            if line.startswith("@"):
+                line = line.split(" ", 1)[1]
+            if line.startswith(":"):
+                line = line.split(" ", 1)[1]
+            head, sep, trailing = line.partition(" :")
+            params = head.split()
+            if sep:
+                params.append(trailing)
+            if params and params[0] == "PING":
+                self.send("PONG :%s" % (params[1] if len(params) > 1 else ""))
+                continue
+            if params:
+                yield params[0], params[1:]
+
+    async def wait_for(self, wanted, timeout):
+        async for command, params in self.lines(timeout):
+            if command in wanted:
+                return command, params
+        return None, []
+
+    async def close(self):
+        try:
+            self.send("QUIT :load test")
+            await self.writer.drain()
+        except (ConnectionError, OSError):
+            pass
+        self.writer.close()
+
+
+def random_nick(prefix):
+    return prefix + "".join(random.choice(string.ascii_lowercase) for _ in range(6))
+
+
+async def register_client(args, conn, nick):
+    conn.send("NICK %s" % nick)
+    conn.send("USER %s 0 * :ObsidianIRC load test" % nick)
+    await conn.wait_for({"001"}, args.timeout)
+
+
+async def run_register(args, stats, worker):
+    for i in range(worker, args.count, args.clients):
+        name = "%s%d" % (args.prefix, i)
+        conn = await Connection.open(args)
+        try:
+            await register_client(args, conn, random_nick("lt"))
+            started = time.monotonic()
+            conn.send("REGISTER %s %s@loadtest.invalid %s" % (name, name, args.password))
+            async for command, params in conn.lines(args.timeout):
+                if command in ("REGISTER", "FAIL") and params[:1] in (["SUCCESS"], ["REGISTER"]):
+                    stats.add("success" if command == "REGISTER" else params[1].lower(), started)
+                    break
+        except (asyncio.TimeoutError, ConnectionError, OSError) as e:
+            stats.add(type(e).__name__)
+        finally:
+            await conn.close()
+
+
+async def run_sasl(args, stats, worker):
+    deadline = time.monotonic() + args.duration
+    while time.monotonic() < deadline:
+        name = "%s%d" % (args.prefix, random.randrange(args.count))
+        bad = random.random() < args.bad_ratio
+        token = base64.b64encode(("\0%s\0%s" % (name, "wrong" + args.password if bad else args.password)).encode()).decode()
+        try:
+            conn = await Connection.open(args)
+        except (ConnectionError, OSError) as e:
+            stats.add(type(e).__name__)
+            await asyncio.sleep(1)
+            continue
+        try:
+            conn.send("CAP REQ :sasl")
+            conn.send("NICK %s" % random_nick("lt"))
+            conn.send("USER lt 0 * :ObsidianIRC load test")
+            await conn.wait_for({"CAP"}, args.timeout)
+            started = time.monotonic()
+            conn.send("AUTHENTICATE PLAIN")
+            await conn.wait_for({"AUTHENTICATE"}, args.timeout)
+            conn.send("AUTHENTICATE %s" % token)
+            command, _ = await conn.wait_for({"903", "904", "905", "906"}, args.timeout)
+            outcome = {"903": "success", "904": "failed"}.get(command, command or "closed")
+            stats.add(("bad-password " if bad else "") + outcome, started)
+            conn.send("CAP END")
+        except (asyncio.TimeoutError, ConnectionError, OSError) as e:
+            stats.add(type(e).__name__)
+        finally:
+            await conn.close()
+
+
+async def run_urls(args, stats, worker):
+    conn = await Connection.open(args)
+    deadline = time.monotonic() + args.duration
+    try:
+        await register_client(args, conn, random_nick("lt"))
+        conn.send("JOIN %s" % args.channel)
+        await conn.wait_for({"366"}, args.timeout)
+        reader = asyncio.ensure_future(drain(conn))
+        while time.monotonic() < deadline:
+            line = random.choice(CHAT_LINES)
+            while "{url}" in line:
+                line = line.replace("{url}", random.choice(args.url_list), 1)
+            conn.send("PRIVMSG %s :%s" % (args.channel, line))
+            await conn.writer.drain()
+            stats.add("with url" if "://" in line else "plain")
+            await asyncio.sleep(args.interval)
+        reader.cancel()
+    except (asyncio.TimeoutError, ConnectionError, OSError) as e:
+        stats.add(type(e).__name__)
+    finally:
+        await conn.close()
+
+
+async def drain(conn):
+    try:
+        async for _ in conn.lines(None):
+            pass
+    except (ConnectionError, OSError):
+        pass
+
+
+async def show_stats(args):
+    conn = await Connection.open(args)
+    try:
+        await register_client(args, conn, random_nick("ltoper"))
+        conn.send("OPER %s %s" % tuple(args.oper))
+        for flag in ("accounts", "linkpreview"):
+            print("STATS %s:" % flag)
+            conn.send("STATS %s" % flag)
+            async for command, params in conn.lines(args.timeout):
+                if command == "304":
+                    print("  " + params[-1])
+                elif command in ("219", "481"):
+                    break
+    finally:
+        await conn.close()
+
+
+def seed(args):
+    """Insert args.count accounts straight into the database, all with the
+    password hash of an account that was registered normally, so SASL
+    against them works without hashing a million passwords."""
+    db = sqlite3.connect(args.db)
+    row = db.execute("SELECT password FROM accounts WHERE name = ? COLLATE NOCASE", (args.template,)).fetchone()
+    if not row:
+        sys.exit("Template account %s not found, REGISTER it first with password %s" % (args.template, args.password))
+    now = int(time.time())
+    with db:
+        db.executemany(
+            "INSERT OR IGNORE INTO accounts (name, email, password, time_registered, verified) VALUES (?, ?, ?, ?, 1)",
+            (("%s%d" % (args.prefix, i), "%s%d@%s.invalid" % (args.prefix, i, random.choice(("mail", "example", "loadtest"))), row[0], now)
+             for i in range(args.count)))
+    print("%d accounts in %s" % (db.execute("SELECT COUNT(*) FROM accounts").fetchone()[0], args.db))
+
+
+async def main(args):
+    runners = {"register": run_register, "sasl": run_sasl, "urls": run_urls}
+    stats = Stats()
+    started = time.monotonic()
+    await asyncio.gather(*(runners[args.mode](args, stats, i) for i in range(args.clients)))
+    stats.report(args.mode, time.monotonic() - started)
+    if args.oper:
+        await show_stats(args)
+
+
+if __name__ == "__main__":
+    p = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    p.add_argument("mode", choices=("seed", "register", "sasl", "urls"))
+    p.add_argument("--host", default="localhost")
+    p.add_argument("--port", type=int, default=int(os.environ.get("IRC_PORT", 6667)))
+    p.add_argument("--tls", action="store_true", help="connect with TLS (use the SSL_PORT)")
+    p.add_argument("--clients", type=int, default=50, help="concurrent connections")
+    p.add_argument("--duration", type=float, default=30, help="seconds, for sasl and urls")
+    p.add_argument("--timeout", type=float, default=30, help="seconds to wait for a reply")
+    p.add_argument("--count", type=int, default=1000, help="accounts to register, seed or log in as")
+    p.add_argument("--prefix", default="loadtest", help="account names are PREFIX0, PREFIX1, ...")
+    p.add_argument("--password", default="loadtest-password")
+    p.add_argument("--bad-ratio", type=float, default=0.2, help="share of SASL attempts with a wrong password")
+    p.add_argument("--channel", default="#loadtest")
+    p.add_argument("--interval", type=float, default=1.0, help="seconds between lines per client, for urls")
+    p.add_argument("--urls", help="file with one URL per line, instead of the built-in list")
+    p.add_argument("--db", default="obsidian.db", help="database file, for seed")
+    p.add_argument("--template", default="loadtest-template", help="account whose password hash seed copies")
+    p.add_argument("--oper", nargs=2, metavar=("NAME", "PASS"), help="print STATS accounts and linkpreview afterwards")
+    args = p.parse_args()
+
+    args.url_list = DEFAULT_URLS
+    if args.urls:
+        with open(args.urls) as f:
+            args.url_list = [line.strip() for line in f if line.strip()]
+
+    if args.mode == "seed":
+        seed(args)
+    else:
+        asyncio.run(main(args))
@@ -28,6 +28,7 @@ module
 */
 
 #include "unrealircd.h"
+#include "stats_histogram.h"
 
 #define CONF_FILEHOST "filehosts"
 
@@ -37,6 +38,18 @@ struct
 	char *isupport_line;
 	MultiLine *hosts;
 	unsigned short int has_hosts;
+	int cache_max_entries;
+	long cache_max_bytes;
+	long cache_ttl;
+	long cache_negative_ttl;
+	int max_fetches;
+	int max_fetches_per_channel;
+	int queue_size;
+	int user_rate_count;
+	int user_rate_period;
+	char *preview_server;
+	MultiLine *allow_domains;
+	MultiLine *deny_domains;
 } cfg;
 
 ModuleHeader MOD_HEADER = {
@@ -54,35 +67,250 @@ ModuleHeader MOD_HEADER = {
 #define MAX_META_LENGTH 2048
 #define MAX_URL_LENGTH 2048
 
-/* Structure to hold context for async callback */
-typedef struct {
+/* The title and meta tags live in <head>, which is nearly always within
+ * the first few KB. We ask the server for no more than this (Range) and
+ * never scan past it.
+ */
+#define HTML_HEAD_MAX_BYTES 65536
+
+/* Preview cache defaults, overridable in the filehosts block */
+#define DEFAULT_CACHE_MAX_ENTRIES 2000
+#define DEFAULT_CACHE_MAX_BYTES 4194304  /* 4MB */
+#define DEFAULT_CACHE_TTL 3600
+#define DEFAULT_CACHE_NEGATIVE_TTL 300
+#define PREVIEW_CACHE_HASH_SIZE 4096
+
+#define PENDING_PREVIEW_HASH_SIZE 256
+
+/* Scheduler defaults, overridable in the filehosts block */
+#define DEFAULT_MAX_FETCHES 8
+#define DEFAULT_MAX_FETCHES_PER_CHANNEL 2
+#define DEFAULT_QUEUE_SIZE 64
+#define DEFAULT_USER_RATE_COUNT 5
+#define DEFAULT_USER_RATE_PERIOD 30
+
+/* Image upload failover: a filehost that failed is skipped for
+ * 2^failures seconds, up to the maximum, then tried again
+ */
+#define UPLOAD_HOST_BACKOFF_MAX 300
+
+/* Bytes of a response looked at to tell HTML from images and other binaries */
+#define SNIFF_BYTES 512
+
+/* Somewhere to deliver a preview once it is ready */
+typedef struct PreviewWaiter PreviewWaiter;
+struct PreviewWaiter {
+	PreviewWaiter *next;
 	char *channel;
 	char *msgid;
+};
+
+/* Context for an in-flight preview, shared by everyone who pasted the
+ * same URL while it is being fetched. It is the callback_data of the
+ * page download and then of the image upload, and stays in the pending
+ * table until the last step has delivered to all waiters.
+ */
+typedef struct LinkPreviewContext LinkPreviewContext;
+struct LinkPreviewContext {
+	LinkPreviewContext *hnext;
 	char *url;
-} LinkPreviewContext;
+	char *cache_key;
+	char *title; /* set once the page is parsed, while the image uploads */
+	char *snippet;
+	PreviewWaiter *waiters;
+	char *origin_channel; /* charged against max-fetches-per-channel */
+	LinkPreviewContext *qnext; /* fetch queue, while waiting for a slot */
+	long long step_started_us; /* when the page download or image upload started */
+	int upload_host; /* index in upload_hosts[] of the image upload, -1 if none */
+	int direct_image; /* the link is an image itself, upload it without fetching a page */
+};
 
-/* Structure to hold context for image upload callback */
+/* A configured filehost that images are uploaded to */
 typedef struct {
-	char *channel;
-	char *msgid;
+	char *url;
+	int failures; /* in a row, reset by a successful upload */
+	time_t retry_after;
+	unsigned long uploads;
+	unsigned long errors;
+} UploadHost;
+
+/* What to do with a link, decided from the domain and the path before fetching */
+typedef enum {
+	PREVIEW_FETCH_PAGE = 0, /* GET the <head> and parse it */
+	PREVIEW_FETCH_IMAGE, /* a direct image link */
+	PREVIEW_FETCH_SKIP, /* video, audio, archive, executable: nothing to preview */
+	PREVIEW_FETCH_DENIED /* by allow-domain / deny-domain */
+} PreviewFetchPolicy;
+
+/* An allow-domain or deny-domain, also matching every subdomain of it */
+typedef struct DomainRule DomainRule;
+struct DomainRule {
+	DomainRule *hnext;
+	uint64_t hashv;
+	int allow;
+	char name[];
+};
+
+/* Per-user token bucket, tokens are in thousandths */
+typedef struct {
+	long tokens;
+	long long last_ms;
+} PreviewRateBucket;
+
+/* A cached preview. Entries without a title are negative entries,
+ * meaning the fetch failed or the page had nothing to show.
+ */
+typedef struct PreviewCacheEntry PreviewCacheEntry;
+struct PreviewCacheEntry {
+	PreviewCacheEntry *hnext;
+	PreviewCacheEntry *lru_prev, *lru_next;
+	char *url; /* normalized */
 	char *title;
 	char *snippet;
-} ImageUploadContext;
+	char *image;
+	time_t expires;
+	size_t size;
+};
+
+/* The cache itself, kept across REHASH via SavePersistentPointer() */
+typedef struct {
+	PreviewCacheEntry *hash[PREVIEW_CACHE_HASH_SIZE];
+	PreviewCacheEntry *lru_head, *lru_tail; /* head is most recently used */
+	char hashkey[SIPHASH_KEY_LENGTH];
+	int entries;
+	size_t bytes;
+	unsigned long hits;
+	unsigned long negative_hits;
+	unsigned long misses;
+} PreviewCache;
+
+static PreviewCache *preview_cache = NULL;
+
+/* In-flight previews by cache key. Not persistent: after a REHASH the
+ * old contexts still complete normally, they just can't be joined.
+ */
+static LinkPreviewContext *pending_previews[PENDING_PREVIEW_HASH_SIZE];
+
+/* Fetches waiting for a free slot, oldest first */
+static LinkPreviewContext *fetch_queue_head = NULL, *fetch_queue_tail = NULL;
+
+/* Scheduler counters and timings, shown in STATS linkpreview and
+ * obsidianirc.linkpreview.stats. fetches_active is kept across REHASH
+ * since those fetches are still running.
+ */
+static int fetches_active = 0;
+static int fetches_queued = 0;
+static struct {
+	unsigned long started;
+	unsigned long dropped;
+	unsigned long rate_limited;
+	unsigned long fetch_errors;
+	unsigned long upload_errors;
+	unsigned long skipped_type; /* by the link's file extension, never fetched */
+	unsigned long skipped_binary; /* fetched, but the body was no HTML */
+	unsigned long skipped_domain;
+	unsigned long direct_images;
+	unsigned long long bytes_downloaded;
+	StatsHistogram fetch_us;
+	StatsHistogram parse_us;
+	StatsHistogram upload_us;
+	StatsHistogram page_bytes;
+} fetch_stats;
+
+/* The filehosts block's hosts, image uploads go round-robin across them */
+static UploadHost *upload_hosts = NULL;
+static int upload_host_count = 0;
+static int upload_host_next = 0;
+
+/* allow-domain and deny-domain of the filehosts block, hashed by lowercased
+ * domain. A host is looked up label by label from the full name upwards and
+ * the most specific rule wins. With any allow-domain, unlisted domains are denied.
+ */
+static struct {
+	DomainRule **hash;
+	unsigned int hash_size; /* power of two */
+	int allow_count;
+} domain_rules;
+
+/* Looked up in MOD_LOAD, the message-tags CAP belongs to another module */
+static long CAP_MESSAGE_TAGS = 0L;
+
+ModDataInfo *channel_fetches_md = NULL;
+ModDataInfo *user_bucket_md = NULL;
+
+/* What parse_html_head() found, each field NULL if not present */
+typedef struct {
+	char *title;
+	char *description;
+	char *og_description;
+	char *og_image;
+	char *twitter_image;
+} HtmlHeadInfo;
+
+/* Precompiled regexes, see compile_link_preview_regexes() */
+typedef enum {
+	LP_RE_URL = 0,
+	LP_RE_COUNT
+} LinkPreviewRegex;
+
+/* Enough ovector pairs for the pattern with the most capture groups */
+#define LP_RE_MAX_GROUPS 1
+
+static const struct {
+	const char *pattern;
+	uint32_t options;
+} link_preview_patterns[LP_RE_COUNT] = {
+	[LP_RE_URL] = { "https?://[^\\s<>\"]+", 0 },
+};
+
+static pcre2_code *link_preview_re[LP_RE_COUNT];
+static pcre2_match_data *link_preview_match_data;
 
 /* Function prototypes */
 void link_preview_download_complete(OutgoingWebRequest *request, OutgoingWebResponse *response);
 void image_upload_complete(OutgoingWebRequest *request, OutgoingWebResponse *response);
 int link_preview_chanmsg(Client *client, Channel *channel, int sendflags, const char *member_modes, const char *target, MessageTag *mtags, const char *text, SendType sendtype);
+const char *find_url_candidate(const char *text);
 char *extract_url_from_message(const char *text);
-char *extract_title_from_html(const char *html);
-char *extract_snippet_from_html(const char *html);
-char *extract_meta_image_from_html(const char *html);
+void parse_html_head(const char *html, size_t len, HtmlHeadInfo *info);
 void send_link_preview(const char *channel, const char *msgid, const char *title, const char *snippet, const char *meta_image);
 int link_preview_mtag_is_ok(Client *client, const char *name, const char *value);
 int filehost_configtest(ConfigFile *cf, ConfigEntry *ce, int type, int *errs);
 int filehost_configrun(ConfigFile *cf, ConfigEntry *ce, int type);
+int link_preview_stats(Client *client, const char *flag);
+RPC_CALL_FUNC(rpc_link_preview_stats);
+long long preview_now_us(void);
+char *normalize_url(const char *url);
+PreviewFetchPolicy preview_fetch_policy(const char *url);
+int sniff_image(const char *data, size_t len);
+int sniff_binary(const char *data, size_t len);
+char *url_filename(const char *url);
+void start_image_upload(LinkPreviewContext *context, const char *image_url);
+void build_domain_rules(void);
+void free_domain_rules(void);
+PreviewCacheEntry *preview_cache_find(const char *key);
+void preview_cache_add(const char *key, const char *title, const char *snippet, const char *image);
+void preview_cache_free(ModData *m);
+EVENT(preview_cache_expire);
+LinkPreviewContext *find_pending_preview(const char *key);
+void add_preview_waiter(LinkPreviewContext *context, const char *channel, const char *msgid);
+void deliver_pending_preview(LinkPreviewContext *context, const char *title, const char *snippet, const char *meta_image);
+void free_pending_preview(LinkPreviewContext *context);
+int preview_rate_allow(Client *client);
+void queue_preview_fetch(LinkPreviewContext *context);
+void run_preview_queue(void);
+void start_preview_fetch(LinkPreviewContext *context);
+void preview_fetch_done(LinkPreviewContext *context);
+void channel_fetches_free(ModData *m);
+void user_bucket_free(ModData *m);
 void setconf(void);
 void freeconf(void);
+int compile_link_preview_regexes(void);
+void free_link_preview_regexes(void);
+void build_upload_hosts(void);
+void free_upload_hosts(void);
+int pick_upload_host(void);
+void upload_host_result(int index, int ok);
 
 /* Module test */
 MOD_TEST()
@@ -96,11 +324,54 @@ MOD_TEST()
 MOD_INIT()
 {
 	MessageTagHandlerInfo mtag;
+	ModDataInfo mreq;
+	RPCHandlerInfo rpc;
+
+	/* Compile our regexes once, rather than for every message.
+	 * A REHASH reloads the module, which rebuilds them.
+	 */
+	if (!compile_link_preview_regexes())
+		return MOD_FAILED;
+
+	LoadPersistentPointer(modinfo, preview_cache, preview_cache_free);
+	if (!preview_cache)
+	{
+		preview_cache = safe_alloc(sizeof(PreviewCache));
+		siphash_generate_key(preview_cache->hashkey);
+	}
+	LoadPersistentInt(modinfo, fetches_active);
+
+	memset(&mreq, 0, sizeof(mreq));
+	mreq.name = "link_preview_fetches";
+	mreq.type = MODDATATYPE_CHANNEL;
+	mreq.free = channel_fetches_free;
+	if (!(channel_fetches_md = ModDataAdd(modinfo->handle, mreq)))
+	{
+		config_error("[o-filehost] Could not add ModData for link_preview_fetches");
+		return MOD_FAILED;
+	}
+
+	memset(&mreq, 0, sizeof(mreq));
+	mreq.name = "link_preview_bucket";
+	mreq.type = MODDATATYPE_CLIENT;
+	mreq.free = user_bucket_free;
+	if (!(user_bucket_md = ModDataAdd(modinfo->handle, mreq)))
+	{
+		config_error("[o-filehost] Could not add ModData for link_preview_bucket");
+		return MOD_FAILED;
+	}
 
 	RegisterApiCallbackWebResponse(modinfo->handle, "link_preview_download_complete", link_preview_download_complete);
 	RegisterApiCallbackWebResponse(modinfo->handle, "image_upload_complete", image_upload_complete);
 	HookAdd(modinfo->handle, HOOKTYPE_CHANMSG, 0, link_preview_chanmsg);
 	HookAdd(modinfo->handle, HOOKTYPE_CONFIGRUN, 0, filehost_configrun);
+	HookAdd(modinfo->handle, HOOKTYPE_STATS, 0, link_preview_stats);
+
+	memset(&rpc, 0, sizeof(rpc));
+	rpc.method = "obsidianirc.linkpreview.stats";
+	rpc.loglevel = ULOG_DEBUG;
+	rpc.call = rpc_link_preview_stats;
+	RPCHandlerAdd(modinfo->handle, &rpc);
 
 	/* Register our custom message tags */
 	memset(&mtag, 0, sizeof(mtag));
@@ -132,17 +403,34 @@ MOD_INIT()
 
 MOD_LOAD()
 {
+	CAP_MESSAGE_TAGS = ClientCapabilityBit("message-tags");
+
 	if (cfg.has_hosts)
 	{
 		ISupport *is;
 		if (!(is = ISupportAdd(modinfo->handle, "FILEHOST", cfg.isupport_line)))
 			return MOD_FAILED;
 	}
+	EventAdd(modinfo->handle, "preview_cache_expire", preview_cache_expire, NULL, 60000, 0);
 	return MOD_SUCCESS;
 }
 
 MOD_UNLOAD()
 {
+	LinkPreviewContext *context;
+
+	/* Queued fetches never started, nothing will come back for them */
+	while ((context = fetch_queue_head))
+	{
+		fetch_queue_head = context->qnext;
+		free_pending_preview(context);
+	}
+	fetch_queue_tail = NULL;
+	fetches_queued = 0;
+
+	free_link_preview_regexes();
+	SavePersistentPointer(modinfo, preview_cache);
+	SavePersistentInt(modinfo, fetches_active);
 	freeconf();
 	return MOD_SUCCESS;
 }
@@ -153,10 +441,13 @@ MOD_UNLOAD()
 int link_preview_chanmsg(Client *client, Channel *channel, int sendflags, const char *member_modes, const char *target, MessageTag *mtags, const char *text, SendType sendtype)
 {
 	char *url;
+	char *cache_key;
 	const char *msgid = NULL;
 	MessageTag *mtag;
 	LinkPreviewContext *context;
-	OutgoingWebRequest *request;
+	PreviewCacheEntry *cached;
+	PreviewFetchPolicy policy;
+	unsigned int hashv;
 
 	/* Only process PRIVMSG, not NOTICE or TAGMSG */
 	if (sendtype != SEND_TYPE_PRIVMSG)
@@ -170,6 +461,15 @@ int link_preview_chanmsg(Client *client, Channel *channel, int sendflags, const
 		return 0;
 	}
 
+	/* Only one server in the network generates a given preview: the
+	 * configured preview-server, or else the sender's own server.
+	 * Everyone else just relays the resulting TAGMSG.
+	 */
+	if (cfg.preview_server ? strcasecmp(cfg.preview_server, me.name) : !MyUser(client))
+	{
+		return 0;
+	}
+
 	/* Extract URL from message */
 	url = extract_url_from_message(text);
 	if (!url)
@@ -189,24 +489,247 @@ int link_preview_chanmsg(Client *client, Channel *channel, int sendflags, const
 		return 0;
 	}
 
+	/* Media and archives have no <head>, don't spend a fetch or a token on them */
+	policy = preview_fetch_policy(url);
+	if (policy == PREVIEW_FETCH_SKIP || policy == PREVIEW_FETCH_DENIED)
+	{
+		if (policy == PREVIEW_FETCH_SKIP)
+			fetch_stats.skipped_type++;
+		else
+			fetch_stats.skipped_domain++;
+		safe_free(url);
+		return 0;
+	}
+
+	/* Per-user rate limit, this covers cached previews too */
+	if (!preview_rate_allow(client))
+	{
+		fetch_stats.rate_limited++;
+		safe_free(url);
+		return 0;
+	}
+
+	/* Answer straight from the cache if we've seen this link recently */
+	cache_key = normalize_url(url);
+	cached = preview_cache_find(cache_key);
+	if (cached)
+	{
+		if (cached->title)
+			send_link_preview(channel->name, msgid, cached->title, cached->snippet, cached->image);
+		safe_free(cache_key);
+		safe_free(url);
+		return 0;
+	}
+
+	/* Someone already pasted this and we're still fetching it: join them */
+	context = find_pending_preview(cache_key);
+	if (context)
+	{
+		add_preview_waiter(context, channel->name, msgid);
+		safe_free(cache_key);
+		safe_free(url);
+		return 0;
+	}
+
+	/* An image with nowhere to upload it to is its own preview, no fetch needed */
+	if (policy == PREVIEW_FETCH_IMAGE && !(cfg.has_hosts && upload_host_count))
+	{
+		char *title = url_filename(url);
+
+		fetch_stats.direct_images++;
+		send_link_preview(channel->name, msgid, title, NULL, url);
+		preview_cache_add(cache_key, title, NULL, url);
+		safe_free(title);
+		safe_free(cache_key);
+		safe_free(url);
+		return 0;
+	}
+
 	/* Create context for the async callback */
 	context = safe_alloc(sizeof(LinkPreviewContext));
-	safe_strdup(context->channel, channel->name);
-	safe_strdup(context->msgid, msgid);
 	context->url = url; /* Transfer ownership */
+	context->cache_key = cache_key;
+	context->upload_host = -1;
+	context->direct_image = policy == PREVIEW_FETCH_IMAGE;
+	add_preview_waiter(context, channel->name, msgid);
+	safe_strdup(context->origin_channel, channel->name);
+	hashv = siphash(cache_key, preview_cache->hashkey) % PENDING_PREVIEW_HASH_SIZE;
+	context->hnext = pending_previews[hashv];
+	pending_previews[hashv] = context;
+
+	/* Fetch it as soon as the limits allow */
+	queue_preview_fetch(context);
+
+	return 0; /* Don't modify the message */
+}
+
+/**
+ * Token bucket check for a user posting links: allows a burst of
+ * user-rate-count previews, refilled at that many per user-rate-period.
+ * Returns 1 if allowed (and takes a token), 0 if rate limited.
+ */
+int preview_rate_allow(Client *client)
+{
+	PreviewRateBucket *bucket = moddata_client(client, user_bucket_md).ptr;
+	long capacity = cfg.user_rate_count * 1000L;
+	struct timeval tv;
+	long long now;
+
+	if (cfg.user_rate_count <= 0 || cfg.user_rate_period <= 0)
+		return 1; /* disabled */
+
+	gettimeofday(&tv, NULL);
+	now = (long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+
+	if (!bucket)
+	{
+		bucket = safe_alloc(sizeof(PreviewRateBucket));
+		bucket->tokens = capacity;
+		bucket->last_ms = now;
+		moddata_client(client, user_bucket_md).ptr = bucket;
+	}
+
+	/* Refill: user_rate_count tokens per user_rate_period seconds */
+	bucket->tokens += (long)((now - bucket->last_ms) * cfg.user_rate_count / cfg.user_rate_period);
+	if (bucket->tokens > capacity)
+		bucket->tokens = capacity;
+	bucket->last_ms = now;
+
+	if (bucket->tokens < 1000)
+		return 0;
+	bucket->tokens -= 1000;
+	return 1;
+}
+
+/**
+ * Put a new preview on the fetch queue and start whatever fits.
+ * If the queue is full the oldest queued preview is dropped.
+ */
+void queue_preview_fetch(LinkPreviewContext *context)
+{
+	if (fetches_queued >= cfg.queue_size && fetch_queue_head)
+	{
+		LinkPreviewContext *oldest = fetch_queue_head;
+
+		fetch_queue_head = oldest->qnext;
+		if (!fetch_queue_head)
+			fetch_queue_tail = NULL;
+		fetches_queued--;
+		fetch_stats.dropped++;
+		free_pending_preview(oldest);
+	}
+
+	context->qnext = NULL;
+	if (fetch_queue_tail)
+		fetch_queue_tail->qnext = context;
+	else
+		fetch_queue_head = context;
+	fetch_queue_tail = context;
+	fetches_queued++;
+
+	run_preview_queue();
+}
+
+/**
+ * Start queued fetches, oldest first, while we are under the global
+ * limit. Entries whose channel is at its own limit are skipped over
+ * and stay queued.
+ */
+void run_preview_queue(void)
+{
+	LinkPreviewContext *context, *prev = NULL, *next;
+
+	for (context = fetch_queue_head; context && fetches_active < cfg.max_fetches; context = next)
+	{
+		Channel *channel = find_channel(context->origin_channel);
+
+		next = context->qnext;
+		if (channel && moddata_channel(channel, channel_fetches_md).i >= cfg.max_fetches_per_channel)
+		{
+			prev = context;
+			continue;
+		}
+
+		/* Unlink and start it */
+		if (prev)
+			prev->qnext = next;
+		else
+			fetch_queue_head = next;
+		if (fetch_queue_tail == context)
+			fetch_queue_tail = prev;
+		context->qnext = NULL;
+		fetches_queued--;
+		start_preview_fetch(context);
+	}
+}
+
+/**
+ * Start the page download for a preview, taking a global and a
+ * per-channel fetch slot until preview_fetch_done() releases them.
+ */
+void start_preview_fetch(LinkPreviewContext *context)
+{
+	OutgoingWebRequest *request;
+	Channel *channel;
+	char range_header[64];
+
+	fetches_active++;
+	fetch_stats.started++;
+	channel = find_channel(context->origin_channel);
+	if (channel)
+		moddata_channel(channel, channel_fetches_md).i++;
+
+	/* Direct image links go straight to the filehost, there is no page to parse */
+	if (context->direct_image)
+	{
+		fetch_stats.direct_images++;
+		context->title = url_filename(context->url);
+		context->snippet = strdup("");
+		start_image_upload(context, context->url);
+		return;
+	}
 
 	/* Start async web request */
+	snprintf(range_header, sizeof(range_header), "bytes=0-%d", HTML_HEAD_MAX_BYTES - 1);
 	request = safe_alloc(sizeof(OutgoingWebRequest));
-	safe_strdup(request->url, url);
+	safe_strdup(request->url, context->url);
 	request->http_method = HTTP_METHOD_GET;
 	safe_strdup(request->apicallback, "link_preview_download_complete");
 	request->max_redirects = 3;
 	request->callback_data = context;
 	add_nvplist(&request->headers, 0, "User-Agent", "UnrealIRCd-LinkPreview/1.0");
+	context->step_started_us = preview_now_us();
+	/* We only look at <head>, so don't make the server send us the rest */
+	add_nvplist(&request->headers, 0, "Range", range_header);
 
 	url_start_async(request);
+}
 
-	return 0; /* Don't modify the message */
+/**
+ * Release the fetch slots of a finished preview (page plus any image
+ * upload) and start the next queued ones.
+ */
+void preview_fetch_done(LinkPreviewContext *context)
+{
+	Channel *channel = find_channel(context->origin_channel);
+
+	/* Counters may have been reset by a REHASH or a recreated channel */
+	if (fetches_active > 0)
+		fetches_active--;
+	if (channel && moddata_channel(channel, channel_fetches_md).i > 0)
+		moddata_channel(channel, channel_fetches_md).i--;
+
+	run_preview_queue();
+}
+
+void channel_fetches_free(ModData *m)
+{
+	m->i = 0;
+}
+
+void user_bucket_free(ModData *m)
+{
+	safe_free(m->ptr);
 }
 
 /**
@@ -218,19 +741,30 @@ void link_preview_download_complete(OutgoingWebRequest *request, OutgoingWebResp
 	char *title = NULL;
 	char *snippet = NULL;
 	char *meta_image = NULL;
+	HtmlHeadInfo head;
+	long long parse_started_us;
 
 	if (!context)
 	{
 		return;
 	}
 
+	histogram_add(&fetch_stats.fetch_us, preview_now_us() - context->step_started_us);
+	if (response->memory)
+	{
+		fetch_stats.bytes_downloaded += response->memory_len;
+		histogram_add(&fetch_stats.page_bytes, response->memory_len);
+	}
+
 	/* Check for errors */
 	if (response->errorbuf || !response->memory)
 	{
+		fetch_stats.fetch_errors++;
 		unreal_log(ULOG_DEBUG, "o-filehost", "DOWNLOAD_ERROR", NULL,
 				   "Error downloading $url: $error",
 				   log_data_string("url", context->url),
 				   log_data_string("error", response->errorbuf ? response->errorbuf : "No data"));
+		preview_cache_add(context->cache_key, NULL, NULL, NULL);
 		goto cleanup;
 	}
 
@@ -241,72 +775,131 @@ void link_preview_download_complete(OutgoingWebRequest *request, OutgoingWebResp
 				   "Download from $url exceeded size limit ($size bytes)",
 				   log_data_string("url", context->url),
 				   log_data_integer("size", response->memory_len));
+		preview_cache_add(context->cache_key, NULL, NULL, NULL);
+		goto cleanup;
+	}
+
+	/* The link turned out to be an image after all (no extension, a CDN
+	 * URL): preview it like a direct image link instead of parsing it
+	 */
+	if (sniff_image(response->memory, response->memory_len))
+	{
+		fetch_stats.direct_images++;
+		title = url_filename(context->url);
+		if (cfg.has_hosts && upload_host_count)
+		{
+			context->title = title;
+			context->snippet = strdup("");
+			start_image_upload(context, context->url);
+			return;
+		}
+		deliver_pending_preview(context, title, NULL, context->url);
+		preview_cache_add(context->cache_key, title, NULL, context->url);
+		goto cleanup;
+	}
+
+	/* Video, archives, PDFs and the like have no <head> to find */
+	if (sniff_binary(response->memory, response->memory_len))
+	{
+		fetch_stats.skipped_binary++;
+		preview_cache_add(context->cache_key, NULL, NULL, NULL);
 		goto cleanup;
 	}
 
-	/* Extract title and snippet from HTML */
-	title = extract_title_from_html(response->memory);
-	snippet = extract_snippet_from_html(response->memory);
-	meta_image = extract_meta_image_from_html(response->memory);
+	/* Extract title, snippet and image from the <head> in a single pass */
+	memset(&head, 0, sizeof(head));
+	parse_started_us = preview_now_us();
+	parse_html_head(response->memory, response->memory_len, &head);
+	histogram_add(&fetch_stats.parse_us, preview_now_us() - parse_started_us);
+	title = head.title;
+	if (head.description)
+	{
+		snippet = head.description;
+		safe_free(head.og_description);
+	}
+	else
+	{
+		snippet = head.og_description;
+	}
+	if (head.og_image)
+	{
+		meta_image = head.og_image;
+		safe_free(head.twitter_image);
+	}
+	else
+	{
+		meta_image = head.twitter_image;
+	}
 
 	/* Only send if we got at least a title */
 	if (title && *title)
 	{
 		/* If we have a meta image, upload it to configured filehost first */
-		if (meta_image && *meta_image && cfg.has_hosts && cfg.hosts)
-		{
-			ImageUploadContext *upload_ctx;
-			OutgoingWebRequest *upload_req;
-			char *json_payload;
-			char upload_url[512];
-
-			snprintf(upload_url, sizeof(upload_url), "%s/upload", cfg.hosts->line);
-
-			/* Create context for image upload callback */
-			upload_ctx = safe_alloc(sizeof(ImageUploadContext));
-			safe_strdup(upload_ctx->channel, context->channel);
-			safe_strdup(upload_ctx->msgid, context->msgid);
-			safe_strdup(upload_ctx->title, title);
-			safe_strdup(upload_ctx->snippet, snippet ? snippet : "");
-
-			/* Build JSON payload: {"url": "image_url"} */
-			json_payload = safe_alloc(strlen(meta_image) + 50);
-			snprintf(json_payload, strlen(meta_image) + 50, "{\"url\":\"%s\"}", meta_image);
-
-			/* Start async upload request */
-			upload_req = safe_alloc(sizeof(OutgoingWebRequest));
-			safe_strdup(upload_req->url, upload_url);
-			upload_req->http_method = HTTP_METHOD_POST;
-			safe_strdup(upload_req->apicallback, "image_upload_complete");
-			upload_req->callback_data = upload_ctx;
-			safe_strdup(upload_req->body, json_payload);
-			add_nvplist(&upload_req->headers, 0, "Content-Type", "application/json");
-			add_nvplist(&upload_req->headers, 0, "User-Agent", "UnrealIRCd-LinkPreview/1.0");
-
-			url_start_async(upload_req);
-			safe_free(json_payload);
+		if (meta_image && *meta_image && cfg.has_hosts && upload_host_count)
+		{
+			/* Keep the context (and its waiters) for the image upload callback */
+			context->title = title;
+			context->snippet = snippet ? snippet : strdup("");
+			title = snippet = NULL;
+			start_image_upload(context, meta_image);
+			safe_free(meta_image);
+			return;
 		}
 		else
 		{
-			if (meta_image && *meta_image && !cfg.has_hosts)
-			{
-			}
 			/* No image or no filehost configured, send preview directly */
-			send_link_preview(context->channel, context->msgid, title, snippet, meta_image && *meta_image ? meta_image : NULL);
+			deliver_pending_preview(context, title, snippet, meta_image && *meta_image ? meta_image : NULL);
+			preview_cache_add(context->cache_key, title, snippet, meta_image && *meta_image ? meta_image : NULL);
 		}
 	}
 	else
 	{
+		/* Nothing to preview, remember that too */
+		preview_cache_add(context->cache_key, NULL, NULL, NULL);
 	}
 
 cleanup:
 	safe_free(title);
 	safe_free(snippet);
 	safe_free(meta_image);
-	safe_free(context->channel);
-	safe_free(context->msgid);
-	safe_free(context->url);
-	safe_free(context);
+	preview_fetch_done(context);
+	free_pending_preview(context);
+}
+
+/**
+ * Upload an image to the next filehost, image_upload_complete() then
+ * delivers context->title and context->snippet with the saved copy.
+ * The preview keeps its fetch slots until then.
+ */
+void start_image_upload(LinkPreviewContext *context, const char *image_url)
+{
+	OutgoingWebRequest *upload_req;
+	json_t *payload;
+	char *json_payload;
+	char upload_url[512];
+
+	context->upload_host = pick_upload_host();
+	snprintf(upload_url, sizeof(upload_url), "%s/upload", upload_hosts[context->upload_host].url);
+
+	/* Build JSON payload: {"url": "image_url"}, escaped by jansson since the URL comes from the page */
+	payload = json_object();
+	json_object_set_new(payload, "url", json_string(image_url));
+	json_payload = json_dumps(payload, JSON_COMPACT);
+	json_decref(payload);
+
+	/* Start async upload request */
+	upload_req = safe_alloc(sizeof(OutgoingWebRequest));
+	safe_strdup(upload_req->url, upload_url);
+	upload_req->http_method = HTTP_METHOD_POST;
+	safe_strdup(upload_req->apicallback, "image_upload_complete");
+	upload_req->callback_data = context;
+	safe_strdup(upload_req->body, json_payload);
+	add_nvplist(&upload_req->headers, 0, "Content-Type", "application/json");
+	add_nvplist(&upload_req->headers, 0, "User-Agent", "UnrealIRCd-LinkPreview/1.0");
+
+	context->step_started_us = preview_now_us();
+	url_start_async(upload_req);
+	safe_free(json_payload);
 }
 
 /**
@@ -314,7 +907,7 @@ cleanup:
  */
 void image_upload_complete(OutgoingWebRequest *request, OutgoingWebResponse *response)
 {
-	ImageUploadContext *context = (ImageUploadContext *)request->callback_data;
+	LinkPreviewContext *context = (LinkPreviewContext *)request->callback_data;
 	json_t *result;
 	json_error_t jerr;
 	const char *saved_url = NULL;
@@ -324,20 +917,25 @@ void image_upload_complete(OutgoingWebRequest *request, OutgoingWebResponse *res
 		return;
 	}
 
+	histogram_add(&fetch_stats.upload_us, preview_now_us() - context->step_started_us);
+
 	/* Check for errors */
 	if (response->errorbuf || !response->memory)
 	{
+		fetch_stats.upload_errors++;
+		upload_host_result(context->upload_host, 0);
 		/* Send preview without image */
-		send_link_preview(context->channel, context->msgid, context->title, context->snippet, NULL);
+		deliver_pending_preview(context, context->title, context->snippet, NULL);
 		goto cleanup;
 	}
 
 	/* Parse JSON response to extract saved_url */
 	result = json_loads(response->memory, JSON_REJECT_DUPLICATES, &jerr);
+	upload_host_result(context->upload_host, result != NULL);
 	if (!result)
 	{
 		/* Send preview without image */
-		send_link_preview(context->channel, context->msgid, context->title, context->snippet, NULL);
+		deliver_pending_preview(context, context->title, context->snippet, NULL);
 		goto cleanup;
 	}
 
@@ -348,322 +946,475 @@ void image_upload_complete(OutgoingWebRequest *request, OutgoingWebResponse *res
 		saved_url = json_string_value(saved_url_obj);
 		
 		/* Send preview with local image URL */
-		send_link_preview(context->channel, context->msgid, context->title, context->snippet, saved_url);
+		deliver_pending_preview(context, context->title, context->snippet, saved_url);
+		preview_cache_add(context->cache_key, context->title, context->snippet, saved_url);
 	}
 	else
 	{
 		/* Send preview without image */
-		send_link_preview(context->channel, context->msgid, context->title, context->snippet, NULL);
+		deliver_pending_preview(context, context->title, context->snippet, NULL);
 	}
 
 	json_decref(result);
 
 cleanup:
-	safe_free(context->channel);
-	safe_free(context->msgid);
-	safe_free(context->title);
-	safe_free(context->snippet);
-	safe_free(context);
+	preview_fetch_done(context);
+	free_pending_preview(context);
 }
 
 /**
- * Extract first URL from message text
+ * Find the in-flight preview for a cache key, if any
  */
-char *extract_url_from_message(const char *text)
+LinkPreviewContext *find_pending_preview(const char *key)
 {
-	pcre2_code *re;
-	pcre2_match_data *match_data;
-	PCRE2_SPTR pattern = (PCRE2_SPTR)"https?://[^\\s<>\"]+";
-	PCRE2_SPTR subject = (PCRE2_SPTR)text;
-	int errornumber;
-	PCRE2_SIZE erroroffset;
-	int rc;
-	char *result = NULL;
-
-	/* Compile regex */
-	re = pcre2_compile(pattern, PCRE2_ZERO_TERMINATED, 0, &errornumber, &erroroffset, NULL);
-	if (!re)
-		return NULL;
-
-	/* Match */
-	match_data = pcre2_match_data_create_from_pattern(re, NULL);
-	rc = pcre2_match(re, subject, strlen(text), 0, 0, match_data, NULL);
+	LinkPreviewContext *context;
 
-	if (rc > 0)
+	for (context = pending_previews[siphash(key, preview_cache->hashkey) % PENDING_PREVIEW_HASH_SIZE]; context; context = context->hnext)
 	{
-		PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(match_data);
-		size_t url_len = ovector[1] - ovector[0];
-		
-		/* Limit URL length for safety */
-		if (url_len > MAX_URL_LENGTH)
-			url_len = MAX_URL_LENGTH;
-
-		result = safe_alloc(url_len + 1);
-		memcpy(result, text + ovector[0], url_len);
-		result[url_len] = '\0';
+		if (!strcmp(context->cache_key, key))
+			return context;
 	}
+	return NULL;
+}
 
-	pcre2_match_data_free(match_data);
-	pcre2_code_free(re);
+/**
+ * Add a channel/msgid pair to be answered when the preview is ready
+ */
+void add_preview_waiter(LinkPreviewContext *context, const char *channel, const char *msgid)
+{
+	PreviewWaiter *w = safe_alloc(sizeof(PreviewWaiter));
 
-	return result;
+	safe_strdup(w->channel, channel);
+	safe_strdup(w->msgid, msgid);
+	w->next = context->waiters;
+	context->waiters = w;
 }
 
 /**
- * Extract title from HTML using regex
+ * Send the finished preview to every waiter of an in-flight request
  */
-char *extract_title_from_html(const char *html)
+void deliver_pending_preview(LinkPreviewContext *context, const char *title, const char *snippet, const char *meta_image)
 {
-	pcre2_code *re;
-	pcre2_match_data *match_data;
-	PCRE2_SPTR pattern = (PCRE2_SPTR)"<title[^>]*>([^<]+)</title>";
-	PCRE2_SPTR subject = (PCRE2_SPTR)html;
-	int errornumber;
-	PCRE2_SIZE erroroffset;
-	int rc;
-	char *result = NULL;
+	PreviewWaiter *w;
 
-	/* Compile regex (case insensitive) */
-	re = pcre2_compile(pattern, PCRE2_ZERO_TERMINATED, PCRE2_CASELESS, &errornumber, &erroroffset, NULL);
-	if (!re)
-		return NULL;
+	for (w = context->waiters; w; w = w->next)
+		send_link_preview(w->channel, w->msgid, title, snippet, meta_image);
+}
 
-	/* Match */
-	match_data = pcre2_match_data_create_from_pattern(re, NULL);
-	rc = pcre2_match(re, subject, strlen(html), 0, 0, match_data, NULL);
+/**
+ * Remove an in-flight preview from the pending table and free it
+ */
+void free_pending_preview(LinkPreviewContext *context)
+{
+	LinkPreviewContext **pp;
+	PreviewWaiter *w, *w_next;
 
-	if (rc > 1)
+	for (pp = &pending_previews[siphash(context->cache_key, preview_cache->hashkey) % PENDING_PREVIEW_HASH_SIZE]; *pp; pp = &(*pp)->hnext)
 	{
-		PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(match_data);
-		size_t title_len = ovector[3] - ovector[2];
-		
-		/* Limit title length */
-		if (title_len > MAX_TITLE_LENGTH)
-			title_len = MAX_TITLE_LENGTH;
-
-		result = safe_alloc(title_len + 1);
-		memcpy(result, html + ovector[2], title_len);
-		result[title_len] = '\0';
-
-		/* Trim whitespace */
-		char *p = result;
-		while (*p && isspace(*p)) p++;
-		if (p != result)
-			memmove(result, p, strlen(p) + 1);
-		
-		p = result + strlen(result) - 1;
-		while (p > result && isspace(*p))
-			*p-- = '\0';
+		if (*pp == context)
+		{
+			*pp = context->hnext;
+			break;
+		}
 	}
 
-	pcre2_match_data_free(match_data);
-	pcre2_code_free(re);
-
-	return result;
+	for (w = context->waiters; w; w = w_next)
+	{
+		w_next = w->next;
+		safe_free(w->channel);
+		safe_free(w->msgid);
+		safe_free(w);
+	}
+	safe_free(context->url);
+	safe_free(context->cache_key);
+	safe_free(context->title);
+	safe_free(context->snippet);
+	safe_free(context->origin_channel);
+	safe_free(context);
 }
 
 /**
- * Extract description/snippet from HTML meta tags or first paragraph
+ * Compile all link preview regexes, with JIT where available.
+ * Returns 1 on success, 0 if any pattern failed to compile.
  */
-char *extract_snippet_from_html(const char *html)
+int compile_link_preview_regexes(void)
 {
-	pcre2_code *re;
-	pcre2_match_data *match_data;
-	PCRE2_SPTR pattern;
-	PCRE2_SPTR subject = (PCRE2_SPTR)html;
 	int errornumber;
 	PCRE2_SIZE erroroffset;
-	int rc;
-	char *result = NULL;
+	int i;
 
-	/* Try meta description first */
-	pattern = (PCRE2_SPTR)"<meta[^>]+name=[\"']description[\"'][^>]+content=[\"']([^\"']+)[\"']";
-	re = pcre2_compile(pattern, PCRE2_ZERO_TERMINATED, PCRE2_CASELESS, &errornumber, &erroroffset, NULL);
-	if (!re)
+	for (i = 0; i < LP_RE_COUNT; i++)
 	{
-		/* Try alternative format */
-		pattern = (PCRE2_SPTR)"<meta[^>]+content=[\"']([^\"']+)[\"'][^>]+name=[\"']description[\"']";
-		re = pcre2_compile(pattern, PCRE2_ZERO_TERMINATED, PCRE2_CASELESS, &errornumber, &erroroffset, NULL);
-	}
-
-	if (re)
-	{
-		match_data = pcre2_match_data_create_from_pattern(re, NULL);
-		rc = pcre2_match(re, subject, strlen(html), 0, 0, match_data, NULL);
-
-		if (rc > 1)
+		link_preview_re[i] = pcre2_compile((PCRE2_SPTR)link_preview_patterns[i].pattern, PCRE2_ZERO_TERMINATED,
+		                                   link_preview_patterns[i].options, &errornumber, &erroroffset, NULL);
+		if (!link_preview_re[i])
 		{
-			PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(match_data);
-			size_t snippet_len = ovector[3] - ovector[2];
-			
-			/* Limit snippet length */
-			if (snippet_len > MAX_SNIPPET_LENGTH)
-				snippet_len = MAX_SNIPPET_LENGTH;
-
-			result = safe_alloc(snippet_len + 1);
-			memcpy(result, html + ovector[2], snippet_len);
-			result[snippet_len] = '\0';
-
-			/* Trim whitespace */
-			char *p = result;
-			while (*p && isspace(*p)) p++;
-			if (p != result)
-				memmove(result, p, strlen(p) + 1);
-			
-			p = result + strlen(result) - 1;
-			while (p > result && isspace(*p))
-				*p-- = '\0';
+			config_error("[o-filehost] Could not compile regex #%d (error %d at offset %d)", i, errornumber, (int)erroroffset);
+			free_link_preview_regexes();
+			return 0;
 		}
-
-		pcre2_match_data_free(match_data);
-		pcre2_code_free(re);
+		/* JIT is optional: if PCRE2 was built without it, pcre2_match() just uses the interpreter */
+		pcre2_jit_compile(link_preview_re[i], PCRE2_JIT_COMPLETE);
 	}
 
-	/* If no meta description, try Open Graph description */
-	if (!result)
+	/* One match data block is enough for every pattern, we only ever run one match at a time */
+	link_preview_match_data = pcre2_match_data_create(LP_RE_MAX_GROUPS, NULL);
+	if (!link_preview_match_data)
 	{
-		pattern = (PCRE2_SPTR)"<meta[^>]+property=[\"']og:description[\"'][^>]+content=[\"']([^\"']+)[\"']";
-		re = pcre2_compile(pattern, PCRE2_ZERO_TERMINATED, PCRE2_CASELESS, &errornumber, &erroroffset, NULL);
-		
-		if (re)
-		{
-			match_data = pcre2_match_data_create_from_pattern(re, NULL);
-			rc = pcre2_match(re, subject, strlen(html), 0, 0, match_data, NULL);
-
-			if (rc > 1)
-			{
-				PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(match_data);
-				size_t snippet_len = ovector[3] - ovector[2];
-				
-				if (snippet_len > MAX_SNIPPET_LENGTH)
-					snippet_len = MAX_SNIPPET_LENGTH;
-
-				result = safe_alloc(snippet_len + 1);
-				memcpy(result, html + ovector[2], snippet_len);
-				result[snippet_len] = '\0';
-
-				/* Trim whitespace */
-				char *p = result;
-				while (*p && isspace(*p)) p++;
-				if (p != result)
-					memmove(result, p, strlen(p) + 1);
-				
-				p = result + strlen(result) - 1;
-				while (p > result && isspace(*p))
-					*p-- = '\0';
-			}
-
-			pcre2_match_data_free(match_data);
-			pcre2_code_free(re);
-		}
+		free_link_preview_regexes();
+		return 0;
 	}
-
-	return result;
+	return 1;
 }
 
 /**
- * Extract meta image from HTML (Open Graph or Twitter Card)
+ * Free the compiled link preview regexes
  */
-char *extract_meta_image_from_html(const char *html)
+void free_link_preview_regexes(void)
 {
-	pcre2_code *re;
-	pcre2_match_data *match_data;
-	PCRE2_SPTR pattern;
-	PCRE2_SPTR subject = (PCRE2_SPTR)html;
-	int errornumber;
-	PCRE2_SIZE erroroffset;
-	int rc;
-	char *result = NULL;
+	int i;
 
-	/* Try Open Graph image first (og:image) */
-	pattern = (PCRE2_SPTR)"<meta[^>]+property=[\"']og:image[\"'][^>]+content=[\"']([^\"']+)[\"']";
-	re = pcre2_compile(pattern, PCRE2_ZERO_TERMINATED, PCRE2_CASELESS, &errornumber, &erroroffset, NULL);
-	if (!re)
+	for (i = 0; i < LP_RE_COUNT; i++)
 	{
-		/* Try alternative format */
-		pattern = (PCRE2_SPTR)"<meta[^>]+content=[\"']([^\"']+)[\"'][^>]+property=[\"']og:image[\"']";
-		re = pcre2_compile(pattern, PCRE2_ZERO_TERMINATED, PCRE2_CASELESS, &errornumber, &erroroffset, NULL);
+		if (link_preview_re[i])
+			pcre2_code_free(link_preview_re[i]);
+		link_preview_re[i] = NULL;
 	}
+	if (link_preview_match_data)
+		pcre2_match_data_free(link_preview_match_data);
+	link_preview_match_data = NULL;
+}
 
-	if (re)
-	{
-		match_data = pcre2_match_data_create_from_pattern(re, NULL);
-		rc = pcre2_match(re, subject, strlen(html), 0, 0, match_data, NULL);
+/**
+ * Trim leading and trailing whitespace in place
+ */
+static void trim_whitespace(char *str)
+{
+	char *p = str;
 
-		if (rc > 1)
-		{
-			PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(match_data);
-			size_t image_len = ovector[3] - ovector[2];
-			
-			/* Limit image URL length */
-			if (image_len > MAX_META_LENGTH)
-				image_len = MAX_META_LENGTH;
+	while (*p && isspace(*p)) p++;
+	if (p != str)
+		memmove(str, p, strlen(p) + 1);
 
-			result = safe_alloc(image_len + 1);
-			memcpy(result, html + ovector[2], image_len);
-			result[image_len] = '\0';
+	p = str + strlen(str) - 1;
+	while (p > str && isspace(*p))
+		*p-- = '\0';
+}
 
-			/* Trim whitespace */
-			char *p = result;
-			while (*p && isspace(*p)) p++;
-			if (p != result)
-				memmove(result, p, strlen(p) + 1);
-			
-			p = result + strlen(result) - 1;
-			while (p > result && isspace(*p))
-				*p-- = '\0';
-		}
+/**
+ * Run precompiled regex 'which' against 'subject' and return a copy of
+ * capture group 'group' (0 = whole match), cut at 'maxlen' bytes.
+ * Returns NULL if there was no match.
+ */
+static char *regex_capture(LinkPreviewRegex which, const char *subject, int group, size_t maxlen)
+{
+	PCRE2_SIZE *ovector;
+	size_t len;
+	char *result;
+	int rc;
 
-		pcre2_match_data_free(match_data);
-		pcre2_code_free(re);
-	}
+	if (!link_preview_re[which] || !link_preview_match_data)
+		return NULL;
 
-	/* If no og:image, try Twitter Card image (twitter:image or twitter:image:src) */
-	if (!result)
+	rc = pcre2_match(link_preview_re[which], (PCRE2_SPTR)subject, strlen(subject), 0, 0, link_preview_match_data, NULL);
+	if (rc <= group)
+		return NULL;
+
+	ovector = pcre2_get_ovector_pointer(link_preview_match_data);
+	len = ovector[2 * group + 1] - ovector[2 * group];
+	if (len > maxlen)
+		len = maxlen;
+
+	result = safe_alloc(len + 1);
+	memcpy(result, subject + ovector[2 * group], len);
+	result[len] = '\0';
+	return result;
+}
+
+/**
+ * Cheap pre-filter for the message hot path: find the first "http://"
+ * or "https://" in 'text' without touching PCRE2. This is a strchr()
+ * walk over the ':' characters, so plain chat costs a single (libc
+ * vectorized) pass over the bytes.
+ * Returns a pointer to the start of the candidate scheme, or NULL.
+ */
+const char *find_url_candidate(const char *text)
+{
+	const char *p = text;
+
+	while ((p = strchr(p, ':')))
 	{
-		pattern = (PCRE2_SPTR)"<meta[^>]+name=[\"']twitter:image(:src)?[\"'][^>]+content=[\"']([^\"']+)[\"']";
-		re = pcre2_compile(pattern, PCRE2_ZERO_TERMINATED, PCRE2_CASELESS, &errornumber, &erroroffset, NULL);
-		
-		if (re)
+		if (p[1] == '/' && p[2] == '/')
 		{
-			match_data = pcre2_match_data_create_from_pattern(re, NULL);
-			rc = pcre2_match(re, subject, strlen(html), 0, 0, match_data, NULL);
+			if ((p - text >= 5) && !strncmp(p - 5, "https", 5))
+				return p - 5;
+			if ((p - text >= 4) && !strncmp(p - 4, "http", 4))
+				return p - 4;
+		}
+		p++;
+	}
+	return NULL;
+}
 
-			if (rc > 1)
+/**
+ * Extract first URL from message text
+ */
+char *extract_url_from_message(const char *text)
+{
+	const char *candidate = find_url_candidate(text);
+
+	/* Most messages have no URL at all, don't bother the regex engine */
+	if (!candidate)
+		return NULL;
+
+	/* Limit URL length for safety */
+	return regex_capture(LP_RE_URL, candidate, 0, MAX_URL_LENGTH);
+}
+
+/**
+ * Decode the handful of HTML entities that commonly show up in titles
+ * and meta content (notably &amp; in image URLs), in place.
+ */
+static void decode_html_entities(char *str)
+{
+	static const struct { const char *entity; char c; } entities[] = {
+		{ "&amp;", '&' }, { "&lt;", '<' }, { "&gt;", '>' },
+		{ "&quot;", '"' }, { "&#39;", '\'' }, { "&#x27;", '\'' }, { "&apos;", '\'' },
+	};
+	char *in = str, *out = str;
+	size_t i;
+
+	while (*in)
+	{
+		if (*in == '&')
+		{
+			for (i = 0; i < sizeof(entities) / sizeof(entities[0]); i++)
 			{
-				PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(match_data);
-				/* The captured group for the URL will be at index 2 (group 1 is :src optional) */
-				size_t image_len;
-				int url_group = (rc > 2) ? 5 : 3; /* If optional :src matched, URL is in group 2, otherwise group 1 */
-				
-				image_len = ovector[url_group] - ovector[url_group - 1];
-				
-				if (image_len > MAX_META_LENGTH)
-					image_len = MAX_META_LENGTH;
-
-				result = safe_alloc(image_len + 1);
-				memcpy(result, html + ovector[url_group - 1], image_len);
-				result[image_len] = '\0';
-
-				/* Trim whitespace */
-				char *p = result;
-				while (*p && isspace(*p)) p++;
-				if (p != result)
-					memmove(result, p, strlen(p) + 1);
-				
-				p = result + strlen(result) - 1;
-				while (p > result && isspace(*p))
-					*p-- = '\0';
+				size_t n = strlen(entities[i].entity);
+				if (!strncasecmp(in, entities[i].entity, n))
+				{
+					*out++ = entities[i].c;
+					in += n;
+					break;
+				}
 			}
-
-			pcre2_match_data_free(match_data);
-			pcre2_code_free(re);
+			if (i < sizeof(entities) / sizeof(entities[0]))
+				continue;
 		}
+		*out++ = *in++;
 	}
+	*out = '\0';
+}
 
+/**
+ * Copy a value out of the page: cut at 'maxlen', decode entities and
+ * trim whitespace. Returns NULL rather than an empty string.
+ */
+static char *copy_html_value(const char *start, size_t len, size_t maxlen)
+{
+	char *result;
+
+	if (len > maxlen)
+		len = maxlen;
+	result = safe_alloc(len + 1);
+	memcpy(result, start, len);
+	result[len] = '\0';
+	decode_html_entities(result);
+	trim_whitespace(result);
+	if (!*result)
+		safe_free(result);
 	return result;
 }
 
+/**
+ * Like copy_html_value(), for image URLs: decoding can turn &quot; and
+ * &#10; into characters no URL has, so those values are dropped.
+ */
+static char *copy_html_url(const char *start, size_t len, size_t maxlen)
+{
+	char *result = copy_html_value(start, len, maxlen);
+
+	if (!result)
+		return NULL;
+	for (const unsigned char *p = (const unsigned char *)result; *p; p++)
+	{
+		if (*p < 0x20 || *p == 0x7f || *p == '"' || *p == '\\')
+		{
+			safe_free(result);
+			return NULL;
+		}
+	}
+	return result;
+}
+
+/**
+ * Find 'needle' between 'p' and 'end' (case-insensitive).
+ * Returns a pointer just past it, or 'end' if not found.
+ */
+static const char *skip_past(const char *p, const char *end, const char *needle)
+{
+	size_t n = strlen(needle);
+
+	while (p < end && (p = memchr(p, needle[0], end - p)))
+	{
+		if ((size_t)(end - p) < n)
+			break;
+		if (!strncasecmp(p, needle, n))
+			return p + n;
+		p++;
+	}
+	return end;
+}
+
+#define HTML_NAME_IS(s, len, lit) ((len) == sizeof(lit) - 1 && !strncasecmp((s), (lit), (len)))
+
+/**
+ * Parse the attributes of a <meta> tag starting at 'p' and store the
+ * content if it is one we care about.
+ * Returns a pointer past the end of the tag.
+ */
+static const char *parse_html_meta(const char *p, const char *end, HtmlHeadInfo *info)
+{
+	const char *key = NULL, *content = NULL;
+	size_t key_len = 0, content_len = 0;
+
+	while (p < end && *p != '>')
+	{
+		const char *attr, *value;
+		size_t attr_len, value_len = 0;
+
+		if (isspace(*p) || *p == '/')
+		{
+			p++;
+			continue;
+		}
+
+		attr = p;
+		while (p < end && !isspace(*p) && *p != '=' && *p != '>' && *p != '/')
+			p++;
+		attr_len = p - attr;
+		while (p < end && isspace(*p))
+			p++;
+		if (p >= end || *p != '=')
+			continue; /* attribute without a value */
+		p++;
+		while (p < end && isspace(*p))
+			p++;
+		if (p < end && (*p == '"' || *p == '\''))
+		{
+			char quote = *p++;
+			value = p;
+			while (p < end && *p != quote)
+				p++;
+			value_len = p - value;
+			if (p < end)
+				p++;
+		}
+		else
+		{
+			value = p;
+			while (p < end && !isspace(*p) && *p != '>')
+				p++;
+			value_len = p - value;
+		}
+
+		if (HTML_NAME_IS(attr, attr_len, "name") || HTML_NAME_IS(attr, attr_len, "property"))
+		{
+			key = value;
+			key_len = value_len;
+		}
+		else if (HTML_NAME_IS(attr, attr_len, "content"))
+		{
+			content = value;
+			content_len = value_len;
+		}
+	}
+
+	if (key && content)
+	{
+		if (!info->description && HTML_NAME_IS(key, key_len, "description"))
+			info->description = copy_html_value(content, content_len, MAX_SNIPPET_LENGTH);
+		else if (!info->og_description && HTML_NAME_IS(key, key_len, "og:description"))
+			info->og_description = copy_html_value(content, content_len, MAX_SNIPPET_LENGTH);
+		else if (!info->og_image && HTML_NAME_IS(key, key_len, "og:image"))
+			info->og_image = copy_html_url(content, content_len, MAX_META_LENGTH);
+		else if (!info->twitter_image && (HTML_NAME_IS(key, key_len, "twitter:image") || HTML_NAME_IS(key, key_len, "twitter:image:src")))
+			info->twitter_image = copy_html_url(content, content_len, MAX_META_LENGTH);
+	}
+
+	return p < end ? p + 1 : end;
+}
+
+/**
+ * Single-pass scan of the start of an HTML page for the <title>, the
+ * description and og:/twitter: meta tags. Stops at </head> (or <body>),
+ * once everything has been found, or after HTML_HEAD_MAX_BYTES.
+ * Comments, <script> and <style> contents are skipped.
+ * The caller frees whatever ends up in 'info'.
+ */
+void parse_html_head(const char *html, size_t len, HtmlHeadInfo *info)
+{
+	const char *p = html;
+	const char *end = html + (len > HTML_HEAD_MAX_BYTES ? HTML_HEAD_MAX_BYTES : len);
+
+	while (p < end && (p = memchr(p, '<', end - p)))
+	{
+		const char *tag;
+		size_t tag_len;
+
+		p++;
+		if (end - p >= 3 && !strncmp(p, "!--", 3))
+		{
+			p = skip_past(p + 3, end, "-->");
+			continue;
+		}
+
+		tag = p;
+		if (p < end && *p == '/')
+			p++;
+		while (p < end && isalnum(*p))
+			p++;
+		tag_len = p - tag;
+
+		if (HTML_NAME_IS(tag, tag_len, "/head") || HTML_NAME_IS(tag, tag_len, "body"))
+			break;
+
+		if (HTML_NAME_IS(tag, tag_len, "script"))
+		{
+			p = skip_past(p, end, "</script");
+			continue;
+		}
+		if (HTML_NAME_IS(tag, tag_len, "style"))
+		{
+			p = skip_past(p, end, "</style");
+			continue;
+		}
+
+		if (HTML_NAME_IS(tag, tag_len, "title") && !info->title)
+		{
+			const char *text, *text_end;
+
+			p = memchr(p, '>', end - p);
+			if (!p)
+				break;
+			text = p + 1;
+			text_end = memchr(text, '<', end - text);
+			if (!text_end)
+				break;
+			info->title = copy_html_value(text, text_end - text, MAX_TITLE_LENGTH);
+			p = text_end;
+		}
+		else if (HTML_NAME_IS(tag, tag_len, "meta"))
+		{
+			p = parse_html_meta(p, end, info);
+		}
+
+		/* Nothing left to look for */
+		if (info->title && info->description && info->og_image)
+			break;
+	}
+}
+
 /**
  * Validate our custom message tags
  */
@@ -687,7 +1438,6 @@ void send_link_preview(const char *channel, const char *msgid, const char *title
 	MessageTag *mtags = NULL;
 	MessageTag *m;
 	Channel *chan;
-	Member *member;
 
 	chan = find_channel(channel);
 	if (!chan)
@@ -741,17 +1491,702 @@ void send_link_preview(const char *channel, const char *msgid, const char *title
 	/* Use new_message_special to add standard tags (msgid, time) and prepare for sending */
 	new_message_special(&me, mtags, &mtags, ":%s TAGMSG %s", me.name, channel);
 
-	/* Send TAGMSG to all channel members */
-	for (member = chan->members; member; member = member->next)
+	/* Send TAGMSG through the core's channel broadcast: local members that
+	 * negotiated message-tags (a TAGMSG means nothing to anyone else), plus
+	 * once per server link that has members. Those servers deliver it to
+	 * their own users rather than fetching it themselves.
+	 */
+	sendto_channel(chan, &me, NULL, NULL, CAP_MESSAGE_TAGS, SEND_ALL, mtags, ":%s TAGMSG %s", me.name, chan->name);
+
+	free_message_tags(mtags);
+}
+
+/**
+ * Normalize a URL for use as a cache key: lowercase the scheme and host,
+ * drop a default port and the #fragment, and make an empty path "/".
+ * Returns a newly allocated string.
+ */
+char *normalize_url(const char *url)
+{
+	const char *host, *host_end, *rest, *fragment;
+	size_t scheme_len, host_len, rest_len;
+	char *result, *p;
+
+	host = strstr(url, "://");
+	if (!host)
+		return strdup(url);
+	scheme_len = host - url;
+	host += 3;
+
+	host_end = host + strcspn(host, "/?#");
+	rest = host_end;
+	fragment = strchr(rest, '#');
+	rest_len = fragment ? (size_t)(fragment - rest) : strlen(rest);
+
+	/* Drop the port if it's the default one for this scheme */
+	host_len = host_end - host;
+	if (host_len > 3 && scheme_len == 4 && !strncasecmp(url, "http", 4) && !strncmp(host_end - 3, ":80", 3))
+		host_len -= 3;
+	else if (host_len > 4 && scheme_len == 5 && !strncasecmp(url, "https", 5) && !strncmp(host_end - 4, ":443", 4))
+		host_len -= 4;
+
+	result = safe_alloc(scheme_len + 3 + host_len + rest_len + 2);
+	p = result;
+	memcpy(p, url, scheme_len + 3);
+	p += scheme_len + 3;
+	memcpy(p, host, host_len);
+	p += host_len;
+	for (char *c = result; c < p; c++)
+		*c = tolower(*c);
+	if (!rest_len || *rest != '/')
+		*p++ = '/';
+	memcpy(p, rest, rest_len);
+	p[rest_len] = '\0';
+	return result;
+}
+
+/* File extensions that decide the fetch policy on their own, sorted for bsearch() */
+typedef struct {
+	const char *ext;
+	PreviewFetchPolicy policy;
+} PreviewExtension;
+
+static const PreviewExtension preview_extensions[] = {
+	{ "7z", PREVIEW_FETCH_SKIP },
+	{ "apk", PREVIEW_FETCH_SKIP },
+	{ "avi", PREVIEW_FETCH_SKIP },
+	{ "avif", PREVIEW_FETCH_IMAGE },
+	{ "bin", PREVIEW_FETCH_SKIP },
+	{ "bmp", PREVIEW_FETCH_IMAGE },
+	{ "bz2", PREVIEW_FETCH_SKIP },
+	{ "deb", PREVIEW_FETCH_SKIP },
+	{ "dmg", PREVIEW_FETCH_SKIP },
+	{ "exe", PREVIEW_FETCH_SKIP },
+	{ "flac", PREVIEW_FETCH_SKIP },
+	{ "gif", PREVIEW_FETCH_IMAGE },
+	{ "gz", PREVIEW_FETCH_SKIP },
+	{ "iso", PREVIEW_FETCH_SKIP },
+	{ "jpeg", PREVIEW_FETCH_IMAGE },
+	{ "jpg", PREVIEW_FETCH_IMAGE },
+	{ "m4a", PREVIEW_FETCH_SKIP },
+	{ "m4v", PREVIEW_FETCH_SKIP },
+	{ "mkv", PREVIEW_FETCH_SKIP },
+	{ "mov", PREVIEW_FETCH_SKIP },
+	{ "mp3", PREVIEW_FETCH_SKIP },
+	{ "mp4", PREVIEW_FETCH_SKIP },
+	{ "msi", PREVIEW_FETCH_SKIP },
+	{ "ogg", PREVIEW_FETCH_SKIP },
+	{ "opus", PREVIEW_FETCH_SKIP },
+	{ "pdf", PREVIEW_FETCH_SKIP },
+	{ "png", PREVIEW_FETCH_IMAGE },
+	{ "rar", PREVIEW_FETCH_SKIP },
+	{ "rpm", PREVIEW_FETCH_SKIP },
+	{ "tar", PREVIEW_FETCH_SKIP },
+	{ "tgz", PREVIEW_FETCH_SKIP },
+	{ "wav", PREVIEW_FETCH_SKIP },
+	{ "webm", PREVIEW_FETCH_SKIP },
+	{ "webp", PREVIEW_FETCH_IMAGE },
+	{ "xz", PREVIEW_FETCH_SKIP },
+	{ "zip", PREVIEW_FETCH_SKIP },
+	{ "zst", PREVIEW_FETCH_SKIP },
+};
+
+static int preview_extension_compare(const void *key, const void *entry)
+{
+	return strcmp(key, ((const PreviewExtension *)entry)->ext);
+}
+
+/**
+ * Find the rule for a domain: the host itself, then each parent
+ * domain up to the top level one. Returns NULL if none matches.
+ */
+static DomainRule *find_domain_rule(const char *host)
+{
+	const char *p = host;
+
+	if (!domain_rules.hash)
+		return NULL;
+
+	while (p && *p)
+	{
+		uint64_t hashv = siphash(p, preview_cache->hashkey);
+		DomainRule *rule;
+
+		for (rule = domain_rules.hash[hashv & (domain_rules.hash_size - 1)]; rule; rule = rule->hnext)
+			if (rule->hashv == hashv && !strcmp(rule->name, p))
+				return rule;
+		p = strchr(p, '.');
+		if (p)
+			p++;
+	}
+	return NULL;
+}
+
+/**
+ * Decide how to preview a link from its domain and file extension,
+ * before anything is fetched
+ */
+PreviewFetchPolicy preview_fetch_policy(const char *url)
+{
+	const char *host, *path, *end, *dot, *slash;
+	const PreviewExtension *found;
+	char buf[256];
+	size_t len;
+
+	host = strstr(url, "://");
+	if (!host)
+		return PREVIEW_FETCH_PAGE;
+	host += 3;
+	path = host + strcspn(host, "/?#");
+
+	if (domain_rules.hash)
+	{
+		const char *at = memchr(host, '@', path - host);
+		DomainRule *rule;
+
+		if (at)
+			host = at + 1;
+		len = strcspn(host, ":/?#");
+		if (len >= sizeof(buf))
+			return domain_rules.allow_count ? PREVIEW_FETCH_DENIED : PREVIEW_FETCH_PAGE;
+		for (size_t i = 0; i < len; i++)
+			buf[i] = tolower(host[i]);
+		buf[len] = '\0';
+		rule = find_domain_rule(buf);
+		if (rule ? !rule->allow : domain_rules.allow_count > 0)
+			return PREVIEW_FETCH_DENIED;
+	}
+
+	/* The extension of the last path segment, if it has a short one */
+	end = path + strcspn(path, "?#");
+	for (slash = end; slash > path && slash[-1] != '/'; slash--)
+		;
+	for (dot = end; dot > slash && dot[-1] != '.'; dot--)
+		;
+	len = end - dot;
+	if (dot == slash || len == 0 || len > 4)
+		return PREVIEW_FETCH_PAGE;
+	for (size_t i = 0; i < len; i++)
+		buf[i] = tolower(dot[i]);
+	buf[len] = '\0';
+
+	found = bsearch(buf, preview_extensions, sizeof(preview_extensions) / sizeof(preview_extensions[0]),
+	                sizeof(preview_extensions[0]), preview_extension_compare);
+	return found ? found->policy : PREVIEW_FETCH_PAGE;
+}
+
+/**
+ * Whether a response body starts like an image format the filehost takes
+ */
+int sniff_image(const char *data, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)data;
+
+	if (len >= 8 && !memcmp(p, "\x89PNG\r\n\x1a\n", 8))
+		return 1;
+	if (len >= 3 && p[0] == 0xFF && p[1] == 0xD8 && p[2] == 0xFF)
+		return 1;
+	if (len >= 6 && (!memcmp(p, "GIF87a", 6) || !memcmp(p, "GIF89a", 6)))
+		return 1;
+	if (len >= 12 && !memcmp(p, "RIFF", 4) && !memcmp(p + 8, "WEBP", 4))
+		return 1;
+	if (len >= 12 && !memcmp(p + 4, "ftypavif", 8))
+		return 1;
+	return 0;
+}
+
+/**
+ * Whether a response body is something other than text: a known
+ * binary signature, or NUL bytes near the start (text never has them)
+ */
+int sniff_binary(const char *data, size_t len)
+{
+	static const struct {
+		size_t offset;
+		const char *magic;
+		size_t len;
+	} signatures[] = {
+		{ 0, "%PDF-", 5 },
+		{ 0, "PK\x03\x04", 4 }, /* zip, also apk, docx and friends */
+		{ 0, "\x1f\x8b", 2 }, /* gzip, unless the server forgot Content-Encoding */
+		{ 0, "Rar!", 4 },
+		{ 0, "7z\xbc\xaf", 4 },
+		{ 0, "\x1a\x45\xdf\xa3", 4 }, /* mkv, webm */
+		{ 4, "ftyp", 4 }, /* mp4, mov, m4a */
+		{ 0, "OggS", 4 },
+		{ 0, "ID3", 3 },
+		{ 0, "fLaC", 4 },
+		{ 0, "MZ", 2 },
+		{ 0, "\x7f" "ELF", 4 },
+	};
+
+	for (size_t i = 0; i < sizeof(signatures) / sizeof(signatures[0]); i++)
+		if (len >= signatures[i].offset + signatures[i].len && !memcmp(data + signatures[i].offset, signatures[i].magic, signatures[i].len))
+			return 1;
+	return memchr(data, '\0', MIN(len, SNIFF_BYTES)) != NULL;
+}
+
+/**
+ * The last path segment of a URL, as the title of an image preview.
+ * Falls back to the host for URLs without one. Returns a newly
+ * allocated string.
+ */
+char *url_filename(const char *url)
+{
+	const char *start = strstr(url, "://");
+	const char *end, *slash;
+	char *result;
+
+	start = start ? start + 3 : url;
+	end = start + strcspn(start, "?#");
+	for (slash = end; slash > start && slash[-1] != '/'; slash--)
+		;
+	if (slash == end || slash == start)
+	{
+		/* No file name, use the host */
+		end = start + strcspn(start, "/?#");
+		slash = memchr(start, '@', end - start);
+		slash = slash ? slash + 1 : start;
+	}
+	result = safe_alloc(end - slash + 1);
+	memcpy(result, slash, end - slash);
+	return result;
+}
+
+static unsigned int preview_cache_hash(const char *key)
+{
+	return siphash(key, preview_cache->hashkey) % PREVIEW_CACHE_HASH_SIZE;
+}
+
+static void preview_cache_lru_unlink(PreviewCacheEntry *e)
+{
+	if (e->lru_prev)
+		e->lru_prev->lru_next = e->lru_next;
+	else
+		preview_cache->lru_head = e->lru_next;
+	if (e->lru_next)
+		e->lru_next->lru_prev = e->lru_prev;
+	else
+		preview_cache->lru_tail = e->lru_prev;
+	e->lru_prev = e->lru_next = NULL;
+}
+
+static void preview_cache_lru_push(PreviewCacheEntry *e)
+{
+	e->lru_prev = NULL;
+	e->lru_next = preview_cache->lru_head;
+	if (preview_cache->lru_head)
+		preview_cache->lru_head->lru_prev = e;
+	preview_cache->lru_head = e;
+	if (!preview_cache->lru_tail)
+		preview_cache->lru_tail = e;
+}
+
+static void preview_cache_remove(PreviewCacheEntry *e)
+{
+	PreviewCacheEntry **pp;
+
+	for (pp = &preview_cache->hash[preview_cache_hash(e->url)]; *pp; pp = &(*pp)->hnext)
 	{
-		Client *acptr = member->client;
-		if (MyConnect(acptr))
+		if (*pp == e)
 		{
-			sendto_one(acptr, mtags, ":%s TAGMSG %s", me.name, channel);
+			*pp = e->hnext;
+			break;
 		}
 	}
+	preview_cache_lru_unlink(e);
+	preview_cache->entries--;
+	preview_cache->bytes -= e->size;
+	safe_free(e->url);
+	safe_free(e->title);
+	safe_free(e->snippet);
+	safe_free(e->image);
+	safe_free(e);
+}
 
-	free_message_tags(mtags);
+/**
+ * Look up a normalized URL in the preview cache.
+ * Expired entries are dropped on the way. A hit moves the entry to the
+ * front of the LRU list. Returns NULL on a miss.
+ */
+PreviewCacheEntry *preview_cache_find(const char *key)
+{
+	PreviewCacheEntry *e;
+
+	for (e = preview_cache->hash[preview_cache_hash(key)]; e; e = e->hnext)
+	{
+		if (!strcmp(e->url, key))
+			break;
+	}
+
+	if (e && e->expires <= TStime())
+	{
+		preview_cache_remove(e);
+		e = NULL;
+	}
+
+	if (!e)
+	{
+		preview_cache->misses++;
+		return NULL;
+	}
+
+	if (e->title)
+		preview_cache->hits++;
+	else
+		preview_cache->negative_hits++;
+	preview_cache_lru_unlink(e);
+	preview_cache_lru_push(e);
+	return e;
+}
+
+/**
+ * Store a preview result. A NULL title stores a negative entry, which
+ * lives for cache-negative-ttl instead of cache-ttl.
+ * Evicts least recently used entries to stay within the configured
+ * entry and byte limits.
+ */
+void preview_cache_add(const char *key, const char *title, const char *snippet, const char *image)
+{
+	PreviewCacheEntry *e;
+	unsigned int hashv;
+
+	if (!key || cfg.cache_max_entries <= 0)
+		return;
+
+	/* Replace any existing entry for this URL */
+	hashv = preview_cache_hash(key);
+	for (e = preview_cache->hash[hashv]; e; e = e->hnext)
+	{
+		if (!strcmp(e->url, key))
+		{
+			preview_cache_remove(e);
+			break;
+		}
+	}
+
+	e = safe_alloc(sizeof(PreviewCacheEntry));
+	safe_strdup(e->url, key);
+	safe_strdup(e->title, title);
+	if (title)
+	{
+		safe_strdup(e->snippet, snippet);
+		safe_strdup(e->image, image);
+	}
+	e->expires = TStime() + (title ? cfg.cache_ttl : cfg.cache_negative_ttl);
+	e->size = sizeof(PreviewCacheEntry) + strlen(key) + 1
+	          + (e->title ? strlen(e->title) + 1 : 0)
+	          + (e->snippet ? strlen(e->snippet) + 1 : 0)
+	          + (e->image ? strlen(e->image) + 1 : 0);
+
+	e->hnext = preview_cache->hash[hashv];
+	preview_cache->hash[hashv] = e;
+	preview_cache_lru_push(e);
+	preview_cache->entries++;
+	preview_cache->bytes += e->size;
+
+	while (preview_cache->lru_tail &&
+	       (preview_cache->entries > cfg.cache_max_entries || preview_cache->bytes > (size_t)cfg.cache_max_bytes))
+	{
+		preview_cache_remove(preview_cache->lru_tail);
+	}
+}
+
+/**
+ * Periodically drop expired entries, so stale previews don't sit
+ * around until LRU pressure pushes them out.
+ */
+EVENT(preview_cache_expire)
+{
+	PreviewCacheEntry *e, *prev;
+	time_t now = TStime();
+
+	for (e = preview_cache->lru_tail; e; e = prev)
+	{
+		prev = e->lru_prev;
+		if (e->expires <= now)
+			preview_cache_remove(e);
+	}
+}
+
+/**
+ * Free the whole cache, called by the core when the module is
+ * unloaded for good (not on REHASH).
+ */
+void preview_cache_free(ModData *m)
+{
+	PreviewCache *cache = (PreviewCache *)m->ptr;
+	PreviewCacheEntry *e, *next;
+
+	if (!cache)
+		return;
+
+	for (e = cache->lru_head; e; e = next)
+	{
+		next = e->lru_next;
+		safe_free(e->url);
+		safe_free(e->title);
+		safe_free(e->snippet);
+		safe_free(e->image);
+		safe_free(e);
+	}
+	safe_free(cache);
+	m->ptr = NULL;
+}
+
+/**
+ * One STATS line summarizing a histogram
+ */
+static void preview_histogram_stats(Client *client, const char *name, const StatsHistogram *h, const char *unit)
+{
+	sendtxtnumeric(client, "%s: %lu (avg %llu%s, p50 %llu%s, p99 %llu%s)", name, h->count,
+	               (unsigned long long)(h->count ? h->sum / h->count : 0), unit,
+	               (unsigned long long)histogram_percentile(h, 50), unit,
+	               (unsigned long long)histogram_percentile(h, 99), unit);
+}
+
+/**
+ * STATS linkpreview - show preview cache counters to opers
+ */
+int link_preview_stats(Client *client, const char *flag)
+{
+	if (strcmp(flag, "linkpreview"))
+		return 0;
+
+	if (!ValidatePermissionsForPath("server:info:stats", client, NULL, NULL, NULL))
+		return 0;
+
+	sendtxtnumeric(client, "cache-entries: %d (max %d)", preview_cache->entries, cfg.cache_max_entries);
+	sendtxtnumeric(client, "cache-bytes: %lu (max %ld)", (unsigned long)preview_cache->bytes, cfg.cache_max_bytes);
+	sendtxtnumeric(client, "cache-hits: %lu", preview_cache->hits);
+	sendtxtnumeric(client, "cache-negative-hits: %lu", preview_cache->negative_hits);
+	sendtxtnumeric(client, "cache-misses: %lu", preview_cache->misses);
+	sendtxtnumeric(client, "fetches-active: %d (max %d, %d per channel)", fetches_active, cfg.max_fetches, cfg.max_fetches_per_channel);
+	sendtxtnumeric(client, "fetches-queued: %d (max %d)", fetches_queued, cfg.queue_size);
+	sendtxtnumeric(client, "fetches-started: %lu", fetch_stats.started);
+	sendtxtnumeric(client, "fetches-dropped: %lu", fetch_stats.dropped);
+	sendtxtnumeric(client, "rate-limited: %lu", fetch_stats.rate_limited);
+	sendtxtnumeric(client, "fetch-errors: %lu", fetch_stats.fetch_errors);
+	sendtxtnumeric(client, "upload-errors: %lu", fetch_stats.upload_errors);
+	sendtxtnumeric(client, "skipped-type: %lu", fetch_stats.skipped_type);
+	sendtxtnumeric(client, "skipped-binary: %lu", fetch_stats.skipped_binary);
+	sendtxtnumeric(client, "skipped-domain: %lu", fetch_stats.skipped_domain);
+	sendtxtnumeric(client, "direct-images: %lu", fetch_stats.direct_images);
+	sendtxtnumeric(client, "bytes-downloaded: %llu", fetch_stats.bytes_downloaded);
+	preview_histogram_stats(client, "fetch-latency", &fetch_stats.fetch_us, "us");
+	preview_histogram_stats(client, "parse-time", &fetch_stats.parse_us, "us");
+	preview_histogram_stats(client, "upload-latency", &fetch_stats.upload_us, "us");
+	preview_histogram_stats(client, "page-size", &fetch_stats.page_bytes, " bytes");
+	for (int i = 0; i < upload_host_count; i++)
+	{
+		UploadHost *host = &upload_hosts[i];
+		if (host->retry_after > TStime())
+			sendtxtnumeric(client, "upload-host: %s uploads %lu errors %lu (skipped for %lds)", host->url, host->uploads, host->errors, (long)(host->retry_after - TStime()));
+		else
+			sendtxtnumeric(client, "upload-host: %s uploads %lu errors %lu", host->url, host->uploads, host->errors);
+	}
+	return 1;
+}
+
+/**
+ * obsidianirc.linkpreview.stats - the STATS linkpreview counters, with
+ * full histograms (cumulative buckets, Prometheus style)
+ */
+RPC_CALL_FUNC(rpc_link_preview_stats)
+{
+	json_t *result = json_object();
+	json_t *cache = json_object();
+	json_t *fetches = json_object();
+
+	json_object_set_new(cache, "entries", json_integer(preview_cache->entries));
+	json_object_set_new(cache, "bytes", json_integer(preview_cache->bytes));
+	json_object_set_new(cache, "hits", json_integer(preview_cache->hits));
+	json_object_set_new(cache, "negative_hits", json_integer(preview_cache->negative_hits));
+	json_object_set_new(cache, "misses", json_integer(preview_cache->misses));
+	json_object_set_new(result, "cache", cache);
+
+	json_object_set_new(fetches, "active", json_integer(fetches_active));
+	json_object_set_new(fetches, "queued", json_integer(fetches_queued));
+	json_object_set_new(fetches, "started", json_integer(fetch_stats.started));
+	json_object_set_new(fetches, "dropped", json_integer(fetch_stats.dropped));
+	json_object_set_new(fetches, "rate_limited", json_integer(fetch_stats.rate_limited));
+	json_object_set_new(fetches, "fetch_errors", json_integer(fetch_stats.fetch_errors));
+	json_object_set_new(fetches, "upload_errors", json_integer(fetch_stats.upload_errors));
+	json_object_set_new(fetches, "skipped_type", json_integer(fetch_stats.skipped_type));
+	json_object_set_new(fetches, "skipped_binary", json_integer(fetch_stats.skipped_binary));
+	json_object_set_new(fetches, "skipped_domain", json_integer(fetch_stats.skipped_domain));
+	json_object_set_new(fetches, "direct_images", json_integer(fetch_stats.direct_images));
+	json_object_set_new(fetches, "bytes_downloaded", json_integer(fetch_stats.bytes_downloaded));
+	json_object_set_new(fetches, "fetch_us", histogram2json(&fetch_stats.fetch_us));
+	json_object_set_new(fetches, "parse_us", histogram2json(&fetch_stats.parse_us));
+	json_object_set_new(fetches, "upload_us", histogram2json(&fetch_stats.upload_us));
+	json_object_set_new(fetches, "page_bytes", histogram2json(&fetch_stats.page_bytes));
+	json_object_set_new(result, "fetches", fetches);
+
+	rpc_response(client, request, result);
+	json_decref(result);
+}
+
+/**
+ * Monotonic clock in microseconds, for timing fetches
+ */
+long long preview_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Build upload_hosts[] from the filehosts block, called once the
+ * config has been read
+ */
+void build_upload_hosts(void)
+{
+	MultiLine *m;
+	int i = 0;
+
+	free_upload_hosts();
+	for (m = cfg.hosts; m; m = m->next)
+		upload_host_count++;
+	if (!upload_host_count)
+		return;
+
+	upload_hosts = safe_alloc(sizeof(UploadHost) * upload_host_count);
+	for (m = cfg.hosts; m; m = m->next, i++)
+	{
+		safe_strdup(upload_hosts[i].url, m->line);
+		/* "host/upload" is appended, so don't end up with "//upload" */
+		if (*upload_hosts[i].url && upload_hosts[i].url[strlen(upload_hosts[i].url) - 1] == '/')
+			upload_hosts[i].url[strlen(upload_hosts[i].url) - 1] = '\0';
+	}
+}
+
+void free_upload_hosts(void)
+{
+	int i;
+
+	for (i = 0; i < upload_host_count; i++)
+		safe_free(upload_hosts[i].url);
+	safe_free(upload_hosts);
+	upload_host_count = 0;
+	upload_host_next = 0;
+}
+
+/**
+ * Pick the filehost for the next image upload: the next one in turn
+ * that is not backing off, or the one whose backoff ends first if they
+ * all are. The core's curl handle keeps connections to each of them
+ * open between uploads, so rotating does not cost extra handshakes
+ * once every host has been used.
+ */
+int pick_upload_host(void)
+{
+	time_t now = TStime();
+	int i, index, best = -1;
+
+	for (i = 0; i < upload_host_count; i++)
+	{
+		index = (upload_host_next + i) % upload_host_count;
+		if (upload_hosts[index].retry_after <= now)
+		{
+			upload_host_next = (index + 1) % upload_host_count;
+			return index;
+		}
+		if (best < 0 || upload_hosts[index].retry_after < upload_hosts[best].retry_after)
+			best = index;
+	}
+	return best;
+}
+
+/**
+ * Record how an image upload to a filehost went, backing off from
+ * hosts that keep failing
+ */
+void upload_host_result(int index, int ok)
+{
+	UploadHost *host;
+
+	/* The hosts may have changed since the upload started (REHASH) */
+	if (index < 0 || index >= upload_host_count)
+		return;
+
+	host = &upload_hosts[index];
+	host->uploads++;
+	if (ok)
+	{
+		host->failures = 0;
+		host->retry_after = 0;
+		return;
+	}
+	host->errors++;
+	if (host->failures < 16)
+		host->failures++;
+	host->retry_after = TStime() + MIN(1L << host->failures, UPLOAD_HOST_BACKOFF_MAX);
+	unreal_log(ULOG_DEBUG, "o-filehost", "UPLOAD_HOST_FAILED", NULL,
+			   "Image upload to $host failed, skipping it for a while",
+			   log_data_string("host", host->url));
+}
+
+/**
+ * Build the domain_rules hash from the filehosts block's allow-domain
+ * and deny-domain, called once the config has been read
+ */
+void build_domain_rules(void)
+{
+	MultiLine *lists[2] = { cfg.allow_domains, cfg.deny_domains };
+	unsigned int count = 0;
+
+	free_domain_rules();
+	for (int allow = 0; allow < 2; allow++)
+		for (MultiLine *m = lists[allow]; m; m = m->next)
+			count++;
+	if (!count)
+		return;
+
+	for (domain_rules.hash_size = 16; domain_rules.hash_size < count * 2; domain_rules.hash_size *= 2)
+		;
+	domain_rules.hash = safe_alloc(sizeof(DomainRule *) * domain_rules.hash_size);
+	for (int i = 0; i < 2; i++)
+	{
+		for (MultiLine *m = lists[i]; m; m = m->next)
+		{
+			/* "*.example.com" and ".example.com" mean the same as "example.com" */
+			const char *name = m->line;
+			DomainRule *rule;
+
+			if (!strncmp(name, "*.", 2))
+				name += 2;
+			else if (*name == '.')
+				name++;
+			rule = safe_alloc(sizeof(DomainRule) + strlen(name) + 1);
+			for (char *d = rule->name; *name; name++)
+				*d++ = tolower(*name);
+			rule->allow = (i == 0);
+			rule->hashv = siphash(rule->name, preview_cache->hashkey);
+			rule->hnext = domain_rules.hash[rule->hashv & (domain_rules.hash_size - 1)];
+			domain_rules.hash[rule->hashv & (domain_rules.hash_size - 1)] = rule;
+			if (rule->allow)
+				domain_rules.allow_count++;
+		}
+	}
+}
+
+void free_domain_rules(void)
+{
+	DomainRule *rule, *next;
+
+	for (unsigned int i = 0; i < domain_rules.hash_size; i++)
+	{
+		for (rule = domain_rules.hash[i]; rule; rule = next)
+		{
+			next = rule->hnext;
+			safe_free(rule);
+		}
+	}
+	safe_free(domain_rules.hash);
+	memset(&domain_rules, 0, sizeof(domain_rules));
 }
 
 void setconf(void)
@@ -759,13 +2194,27 @@ void setconf(void)
 	memset(&cfg, 0, sizeof(cfg));
 	cfg.has_hosts = 0;
 	safe_strdup(cfg.isupport_line,"");
+	cfg.cache_max_entries = DEFAULT_CACHE_MAX_ENTRIES;
+	cfg.cache_max_bytes = DEFAULT_CACHE_MAX_BYTES;
+	cfg.cache_ttl = DEFAULT_CACHE_TTL;
+	cfg.cache_negative_ttl = DEFAULT_CACHE_NEGATIVE_TTL;
+	cfg.max_fetches = DEFAULT_MAX_FETCHES;
+	cfg.max_fetches_per_channel = DEFAULT_MAX_FETCHES_PER_CHANNEL;
+	cfg.queue_size = DEFAULT_QUEUE_SIZE;
+	cfg.user_rate_count = DEFAULT_USER_RATE_COUNT;
+	cfg.user_rate_period = DEFAULT_USER_RATE_PERIOD;
 }
 
 void freeconf(void)
 {
+	free_upload_hosts();
+	free_domain_rules();
 	freemultiline(cfg.hosts);
+	freemultiline(cfg.allow_domains);
+	freemultiline(cfg.deny_domains);
 	cfg.has_hosts = 0;
 	safe_free(cfg.isupport_line);
+	safe_free(cfg.preview_server);
 	memset(&cfg, 0, sizeof(cfg));
 }
 
@@ -802,6 +2251,72 @@ int filehost_configtest(ConfigFile *cf, ConfigEntry *ce, int type, int *errs)
 
 			continue;
 		}
+		if (!strcmp(cep->name, "cache-max-entries"))
+		{
+			if (BadPtr(cep->value) || atoi(cep->value) < 0)
+			{
+				config_error("%s:%i: %s::%s must be a number of 0 or more (0 disables the cache)", cep->file->filename, cep->line_number, CONF_FILEHOST, cep->name);
+				++errors;
+			}
+			continue;
+		}
+		if (!strcmp(cep->name, "cache-max-bytes"))
+		{
+			if (BadPtr(cep->value) || config_checkval(cep->value, CFG_SIZE) <= 0)
+			{
+				config_error("%s:%i: %s::%s must be a size, eg: 4M", cep->file->filename, cep->line_number, CONF_FILEHOST, cep->name);
+				++errors;
+			}
+			continue;
+		}
+		if (!strcmp(cep->name, "cache-ttl") || !strcmp(cep->name, "cache-negative-ttl"))
+		{
+			if (BadPtr(cep->value) || config_checkval(cep->value, CFG_TIME) <= 0)
+			{
+				config_error("%s:%i: %s::%s must be a time value, eg: 1h", cep->file->filename, cep->line_number, CONF_FILEHOST, cep->name);
+				++errors;
+			}
+			continue;
+		}
+		if (!strcmp(cep->name, "max-fetches") || !strcmp(cep->name, "max-fetches-per-channel") || !strcmp(cep->name, "queue-size"))
+		{
+			if (BadPtr(cep->value) || atoi(cep->value) < 1)
+			{
+				config_error("%s:%i: %s::%s must be a number of 1 or more", cep->file->filename, cep->line_number, CONF_FILEHOST, cep->name);
+				++errors;
+			}
+			continue;
+		}
+		if (!strcmp(cep->name, "preview-server"))
+		{
+			if (BadPtr(cep->value) || !strchr(cep->value, '.'))
+			{
+				config_error("%s:%i: %s::%s must be a server name", cep->file->filename, cep->line_number, CONF_FILEHOST, cep->name);
+				++errors;
+			}
+			continue;
+		}
+		if (!strcmp(cep->name, "allow-domain") || !strcmp(cep->name, "deny-domain"))
+		{
+			if (BadPtr(cep->value) || strpbrk(cep->value, "/:@ "))
+			{
+				config_error("%s:%i: %s::%s must be a domain name, eg: example.com", cep->file->filename, cep->line_number, CONF_FILEHOST, cep->name);
+				++errors;
+			}
+			continue;
+		}
+		if (!strcmp(cep->name, "user-rate"))
+		{
+			int count, period;
+
+			/* "0" disables the per-user limit */
+			if (BadPtr(cep->value) || (strcmp(cep->value, "0") && !config_parse_flood(cep->value, &count, &period)))
+			{
+				config_error("%s:%i: %s::%s must be in the form <count>:<period>, eg: 5:30s", cep->file->filename, cep->line_number, CONF_FILEHOST, cep->name);
+				++errors;
+			}
+			continue;
+		}
 
 		// Anything else is unknown to us =]
 		config_warn("%s:%i: unknown item %s::%s", cep->file->filename, cep->line_number, CONF_FILEHOST, cep->name); // So display just a warning
@@ -832,6 +2347,33 @@ int filehost_configrun(ConfigFile *cf, ConfigEntry *ce, int type)
 
 		if (!strcmp(cep->name, "host"))
 			addmultiline(&cfg.hosts, cep->value);
+		else if (!strcmp(cep->name, "cache-max-entries"))
+			cfg.cache_max_entries = atoi(cep->value);
+		else if (!strcmp(cep->name, "cache-max-bytes"))
+			cfg.cache_max_bytes = config_checkval(cep->value, CFG_SIZE);
+		else if (!strcmp(cep->name, "cache-ttl"))
+			cfg.cache_ttl = config_checkval(cep->value, CFG_TIME);
+		else if (!strcmp(cep->name, "cache-negative-ttl"))
+			cfg.cache_negative_ttl = config_checkval(cep->value, CFG_TIME);
+		else if (!strcmp(cep->name, "max-fetches"))
+			cfg.max_fetches = atoi(cep->value);
+		else if (!strcmp(cep->name, "max-fetches-per-channel"))
+			cfg.max_fetches_per_channel = atoi(cep->value);
+		else if (!strcmp(cep->name, "queue-size"))
+			cfg.queue_size = atoi(cep->value);
+		else if (!strcmp(cep->name, "preview-server"))
+			safe_strdup(cfg.preview_server, cep->value);
+		else if (!strcmp(cep->name, "allow-domain"))
+			addmultiline(&cfg.allow_domains, cep->value);
+		else if (!strcmp(cep->name, "deny-domain"))
+			addmultiline(&cfg.deny_domains, cep->value);
+		else if (!strcmp(cep->name, "user-rate"))
+		{
+			if (!strcmp(cep->value, "0"))
+				cfg.user_rate_count = 0;
+			else
+				config_parse_flood(cep->value, &cfg.user_rate_count, &cfg.user_rate_period);
+		}
 		
 	}
 	
@@ -844,6 +2386,8 @@ int filehost_configrun(ConfigFile *cf, ConfigEntry *ce, int type)
 	if (strlen(buf))
 		safe_strdup(cfg.isupport_line, buf);
 
+	build_upload_hosts();
+	build_domain_rules();
 
 	return 1; // We good
 }
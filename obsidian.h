@@ -4,36 +4,167 @@
 // Includes
 #include "unrealircd.h"
 #include "sqlite3.h"
+#include <pthread.h>
+#include <openssl/crypto.h>
+#include <openssl/hmac.h>
+#include <sys/mman.h>
+#include "stats_histogram.h"
 
 // Database files
 #define OBSIDIAN_DB "../data/obsidian.db"
+#define OBSIDIAN_SNAPSHOT "../data/obsidian.snap" // Account cache written at MOD_UNLOAD, read back by the next MOD_LOAD
 // Config
 #define CONF_ACCOUNT_BLOCK "account-registration"
 
+// In-memory account index, buckets are looked up case-insensitively.
+// Starts at this many buckets and doubles whenever there are more accounts than buckets.
+#define ACCOUNT_HASH_SIZE 8192
+
 // Range allowed
 #define MIN_ACCOUNT_NAME_LENGTH 1
 #define MAX_ACCOUNT_NAME_LENGTH 200
 #define MIN_PASSWORD_LENGTH 3
 #define MAX_PASSWORD_LENGTH 200
+#define MIN_AUTH_THREADS 1
+#define MAX_AUTH_THREADS 32
+#define MIN_AUTH_QUEUE_DEPTH 1
+#define MAX_AUTH_QUEUE_DEPTH 65536
+
+// obsidianirc.accounts.list page sizes
+#define ACCOUNT_LIST_DEFAULT_LIMIT 100
+#define ACCOUNT_LIST_MAX_LIMIT 1000
+
+// Most LISTACC lines sent for one search
+#define LISTACC_MAX_RESULTS 100
+
+// Account fields for account2json_fields()
+#define ACCOUNT_FIELD_ID                0x0001
+#define ACCOUNT_FIELD_NAME              0x0002
+#define ACCOUNT_FIELD_EMAIL             0x0004
+#define ACCOUNT_FIELD_PASSWORD          0x0008
+#define ACCOUNT_FIELD_TIME_REGISTERED   0x0010
+#define ACCOUNT_FIELD_VERIFIED          0x0020
+#define ACCOUNT_FIELD_CHANNELS          0x0040
+#define ACCOUNT_FIELD_METADATA          0x0080
+#define ACCOUNT_FIELD_ONLINE_CLIENTS    0x0100
+#define ACCOUNT_FIELDS_ALL              0x01FF
+
+// Account metadata limits (ACCOUNTMETA, obsidianirc.accounts.metadata.set)
+#define ACCOUNT_METADATA_MAX_KEYS 32
+#define ACCOUNT_METADATA_MAX_KEY_LENGTH 64
+#define ACCOUNT_METADATA_MAX_VALUE_LENGTH 1024
+
+// Client certificate fingerprints (SASL EXTERNAL): SHA256 in hex, as UnrealIRCd stores them
+#define CERTFP_LENGTH 64
+#define ACCOUNT_MAX_CERTFPS 10
+#define CERTFP_HASH_SIZE 4096
+
+// Spare AccountMember session nodes kept for reuse
+#define ACCOUNT_MEMBER_POOL_SIZE 4096
+
+// Nick enforcement: seconds someone on a registered nick has to log in (0 turns it off)
+#define DEFAULT_NICK_ENFORCE_DELAY 60
+#define MAX_NICK_ENFORCE_DELAY 3600
+// Timer wheel slots, one per second, deadlines further out go round more than once
+#define NICK_ENFORCE_WHEEL_SLOTS 256
+// Guest nicks tried from the sequence before falling back to one made from the UID
+#define NICK_ENFORCE_GUEST_TRIES 8
+
+// Most account writes the db writer thread commits in one transaction
+#define DB_WRITE_BATCH_SIZE 512
+
+// Failed login limiter: failures allowed per window, per account and per IP (0 turns a limit off)
+#define DEFAULT_LOGIN_LIMIT_ACCOUNT 10
+#define DEFAULT_LOGIN_LIMIT_IP 30
+#define DEFAULT_LOGIN_LIMIT_WINDOW 300
+#define MAX_LOGIN_LIMIT 100000
+#define MAX_LOGIN_LIMIT_WINDOW 86400
+// IPv6 clients are counted per /64, IPv4 ones per address
+#define LOGIN_LIMIT_IPV6_CIDR 64
+// Most keys tracked at once, the least recently failed one makes room for a new one
+#define LOGIN_LIMIT_MAX_ENTRIES 65536
+#define LOGIN_LIMIT_HASH_SIZE 16384
+
+// OBSACC account sync: the answer to a HELLO goes out in batches of this many rows per tick,
+// and waits for the next tick while the link's sendq is above OBSACC_SYNC_SENDQ bytes
+#define OBSACC_SYNC_BATCH 1000
+#define OBSACC_SYNC_SENDQ 65536
+#define OBSACC_SYNC_INTERVAL 250
+// Seconds between the MARKs that tell a linked server how far it has all our changes
+#define OBSACC_MARK_INTERVAL 5
+// Deleted metadata keys and certfps are kept this long as tombstones, a server split off
+// for longer could bring back what was deleted meanwhile
+#define OBSACC_TOMBSTONE_LIFETIME 2592000
+
+// Session tokens (SASL SESSION-COOKIE): default lifetime in seconds, 0 turns them off
+#define DEFAULT_SESSION_TOKEN_LIFETIME 2592000
+#define MAX_SESSION_TOKEN_LIFETIME 31536000
+// Token id, account id and expiry (8 bytes each, big endian) followed by the HMAC-SHA256
+#define SESSION_TOKEN_HEADER_LENGTH 24
+#define SESSION_TOKEN_MAC_LENGTH 32
+#define SESSION_TOKEN_LENGTH (SESSION_TOKEN_HEADER_LENGTH + SESSION_TOKEN_MAC_LENGTH)
+#define SESSION_SECRET_LENGTH 32
+// Buckets of the in-memory revocation set
+#define SESSION_REVOCATION_HASH_SIZE 1024
+// Revoked tokens an account can have at once, and the fake lag in msec every SESSIONTOKEN REVOKE costs
+#define SESSION_MAX_REVOCATIONS 32
+#define SESSION_REVOKE_FAKE_LAG 2000
+
+// Rows an ACCOUNTDB import or export handles per transaction, other writes get their turn in between
+#define DB_TRANSFER_CHUNK_SIZE 10000
+
+// Auth worker pool defaults
+#define DEFAULT_AUTH_THREADS 2
+#define DEFAULT_AUTH_QUEUE_DEPTH 1024
+
+// argon2id parameters for new hashes, the same ones Auth_Hash() uses
+#define AUTH_ARGON2_TIME_COST 4
+#define AUTH_ARGON2_MEMORY_COST 8192
+#define AUTH_ARGON2_PARALLELISM 2
+#define AUTH_ARGON2_HASH_LENGTH 32
+#define AUTH_ARGON2_SALT_LENGTH 16
+#define AUTH_ARGON2_ENCODED_LENGTH 256
 
 // Commands
 #define CMD_REGISTER "REGISTER"
 #define CMD_LISTACC "LISTACC"
 #define CMD_IDENTIFY "IDENTIFY"
 #define CMD_LOGOUT "LOGOUT"
+#define CMD_ACCOUNTDB "ACCOUNTDB"
+#define CMD_ACCOUNTMETA "ACCOUNTMETA"
+#define CMD_SESSIONTOKEN "SESSIONTOKEN"
+#define CMD_CERTFP "CERTFP"
+#define CMD_LOGINFAIL "LOGINFAIL" // Server to server, shares failed logins with login-limit-sync
+#define CMD_OBSACC "OBSACC" // Server to server, account changes and the sync on link
 
 // Command functions
 CMD_FUNC(register_account);
 CMD_FUNC(list_accounts);
 CMD_FUNC(cmd_identify);
 CMD_FUNC(cmd_logout);
+CMD_FUNC(cmd_accountdb);
+CMD_FUNC(cmd_accountmeta);
+CMD_FUNC(cmd_sessiontoken);
+CMD_FUNC(cmd_certfp);
+CMD_FUNC(cmd_loginfail);
+CMD_FUNC(cmd_obsacc);
 
 // RPC commands
 RPC_CALL_FUNC(rpc_list_accounts);
 RPC_CALL_FUNC(rpc_accounts_find);
+RPC_CALL_FUNC(rpc_accounts_search);
+RPC_CALL_FUNC(rpc_obsidian_stats);
+RPC_CALL_FUNC(rpc_accounts_import);
+RPC_CALL_FUNC(rpc_accounts_export);
+RPC_CALL_FUNC(rpc_accounts_metadata_set);
+RPC_CALL_FUNC(rpc_accounts_certfp_add);
+RPC_CALL_FUNC(rpc_accounts_certfp_del);
+RPC_CALL_FUNC(rpc_accounts_certfp_list);
 
 // Events
 EVENT(nick_enforce); // Enforce Guest nicks
+EVENT(login_limit_expire); // Drop failed login counts that ran out
+EVENT(obsacc_sync); // Send the next batch of the answers to OBSACC HELLO, and the MARKs
 
 // Capabilities
 #define REGCAP_NAME "draft/account-registration"
@@ -44,6 +175,7 @@ EVENT(nick_enforce); // Enforce Guest nicks
 // Hooks
 int authenticate_attempt(Client *client, int first, const char *param);
 const char *saslmechs(Client *client);
+int obsidian_stats(Client *client, const char *flag);
 
 // SASL definitions
 #define SASL_TYPE_NONE 0
@@ -52,30 +184,46 @@ const char *saslmechs(Client *client);
 #define SASL_TYPE_ANONYMOUS 3 // logout
 #define SASL_TYPE_SESSION_COOKIE 4
 #define SASL_TYPE_OTP 5
+// What saslmechs() advertises and MOD_LOAD puts in saslmechlist
+#define SASL_MECHS "PLAIN,EXTERNAL,ANONYMOUS,SESSION-COOKIE"
 #define GetSaslType(x)			(moddata_client(x, sasl_md).i)
 #define SetSaslType(x, y)		do { moddata_client(x, sasl_md).i = y; } while (0)
 #define DelSaslType(x)		do { moddata_client(x, sasl_md).i = SASL_TYPE_NONE; } while (0)
 
+// Set while a password of this client is with the auth worker pool
+#define IsAuthPending(x)		(moddata_client(x, auth_pending_md).i)
+#define SetAuthPending(x)		do { moddata_client(x, auth_pending_md).i = 1; } while (0)
+#define ClearAuthPending(x)		do { moddata_client(x, auth_pending_md).i = 0; } while (0)
+
 // SASL MD serialization
 void sat_free(ModData *m);
 const char *sat_serialize(ModData *m);
 void sat_unserialize(const char *str, ModData *m);
 
 // Structs
-// IRCv3 METADATA
-typedef struct Metadata {
-    bool ircv3; // true if this is an IRCv3 metadata item;
-    char *key;
-    char *value;
-    struct Metadata *prev, *next;
-} Metadata;
+// Metadata of an account (the account_metadata table), loaded on first use by account_metadata().
+// All pairs live in data[] as "key\0value\0", so an account has one allocation however many keys it has.
+typedef struct AccountMetadata {
+    int count;
+    unsigned int used; // Bytes of data[] in use
+    unsigned int size; // Bytes allocated for data[]
+    char data[];
+} AccountMetadata;
 
 // List of online users who are logged into this account
 typedef struct AccountMember {
     Client *client;
-    struct AccountMember *next;
+    struct AccountMember *prev, *next;
+    struct Account *account; // Only set on live sessions (account_session_md), not on copies
 } AccountMember;
 
+typedef struct NickEnforceTimer {
+    Client *client;
+    time_t deadline;
+    struct NickEnforceTimer *prev, *next; // In the wheel slot of deadline
+    bool linked;
+} NickEnforceTimer;
+
 typedef struct Account {
     long int id; // Unique ID, can be NULL if not used
     char *name;
@@ -84,10 +232,176 @@ typedef struct Account {
     time_t time_registered;
     int verified;
     char **channels;
-    Metadata *metadata_head;
+    AccountMetadata *metadata; // NULL until loaded, see account_metadata()
     AccountMember *members;
+    time_t updated_at; // Last change, here or on another server, newer wins in OBSACC sync
+    struct Account *hnext; // Next in the account index bucket
+    uint64_t namehash; // siphash_nocase() of name, so bucket walks rarely need strcasecmp()
 } Account;
 
+// What an auth job was started for, decides how the main loop finishes it
+typedef enum AuthJobOrigin {
+    AUTH_FOR_SASL,
+    AUTH_FOR_IDENTIFY,
+    AUTH_FOR_REGISTER
+} AuthJobOrigin;
+
+// A password verify (SASL, IDENTIFY) or hash (REGISTER) done by the auth worker pool
+typedef struct AuthJob {
+    struct AuthJob *next;
+    AuthJobOrigin origin;
+    char client_id[IDLEN+1];
+    char *account; // Account name, or the name being registered
+    char *email; // REGISTER only
+    char *password; // Plaintext, wiped by the worker as soon as it is done with it
+    char *hash; // Stored hash to verify against, or the new hash for REGISTER
+    unsigned char salt[AUTH_ARGON2_SALT_LENGTH]; // REGISTER only
+    int ok;
+    uint64_t queued_ns; // monotonic_nsec() when submitted
+    uint64_t work_ns; // Time the worker spent in argon2
+} AuthJob;
+
+// Accounts sorted by one key, see account_index_add()
+typedef struct AccountIndex {
+    Account **items;
+    int count;
+    int size;
+    int (*compare)(const void *a, const void *b); // qsort() style, on Account **
+} AccountIndex;
+
+// Failed logins of one key ("a:" account or "i:" IP/CIDR) in the current and the previous window
+typedef struct LoginLimitEntry {
+    struct LoginLimitEntry *hnext;
+    struct LoginLimitEntry *prev, *next; // Least recently failed last
+    uint64_t hashv;
+    time_t window_start;
+    unsigned int prev_count;
+    unsigned int count;
+    char key[];
+} LoginLimitEntry;
+
+// Account cache snapshot: this header, count AccountSnapshotRecords in id order, the record
+// numbers in name order and in domain order (uint32_t each), then the NUL terminated strings.
+// Written in host byte order, a snapshot from another machine fails the version check.
+#define ACCOUNT_SNAPSHOT_MAGIC "OBSSNAP"
+#define ACCOUNT_SNAPSHOT_VERSION 1
+typedef struct AccountSnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    int64_t max_id;
+    int64_t updated_at; // Newest updated_at, rows changed since are replayed from the database
+    uint64_t strings_size;
+} AccountSnapshotHeader;
+
+typedef struct AccountSnapshotRecord {
+    int64_t id;
+    int64_t time_registered;
+    int64_t updated_at;
+    uint32_t name; // Offsets into the strings
+    uint32_t email;
+    uint32_t password;
+    int32_t verified;
+} AccountSnapshotRecord;
+
+// Steps of the answer to a HELLO, each sends the rows of one table changed since the peer's mark
+typedef enum ObsaccSyncStage {
+    OBSACC_SYNC_ACCOUNTS,
+    OBSACC_SYNC_METADATA,
+    OBSACC_SYNC_CERTFPS,
+    OBSACC_SYNC_DONE // Only MARKs from here on
+} ObsaccSyncStage;
+
+// A directly linked server that sent us HELLO. EVENT(obsacc_sync) sends it the rows changed
+// since its mark, by (seq, key), then keeps it up to date with MARKs while the link is up.
+typedef struct ObsaccSync {
+    struct ObsaccSync *next;
+    char server_id[IDLEN+1];
+    ObsaccSyncStage stage;
+    uint64_t since; // The peer has all our changes up to this seq
+    uint64_t wait_for; // Writes queued before the HELLO, they go out in the answer and not live
+    uint64_t cursor_seq; // Last row sent, by seq and then its key within the stage
+    long int cursor_id;
+    char cursor_key[MAX(ACCOUNT_METADATA_MAX_KEY_LENGTH, CERTFP_LENGTH) + 1];
+    uint64_t marked; // Last MARK sent
+    time_t marked_at;
+    int sent;
+} ObsaccSync;
+
+// A certificate fingerprint someone can log into an account with, see find_certfp()
+typedef struct CertfpEntry {
+    struct CertfpEntry *next;
+    uint64_t hashv;
+    long int account_id;
+    char certfp[CERTFP_LENGTH + 1];
+} CertfpEntry;
+
+// A revoked session token, kept until it would have expired anyway
+typedef struct RevokedToken {
+    struct RevokedToken *next;
+    uint64_t token_id;
+    long int account_id;
+    time_t expires;
+} RevokedToken;
+
+// An exact-name Q-line in the nameban lookup, see my_find_tkl_nameban()
+typedef struct NameBanEntry {
+    struct NameBanEntry *next;
+    uint64_t namehash;
+    TKL *tkl;
+} NameBanEntry;
+
+// Kinds of writes the db writer thread knows how to apply
+typedef enum DbWriteType {
+    DB_WRITE_ACCOUNT_INSERT,
+    DB_WRITE_ACCOUNT_UPDATE, // Email, password, verified, time_registered and updated_at of the account named acc->name
+    DB_WRITE_IMPORT, // NDJSON file of pre-hashed accounts into the accounts table
+    DB_WRITE_EXPORT, // The accounts table into an NDJSON file
+    DB_WRITE_METADATA_SET, // Sets a key of account_metadata, or makes it a tombstone if value is NULL
+    DB_WRITE_SESSION_REVOKE, // Adds a token to session_revocations
+    DB_WRITE_CERTFP_ADD, // Links key (a certfp) to account_id in account_certfp
+    DB_WRITE_CERTFP_DEL, // Makes the account_certfp row of key a tombstone, if it is linked to account_id
+    DB_WRITE_PEER_MARK // Stores seq as the OBSACC mark of the server named key
+} DbWriteType;
+
+// A queued database write, done() runs on the main loop after its transaction
+typedef struct DbWrite {
+    struct DbWrite *next;
+    DbWriteType type;
+    Account *acc; // Owned by the write until done() runs
+    char client_id[IDLEN+1]; // Who to answer, if anyone
+    int result; // sqlite3_step() result, SQLITE_DONE on success
+    void (*done)(struct DbWrite *w);
+    int batch_size; // Only set on the first write of a batch, with its commit time
+    uint64_t commit_ns;
+    // Imports and exports, which go DB_TRANSFER_CHUNK_SIZE rows per transaction
+    char *path;
+    FILE *file;
+    bool more; // Requeued for another chunk instead of completing
+    long last_id; // Export: highest id written so far
+    unsigned long rows; // Imported or exported
+    unsigned long skipped; // Import: already registered
+    unsigned long invalid; // Import: lines that are not a pre-hashed account
+    Account *chunk; // Import: rows of the current transaction, chained on hnext
+    Account *imported; // Import: committed rows, indexed by the done callback
+    // Metadata and certfp writes. Those from another server go by account_name and its
+    // time_registered instead of account_id, the insert may still be queued.
+    long account_id;
+    char *account_name;
+    time_t time_registered;
+    char *key;
+    char *value;
+    time_t updated_at; // Of the row, ours are moved past its last change by the writer
+    char source[IDLEN+1]; // Server the change came from, empty for ours
+    bool changed; // The row was written, an older change from another server is not
+    bool reset; // Account update: the name went to another registration, drop its metadata and certfps
+    // Session token revocations
+    uint64_t token_id;
+    time_t expires;
+    // Change number given by the writer to rows of the synced tables, see obsacc_sync_step()
+    uint64_t seq;
+} DbWrite;
+
 typedef struct AccountRegistrationConfStruct
 {
     int min_name_length;
@@ -100,6 +414,14 @@ typedef struct AccountRegistrationConfStruct
     int allow_password_changes;
     int allow_email_changes;
     char *guest_nick_format;
+    int auth_threads;
+    int auth_queue_depth;
+    int nick_enforce_delay;
+    int session_token_lifetime;
+    int login_limit_account;
+    int login_limit_ip;
+    int login_limit_window;
+    int login_limit_sync;
 
     bool got_min_name_length;
     bool got_max_name_length;
@@ -111,6 +433,14 @@ typedef struct AccountRegistrationConfStruct
     bool got_allow_password_changes;
     bool got_allow_email_changes;
     bool got_guest_nick_format;
+    bool got_auth_threads;
+    bool got_auth_queue_depth;
+    bool got_nick_enforce_delay;
+    bool got_session_token_lifetime;
+    bool got_login_limit_account;
+    bool got_login_limit_ip;
+    bool got_login_limit_window;
+    bool got_login_limit_sync;
 } AccountRegistrationConfStruct;
 
 // Global variables
@@ -118,16 +448,67 @@ sqlite3 *db;
 
 // Function declarations
 int open_database(const char *filename);
+int migrate_database(void);
 void close_database();
-int write_account_to_db(const Account *acc);
-Account **read_accounts_from_db(const char *name);
+int write_account_to_db(Account *acc);
+int db_write_account(Client *client, Account *acc, void (*done)(DbWrite *w));
+int db_write_account_update(const Account *acc, bool reset);
+int db_write_transfer(Client *client, DbWriteType type, const char *path, void (*done)(DbWrite *w));
+int db_write_metadata(const Account *acc, const char *key, const char *value);
+int db_write_session_revoke(uint64_t token_id, long int account_id, time_t expires);
+int db_write_certfp(const char *certfp, long int account_id, bool add);
+int db_write_by_name(DbWriteType type, const char *name, time_t time_registered, const char *key, const char *value, time_t updated_at, Client *source);
+int db_write_peer_mark(const char *server, uint64_t seq);
+int db_writer_start(const char *filename);
+void db_writer_stop(void);
 Account *find_account(const char *name);
+int load_account_cache(void);
+void free_account_cache(void);
+int load_account_snapshot(const char *path);
+int write_account_snapshot(const char *path);
+Account *find_cached_account(const char *name);
+Account *find_cached_account_by_id(long int id);
+int load_certfps(void);
+void free_certfps(void);
+int valid_certfp(const char *in, char *out);
+Account *find_certfp(const char *certfp);
+int certfp_add(Account *acc, const char *certfp);
+int certfp_del(Account *acc, const char *certfp);
+int certfp_list(Account *acc, const char **list, int max);
+void add_cached_account(Account *acc);
+void add_cached_accounts(Account *list);
+int obsacc_account_register(Account *acc, Client *client);
+int obsacc_server_sync(Client *client);
+void free_obsacc_syncs(void);
+void obsacc_resync(void);
+void obsacc_row_written(DbWrite *w);
+Account *dup_account(const Account *acc);
+int search_accounts(const char *pattern, const char *domain, int offset, int max, Account **results);
+void free_account_member_pool(void);
+int account_session_login(Client *client, MessageTag *mtags);
+void account_session_free(ModData *m);
+int nick_enforce_check(Client *client);
+int nick_enforce_connect(Client *client);
+int nick_enforce_nickchange(Client *client, MessageTag *mtags, const char *oldnick);
+int nick_enforce_login(Client *client, MessageTag *mtags);
+void nick_enforce_free(ModData *m);
 json_t* account2json(const Account *acc);
+json_t* account2json_fields(const Account *acc, int fields);
 void free_account(Account *acc);
-void free_metadata(Metadata *head);
-Metadata* create_metadata(const char *key, const char *value);
-void add_metadata(Account *acc, const char *key, const char *value);
+AccountMetadata *account_metadata(Account *acc);
+const AccountMetadata *account_metadata_peek(const Account *acc, AccountMetadata **copy);
+const char *account_metadata_get(Account *acc, const char *key);
+int account_metadata_set(Account *acc, const char *key, const char *value);
+int valid_metadata_key(const char *key);
+int valid_metadata_value(const char *value);
+const char *metadata_first(const AccountMetadata *md);
+const char *metadata_next(const AccountMetadata *md, const char *key);
+const char *metadata_value(const char *key);
 TKL *my_find_tkl_nameban(const char *name);
+int nameban_tkl_changed(Client *client, TKL *tkl);
+int nameban_rehash_complete(void);
+void rebuild_namebans(void);
+void free_namebans(void);
 const char *accreg_capability_parameter(Client *client);
 int accreg_capability_visible(Client *client);
 void set_accreg_conf(void);
@@ -135,6 +516,21 @@ void free_accreg_conf(void);
 int accreg_configtest(ConfigFile *cf, ConfigEntry *ce, int type, int *errs);
 int accreg_configposttest(int *errs);
 int accreg_configrun(ConfigFile *cf, ConfigEntry *ce, int type);
-char *convert_guest_nick_format(const char *format, Client *client);
+size_t convert_guest_nick_format(const char *format, Client *client, unsigned long seq, char *buf, size_t buflen);
+int login_limited(Client *client, const char *account);
+void login_failed(Client *client, const char *account);
+void login_succeeded(const char *account);
+void free_login_limits(void);
+int load_session_tokens(void);
+void free_session_tokens(void);
+int session_token_issue(const Account *acc, char *buf, size_t buflen, time_t *expires);
+Account *session_token_verify(const char *token, uint64_t *token_id, time_t *expires);
+int session_token_revocations(long int account_id);
+int session_token_revoke(uint64_t token_id, long int account_id, time_t expires);
+int auth_pool_start(void);
+void auth_pool_stop(void);
+int auth_pool_verify(Client *client, AuthJobOrigin origin, const Account *acc, const char *password);
+int auth_pool_hash(Client *client, const char *name, const char *email, const char *password);
+uint64_t monotonic_nsec(void);
 
 #endif
@@ -24,9 +24,224 @@ module
 #include "obsidian.h"
 
 ModDataInfo *sasl_md;
+ModDataInfo *auth_pending_md;
+ModDataInfo *account_session_md; // AccountMember in the session list of the account a client is logged into
+ModDataInfo *nick_enforce_md; // NickEnforceTimer of a client on a registered nick it isn't logged into
 long CAP_ACCOUNTREGISTRATION = 0L;
 static struct AccountRegistrationConfStruct MyConf;
 
+/* Every registered account, loaded at MOD_LOAD. SQLite is only the
+ * persistent store, lookups never go back to it.
+ */
+static Account **account_hash = NULL;
+static unsigned int account_hash_size = 0; // Power of two, grows to stay above account_count
+static char account_hashkey[SIPHASH_KEY_LENGTH];
+static int account_count = 0;
+
+/* The same accounts sorted by id (paging), by name and by email domain (searches) */
+static int account_compare_id(const void *a, const void *b);
+static int account_compare_name(const void *a, const void *b);
+static int account_compare_domain(const void *a, const void *b);
+static AccountIndex accounts_by_id = { .compare = account_compare_id };
+static AccountIndex accounts_by_name = { .compare = account_compare_name };
+static AccountIndex accounts_by_domain = { .compare = account_compare_domain };
+static bool loading_accounts = false; // Sort once at the end of load_account_cache()
+
+/* Exact-name Q-lines hashed by case-folded name, wildcard ones in a list.
+ * Rebuilt from tklines[] on first use after a Q-line was added or removed.
+ */
+static struct {
+    NameBanEntry **hash;
+    unsigned int hash_size;
+    NameBanEntry *entries;
+    TKL **globs;
+    int nglobs;
+    bool dirty;
+} namebans = { .dirty = true };
+
+/* Counters and timings for STATS accounts and obsidianirc.stats.
+ * Everything is in nanoseconds unless the name says otherwise.
+ */
+static struct {
+    uint64_t cache_load_ns;
+    bool cache_from_snapshot;
+    unsigned long cache_replayed; // Rows newer than the snapshot
+    StatsHistogram lookup_ns;
+    unsigned long lookup_hits;
+    unsigned long lookup_misses;
+    StatsHistogram auth_wait_ns; // Submit to reply, queueing included
+    StatsHistogram argon2_verify_ns;
+    StatsHistogram argon2_hash_ns;
+    StatsHistogram db_commit_ns;
+    StatsHistogram db_batch_size; // Writes per transaction
+    unsigned long db_write_errors;
+    unsigned long sasl_success;
+    unsigned long sasl_bad_password;
+    unsigned long sasl_unknown_account;
+    unsigned long sasl_busy; // Already pending or the auth queue was full
+    unsigned long sasl_aborted;
+    unsigned long sasl_token_success;
+    unsigned long sasl_token_failed; // Bad MAC, expired, revoked or the account is gone
+    unsigned long sasl_external_success;
+    unsigned long sasl_external_failed; // No certificate, or one nobody added
+    unsigned long login_rate_limited; // SASL and IDENTIFY attempts refused before any lookup
+    StatsHistogram session_token_verify_ns;
+    unsigned long identify_success;
+    unsigned long identify_failed;
+    unsigned long register_success;
+    unsigned long register_failed;
+    unsigned long nick_enforce_warned;
+    unsigned long nick_enforce_renamed;
+} account_stats;
+
+/* Pending guest renames, hashed by deadline into one slot per second.
+ * Scheduling and cancelling are O(1), nick_enforce() only looks at the
+ * slots of the seconds that went by since it last ran.
+ */
+static struct {
+    NickEnforceTimer *slots[NICK_ENFORCE_WHEEL_SLOTS];
+    time_t last_tick; // Slots up to and including this second have run
+    int pending;
+    unsigned long guest_seq; // Next number for the $d digits of guest-nick-format
+} nick_wheel;
+
+/* Failed logins per account and per IP/CIDR, as a sliding window made
+ * of two fixed ones: the previous count weighs less the further the
+ * current window is along. A hash for lookups, an LRU list to expire
+ * and evict from, at most LOGIN_LIMIT_MAX_ENTRIES entries.
+ */
+static struct {
+    LoginLimitEntry *hash[LOGIN_LIMIT_HASH_SIZE];
+    LoginLimitEntry *head, *tail;
+    int count;
+} login_limits;
+
+/* Certificate fingerprints by hash, for SASL EXTERNAL. Filled by
+ * load_certfps() from account_certfp, each account has at most
+ * ACCOUNT_MAX_CERTFPS of them.
+ */
+static struct {
+    CertfpEntry *hash[CERTFP_HASH_SIZE];
+    int count;
+} certfps;
+
+/* Session tokens: the HMAC key lives in the database so tokens survive
+ * restarts, revoked tokens are in a hash set that load_session_tokens()
+ * fills from session_revocations.
+ */
+static struct {
+    unsigned char secret[SESSION_SECRET_LENGTH];
+    bool loaded;
+    RevokedToken *revoked[SESSION_REVOCATION_HASH_SIZE];
+    int revoked_count;
+} session_tokens;
+
+/* Statements prepared once in open_database(), reset after every use.
+ * Writes go through the db writer thread and its own connection.
+ */
+static struct {
+    sqlite3_stmt *select_accounts;
+    sqlite3_stmt *select_account;
+    sqlite3_stmt *select_metadata;
+    sqlite3_stmt *select_accounts_since;
+    sqlite3_stmt *count_accounts;
+    sqlite3_stmt *sync_accounts;
+    sqlite3_stmt *sync_metadata;
+    sqlite3_stmt *sync_certfps;
+    sqlite3_stmt *select_peer_mark;
+} stmts;
+
+/* Schema changes, applied in order. PRAGMA user_version holds how many
+ * of them a database already has. A fallback runs if the step itself
+ * fails and is only there so old data can't stop the module loading.
+ */
+static const struct {
+    const char *sql;
+    const char *fallback;
+    const char *fallback_warning;
+} db_migrations[] = {
+    /* 1: Point lookups on name, one account per case-insensitive name */
+    {
+        "CREATE UNIQUE INDEX IF NOT EXISTS accounts_name ON accounts (name COLLATE NOCASE)",
+        "CREATE INDEX IF NOT EXISTS accounts_name ON accounts (name COLLATE NOCASE)",
+        "The accounts table has names that only differ in case, only the oldest of them can be used. Remove the others and drop the accounts_name index to get a unique one."
+    },
+    /* 2: Account metadata, read per account by account_metadata() */
+    {
+        "CREATE TABLE IF NOT EXISTS account_metadata ("
+        "account_id INTEGER NOT NULL, "
+        "key TEXT NOT NULL, "
+        "value TEXT NOT NULL, "
+        "PRIMARY KEY (account_id, key)) WITHOUT ROWID",
+        NULL,
+        NULL
+    },
+    /* 3: Session token key and revocations, see load_session_tokens() */
+    {
+        "CREATE TABLE IF NOT EXISTS session_secret ("
+        "id INTEGER PRIMARY KEY CHECK (id = 1), "
+        "secret BLOB NOT NULL);"
+        "CREATE TABLE IF NOT EXISTS session_revocations ("
+        "token_id INTEGER PRIMARY KEY, "
+        "expires INTEGER NOT NULL)",
+        NULL,
+        NULL
+    },
+    /* 4: Certificate fingerprints for SASL EXTERNAL, see load_certfps() */
+    {
+        "CREATE TABLE IF NOT EXISTS account_certfp ("
+        "certfp TEXT PRIMARY KEY, "
+        "account_id INTEGER NOT NULL) WITHOUT ROWID;"
+        "CREATE INDEX IF NOT EXISTS account_certfp_account ON account_certfp (account_id)",
+        NULL,
+        NULL
+    },
+    /* 5: Change time of each account, compared by the OBSACC sync between servers */
+    {
+        "ALTER TABLE accounts ADD COLUMN updated_at INTEGER NOT NULL DEFAULT 0;"
+        "UPDATE accounts SET updated_at = time_registered",
+        NULL,
+        NULL
+    },
+    /* 6: Rows changed since the account snapshot are found by updated_at */
+    {
+        "CREATE INDEX IF NOT EXISTS accounts_updated_at ON accounts (updated_at)",
+        NULL,
+        NULL
+    },
+    /* 7: Change numbers of the synced rows and how far each linked server has them, see obsacc_sync_step() */
+    {
+        "ALTER TABLE accounts ADD COLUMN seq INTEGER NOT NULL DEFAULT 1;"
+        "ALTER TABLE account_metadata ADD COLUMN seq INTEGER NOT NULL DEFAULT 1;"
+        "ALTER TABLE account_certfp ADD COLUMN seq INTEGER NOT NULL DEFAULT 1;"
+        "CREATE INDEX IF NOT EXISTS accounts_seq ON accounts (seq);"
+        "CREATE INDEX IF NOT EXISTS account_metadata_seq ON account_metadata (seq);"
+        "CREATE INDEX IF NOT EXISTS account_certfp_seq ON account_certfp (seq);"
+        "CREATE TABLE IF NOT EXISTS obsacc_peers ("
+        "server TEXT PRIMARY KEY, "
+        "seq INTEGER NOT NULL) WITHOUT ROWID",
+        NULL,
+        NULL
+    },
+    /* 8: Change time of each metadata key and certfp, kept as a tombstone once deleted, for the OBSACC sync */
+    {
+        "ALTER TABLE account_metadata ADD COLUMN updated_at INTEGER NOT NULL DEFAULT 0;"
+        "ALTER TABLE account_metadata ADD COLUMN deleted INTEGER NOT NULL DEFAULT 0;"
+        "ALTER TABLE account_certfp ADD COLUMN updated_at INTEGER NOT NULL DEFAULT 0;"
+        "ALTER TABLE account_certfp ADD COLUMN deleted INTEGER NOT NULL DEFAULT 0;"
+        "UPDATE account_metadata SET updated_at = IFNULL((SELECT updated_at FROM accounts WHERE id = account_id), 0);"
+        "UPDATE account_certfp SET updated_at = IFNULL((SELECT updated_at FROM accounts WHERE id = account_id), 0)",
+        NULL,
+        NULL
+    },
+    /* 9: Who each revoked session token belongs to, see session_token_revocations() */
+    {
+        "ALTER TABLE session_revocations ADD COLUMN account_id INTEGER NOT NULL DEFAULT 0",
+        NULL,
+        NULL
+    },
+};
+
 ModuleHeader MOD_HEADER
 = 
 {
@@ -43,6 +258,7 @@ ModuleHeader MOD_HEADER
 MOD_INIT()
 {
     set_accreg_conf(); // Set defaults
+    siphash_generate_key(account_hashkey);
     ModDataInfo mreq;
 
     memset(&mreq, 0, sizeof(mreq));
@@ -57,6 +273,37 @@ MOD_INIT()
         return MOD_FAILED;
     }
 
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.name = "obsidian_auth_pending";
+    mreq.type = MODDATATYPE_CLIENT;
+    if (!(auth_pending_md = ModDataAdd(modinfo->handle, mreq)))
+    {
+        config_error("Could not add ModData for obsidian_auth_pending. Please open an Issue on GitHub: https://github.com/ObsidianIRC/UnrealIRCd-Modules/issues/.");
+        return MOD_FAILED;
+    }
+
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.name = "obsidian_account_session";
+    mreq.free = account_session_free;
+    mreq.type = MODDATATYPE_CLIENT;
+    if (!(account_session_md = ModDataAdd(modinfo->handle, mreq)))
+    {
+        config_error("Could not add ModData for obsidian_account_session. Please open an Issue on GitHub: https://github.com/ObsidianIRC/UnrealIRCd-Modules/issues/.");
+        return MOD_FAILED;
+    }
+
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.name = "obsidian_nick_enforce";
+    mreq.free = nick_enforce_free;
+    mreq.type = MODDATATYPE_CLIENT;
+    if (!(nick_enforce_md = ModDataAdd(modinfo->handle, mreq)))
+    {
+        config_error("Could not add ModData for obsidian_nick_enforce. Please open an Issue on GitHub: https://github.com/ObsidianIRC/UnrealIRCd-Modules/issues/.");
+        return MOD_FAILED;
+    }
+    // Start the guest numbers somewhere else after every restart
+    nick_wheel.guest_seq = getrandom32();
+
     if (open_database(OBSIDIAN_DB) != SQLITE_OK)
     {
         config_error("Could not open database. Please open an Issue on GitHub: https://github.com/ObsidianIRC/UnrealIRCd-Modules/issues/.");
@@ -76,12 +323,28 @@ MOD_INIT()
 
     HookAddConstString(modinfo->handle, HOOKTYPE_SASL_MECHS, 0, saslmechs);
     HookAdd(modinfo->handle, HOOKTYPE_SASL_AUTHENTICATE, 0, authenticate_attempt);
+    HookAdd(modinfo->handle, HOOKTYPE_ACCOUNT_LOGIN, 0, account_session_login);
+    HookAdd(modinfo->handle, HOOKTYPE_ACCOUNT_LOGIN, 0, nick_enforce_login);
+    HookAdd(modinfo->handle, HOOKTYPE_LOCAL_CONNECT, 0, nick_enforce_connect);
+    HookAdd(modinfo->handle, HOOKTYPE_POST_LOCAL_NICKCHANGE, 0, nick_enforce_nickchange);
+    HookAdd(modinfo->handle, HOOKTYPE_TKL_ADD, 0, nameban_tkl_changed);
+    HookAdd(modinfo->handle, HOOKTYPE_TKL_DEL, 0, nameban_tkl_changed);
+    HookAdd(modinfo->handle, HOOKTYPE_REHASH_COMPLETE, 0, nameban_rehash_complete);
+    HookAdd(modinfo->handle, HOOKTYPE_STATS, 0, obsidian_stats);
+    HookAdd(modinfo->handle, HOOKTYPE_ACCOUNT_REGISTER, 0, obsacc_account_register);
+    HookAdd(modinfo->handle, HOOKTYPE_SERVER_SYNC, 0, obsacc_server_sync);
 	HookAdd(modinfo->handle, HOOKTYPE_CONFIGRUN, 0, accreg_configrun); // Run through the config and set the values
 	
     CommandAdd(modinfo->handle, CMD_REGISTER, register_account, 3, CMD_USER|CMD_UNREGISTERED);
     CommandAdd(modinfo->handle, CMD_LISTACC, list_accounts, 3, CMD_OPER);
     CommandAdd(modinfo->handle, CMD_IDENTIFY, cmd_identify, 2, CMD_USER);
     CommandAdd(modinfo->handle, CMD_LOGOUT, cmd_logout, 0, CMD_USER);
+    CommandAdd(modinfo->handle, CMD_ACCOUNTDB, cmd_accountdb, 2, CMD_OPER);
+    CommandAdd(modinfo->handle, CMD_ACCOUNTMETA, cmd_accountmeta, 3, CMD_USER);
+    CommandAdd(modinfo->handle, CMD_SESSIONTOKEN, cmd_sessiontoken, 2, CMD_USER);
+    CommandAdd(modinfo->handle, CMD_CERTFP, cmd_certfp, 2, CMD_USER);
+    CommandAdd(modinfo->handle, CMD_LOGINFAIL, cmd_loginfail, 1, CMD_SERVER);
+    CommandAdd(modinfo->handle, CMD_OBSACC, cmd_obsacc, MAXPARA, CMD_SERVER);
     
 
     RPCHandlerInfo r;
@@ -96,6 +359,54 @@ MOD_INIT()
 	r.loglevel = ULOG_DEBUG;
 	r.call = rpc_accounts_find;
     RPCHandlerAdd(modinfo->handle, &r);
+
+    memset(&r, 0, sizeof(r));
+    r.method = "obsidianirc.accounts.search";
+	r.loglevel = ULOG_DEBUG;
+	r.call = rpc_accounts_search;
+    RPCHandlerAdd(modinfo->handle, &r);
+
+    memset(&r, 0, sizeof(r));
+    r.method = "obsidianirc.stats";
+	r.loglevel = ULOG_DEBUG;
+	r.call = rpc_obsidian_stats;
+    RPCHandlerAdd(modinfo->handle, &r);
+
+    memset(&r, 0, sizeof(r));
+    r.method = "obsidianirc.accounts.import";
+	r.loglevel = ULOG_INFO;
+	r.call = rpc_accounts_import;
+    RPCHandlerAdd(modinfo->handle, &r);
+
+    memset(&r, 0, sizeof(r));
+    r.method = "obsidianirc.accounts.export";
+	r.loglevel = ULOG_INFO;
+	r.call = rpc_accounts_export;
+    RPCHandlerAdd(modinfo->handle, &r);
+
+    memset(&r, 0, sizeof(r));
+    r.method = "obsidianirc.accounts.metadata.set";
+	r.loglevel = ULOG_INFO;
+	r.call = rpc_accounts_metadata_set;
+    RPCHandlerAdd(modinfo->handle, &r);
+
+    memset(&r, 0, sizeof(r));
+    r.method = "obsidianirc.accounts.certfp.add";
+	r.loglevel = ULOG_INFO;
+	r.call = rpc_accounts_certfp_add;
+    RPCHandlerAdd(modinfo->handle, &r);
+
+    memset(&r, 0, sizeof(r));
+    r.method = "obsidianirc.accounts.certfp.del";
+	r.loglevel = ULOG_INFO;
+	r.call = rpc_accounts_certfp_del;
+    RPCHandlerAdd(modinfo->handle, &r);
+
+    memset(&r, 0, sizeof(r));
+    r.method = "obsidianirc.accounts.certfp.list";
+	r.loglevel = ULOG_DEBUG;
+	r.call = rpc_accounts_certfp_list;
+    RPCHandlerAdd(modinfo->handle, &r);
     return MOD_SUCCESS;
 }
 
@@ -107,8 +418,43 @@ MOD_LOAD()
         config_error("Could not open database. Please contact ObsidianIRC Support.");
         return MOD_FAILED;
     }
+    if (!load_account_cache())
+    {
+        config_error("Could not load accounts from the database. Please contact ObsidianIRC Support.");
+        return MOD_FAILED;
+    }
+    if (!load_certfps())
+    {
+        config_error("Could not load certificate fingerprints from the database. Please contact ObsidianIRC Support.");
+        return MOD_FAILED;
+    }
+    if (!load_session_tokens())
+    {
+        config_error("Could not load the session token key from the database. Please contact ObsidianIRC Support.");
+        return MOD_FAILED;
+    }
+    // Pick up users who were already logged in before we were (re)loaded
+    Client *acptr;
+    list_for_each_entry(acptr, &client_list, client_node)
+    {
+        account_session_login(acptr, NULL);
+        nick_enforce_check(acptr);
+    }
+    if (!db_writer_start(OBSIDIAN_DB))
+    {
+        config_error("Could not start the database writer. Please contact ObsidianIRC Support.");
+        return MOD_FAILED;
+    }
+    if (!auth_pool_start())
+    {
+        config_error("Could not start the auth worker threads. Please contact ObsidianIRC Support.");
+        return MOD_FAILED;
+    }
+    EventAdd(modinfo->handle, "nick_enforce", nick_enforce, NULL, 1000, 0);
+    EventAdd(modinfo->handle, "login_limit_expire", login_limit_expire, NULL, 60000, 0);
+    EventAdd(modinfo->handle, "obsacc_sync", obsacc_sync, NULL, OBSACC_SYNC_INTERVAL, 0);
     safe_strdup(iConf.sasl_server, me.name);
-    moddata_client_set(&me, "saslmechlist", "PLAIN,EXTERNAL");
+    moddata_client_set(&me, "saslmechlist", SASL_MECHS);
     return MOD_SUCCESS;
 }
 
@@ -117,6 +463,20 @@ MOD_LOAD()
  */
 MOD_UNLOAD()
 {
+    auth_pool_stop();
+    db_writer_stop();
+    if (!write_account_snapshot(OBSIDIAN_SNAPSHOT))
+    {
+        unreal_log(ULOG_WARNING, "obsidianirc", "SNAPSHOT_WRITE_FAILED", NULL, "Could not write the account snapshot, the next load reads the whole database: $error",
+            log_data_string("error", strerror(errno)));
+    }
+    free_account_cache();
+    free_account_member_pool();
+    free_session_tokens();
+    free_certfps();
+    free_login_limits();
+    free_obsacc_syncs();
+    free_namebans();
     close_database();
     safe_free(iConf.sasl_server);
     iConf.sasl_server = NULL;
@@ -190,65 +550,45 @@ CMD_FUNC(register_account)
     }
 
     // Check if account already exists
-    Account *existing = find_account(name);
-    if (existing)
+    if (find_cached_account(name))
     {
         sendto_one(client, NULL, ":%s FAIL REGISTER ACCOUNT_EXISTS %s :That account name is already registered.", me.name, name);
-        free_account(existing);
-        return;
-    }
-    const char *password_hash = NULL;
-    
-    if (!(password_hash = Auth_Hash(6, parv[3])))
-    {
-        sendto_one(client, NULL, ":%s FAIL REGISTER SERVER_BUG %s :The hashing mechanism was not supported. Please contact an administrator.", me.name, parv[1]);
         return;
     }
-    // Create and store new account
-    Account *acc = safe_alloc(sizeof(Account));
-    acc->name = strdup(name);
-    acc->email = strdup(email);
-    acc->password = strdup(password_hash);
-    acc->time_registered = time(NULL);
-    acc->verified = 0;
-    acc->channels = NULL;
-    acc->metadata_head = NULL;
 
-    if (write_account_to_db(acc))
-    {
-        sendto_one(client, NULL, ":%s REGISTER SUCCESS %s :Account registered successfully.", me.name, name);
-        strlcpy(client->user->account, name, sizeof(client->user->account));
-        user_account_login(NULL, client);
-        unreal_log(ULOG_INFO, "account", "REGISTER", client,
-            "New account registered by $client.details [account: $account] [email: $email]", 
-            log_data_string("account", acc->name),
-            log_data_string("email", acc->email)
-        );
-        RunHook(HOOKTYPE_ACCOUNT_REGISTER, acc, client);
-    }
-    else
+    // Hashed by the auth worker pool, register_finish() stores the account
+    if (!auth_pool_hash(client, name, email, password))
     {
-        sendto_one(client, NULL, ":%s FAIL REGISTER INTERNAL_ERROR :Failed to register account.", me.name);
+        sendto_one(client, NULL, ":%s FAIL REGISTER TEMPORARILY_UNAVAILABLE %s :Please try again later.", me.name, name);
     }
-    free_account(acc);
 }
 
 /**
  * list_accounts - Handles the LISTACC command from users.
+ * Syntax: LISTACC [<name pattern>|@<email domain>]
+ * Shows at most LISTACC_MAX_RESULTS matches, in name order.
  */
 CMD_FUNC(list_accounts)
 {
-    Account **accounts = read_accounts_from_db(!BadPtr(parv[1]) ? parv[1] : NULL);
-    if (!accounts || !accounts[0])
+    const char *arg = !BadPtr(parv[1]) ? parv[1] : "*";
+    Account *accounts[LISTACC_MAX_RESULTS];
+    int total, shown;
+
+    if (*arg == '@')
+    {
+        total = search_accounts(NULL, arg + 1, 0, LISTACC_MAX_RESULTS, accounts);
+    }
+    else
+    {
+        total = search_accounts(arg, NULL, 0, LISTACC_MAX_RESULTS, accounts);
+    }
+    if (!total)
     {
         sendto_one(client, NULL, ":%s LISTACC NO_ACCOUNTS :No accounts registered.", me.name);
-        if (accounts)
-        {
-            free(accounts);
-        }
         return;
     }
-    for (size_t i = 0; accounts[i]; i++)
+    shown = MIN(total, LISTACC_MAX_RESULTS);
+    for (int i = 0; i < shown; i++)
     {
         // Count logged-in users (members)
         int member_count = 0;
@@ -267,18 +607,65 @@ CMD_FUNC(list_accounts)
             accounts[i]->verified,
             member_count // number of logged-in users
         );
-        free_account(accounts[i]);
     }
-    free(accounts);
+    if (shown < total)
+    {
+        sendto_one(client, NULL, ":%s LISTACC TRUNCATED %d %d :Only the first %d of %d matches are shown, narrow down the search.", me.name, shown, total, shown, total);
+    }
 }
 
 /**
  * my_find_tkl_nameban - Checks if a given name is banned via TKL nameban.
+ * Exact names are a hash lookup, only the (few) wildcard bans are matched one by one.
  * Returns a pointer to the TKL if found, otherwise NULL.
  */
 TKL *my_find_tkl_nameban(const char *name)
+{
+    NameBanEntry *e;
+    uint64_t hashv;
+
+    if (namebans.dirty)
+    {
+        rebuild_namebans();
+    }
+    hashv = siphash_nocase(name, account_hashkey);
+    for (e = namebans.hash[hashv & (namebans.hash_size - 1)]; e; e = e->next)
+    {
+        if (e->namehash == hashv && !strcasecmp(name, e->tkl->ptr.nameban->name))
+        {
+            return e->tkl;
+        }
+    }
+    for (int i = 0; i < namebans.nglobs; i++)
+    {
+        if (match_simple(namebans.globs[i]->ptr.nameban->name, name))
+        {
+            return namebans.globs[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * rebuild_namebans - Rebuilds the nameban lookup from the Q-line list.
+ */
+void rebuild_namebans(void)
 {
     TKL *tkl;
+    int count = 0, nexact = 0;
+
+    free_namebans();
+    for (tkl = tklines[tkl_hash('Q')]; tkl; tkl = tkl->next)
+    {
+        count++;
+    }
+    for (namebans.hash_size = 16; namebans.hash_size < (unsigned int)count; namebans.hash_size *= 2)
+    {
+        ;
+    }
+    namebans.hash = safe_alloc(sizeof(NameBanEntry *) * namebans.hash_size);
+    namebans.entries = safe_alloc(sizeof(NameBanEntry) * (count + 1));
+    namebans.globs = safe_alloc(sizeof(TKL *) * (count + 1));
 
     for (tkl = tklines[tkl_hash('Q')]; tkl; tkl = tkl->next)
     {
@@ -286,12 +673,55 @@ TKL *my_find_tkl_nameban(const char *name)
         {
             continue;
         }
-        if (!strcasecmp(name, tkl->ptr.nameban->name))
+        const char *mask = tkl->ptr.nameban->name;
+        if (strpbrk(mask, "*?"))
         {
-            return tkl;
+            namebans.globs[namebans.nglobs++] = tkl;
+            continue;
         }
+        NameBanEntry *e = &namebans.entries[nexact++];
+        e->tkl = tkl;
+        e->namehash = siphash_nocase(mask, account_hashkey);
+        e->next = namebans.hash[e->namehash & (namebans.hash_size - 1)];
+        namebans.hash[e->namehash & (namebans.hash_size - 1)] = e;
     }
-    return NULL;
+    namebans.dirty = false;
+}
+
+/**
+ * free_namebans - Frees the nameban lookup, it is rebuilt on next use.
+ */
+void free_namebans(void)
+{
+    safe_free(namebans.hash);
+    safe_free(namebans.entries);
+    safe_free(namebans.globs);
+    namebans.hash_size = 0;
+    namebans.nglobs = 0;
+    namebans.dirty = true;
+}
+
+/**
+ * nameban_tkl_changed - Hook for HOOKTYPE_TKL_ADD and HOOKTYPE_TKL_DEL.
+ * Services add thousands of Q-lines in a burst, so they only mark the lookup
+ * for a rebuild on next use. It holds TKL pointers and is not read before that.
+ */
+int nameban_tkl_changed(Client *client, TKL *tkl)
+{
+    if (TKLIsNameBan(tkl))
+    {
+        namebans.dirty = true;
+    }
+    return 0;
+}
+
+/**
+ * nameban_rehash_complete - Hook for HOOKTYPE_REHASH_COMPLETE, config Q-lines may have been replaced.
+ */
+int nameban_rehash_complete(void)
+{
+    namebans.dirty = true;
+    return 0;
 }
 
 /**
@@ -315,11 +745,20 @@ int accreg_capability_visible(Client *client)
  */
 int open_database(const char *filename)
 {
+    if (db)
+    {
+        return SQLITE_OK; // Already open, MOD_INIT and MOD_LOAD both get here
+    }
     if (sqlite3_open(filename, &db) != SQLITE_OK)
     {
+        close_database();
         return SQLITE_ERROR;
     }
-    const char *sql =   "CREATE TABLE IF NOT EXISTS accounts ("
+    sqlite3_busy_timeout(db, 5000);
+    const char *sql =   "PRAGMA journal_mode = WAL;"
+                        "PRAGMA synchronous = NORMAL;"
+                        "PRAGMA cache_size = -8192;" // KiB
+                        "CREATE TABLE IF NOT EXISTS accounts ("
                         "id INTEGER PRIMARY KEY AUTOINCREMENT, "
                         "name TEXT, "
                         "email TEXT, "
@@ -330,8 +769,80 @@ int open_database(const char *filename)
     if (sqlite3_exec(db, sql, NULL, NULL, &errmsg) != SQLITE_OK)
     {
         sqlite3_free(errmsg);
+        close_database();
+        return SQLITE_ERROR;
+    }
+    if (migrate_database() != SQLITE_OK
+        || sqlite3_prepare_v3(db, "SELECT * FROM accounts ORDER BY id",
+                              -1, SQLITE_PREPARE_PERSISTENT, &stmts.select_accounts, NULL) != SQLITE_OK
+        || sqlite3_prepare_v3(db, "SELECT * FROM accounts WHERE name = ? COLLATE NOCASE ORDER BY id LIMIT 1",
+                              -1, SQLITE_PREPARE_PERSISTENT, &stmts.select_account, NULL) != SQLITE_OK
+        || sqlite3_prepare_v3(db, "SELECT key, value FROM account_metadata WHERE account_id = ? AND deleted = 0 ORDER BY key",
+                              -1, SQLITE_PREPARE_PERSISTENT, &stmts.select_metadata, NULL) != SQLITE_OK
+        || sqlite3_prepare_v3(db, "SELECT * FROM accounts WHERE id > ? OR updated_at >= ? ORDER BY id",
+                              -1, 0, &stmts.select_accounts_since, NULL) != SQLITE_OK
+        || sqlite3_prepare_v3(db, "SELECT COUNT(*) FROM accounts",
+                              -1, 0, &stmts.count_accounts, NULL) != SQLITE_OK
+        // Two halves, a row value on (seq, id) would not use the index past seq
+        || sqlite3_prepare_v3(db, "SELECT * FROM (SELECT * FROM accounts WHERE seq = ?1 AND id > ?2 ORDER BY id LIMIT ?3) "
+                              "UNION ALL SELECT * FROM (SELECT * FROM accounts WHERE seq > ?1 ORDER BY seq, id LIMIT ?3) ORDER BY seq, id LIMIT ?3",
+                              -1, SQLITE_PREPARE_PERSISTENT, &stmts.sync_accounts, NULL) != SQLITE_OK
+        || sqlite3_prepare_v3(db, "SELECT m.seq, m.account_id, m.key, m.value, a.name, a.time_registered, m.updated_at, m.deleted FROM account_metadata m JOIN accounts a ON a.id = m.account_id "
+                              "WHERE (m.seq, m.account_id, m.key) > (?1, ?2, ?3) ORDER BY m.seq, m.account_id, m.key LIMIT ?4",
+                              -1, SQLITE_PREPARE_PERSISTENT, &stmts.sync_metadata, NULL) != SQLITE_OK
+        || sqlite3_prepare_v3(db, "SELECT c.seq, c.certfp, a.name, a.time_registered, c.updated_at, c.deleted FROM account_certfp c JOIN accounts a ON a.id = c.account_id "
+                              "WHERE (c.seq, c.certfp) > (?1, ?2) ORDER BY c.seq, c.certfp LIMIT ?3",
+                              -1, SQLITE_PREPARE_PERSISTENT, &stmts.sync_certfps, NULL) != SQLITE_OK
+        || sqlite3_prepare_v3(db, "SELECT seq FROM obsacc_peers WHERE server = ?",
+                              -1, SQLITE_PREPARE_PERSISTENT, &stmts.select_peer_mark, NULL) != SQLITE_OK)
+    {
+        close_database();
+        return SQLITE_ERROR;
+    }
+    return SQLITE_OK;
+}
+
+/**
+ * migrate_database - Brings the schema up to date, see db_migrations.
+ */
+int migrate_database(void)
+{
+    sqlite3_stmt *stmt;
+    int version = 0;
+
+    if (sqlite3_prepare_v2(db, "PRAGMA user_version", -1, &stmt, NULL) != SQLITE_OK)
+    {
         return SQLITE_ERROR;
     }
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        version = sqlite3_column_int(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+
+    for (; version < (int)ARRAY_SIZEOF(db_migrations); version++)
+    {
+        char sql[64];
+
+        sqlite3_exec(db, "BEGIN", NULL, NULL, NULL);
+        if (sqlite3_exec(db, db_migrations[version].sql, NULL, NULL, NULL) != SQLITE_OK)
+        {
+            if (!db_migrations[version].fallback || sqlite3_exec(db, db_migrations[version].fallback, NULL, NULL, NULL) != SQLITE_OK)
+            {
+                config_error("Could not upgrade the database to version %d: %s", version + 1, sqlite3_errmsg(db));
+                sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+                return SQLITE_ERROR;
+            }
+            config_warn("%s", db_migrations[version].fallback_warning);
+        }
+        snprintf(sql, sizeof(sql), "PRAGMA user_version = %d", version + 1);
+        if (sqlite3_exec(db, sql, NULL, NULL, NULL) != SQLITE_OK || sqlite3_exec(db, "COMMIT", NULL, NULL, NULL) != SQLITE_OK)
+        {
+            config_error("Could not upgrade the database to version %d: %s", version + 1, sqlite3_errmsg(db));
+            sqlite3_exec(db, "ROLLBACK", NULL, NULL, NULL);
+            return SQLITE_ERROR;
+        }
+    }
     return SQLITE_OK;
 }
 
@@ -342,6 +853,16 @@ void close_database()
 {
     if (db)
     {
+        sqlite3_finalize(stmts.select_accounts);
+        sqlite3_finalize(stmts.select_account);
+        sqlite3_finalize(stmts.select_metadata);
+        sqlite3_finalize(stmts.select_accounts_since);
+        sqlite3_finalize(stmts.count_accounts);
+        sqlite3_finalize(stmts.sync_accounts);
+        sqlite3_finalize(stmts.sync_metadata);
+        sqlite3_finalize(stmts.sync_certfps);
+        sqlite3_finalize(stmts.select_peer_mark);
+        memset(&stmts, 0, sizeof(stmts));
         sqlite3_close(db);
         db = NULL;
     }
@@ -367,519 +888,5352 @@ void free_account(Account *acc)
         }
         free(acc->channels);
     }
-    free_metadata(acc->metadata_head);
+    free(acc->metadata);
+    for (AccountMember *m = acc->members, *next; m; m = next)
+    {
+        next = m->next;
+        free(m);
+    }
     free(acc);
 }
 
 /**
- * write_account_to_db - Appends an Account to the account database.
+ * open_wakeup_pipe - Creates a non-blocking pipe that worker threads write to
+ * in order to have callback run on the main loop.
  * Returns 1 on success, 0 on failure.
  */
-int write_account_to_db(const Account *acc)
+static int open_wakeup_pipe(int pipefd[2], const char *desc, void (*callback)(int fd, int revents, void *data))
 {
-    if (find_account(acc->name))
+    if (pipe(pipefd) < 0)
     {
-        // Account already exists
+        pipefd[0] = pipefd[1] = -1;
         return 0;
     }
-    const char *sql = "INSERT INTO accounts (name, email, password, time_registered, verified) VALUES (?, ?, ?, ?, ?)";
-    sqlite3_stmt *stmt;
+    fcntl(pipefd[0], F_SETFL, O_NONBLOCK);
+    fcntl(pipefd[1], F_SETFL, O_NONBLOCK);
+    fd_open(pipefd[0], desc, FDCLOSE_NONE);
+    fd_setselect(pipefd[0], FD_SELECT_READ, callback, NULL);
+    return 1;
+}
 
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+/**
+ * notify_wakeup_pipe - Wakes up the main loop (any thread).
+ */
+static void notify_wakeup_pipe(int pipefd[2])
+{
+    // If the pipe is full the main loop has a wakeup pending already
+    if (write(pipefd[1], "", 1) < 0)
     {
-        return 0;
+        ;
+    }
+}
+
+/**
+ * drain_wakeup_pipe - Empties the pipe before handling what a thread handed over (main loop).
+ */
+static void drain_wakeup_pipe(int fd)
+{
+    char buf[256];
+
+    while (read(fd, buf, sizeof(buf)) > 0)
+    {
+        ;
+    }
+}
+
+/**
+ * close_wakeup_pipe - Closes a pipe made by open_wakeup_pipe(), if it is open.
+ */
+static void close_wakeup_pipe(int pipefd[2])
+{
+    if (pipefd[0] < 0)
+    {
+        return;
     }
+    // fd_close() closes the read end as well
+    fd_close(pipefd[0]);
+    close(pipefd[1]);
+    pipefd[0] = pipefd[1] = -1;
+}
+
+/* Write-behind for account changes: a background thread with its own
+ * connection applies queued writes, as many as have piled up (up to
+ * DB_WRITE_BATCH_SIZE) in one transaction, so registrations share the
+ * fsync. Each write's done callback runs on the main loop once its
+ * transaction committed, or failed.
+ */
+static struct {
+    pthread_t thread;
+    bool running;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    DbWrite *queue_head, *queue_tail;
+    DbWrite *done_head, *done_tail;
+    int pipefd[2];
+    bool shutdown;
+    sqlite3 *conn;
+    sqlite3_stmt *insert_account;
+    sqlite3_stmt *export_accounts;
+    sqlite3_stmt *get_metadata;
+    sqlite3_stmt *set_metadata;
+    sqlite3_stmt *revoke_session;
+    sqlite3_stmt *get_certfp;
+    sqlite3_stmt *set_certfp;
+    sqlite3_stmt *update_account;
+    sqlite3_stmt *find_account;
+    sqlite3_stmt *reset_metadata;
+    sqlite3_stmt *reset_certfps;
+    sqlite3_stmt *set_peer_mark;
+    uint64_t seq; // Writer thread: last change number given out
+    // Main loop: writes queued and completed so far, the highest seq completed and imports still running
+    uint64_t queued;
+    uint64_t completed;
+    uint64_t completed_seq;
+    int imports;
+} db_writer_state = { .pipefd = { -1, -1 } };
+
+/**
+ * write_account_to_db - Inserts an Account as the next change and sets its id to the new row (writer thread).
+ * Returns the result of sqlite3_step(), SQLITE_DONE on success.
+ * A name that is already registered fails with SQLITE_CONSTRAINT, from the unique index or, on a
+ * database that only has the fallback index, because the insert found the name and did nothing.
+ */
+int write_account_to_db(Account *acc)
+{
+    sqlite3_stmt *stmt = db_writer_state.insert_account;
 
     sqlite3_bind_text(stmt, 1, acc->name, -1, SQLITE_STATIC);
     sqlite3_bind_text(stmt, 2, acc->email, -1, SQLITE_STATIC);
     sqlite3_bind_text(stmt, 3, acc->password, -1, SQLITE_STATIC);
-    sqlite3_bind_int(stmt, 4, (int)acc->time_registered);
+    sqlite3_bind_int64(stmt, 4, acc->time_registered);
     sqlite3_bind_int(stmt, 5, acc->verified);
+    sqlite3_bind_int64(stmt, 6, acc->updated_at ? acc->updated_at : acc->time_registered);
+    sqlite3_bind_int64(stmt, 7, (sqlite3_int64)++db_writer_state.seq);
 
     int result = sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
-    return result == SQLITE_DONE ? 1 : 0;
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    if (result == SQLITE_DONE && !sqlite3_changes(db_writer_state.conn))
+    {
+        result = SQLITE_CONSTRAINT;
+    }
+    if (result == SQLITE_DONE)
+    {
+        acc->id = (long int)sqlite3_last_insert_rowid(db_writer_state.conn);
+    }
+    else if ((result & 0xff) == SQLITE_CONSTRAINT)
+    {
+        db_writer_state.seq--; // No row got the number
+    }
+    return result;
 }
 
 /**
- * read_accounts_from_db - Reads all accounts from the database.
- * Returns a NULL-terminated array of Account*.
+ * account_from_json - Builds an Account from one NDJSON import line, as written by db_export_chunk().
+ * Returns NULL if the line is not a valid account with an argon2 hash.
  */
-Account **read_accounts_from_db(const char *name)
+static Account *account_from_json(const char *line)
 {
-    const char *sql_all = "SELECT * FROM accounts";
-    const char *sql_one = "SELECT * FROM accounts WHERE lower(name) = lower(?) LIMIT 1";
-    sqlite3_stmt *stmt;
-    Account **accounts = NULL;
-    size_t count = 0;
+    json_error_t jerr;
+    json_t *j = json_loads(line, 0, &jerr);
+    const char *name, *email, *password;
+    Account *acc = NULL;
 
-    if (!db)
+    if (!j)
     {
         return NULL;
     }
-
-    if (sqlite3_prepare_v2(db, name ? sql_one : sql_all, -1, &stmt, NULL) != SQLITE_OK)
+    name = json_string_value(json_object_get(j, "name"));
+    email = json_string_value(json_object_get(j, "email"));
+    password = json_string_value(json_object_get(j, "password"));
+    // Names become nicks, so the same bounds as REGISTER and no spaces or control characters
+    if (name && password && !strncmp(password, "$argon2", 7)
+        && strlen(name) >= MyConf.min_name_length && strlen(name) <= MyConf.max_name_length
+        && !strpbrk(name, " ,*?!@\r\n\t"))
     {
-        return NULL;
+        json_t *jtime = json_object_get(j, "time_registered");
+        acc = safe_alloc(sizeof(Account));
+        acc->name = strdup(name);
+        acc->email = strdup(email ? email : "");
+        acc->password = strdup(password);
+        acc->time_registered = json_is_integer(jtime) ? (time_t)json_integer_value(jtime) : time(NULL);
+        acc->verified = json_is_true(json_object_get(j, "verified")) || json_integer_value(json_object_get(j, "verified")) > 0;
+        acc->updated_at = time(NULL); // New to this network, whenever it was registered
     }
+    json_decref(j);
+    return acc;
+}
+
+/**
+ * db_import_chunk - Inserts the next DB_TRANSFER_CHUNK_SIZE accounts of an import file (writer thread).
+ * Names that are already registered are skipped by write_account_to_db(), and counted as skipped.
+ * The chunk is its own savepoint, so on an error none of its rows stay in the batch's transaction.
+ */
+static int db_import_chunk(DbWrite *w)
+{
+    char *line = NULL;
+    size_t size = 0;
+    int n = 0, result = SQLITE_DONE;
 
-    if (name)
+    w->more = false;
+    if (!w->file && !(w->file = fopen(w->path, "r")))
     {
-        sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+        return SQLITE_CANTOPEN;
     }
-
-    while (sqlite3_step(stmt) == SQLITE_ROW)
+    if ((result = sqlite3_exec(db_writer_state.conn, "SAVEPOINT import_chunk", NULL, NULL, NULL)) != SQLITE_OK)
     {
-        Account *acc = safe_alloc(sizeof(Account));
-        acc->id = sqlite3_column_int(stmt, 0);
-        acc->name = strdup((const char *)sqlite3_column_text(stmt, 1));
-        acc->email = strdup((const char *)sqlite3_column_text(stmt, 2));
-        acc->password = strdup((const char *)sqlite3_column_text(stmt, 3));
-        acc->time_registered = (time_t)sqlite3_column_int(stmt, 4);
-        acc->verified = sqlite3_column_int(stmt, 5);
-        acc->channels = NULL;
-        acc->metadata_head = NULL;
-        acc->members = NULL;
-
-        // Populate online clients for this account
-        Client *cptr;
-        list_for_each_entry(cptr, &client_list, client_node)
-        {
-            if (cptr->user && cptr->user->account && strcmp(cptr->user->account, acc->name) == 0)
-            {
-                AccountMember *member = safe_alloc(sizeof(AccountMember));
-                member->client = cptr;
-                member->next = acc->members;
-                acc->members = member;
-            }
-        }
-
-        Account **tmp = realloc(accounts, sizeof(Account*) * (count + 2));
-        if (!tmp)
-        {
-            for (size_t i = 0; accounts && accounts[i]; i++)
-            {
-                free_account(accounts[i]);
-            }
-            free(accounts);
-            sqlite3_finalize(stmt);
-            return NULL;
+        return result;
+    }
+    result = SQLITE_DONE;
+    while (n < DB_TRANSFER_CHUNK_SIZE && getline(&line, &size, w->file) >= 0)
+    {
+        if (strspn(line, " \t\r\n") == strlen(line))
+        {
+            continue;
+        }
+        Account *acc = account_from_json(line);
+        if (!acc)
+        {
+            w->invalid++;
+            continue;
+        }
+        n++;
+        result = write_account_to_db(acc);
+        if (result == SQLITE_DONE)
+        {
+            w->seq = db_writer_state.seq;
+            acc->hnext = w->chunk;
+            w->chunk = acc;
+            w->rows++;
+        }
+        else if ((result & 0xff) == SQLITE_CONSTRAINT)
+        {
+            free_account(acc);
+            w->skipped++;
+            result = SQLITE_DONE;
+        }
+        else
+        {
+            free_account(acc);
+            break;
         }
-        accounts = tmp;
-        accounts[count++] = acc;
     }
+    free(line);
+    if (result != SQLITE_DONE)
+    {
+        // db_write_batch() drops w->chunk for a failed import, the database must not keep it either
+        sqlite3_exec(db_writer_state.conn, "ROLLBACK TO import_chunk", NULL, NULL, NULL);
+    }
+    sqlite3_exec(db_writer_state.conn, "RELEASE import_chunk", NULL, NULL, NULL);
+    w->more = result == SQLITE_DONE && n == DB_TRANSFER_CHUNK_SIZE;
+    return result;
+}
 
-    sqlite3_finalize(stmt);
+/**
+ * db_export_chunk - Writes the next DB_TRANSFER_CHUNK_SIZE accounts to an export file (writer thread).
+ * The file is written as <path>.tmp and only renamed to <path> once complete.
+ */
+static int db_export_chunk(DbWrite *w)
+{
+    sqlite3_stmt *stmt = db_writer_state.export_accounts;
+    char tmp[PATH_MAX];
+    int n = 0, result;
 
-    if (!accounts)
+    w->more = false;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", w->path);
+    if (!w->file && !(w->file = fopen(tmp, "w")))
     {
-        accounts = safe_alloc(sizeof(Account*));
-        accounts[0] = NULL;
+        return SQLITE_CANTOPEN;
     }
-    else
+    sqlite3_bind_int64(stmt, 1, w->last_id);
+    sqlite3_bind_int(stmt, 2, DB_TRANSFER_CHUNK_SIZE);
+    while ((result = sqlite3_step(stmt)) == SQLITE_ROW)
     {
-        accounts[count] = NULL;
+        json_t *j = json_object();
+        w->last_id = (long)sqlite3_column_int64(stmt, 0);
+        json_object_set_new(j, "id", json_integer(w->last_id));
+        json_object_set_new(j, "name", json_string((const char *)sqlite3_column_text(stmt, 1)));
+        json_object_set_new(j, "email", json_string((const char *)sqlite3_column_text(stmt, 2)));
+        json_object_set_new(j, "password", json_string((const char *)sqlite3_column_text(stmt, 3)));
+        json_object_set_new(j, "time_registered", json_integer(sqlite3_column_int64(stmt, 4)));
+        json_object_set_new(j, "verified", json_boolean(sqlite3_column_int(stmt, 5)));
+        json_dumpf(j, w->file, JSON_COMPACT);
+        fputc('\n', w->file);
+        json_decref(j);
+        n++;
     }
-
-    return accounts;
+    sqlite3_reset(stmt);
+    w->rows += n;
+    if (result != SQLITE_DONE || ferror(w->file))
+    {
+        fclose(w->file);
+        w->file = NULL;
+        unlink(tmp);
+        return result != SQLITE_DONE ? result : SQLITE_IOERR;
+    }
+    if (n == DB_TRANSFER_CHUNK_SIZE)
+    {
+        w->more = true;
+        return SQLITE_DONE;
+    }
+    result = fclose(w->file) || rename(tmp, w->path) ? SQLITE_IOERR : SQLITE_DONE;
+    w->file = NULL;
+    return result;
 }
 
-Account *find_account_by_client(Client *client)
+/**
+ * db_row_newer - Whether a change from another server beats the row it would replace.
+ * The later updated_at wins, then a delete, then the greater value, so every server keeps the same one.
+ */
+static bool db_row_newer(time_t updated_at, bool deleted, const char *value, time_t row_updated_at, bool row_deleted, const char *row_value)
 {
-    if (!db || !client || !client->name)
+    if (updated_at != row_updated_at)
     {
-        return NULL;
+        return updated_at > row_updated_at;
     }
+    if (deleted != row_deleted)
+    {
+        return deleted;
+    }
+    return strcmp(value, row_value ? row_value : "") > 0;
+}
 
-    return find_account(client->user->account);
+/**
+ * db_find_account_id - Sets w->account_id to the account named w->account_name that was
+ * registered at w->time_registered (writer thread).
+ * Returns SQLITE_ROW if there is one, SQLITE_DONE if the name is not, or no longer, that registration.
+ */
+static int db_find_account_id(DbWrite *w)
+{
+    sqlite3_stmt *stmt = db_writer_state.find_account;
+    int result;
+
+    sqlite3_bind_text(stmt, 1, w->account_name, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, w->time_registered);
+    if ((result = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+        w->account_id = (long int)sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    return result;
 }
 
-Account *find_account(const char *name)
+/**
+ * db_metadata_apply - Sets one account_metadata row, or makes it a tombstone (writer thread).
+ * Our own changes are stamped after the row's last one, changes from another server
+ * only replace an older row. w->changed tells the done callback which happened.
+ */
+static int db_metadata_apply(DbWrite *w)
 {
-    if (!db || !name)
+    sqlite3_stmt *stmt = db_writer_state.get_metadata;
+    bool newer = true;
+    int result;
+
+    if (w->account_name && (result = db_find_account_id(w)) != SQLITE_ROW)
     {
-        return NULL;
+        return result;
     }
-    Account **accounts = read_accounts_from_db(name);
-    if (!accounts)
+    sqlite3_bind_int64(stmt, 1, w->account_id);
+    sqlite3_bind_text(stmt, 2, w->key, -1, SQLITE_STATIC);
+    if ((result = sqlite3_step(stmt)) == SQLITE_ROW)
     {
-        return NULL;
+        time_t row_updated_at = (time_t)sqlite3_column_int64(stmt, 1);
+        if (!*w->source)
+        {
+            w->updated_at = MAX(w->updated_at, row_updated_at + 1);
+        }
+        else
+        {
+            newer = db_row_newer(w->updated_at, !w->value, w->value ? w->value : "",
+                                 row_updated_at, sqlite3_column_int(stmt, 2), (const char *)sqlite3_column_text(stmt, 0));
+        }
     }
-    Account *result = NULL;
-    if (accounts[0])
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    if (result != SQLITE_ROW && result != SQLITE_DONE)
     {
-        result = accounts[0];
-        accounts[0] = NULL;
+        return result;
     }
-    // Free the rest (should be none, but for safety)
-    for (size_t i = 0; accounts[i]; i++)
+    if (!newer)
     {
-        if (accounts[i])
-        {
-            free_account(accounts[i]);
-        }
+        return SQLITE_DONE;
     }
-    free(accounts);
+    stmt = db_writer_state.set_metadata;
+    sqlite3_bind_int64(stmt, 1, w->account_id);
+    sqlite3_bind_text(stmt, 2, w->key, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 3, w->value ? w->value : "", -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 4, w->updated_at);
+    sqlite3_bind_int(stmt, 5, !w->value);
+    sqlite3_bind_int64(stmt, 6, (sqlite3_int64)(w->seq = ++db_writer_state.seq));
+    result = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    w->changed = result == SQLITE_DONE;
     return result;
 }
 
-// Create a new metadata node
-Metadata* create_metadata(const char *key, const char *value)
+/**
+ * db_session_revoke_apply - Stores one revoked session token (writer thread).
+ */
+static int db_session_revoke_apply(DbWrite *w)
 {
-    Metadata *m = safe_alloc(sizeof(Metadata));
-    m->key = strdup(key);
-    m->value = strdup(value);
-    m->prev = m->next = NULL;
-    return m;
+    sqlite3_stmt *stmt = db_writer_state.revoke_session;
+    int result;
+
+    sqlite3_bind_int64(stmt, 1, (sqlite3_int64)w->token_id);
+    sqlite3_bind_int64(stmt, 2, w->expires);
+    sqlite3_bind_int64(stmt, 3, w->account_id);
+    result = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    return result;
 }
 
 /**
- * add_metadata - Adds a metadata key/value pair to an Account.
+ * db_reset_account - Drops every metadata and certfp row of the account named name (writer thread).
  */
-void add_metadata(Account *acc, const char *key, const char *value)
+static int db_reset_account(const char *name)
 {
-    Metadata *m = create_metadata(key, value);
-    m->next = acc->metadata_head;
-    if (acc->metadata_head)
+    sqlite3_stmt *list[] = { db_writer_state.reset_metadata, db_writer_state.reset_certfps };
+    int result = SQLITE_DONE;
+
+    for (size_t i = 0; i < ARRAY_SIZEOF(list) && result == SQLITE_DONE; i++)
     {
-        acc->metadata_head->prev = m;
+        sqlite3_bind_text(list[i], 1, name, -1, SQLITE_STATIC);
+        result = sqlite3_step(list[i]);
+        sqlite3_reset(list[i]);
+        sqlite3_clear_bindings(list[i]);
     }
-    acc->metadata_head = m;
+    return result;
 }
 
 /**
- * free_metadata - Frees a linked list of Metadata nodes.
+ * db_account_update_apply - Stores the changed fields of an account (writer thread).
  */
-void free_metadata(Metadata *head)
+static int db_account_update_apply(DbWrite *w)
 {
-    Metadata *cur = head, *tmp;
-    while (cur)
+    sqlite3_stmt *stmt = db_writer_state.update_account;
+    int result;
+
+    if (w->reset && (result = db_reset_account(w->acc->name)) != SQLITE_DONE)
     {
-        tmp = cur->next;
-        free(cur->key);
-        free(cur->value);
-        free(cur);
-        cur = tmp;
+        return result;
     }
+    sqlite3_bind_text(stmt, 1, w->acc->email, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, w->acc->password, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 3, w->acc->verified);
+    sqlite3_bind_int64(stmt, 4, w->acc->updated_at);
+    sqlite3_bind_int64(stmt, 5, (sqlite3_int64)(w->seq = ++db_writer_state.seq));
+    sqlite3_bind_int64(stmt, 6, w->acc->time_registered);
+    sqlite3_bind_text(stmt, 7, w->acc->name, -1, SQLITE_STATIC);
+    result = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    return result;
 }
 
 /**
- * authenticate_attempt - Hook to handle authentication attempts.
- * This is called when a client attempts to authenticate when we
- * are the SASL server.
+ * db_certfp_apply - Links a certfp to an account, or makes its row a tombstone (writer thread).
+ * Like db_metadata_apply(), and a removal only counts for the account the certfp is linked to.
  */
-int authenticate_attempt(Client *client, int first, const char *param)
+static int db_certfp_apply(DbWrite *w)
 {
-    if (!SASL_SERVER || !MyConnect(client) || !param || !*param)
+    sqlite3_stmt *stmt = db_writer_state.get_certfp;
+    bool add = w->type == DB_WRITE_CERTFP_ADD, newer = true;
+    int result;
+
+    if (w->account_name && (result = db_find_account_id(w)) != SQLITE_ROW)
     {
-        return 0;
+        return result;
     }
-    if (!strcmp(param, "*")) // abort
+    sqlite3_bind_text(stmt, 1, w->key, -1, SQLITE_STATIC);
+    if ((result = sqlite3_step(stmt)) == SQLITE_ROW)
     {
-        if (GetSaslType(client))
+        time_t row_updated_at = (time_t)sqlite3_column_int64(stmt, 1);
+        if (!add && (long int)sqlite3_column_int64(stmt, 0) != w->account_id)
         {
-            DelSaslType(client);
-            return 0;
+            newer = false;
+        }
+        else if (!*w->source)
+        {
+            w->updated_at = MAX(w->updated_at, row_updated_at + 1);
+        }
+        else
+        {
+            newer = db_row_newer(w->updated_at, !add, w->account_name,
+                                 row_updated_at, sqlite3_column_int(stmt, 2), (const char *)sqlite3_column_text(stmt, 3));
         }
     }
-    else if (!strcmp(param,"PLAIN"))
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    if (result != SQLITE_ROW && result != SQLITE_DONE)
     {
-        SetSaslType(client, SASL_TYPE_PLAIN);
-        sendto_one(client, NULL, ":%s AUTHENTICATE +", me.name);
-        return 0;
+        return result;
     }
-    else if (!strcmp(param, "ANONYMOUS"))
+    if (!newer)
     {
-        strlcpy(client->user->account, "0", sizeof("0"));
-        user_account_login(NULL, client);
+        return SQLITE_DONE;
+    }
+    stmt = db_writer_state.set_certfp;
+    sqlite3_bind_text(stmt, 1, w->key, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, w->account_id);
+    sqlite3_bind_int64(stmt, 3, w->updated_at);
+    sqlite3_bind_int(stmt, 4, !add);
+    sqlite3_bind_int64(stmt, 5, (sqlite3_int64)(w->seq = ++db_writer_state.seq));
+    result = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    w->changed = result == SQLITE_DONE;
+    return result;
+}
 
-        if (IsDead(client)) // Can be dead at this point
-        {
-            return 0;
-        }
+/**
+ * db_peer_mark_apply - Stores how far a linked server has our changes (writer thread).
+ */
+static int db_peer_mark_apply(DbWrite *w)
+{
+    sqlite3_stmt *stmt = db_writer_state.set_peer_mark;
+    int result;
 
-        if (GetSaslType(client))
-        {
-            client->local->sasl_complete = 0;
-            sendnumeric(client, RPL_SASLSUCCESS);
-            DelSaslType(client);
-        }
+    sqlite3_bind_text(stmt, 1, w->key, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, (sqlite3_int64)w->seq);
+    result = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    return result;
+}
 
-        return 0;
+/**
+ * db_write_apply - Runs one queued write inside the current transaction (writer thread).
+ */
+static int db_write_apply(DbWrite *w)
+{
+    int result;
+
+    switch (w->type)
+    {
+        case DB_WRITE_ACCOUNT_INSERT:
+            result = write_account_to_db(w->acc);
+            w->seq = db_writer_state.seq;
+            return result;
+        case DB_WRITE_ACCOUNT_UPDATE:
+            return db_account_update_apply(w);
+        case DB_WRITE_IMPORT:
+            return db_import_chunk(w);
+        case DB_WRITE_EXPORT:
+            return db_export_chunk(w);
+        case DB_WRITE_METADATA_SET:
+            return db_metadata_apply(w);
+        case DB_WRITE_SESSION_REVOKE:
+            return db_session_revoke_apply(w);
+        case DB_WRITE_CERTFP_ADD:
+        case DB_WRITE_CERTFP_DEL:
+            return db_certfp_apply(w);
+        case DB_WRITE_PEER_MARK:
+            return db_peer_mark_apply(w);
     }
-    else if (!strcmp(param, "EXTERNAL"))
+    return SQLITE_MISUSE;
+}
+
+/**
+ * free_account_chain - Frees a list of Accounts chained on hnext.
+ */
+static void free_account_chain(Account *acc)
+{
+    for (Account *next; acc; acc = next)
     {
-        SetSaslType(client, SASL_TYPE_EXTERNAL);
+        next = acc->hnext;
+        free_account(acc);
     }
+}
 
-    if (!GetSaslType(client) || GetSaslType(client) == SASL_TYPE_NONE)
+/**
+ * db_write_batch - Applies a batch of writes in a single transaction (writer thread).
+ */
+static void db_write_batch(DbWrite *batch)
+{
+    DbWrite *w;
+    uint64_t start = monotonic_nsec();
+    int rc = sqlite3_exec(db_writer_state.conn, "BEGIN", NULL, NULL, NULL);
+
+    batch->batch_size = 0;
+    for (w = batch; w; w = w->next)
     {
-        return 0;
+        w->result = rc == SQLITE_OK ? db_write_apply(w) : rc;
+        batch->batch_size++;
     }
-    else if (GetSaslType(client) == SASL_TYPE_PLAIN)
+    if (rc == SQLITE_OK && sqlite3_exec(db_writer_state.conn, "COMMIT", NULL, NULL, NULL) != SQLITE_OK)
     {
-        char *auth, *username, *password;
-
-        if (!decode_authenticate_plain(param, &auth, &username, &password))
+        sqlite3_exec(db_writer_state.conn, "ROLLBACK", NULL, NULL, NULL);
+        for (w = batch; w; w = w->next)
         {
-            sendnumeric(client, ERR_SASLFAIL);
-            return 0;
+            w->result = SQLITE_ERROR;
         }
+    }
+    batch->commit_ns = monotonic_nsec() - start;
 
-        if (BadPtr(username) || BadPtr(password))
+    // Imported rows only count once their transaction made it
+    for (w = batch; w; w = w->next)
+    {
+        if (w->type != DB_WRITE_IMPORT)
         {
-            sendnumeric(client, ERR_SASLFAIL);
-            return 0;
+            continue;
         }
-
-        Account *account = find_account(username);
-        if (account && argon2_verify(account->password, password, strlen(password), Argon2_id) == ARGON2_OK)
+        for (Account *acc = w->chunk, *next; acc; acc = next)
         {
-            strlcpy(client->user->account, account->name, sizeof(client->user->account));
-            unreal_log(ULOG_INFO, "account", "LOGIN", client,
-                "User $client.details logged in [account: $account] [email: $email]",
-                log_data_string("email", account->email),
-                log_data_string("account", account->name)
-            );
-            user_account_login(NULL, client);
-            sendnumeric(client, RPL_SASLSUCCESS);
-            client->local->sasl_complete = 1;
-            DelSaslType(client);
+            next = acc->hnext;
+            if (w->result == SQLITE_DONE)
+            {
+                acc->hnext = w->imported;
+                w->imported = acc;
+            }
+            else
+            {
+                w->rows--;
+                free_account(acc);
+            }
         }
-        else
+        w->chunk = NULL;
+        if (w->result != SQLITE_DONE)
         {
-            client->local->sasl_sent_time = 0;
-            add_fake_lag(client, 7000);
-            sendnumeric(client, ERR_SASLFAIL);
+            w->more = false;
         }
-        free_account(account);
-        return 0;
     }
-    else if (GetSaslType(client) == SASL_TYPE_EXTERNAL)
+}
+
+/**
+ * db_writer - Writer thread main loop. Only exits once the queue is empty.
+ */
+static void *db_writer(void *arg)
+{
+    DbWrite *batch, *last;
+
+    pthread_mutex_lock(&db_writer_state.lock);
+    while (1)
     {
-        // TODO: Handle EXTERNAL authentication
-    }
+        while (!db_writer_state.queue_head && !db_writer_state.shutdown)
+        {
+            pthread_cond_wait(&db_writer_state.wakeup, &db_writer_state.lock);
+        }
+        if (!db_writer_state.queue_head)
+        {
+            break;
+        }
+        batch = last = db_writer_state.queue_head;
+        for (int n = 1; last->next && n < DB_WRITE_BATCH_SIZE; n++)
+        {
+            last = last->next;
+        }
+        db_writer_state.queue_head = last->next;
+        if (!db_writer_state.queue_head)
+        {
+            db_writer_state.queue_tail = NULL;
+        }
+        last->next = NULL;
+        pthread_mutex_unlock(&db_writer_state.lock);
 
-    return 0;
+        db_write_batch(batch);
+
+        pthread_mutex_lock(&db_writer_state.lock);
+        bool completed = false;
+        for (DbWrite *w = batch, *next; w; w = next)
+        {
+            next = w->next;
+            w->next = NULL;
+            // Unfinished imports and exports go to the back of the queue, unless we are stopping
+            DbWrite **head = w->more && !db_writer_state.shutdown ? &db_writer_state.queue_head : &db_writer_state.done_head;
+            DbWrite **tail = w->more && !db_writer_state.shutdown ? &db_writer_state.queue_tail : &db_writer_state.done_tail;
+            if (*tail)
+            {
+                (*tail)->next = w;
+            }
+            else
+            {
+                *head = w;
+            }
+            *tail = w;
+            completed |= head == &db_writer_state.done_head;
+        }
+        if (completed)
+        {
+            notify_wakeup_pipe(db_writer_state.pipefd);
+        }
+    }
+    pthread_mutex_unlock(&db_writer_state.lock);
+    return NULL;
 }
 
-const char *saslmechs(Client *client)
+/**
+ * db_write_free - Frees a DbWrite, and its Account if the done callback did not keep it.
+ */
+static void db_write_free(DbWrite *w)
 {
-    return "PLAIN,ANONYMOUS";
+    free_account(w->acc);
+    free_account_chain(w->chunk);
+    free_account_chain(w->imported);
+    if (w->file)
+    {
+        fclose(w->file);
+    }
+    free(w->path);
+    free(w->key);
+    free(w->value);
+    free(w->account_name);
+    free(w);
 }
 
-const char *sat_serialize(ModData *m)
+/**
+ * db_writer_complete - Runs the done callbacks of committed writes (main loop).
+ */
+static void db_writer_complete(int fd, int revents, void *data)
 {
-    static char buf[32];
-    if (m->i == 0)
+    DbWrite *w, *next;
+
+    drain_wakeup_pipe(fd);
+    pthread_mutex_lock(&db_writer_state.lock);
+    w = db_writer_state.done_head;
+    db_writer_state.done_head = db_writer_state.done_tail = NULL;
+    pthread_mutex_unlock(&db_writer_state.lock);
+
+    for (; w; w = next)
     {
-        return NULL; /* not set */
+        next = w->next;
+        if (w->batch_size)
+        {
+            histogram_add(&account_stats.db_commit_ns, w->commit_ns);
+            histogram_add(&account_stats.db_batch_size, w->batch_size);
+        }
+        if (w->result != SQLITE_DONE)
+        {
+            account_stats.db_write_errors++;
+        }
+        if (w->type == DB_WRITE_IMPORT)
+        {
+            db_writer_state.imports--;
+        }
+        if (w->done)
+        {
+            w->done(w);
+        }
+        // Only after done(), which may be what passes the change on to the other servers
+        db_writer_state.completed++;
+        if (w->type != DB_WRITE_PEER_MARK && w->seq > db_writer_state.completed_seq)
+        {
+            db_writer_state.completed_seq = w->seq;
+        }
+        db_write_free(w);
     }
-    snprintf(buf, sizeof(buf), "%d", m->i);
-    return buf;
 }
 
-void sat_free(ModData *m)
+/**
+ * db_write_queue - Hands a write to the writer thread (main loop).
+ */
+static void db_write_queue(DbWrite *w)
 {
-    m->i = 0;
+    pthread_mutex_lock(&db_writer_state.lock);
+    if (db_writer_state.queue_tail)
+    {
+        db_writer_state.queue_tail->next = w;
+    }
+    else
+    {
+        db_writer_state.queue_head = w;
+    }
+    db_writer_state.queue_tail = w;
+    pthread_cond_signal(&db_writer_state.wakeup);
+    pthread_mutex_unlock(&db_writer_state.lock);
+    db_writer_state.queued++;
+    if (w->type == DB_WRITE_IMPORT)
+    {
+        db_writer_state.imports++;
+    }
 }
 
-void sat_unserialize(const char *str, ModData *m)
+/**
+ * db_write_account - Queues an Account insert. The write owns the Account until
+ * done() runs on the main loop, which may keep it by setting w->acc to NULL.
+ * Returns 1 if queued, 0 if the writer is not running (the Account is freed).
+ */
+int db_write_account(Client *client, Account *acc, void (*done)(DbWrite *w))
 {
-    m->i = atoi(str);
-}
+    DbWrite *w;
 
+    if (!db_writer_state.running)
+    {
+        free_account(acc);
+        return 0;
+    }
+    w = safe_alloc(sizeof(DbWrite));
+    w->type = DB_WRITE_ACCOUNT_INSERT;
+    w->acc = acc;
+    w->done = done;
+    if (client)
+    {
+        strlcpy(w->client_id, client->id, sizeof(w->client_id));
+    }
+    db_write_queue(w);
+    return 1;
+}
 
 /**
- * account2json - Converts an Account struct to a JSON object.
- * Returns a new json_t* object.
+ * db_write_transfer - Queues an import (DB_WRITE_IMPORT) or export (DB_WRITE_EXPORT) of
+ * path, done() runs on the main loop once the whole file has been handled or it failed.
+ * Returns 1 if queued, 0 if the writer is not running.
  */
-json_t* account2json(const Account *acc) {
-    json_t *j = json_object();
-    json_object_set_new(j, "id", acc->id ? json_integer(acc->id) : 0);
-    json_object_set_new(j, "name", json_string(acc->name));
-    json_object_set_new(j, "email", json_string(acc->email));
-    json_object_set_new(j, "password", json_string(acc->password));
-    json_object_set_new(j, "time_registered", json_integer(acc->time_registered));
-    json_object_set_new(j, "verified", json_integer(acc->verified));
+int db_write_transfer(Client *client, DbWriteType type, const char *path, void (*done)(DbWrite *w))
+{
+    DbWrite *w;
 
-    // Channels array
-    json_t *jchannels = json_array();
-    if (acc->channels) {
-        for (char **c = acc->channels; *c; ++c)
-            json_array_append_new(jchannels, json_string(*c));
+    if (!db_writer_state.running)
+    {
+        return 0;
     }
-    json_object_set_new(j, "channels", jchannels);
-
-    // Metadata array
-    json_t *jmeta = json_array();
-    for (Metadata *m = acc->metadata_head; m; m = m->next)
+    w = safe_alloc(sizeof(DbWrite));
+    w->type = type;
+    w->path = strdup(path);
+    w->done = done;
+    if (client)
     {
-        json_t *mj = json_object();
-        json_object_set_new(mj, "key", json_string(m->key));
-        json_object_set_new(mj, "value", json_string(m->value));
-        json_array_append_new(jmeta, mj);
+        strlcpy(w->client_id, client->id, sizeof(w->client_id));
     }
-    json_object_set_new(j, "metadata", jmeta);
-    
-    json_t *jmembers = json_object();
-    for (AccountMember *m = acc->members; m; m = m->next)
-        json_expand_client(jmembers, m->client->id, m->client, 2);
-    
-    json_object_set_new(j, "online_clients", jmembers);
-    
-    return j;
+    db_write_queue(w);
+    return 1;
 }
 
-RPC_CALL_FUNC(rpc_list_accounts)
+/**
+ * db_write_account_update - Queues storing the email, password, verified, time_registered and
+ * updated_at of an account. With reset, its metadata and certfps are dropped first.
+ * Returns 1 if queued, 0 if the writer is not running.
+ */
+int db_write_account_update(const Account *acc, bool reset)
 {
-    if (!db)
+    DbWrite *w;
+
+    if (!db_writer_state.running)
     {
-        rpc_error(client, request, JSON_RPC_ERROR_INTERNAL_ERROR, "Database is not available.");
+        return 0;
+    }
+    w = safe_alloc(sizeof(DbWrite));
+    w->type = DB_WRITE_ACCOUNT_UPDATE;
+    w->acc = safe_alloc(sizeof(Account));
+    w->acc->name = strdup(acc->name);
+    w->acc->email = strdup(acc->email ? acc->email : "");
+    w->acc->password = strdup(acc->password ? acc->password : "");
+    w->acc->verified = acc->verified;
+    w->acc->time_registered = acc->time_registered;
+    w->acc->updated_at = acc->updated_at;
+    w->reset = reset;
+    db_write_queue(w);
+    return 1;
+}
+
+/**
+ * db_write_metadata - Queues setting (or deleting, if value is NULL) a metadata key of an account.
+ * The in-memory copy is updated by account_metadata_set(), obsacc_row_written() tells the other servers.
+ * Returns 1 if queued, 0 if the writer is not running.
+ */
+int db_write_metadata(const Account *acc, const char *key, const char *value)
+{
+    DbWrite *w;
+
+    if (!db_writer_state.running)
+    {
+        return 0;
+    }
+    w = safe_alloc(sizeof(DbWrite));
+    w->type = DB_WRITE_METADATA_SET;
+    w->account_id = acc->id;
+    w->key = strdup(key);
+    w->value = value ? strdup(value) : NULL;
+    w->updated_at = TStime();
+    w->done = obsacc_row_written;
+    db_write_queue(w);
+    return 1;
+}
+
+/**
+ * db_write_session_revoke - Queues storing a revoked session token, nobody waits for it.
+ * Returns 1 if queued, 0 if the writer is not running.
+ */
+int db_write_session_revoke(uint64_t token_id, long int account_id, time_t expires)
+{
+    DbWrite *w;
+
+    if (!db_writer_state.running)
+    {
+        return 0;
+    }
+    w = safe_alloc(sizeof(DbWrite));
+    w->type = DB_WRITE_SESSION_REVOKE;
+    w->token_id = token_id;
+    w->account_id = account_id;
+    w->expires = expires;
+    db_write_queue(w);
+    return 1;
+}
+
+/**
+ * db_write_certfp - Queues adding (or removing) a certificate fingerprint of an account.
+ * The in-memory index is updated by certfp_add() and certfp_del(), obsacc_row_written() tells the other servers.
+ * Returns 1 if queued, 0 if the writer is not running.
+ */
+int db_write_certfp(const char *certfp, long int account_id, bool add)
+{
+    DbWrite *w;
+
+    if (!db_writer_state.running)
+    {
+        return 0;
+    }
+    w = safe_alloc(sizeof(DbWrite));
+    w->type = add ? DB_WRITE_CERTFP_ADD : DB_WRITE_CERTFP_DEL;
+    w->key = strdup(certfp);
+    w->account_id = account_id;
+    w->updated_at = TStime();
+    w->done = obsacc_row_written;
+    db_write_queue(w);
+    return 1;
+}
+
+/**
+ * db_write_by_name - Queues a DB_WRITE_METADATA_SET, DB_WRITE_CERTFP_ADD or DB_WRITE_CERTFP_DEL
+ * from another server, for the registration of name at time_registered, which doesn't have to
+ * be indexed yet. Only applied if newer than the row, obsacc_row_written() then updates the cache.
+ * Returns 1 if queued, 0 if the writer is not running.
+ */
+int db_write_by_name(DbWriteType type, const char *name, time_t time_registered, const char *key, const char *value, time_t updated_at, Client *source)
+{
+    DbWrite *w;
+
+    if (!db_writer_state.running)
+    {
+        return 0;
+    }
+    w = safe_alloc(sizeof(DbWrite));
+    w->type = type;
+    w->account_name = strdup(name);
+    w->time_registered = time_registered;
+    w->key = strdup(key);
+    w->value = value ? strdup(value) : NULL;
+    w->updated_at = updated_at;
+    strlcpy(w->source, source->id, sizeof(w->source));
+    w->done = obsacc_row_written;
+    db_write_queue(w);
+    return 1;
+}
+
+/**
+ * db_write_peer_mark - Queues storing seq as how far the linked server named server has our changes.
+ * Returns 1 if queued, 0 if the writer is not running.
+ */
+int db_write_peer_mark(const char *server, uint64_t seq)
+{
+    DbWrite *w;
+
+    if (!db_writer_state.running)
+    {
+        return 0;
+    }
+    w = safe_alloc(sizeof(DbWrite));
+    w->type = DB_WRITE_PEER_MARK;
+    w->key = strdup(server);
+    w->seq = seq;
+    db_write_queue(w);
+    return 1;
+}
+
+/**
+ * db_writer_seq - Reads the highest change number in the synced tables (called by db_writer_start()).
+ */
+static int db_writer_seq(void)
+{
+    sqlite3_stmt *stmt;
+    int result;
+
+    if (sqlite3_prepare_v2(db_writer_state.conn, "SELECT MAX((SELECT IFNULL(MAX(seq), 0) FROM accounts), "
+                           "(SELECT IFNULL(MAX(seq), 0) FROM account_metadata), (SELECT IFNULL(MAX(seq), 0) FROM account_certfp))",
+                           -1, &stmt, NULL) != SQLITE_OK)
+    {
+        return 0;
+    }
+    if ((result = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+        db_writer_state.seq = db_writer_state.completed_seq = (uint64_t)sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+    return result == SQLITE_ROW;
+}
+
+/**
+ * db_writer_purge - Drops the tombstones older than OBSACC_TOMBSTONE_LIFETIME (called by db_writer_start()).
+ * The newest row of each table stays, so the next start still finds the highest seq given out.
+ */
+static int db_writer_purge(void)
+{
+    char sql[512];
+
+    snprintf(sql, sizeof(sql),
+             "DELETE FROM account_metadata WHERE deleted = 1 AND updated_at < %lld AND seq < (SELECT MAX(seq) FROM account_metadata);"
+             "DELETE FROM account_certfp WHERE deleted = 1 AND updated_at < %lld AND seq < (SELECT MAX(seq) FROM account_certfp)",
+             (long long)(time(NULL) - OBSACC_TOMBSTONE_LIFETIME), (long long)(time(NULL) - OBSACC_TOMBSTONE_LIFETIME));
+    return sqlite3_exec(db_writer_state.conn, sql, NULL, NULL, NULL) == SQLITE_OK;
+}
+
+/**
+ * db_writer_start - Opens the writer connection and starts its thread (called in MOD_LOAD).
+ * Returns 1 on success, 0 on failure.
+ */
+int db_writer_start(const char *filename)
+{
+    if (sqlite3_open(filename, &db_writer_state.conn) != SQLITE_OK
+        || sqlite3_exec(db_writer_state.conn, "PRAGMA synchronous = NORMAL", NULL, NULL, NULL) != SQLITE_OK
+        || sqlite3_busy_timeout(db_writer_state.conn, 5000) != SQLITE_OK
+        || sqlite3_prepare_v3(db_writer_state.conn, "INSERT INTO accounts (name, email, password, time_registered, verified, updated_at, seq) SELECT ?1, ?2, ?3, ?4, ?5, ?6, ?7 "
+                              "WHERE NOT EXISTS (SELECT 1 FROM accounts WHERE name = ?1 COLLATE NOCASE)",
+                              -1, SQLITE_PREPARE_PERSISTENT, &db_writer_state.insert_account, NULL) != SQLITE_OK
+        || sqlite3_prepare_v3(db_writer_state.conn, "SELECT id, name, email, password, time_registered, verified FROM accounts WHERE id > ? ORDER BY id LIMIT ?",
+                              -1, SQLITE_PREPARE_PERSISTENT, &db_writer_state.export_accounts, NULL) != SQLITE_OK
+        || sqlite3_prepare_v3(db_writer_state.conn, "SELECT value, updated_at, deleted FROM account_metadata WHERE account_id = ? AND key = ?",
+                              -1, SQLITE_PREPARE_PERSISTENT, &db_writer_state.get_metadata, NULL) != SQLITE_OK
+        || sqlite3_prepare_v3(db_writer_state.conn, "INSERT OR REPLACE INTO account_metadata (account_id, key, value, updated_at, deleted, seq) VALUES (?, ?, ?, ?, ?, ?)",
+                              -1, SQLITE_PREPARE_PERSISTENT, &db_writer_state.set_metadata, NULL) != SQLITE_OK
+        || sqlite3_prepare_v3(db_writer_state.conn, "INSERT OR IGNORE INTO session_revocations (token_id, expires, account_id) VALUES (?, ?, ?)",
+                              -1, SQLITE_PREPARE_PERSISTENT, &db_writer_state.revoke_session, NULL) != SQLITE_OK
+        || sqlite3_prepare_v3(db_writer_state.conn, "SELECT c.account_id, c.updated_at, c.deleted, IFNULL(a.name, '') FROM account_certfp c "
+                              "LEFT JOIN accounts a ON a.id = c.account_id WHERE c.certfp = ?",
+                              -1, SQLITE_PREPARE_PERSISTENT, &db_writer_state.get_certfp, NULL) != SQLITE_OK
+        || sqlite3_prepare_v3(db_writer_state.conn, "INSERT OR REPLACE INTO account_certfp (certfp, account_id, updated_at, deleted, seq) VALUES (?, ?, ?, ?, ?)",
+                              -1, SQLITE_PREPARE_PERSISTENT, &db_writer_state.set_certfp, NULL) != SQLITE_OK
+        || sqlite3_prepare_v3(db_writer_state.conn, "UPDATE accounts SET email = ?, password = ?, verified = ?, updated_at = ?, seq = ?, time_registered = ? WHERE name = ? COLLATE NOCASE",
+                              -1, SQLITE_PREPARE_PERSISTENT, &db_writer_state.update_account, NULL) != SQLITE_OK
+        || sqlite3_prepare_v3(db_writer_state.conn, "SELECT id FROM accounts WHERE name = ? COLLATE NOCASE AND time_registered = ?",
+                              -1, SQLITE_PREPARE_PERSISTENT, &db_writer_state.find_account, NULL) != SQLITE_OK
+        || sqlite3_prepare_v3(db_writer_state.conn, "DELETE FROM account_metadata WHERE account_id = (SELECT id FROM accounts WHERE name = ? COLLATE NOCASE)",
+                              -1, SQLITE_PREPARE_PERSISTENT, &db_writer_state.reset_metadata, NULL) != SQLITE_OK
+        || sqlite3_prepare_v3(db_writer_state.conn, "DELETE FROM account_certfp WHERE account_id = (SELECT id FROM accounts WHERE name = ? COLLATE NOCASE)",
+                              -1, SQLITE_PREPARE_PERSISTENT, &db_writer_state.reset_certfps, NULL) != SQLITE_OK
+        || sqlite3_prepare_v3(db_writer_state.conn, "INSERT OR REPLACE INTO obsacc_peers (server, seq) VALUES (?, ?)",
+                              -1, SQLITE_PREPARE_PERSISTENT, &db_writer_state.set_peer_mark, NULL) != SQLITE_OK
+        || !db_writer_seq()
+        || !db_writer_purge()
+        || !open_wakeup_pipe(db_writer_state.pipefd, "obsidianirc db writer", db_writer_complete))
+    {
+        sqlite3_finalize(db_writer_state.insert_account);
+        sqlite3_finalize(db_writer_state.export_accounts);
+        sqlite3_finalize(db_writer_state.get_metadata);
+        sqlite3_finalize(db_writer_state.set_metadata);
+        sqlite3_finalize(db_writer_state.revoke_session);
+        sqlite3_finalize(db_writer_state.get_certfp);
+        sqlite3_finalize(db_writer_state.set_certfp);
+        sqlite3_finalize(db_writer_state.update_account);
+        sqlite3_finalize(db_writer_state.find_account);
+        sqlite3_finalize(db_writer_state.reset_metadata);
+        sqlite3_finalize(db_writer_state.reset_certfps);
+        sqlite3_finalize(db_writer_state.set_peer_mark);
+        sqlite3_close(db_writer_state.conn);
+        db_writer_state.insert_account = NULL;
+        db_writer_state.export_accounts = NULL;
+        db_writer_state.get_metadata = NULL;
+        db_writer_state.set_metadata = NULL;
+        db_writer_state.revoke_session = NULL;
+        db_writer_state.get_certfp = NULL;
+        db_writer_state.set_certfp = NULL;
+        db_writer_state.update_account = NULL;
+        db_writer_state.find_account = NULL;
+        db_writer_state.reset_metadata = NULL;
+        db_writer_state.reset_certfps = NULL;
+        db_writer_state.set_peer_mark = NULL;
+        db_writer_state.conn = NULL;
+        return 0;
+    }
+    pthread_mutex_init(&db_writer_state.lock, NULL);
+    pthread_cond_init(&db_writer_state.wakeup, NULL);
+    db_writer_state.shutdown = false;
+    db_writer_state.running = !pthread_create(&db_writer_state.thread, NULL, db_writer, NULL);
+    return db_writer_state.running;
+}
+
+/**
+ * db_writer_stop - Commits whatever is still queued and stops the writer (called in MOD_UNLOAD).
+ * Done callbacks no longer run, clients waiting on a write are not answered.
+ */
+void db_writer_stop(void)
+{
+    DbWrite *w, *next;
+
+    if (db_writer_state.running)
+    {
+        pthread_mutex_lock(&db_writer_state.lock);
+        db_writer_state.shutdown = true;
+        pthread_cond_signal(&db_writer_state.wakeup);
+        pthread_mutex_unlock(&db_writer_state.lock);
+        pthread_join(db_writer_state.thread, NULL);
+        db_writer_state.running = false;
+
+        for (w = db_writer_state.done_head; w; w = next)
+        {
+            next = w->next;
+            db_write_free(w);
+        }
+        db_writer_state.done_head = db_writer_state.done_tail = NULL;
+        pthread_cond_destroy(&db_writer_state.wakeup);
+        pthread_mutex_destroy(&db_writer_state.lock);
+    }
+    close_wakeup_pipe(db_writer_state.pipefd);
+    sqlite3_finalize(db_writer_state.insert_account);
+    sqlite3_finalize(db_writer_state.export_accounts);
+    sqlite3_finalize(db_writer_state.get_metadata);
+    sqlite3_finalize(db_writer_state.set_metadata);
+    sqlite3_finalize(db_writer_state.revoke_session);
+    sqlite3_finalize(db_writer_state.get_certfp);
+    sqlite3_finalize(db_writer_state.set_certfp);
+    sqlite3_finalize(db_writer_state.update_account);
+    sqlite3_finalize(db_writer_state.find_account);
+    sqlite3_finalize(db_writer_state.reset_metadata);
+    sqlite3_finalize(db_writer_state.reset_certfps);
+    sqlite3_finalize(db_writer_state.set_peer_mark);
+    sqlite3_close(db_writer_state.conn);
+    db_writer_state.insert_account = NULL;
+    db_writer_state.export_accounts = NULL;
+    db_writer_state.get_metadata = NULL;
+    db_writer_state.set_metadata = NULL;
+    db_writer_state.revoke_session = NULL;
+    db_writer_state.get_certfp = NULL;
+    db_writer_state.set_certfp = NULL;
+    db_writer_state.update_account = NULL;
+    db_writer_state.find_account = NULL;
+    db_writer_state.reset_metadata = NULL;
+    db_writer_state.reset_certfps = NULL;
+    db_writer_state.set_peer_mark = NULL;
+    db_writer_state.conn = NULL;
+}
+
+/**
+ * account_from_row - Builds an Account from the current row of a
+ * "SELECT * FROM accounts" statement.
+ */
+static Account *account_from_row(sqlite3_stmt *stmt)
+{
+    Account *acc = safe_alloc(sizeof(Account));
+    acc->id = (long int)sqlite3_column_int64(stmt, 0);
+    acc->name = strdup((const char *)sqlite3_column_text(stmt, 1));
+    acc->email = strdup((const char *)sqlite3_column_text(stmt, 2));
+    acc->password = strdup((const char *)sqlite3_column_text(stmt, 3));
+    acc->time_registered = (time_t)sqlite3_column_int64(stmt, 4);
+    acc->verified = sqlite3_column_int(stmt, 5);
+    acc->updated_at = (time_t)sqlite3_column_int64(stmt, 6);
+    acc->channels = NULL;
+    acc->metadata = NULL;
+    acc->members = NULL;
+    return acc;
+}
+
+/* Spare session nodes, so connect and login storms don't malloc and free
+ * one per client. Linked on next, at most ACCOUNT_MEMBER_POOL_SIZE of them.
+ */
+static struct {
+    AccountMember *free;
+    int count;
+    bool closed; // Freed in MOD_UNLOAD, the ModData frees that come after it bypass the pool
+} member_pool;
+
+/**
+ * account_member_get - Takes a zeroed AccountMember from the pool, or allocates one.
+ */
+static AccountMember *account_member_get(void)
+{
+    AccountMember *member = member_pool.free;
+
+    if (!member)
+    {
+        return safe_alloc(sizeof(AccountMember));
+    }
+    member_pool.free = member->next;
+    member_pool.count--;
+    memset(member, 0, sizeof(AccountMember));
+    return member;
+}
+
+/**
+ * account_member_put - Gives an AccountMember back to the pool, or frees it if the pool is full.
+ */
+static void account_member_put(AccountMember *member)
+{
+    if (member_pool.closed || member_pool.count >= ACCOUNT_MEMBER_POOL_SIZE)
+    {
+        free(member);
+        return;
+    }
+    member->next = member_pool.free;
+    member_pool.free = member;
+    member_pool.count++;
+}
+
+/**
+ * free_account_member_pool - Frees the spare session nodes (called in MOD_UNLOAD).
+ */
+void free_account_member_pool(void)
+{
+    for (AccountMember *member = member_pool.free, *next; member; member = next)
+    {
+        next = member->next;
+        free(member);
+    }
+    member_pool.free = NULL;
+    member_pool.count = 0;
+    member_pool.closed = true;
+}
+
+/**
+ * account_session_unlink - Removes a session from the member list of its account.
+ */
+static void account_session_unlink(AccountMember *session)
+{
+    if (!session->account)
+    {
+        return;
+    }
+    if (session->prev)
+    {
+        session->prev->next = session->next;
+    }
+    else
+    {
+        session->account->members = session->next;
+    }
+    if (session->next)
+    {
+        session->next->prev = session->prev;
+    }
+    session->account = NULL;
+    session->prev = session->next = NULL;
+}
+
+/**
+ * account_session_login - Hook for HOOKTYPE_ACCOUNT_LOGIN, also used for logouts.
+ * Moves the client to the session list of the account it is now logged into.
+ */
+int account_session_login(Client *client, MessageTag *mtags)
+{
+    AccountMember *session;
+    Account *acc;
+
+    if (!client->user)
+    {
+        return 0;
+    }
+    session = moddata_client(client, account_session_md).ptr;
+    acc = IsLoggedIn(client) ? find_cached_account(client->user->account) : NULL;
+    if (session && session->account == acc)
+    {
+        return 0;
+    }
+    if (session)
+    {
+        account_session_unlink(session);
+    }
+    if (!acc)
+    {
+        return 0;
+    }
+    if (!session)
+    {
+        session = account_member_get();
+        session->client = client;
+        moddata_client(client, account_session_md).ptr = session;
+    }
+    session->account = acc;
+    session->prev = NULL;
+    session->next = acc->members;
+    if (acc->members)
+    {
+        acc->members->prev = session;
+    }
+    acc->members = session;
+    return 0;
+}
+
+/**
+ * account_session_free - ModData free for account_session_md, called when the client goes away.
+ */
+void account_session_free(ModData *m)
+{
+    AccountMember *session = m->ptr;
+    if (session)
+    {
+        account_session_unlink(session);
+        account_member_put(session);
+        m->ptr = NULL;
+    }
+}
+
+/**
+ * nick_wheel_unlink - Takes a timer out of its wheel slot, if it is in one.
+ */
+static void nick_wheel_unlink(NickEnforceTimer *timer)
+{
+    if (!timer->linked)
+    {
+        return;
+    }
+    if (timer->prev)
+    {
+        timer->prev->next = timer->next;
+    }
+    else
+    {
+        nick_wheel.slots[timer->deadline % NICK_ENFORCE_WHEEL_SLOTS] = timer->next;
+    }
+    if (timer->next)
+    {
+        timer->next->prev = timer->prev;
+    }
+    timer->prev = timer->next = NULL;
+    timer->linked = false;
+    nick_wheel.pending--;
+}
+
+/**
+ * nick_wheel_schedule - (Re)starts the rename countdown of a client.
+ */
+static void nick_wheel_schedule(Client *client, time_t deadline)
+{
+    NickEnforceTimer *timer = moddata_client(client, nick_enforce_md).ptr;
+    NickEnforceTimer **slot;
+
+    if (!timer)
+    {
+        timer = safe_alloc(sizeof(NickEnforceTimer));
+        timer->client = client;
+        moddata_client(client, nick_enforce_md).ptr = timer;
+    }
+    nick_wheel_unlink(timer);
+    timer->deadline = deadline;
+    slot = &nick_wheel.slots[deadline % NICK_ENFORCE_WHEEL_SLOTS];
+    timer->next = *slot;
+    if (*slot)
+    {
+        (*slot)->prev = timer;
+    }
+    *slot = timer;
+    timer->linked = true;
+    nick_wheel.pending++;
+}
+
+/**
+ * nick_wheel_cancel - Stops the rename countdown of a client, if it has one.
+ */
+static void nick_wheel_cancel(Client *client)
+{
+    NickEnforceTimer *timer = moddata_client(client, nick_enforce_md).ptr;
+    if (timer)
+    {
+        nick_wheel_unlink(timer);
+    }
+}
+
+/**
+ * nick_enforce_account - Returns the account whose name the client is using without
+ * being logged into it, or NULL if its nick is fine.
+ */
+static Account *nick_enforce_account(Client *client)
+{
+    Account *acc;
+
+    if (!MyUser(client) || IsULine(client))
+    {
+        return NULL;
+    }
+    acc = find_cached_account(client->name);
+    if (!acc || (IsLoggedIn(client) && !strcasecmp(client->user->account, acc->name)))
+    {
+        return NULL;
+    }
+    return acc;
+}
+
+/**
+ * nick_enforce_check - Starts or stops the rename countdown after the nick or login of a client changed.
+ */
+int nick_enforce_check(Client *client)
+{
+    NickEnforceTimer *timer;
+    Account *acc;
+
+    if (!MyConf.nick_enforce_delay || !(acc = nick_enforce_account(client)))
+    {
+        nick_wheel_cancel(client);
+        return 0;
+    }
+    timer = moddata_client(client, nick_enforce_md).ptr;
+    if (timer && timer->linked)
+    {
+        return 0; // Still counting down from the last change
+    }
+    nick_wheel_schedule(client, TStime() + MyConf.nick_enforce_delay);
+    account_stats.nick_enforce_warned++;
+    sendnotice(client, "The nick %s belongs to a registered account. Log in to it with SASL or /%s within %d seconds, or your nick will be changed.",
+        client->name, CMD_IDENTIFY, MyConf.nick_enforce_delay);
+    return 0;
+}
+
+/**
+ * nick_enforce_connect - Hook for HOOKTYPE_LOCAL_CONNECT.
+ */
+int nick_enforce_connect(Client *client)
+{
+    return nick_enforce_check(client);
+}
+
+/**
+ * nick_enforce_nickchange - Hook for HOOKTYPE_POST_LOCAL_NICKCHANGE.
+ */
+int nick_enforce_nickchange(Client *client, MessageTag *mtags, const char *oldnick)
+{
+    nick_wheel_cancel(client); // The countdown was for the old nick
+    return nick_enforce_check(client);
+}
+
+/**
+ * nick_enforce_login - Hook for HOOKTYPE_ACCOUNT_LOGIN, a successful SASL or IDENTIFY cancels the rename.
+ */
+int nick_enforce_login(Client *client, MessageTag *mtags)
+{
+    return nick_enforce_check(client);
+}
+
+/**
+ * nick_enforce_free - ModData free for nick_enforce_md, called when the client goes away.
+ */
+void nick_enforce_free(ModData *m)
+{
+    NickEnforceTimer *timer = m->ptr;
+    if (timer)
+    {
+        nick_wheel_unlink(timer);
+        free(timer);
+        m->ptr = NULL;
+    }
+}
+
+/**
+ * guest_nick - Picks a free guest nick for a client.
+ * The $d digits come from a sequence rather than rand(), so collisions only happen
+ * when the sequence wraps onto nicks still in use, and a few tries get past those.
+ * Returns 0 if even the UID based fallback is taken.
+ */
+static int guest_nick(Client *client, char *buf, size_t buflen)
+{
+    for (int i = 0; i < NICK_ENFORCE_GUEST_TRIES; i++)
+    {
+        convert_guest_nick_format(MyConf.guest_nick_format, client, nick_wheel.guest_seq++, buf, buflen);
+        if (do_nick_name(buf) && !find_client(buf, NULL) && !find_cached_account(buf))
+        {
+            return 1;
+        }
+    }
+    // UIDs are unique on the network, nobody has this one unless they picked it on purpose
+    snprintf(buf, buflen, "Guest%s", client->id);
+    return do_nick_name(buf) && !find_client(buf, NULL) && !find_cached_account(buf);
+}
+
+/**
+ * nick_enforce_rename - Changes the nick of a client whose countdown ran out.
+ */
+static void nick_enforce_rename(Client *client)
+{
+    char newnick[NICKLEN + 1];
+    char ts[32];
+    const char *parv[5];
+
+    if (!MyConf.nick_enforce_delay || !nick_enforce_account(client))
+    {
+        return; // Logged in, changed nick or enforcement was turned off by a rehash
+    }
+    if (!guest_nick(client, newnick, sizeof(newnick)))
+    {
+        // Try again next round rather than leaving them on the nick
+        nick_wheel_schedule(client, TStime() + MyConf.nick_enforce_delay);
+        return;
+    }
+    sendnotice(client, "You did not log in to the account %s in time, your nick is being changed to %s.", client->name, newnick);
+    unreal_log(ULOG_INFO, "obsidianirc", "NICK_ENFORCE", client, "Changing nick of $client.details to $newnick, it belongs to a registered account",
+        log_data_string("newnick", newnick));
+    account_stats.nick_enforce_renamed++;
+    snprintf(ts, sizeof(ts), "%lld", (long long)TStime());
+    parv[0] = NULL;
+    parv[1] = client->name;
+    parv[2] = newnick;
+    parv[3] = ts;
+    parv[4] = NULL;
+    do_cmd(&me, NULL, "SVSNICK", 4, parv);
+}
+
+/**
+ * nick_enforce - Event, once a second. Renames the clients in the wheel slots
+ * of the seconds since the last run whose deadline has passed.
+ */
+EVENT(nick_enforce)
+{
+    time_t now = TStime();
+    time_t t;
+
+    if (!nick_wheel.last_tick || now - nick_wheel.last_tick > NICK_ENFORCE_WHEEL_SLOTS)
+    {
+        // First run, or the clock jumped: one pass over every slot does it
+        nick_wheel.last_tick = now - NICK_ENFORCE_WHEEL_SLOTS;
+    }
+    for (t = nick_wheel.last_tick + 1; t <= now && nick_wheel.pending; t++)
+    {
+        NickEnforceTimer *timer = nick_wheel.slots[t % NICK_ENFORCE_WHEEL_SLOTS];
+        while (timer)
+        {
+            NickEnforceTimer *next = timer->next;
+            // Deadlines more than a full turn away share the slot, they stay for a later round
+            if (timer->deadline <= now)
+            {
+                nick_wheel_unlink(timer);
+                nick_enforce_rename(timer->client);
+            }
+            timer = next;
+        }
+    }
+    nick_wheel.last_tick = now;
+}
+
+Account *find_account_by_client(Client *client)
+{
+    if (!db || !client || !client->name)
+    {
+        return NULL;
+    }
+
+    return find_account(client->user->account);
+}
+
+/**
+ * find_account - Looks up an account by name (case-insensitive), or NULL if there is no such account.
+ * The Account is borrowed from the account index, do not free it or keep it past the current event.
+ */
+Account *find_account(const char *name)
+{
+    if (!name)
+    {
+        return NULL;
+    }
+    return find_cached_account(name);
+}
+
+/**
+ * dup_account - Copies the stored fields of an Account, without its online members.
+ * Only for code that must hold on to an account outside the main loop, lookups borrow.
+ */
+Account *dup_account(const Account *acc)
+{
+    Account *copy = safe_alloc(sizeof(Account));
+    copy->id = acc->id;
+    copy->name = strdup(acc->name);
+    copy->email = strdup(acc->email);
+    copy->password = strdup(acc->password);
+    copy->time_registered = acc->time_registered;
+    copy->verified = acc->verified;
+    copy->channels = NULL;
+    copy->metadata = NULL;
+    if (acc->metadata)
+    {
+        copy->metadata = safe_alloc(sizeof(AccountMetadata) + acc->metadata->size);
+        memcpy(copy->metadata, acc->metadata, sizeof(AccountMetadata) + acc->metadata->used);
+    }
+    copy->members = NULL;
+    return copy;
+}
+
+/**
+ * find_cached_account - Looks up an account in the in-memory index (case-insensitive).
+ * The returned Account belongs to the index, do not free it.
+ */
+Account *find_cached_account(const char *name)
+{
+    Account *acc;
+    uint64_t hashv, start;
+
+    if (!account_hash)
+    {
+        return NULL;
+    }
+    start = monotonic_nsec();
+    // Misses are what brute-forcing bots mostly cause, compare full hashes before names
+    hashv = siphash_nocase(name, account_hashkey);
+    for (acc = account_hash[hashv & (account_hash_size - 1)]; acc; acc = acc->hnext)
+    {
+        if (acc->namehash == hashv && !strcasecmp(acc->name, name))
+        {
+            break;
+        }
+    }
+    // The duplicate checks of load_account_cache() are not lookups anyone waits for
+    if (!loading_accounts)
+    {
+        histogram_add(&account_stats.lookup_ns, monotonic_nsec() - start);
+        if (acc)
+        {
+            account_stats.lookup_hits++;
+        }
+        else
+        {
+            account_stats.lookup_misses++;
+        }
+    }
+    return acc;
+}
+
+/**
+ * account_email_domain - Returns the part of an account's email after the '@', or "".
+ */
+static const char *account_email_domain(const Account *acc)
+{
+    const char *at = acc->email ? strrchr(acc->email, '@') : NULL;
+    return at ? at + 1 : "";
+}
+
+/* AccountIndex comparators, qsort() style on Account ** */
+static int account_compare_id(const void *a, const void *b)
+{
+    long int x = (*(Account * const *)a)->id, y = (*(Account * const *)b)->id;
+    return x < y ? -1 : x > y;
+}
+
+static int account_compare_name(const void *a, const void *b)
+{
+    return strcasecmp((*(Account * const *)a)->name, (*(Account * const *)b)->name);
+}
+
+static int account_compare_domain(const void *a, const void *b)
+{
+    const Account *x = *(Account * const *)a, *y = *(Account * const *)b;
+    int r = strcasecmp(account_email_domain(x), account_email_domain(y));
+    return r ? r : strcasecmp(x->name, y->name);
+}
+
+/**
+ * account_index_add - Adds an Account to a sorted index, or just appends it
+ * while loading_accounts is set and account_index_sort() follows.
+ */
+static void account_index_add(AccountIndex *idx, Account *acc)
+{
+    int lo = 0, hi = idx->count;
+
+    if (idx->count == idx->size)
+    {
+        idx->size = idx->size ? idx->size * 2 : 1024;
+        idx->items = realloc(idx->items, sizeof(Account *) * idx->size);
+        if (!idx->items)
+        {
+            outofmemory(sizeof(Account *) * idx->size);
+        }
+    }
+    // Check the end first: load order and new ids make appends the common case for accounts_by_id
+    if (!loading_accounts && hi && idx->compare(&acc, &idx->items[hi - 1]) < 0)
+    {
+        while (lo < hi)
+        {
+            int mid = lo + (hi - lo) / 2;
+            if (idx->compare(&idx->items[mid], &acc) <= 0)
+            {
+                lo = mid + 1;
+            }
+            else
+            {
+                hi = mid;
+            }
+        }
+    }
+    memmove(&idx->items[hi + 1], &idx->items[hi], sizeof(Account *) * (idx->count - hi));
+    idx->items[hi] = acc;
+    idx->count++;
+}
+
+/**
+ * account_index_remove - Takes an Account out of a sorted index, found by pointer.
+ * Only for the rare changes of a sort key, so a linear scan is fine.
+ */
+static void account_index_remove(AccountIndex *idx, Account *acc)
+{
+    for (int i = 0; i < idx->count; i++)
+    {
+        if (idx->items[i] == acc)
+        {
+            memmove(&idx->items[i], &idx->items[i + 1], sizeof(Account *) * (idx->count - i - 1));
+            idx->count--;
+            return;
+        }
+    }
+}
+
+/**
+ * account_index_sort - Sorts an index filled while loading_accounts was set.
+ */
+static void account_index_sort(AccountIndex *idx)
+{
+    if (idx->count > 1)
+    {
+        qsort(idx->items, idx->count, sizeof(Account *), idx->compare);
+    }
+}
+
+/**
+ * account_index_clear - Empties an index, the accounts themselves are not freed.
+ */
+static void account_index_clear(AccountIndex *idx)
+{
+    safe_free(idx->items);
+    idx->count = idx->size = 0;
+}
+
+/**
+ * accounts_by_id_search - Returns the index of the first account in accounts_by_id with an id above after_id.
+ */
+static int accounts_by_id_search(long int after_id)
+{
+    int lo = 0, hi = accounts_by_id.count;
+
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if (accounts_by_id.items[mid]->id <= after_id)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/**
+ * find_cached_account_by_id - Looks up an account by id in accounts_by_id, or NULL.
+ * The returned Account belongs to the index, do not free it.
+ */
+Account *find_cached_account_by_id(long int id)
+{
+    int i = accounts_by_id_search(id - 1);
+    return i < accounts_by_id.count && accounts_by_id.items[i]->id == id ? accounts_by_id.items[i] : NULL;
+}
+
+/**
+ * valid_certfp - Checks for a SHA256 fingerprint in hex and writes it lowercased to out
+ * (CERTFP_LENGTH + 1 bytes). Colons between the bytes are allowed and dropped.
+ * Returns 1 if valid, 0 if not.
+ */
+int valid_certfp(const char *in, char *out)
+{
+    int n = 0;
+
+    for (; *in; in++)
+    {
+        if (*in == ':' && n && !(n % 2))
+        {
+            continue;
+        }
+        if (!isxdigit((unsigned char)*in) || n == CERTFP_LENGTH)
+        {
+            return 0;
+        }
+        out[n++] = tolower((unsigned char)*in);
+    }
+    out[n] = '\0';
+    return n == CERTFP_LENGTH;
+}
+
+/**
+ * find_certfp_entry - Returns the index entry of a normalized fingerprint, or NULL.
+ */
+static CertfpEntry *find_certfp_entry(const char *certfp)
+{
+    uint64_t hashv = siphash(certfp, account_hashkey);
+
+    for (CertfpEntry *e = certfps.hash[hashv & (CERTFP_HASH_SIZE - 1)]; e; e = e->next)
+    {
+        if (e->hashv == hashv && !strcmp(e->certfp, certfp))
+        {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * certfp_index_add - Puts a normalized fingerprint in the index, replacing the account it belonged to.
+ */
+static void certfp_index_add(const char *certfp, long int account_id)
+{
+    CertfpEntry *e = find_certfp_entry(certfp);
+
+    if (!e)
+    {
+        e = safe_alloc(sizeof(CertfpEntry));
+        strlcpy(e->certfp, certfp, sizeof(e->certfp));
+        e->hashv = siphash(certfp, account_hashkey);
+        e->next = certfps.hash[e->hashv & (CERTFP_HASH_SIZE - 1)];
+        certfps.hash[e->hashv & (CERTFP_HASH_SIZE - 1)] = e;
+        certfps.count++;
+    }
+    e->account_id = account_id;
+}
+
+/**
+ * find_certfp - Returns the account a normalized fingerprint logs into, or NULL.
+ * The returned Account belongs to the index, do not free it.
+ */
+Account *find_certfp(const char *certfp)
+{
+    CertfpEntry *e = find_certfp_entry(certfp);
+    return e ? find_cached_account_by_id(e->account_id) : NULL;
+}
+
+/**
+ * certfp_list - Stores up to max fingerprints of an account in list.
+ * Returns how many the account has.
+ */
+int certfp_list(Account *acc, const char **list, int max)
+{
+    int n = 0;
+
+    // Only management commands get here, a walk over the index is fine for them
+    for (int i = 0; i < CERTFP_HASH_SIZE; i++)
+    {
+        for (CertfpEntry *e = certfps.hash[i]; e; e = e->next)
+        {
+            if (e->account_id == acc->id)
+            {
+                if (n < max)
+                {
+                    list[n] = e->certfp;
+                }
+                n++;
+            }
+        }
+    }
+    return n;
+}
+
+/**
+ * certfp_add - Lets a normalized fingerprint log into acc.
+ * Returns 1 on success, 0 if someone else has it, -1 if acc has too many.
+ */
+int certfp_add(Account *acc, const char *certfp)
+{
+    CertfpEntry *e = find_certfp_entry(certfp);
+
+    if (e && e->account_id == acc->id)
+    {
+        return 1;
+    }
+    if (e && find_cached_account_by_id(e->account_id))
+    {
+        return 0;
+    }
+    if (certfp_list(acc, NULL, 0) >= ACCOUNT_MAX_CERTFPS)
+    {
+        return -1;
+    }
+    certfp_index_add(certfp, acc->id);
+    db_write_certfp(certfp, acc->id, true);
+    return 1;
+}
+
+/**
+ * certfp_index_del - Takes a normalized fingerprint out of the index if it belongs to account_id.
+ * Returns 1 if it was removed, 0 if not.
+ */
+static int certfp_index_del(const char *certfp, long int account_id)
+{
+    uint64_t hashv = siphash(certfp, account_hashkey);
+
+    for (CertfpEntry **ep = &certfps.hash[hashv & (CERTFP_HASH_SIZE - 1)]; *ep; ep = &(*ep)->next)
+    {
+        CertfpEntry *e = *ep;
+        if (e->hashv == hashv && !strcmp(e->certfp, certfp) && e->account_id == account_id)
+        {
+            *ep = e->next;
+            free(e);
+            certfps.count--;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * certfp_del - Stops a normalized fingerprint from logging into acc.
+ * Returns 1 if it was removed, 0 if acc did not have it.
+ */
+int certfp_del(Account *acc, const char *certfp)
+{
+    if (!certfp_index_del(certfp, acc->id))
+    {
+        return 0;
+    }
+    db_write_certfp(certfp, acc->id, false);
+    return 1;
+}
+
+/**
+ * certfp_drop_account - Takes every fingerprint of an account out of the index.
+ */
+static void certfp_drop_account(long int account_id)
+{
+    for (int i = 0; i < CERTFP_HASH_SIZE; i++)
+    {
+        for (CertfpEntry **ep = &certfps.hash[i], *e; (e = *ep); )
+        {
+            if (e->account_id != account_id)
+            {
+                ep = &e->next;
+                continue;
+            }
+            *ep = e->next;
+            free(e);
+            certfps.count--;
+        }
+    }
+}
+
+/**
+ * load_certfps - Fills the fingerprint index from account_certfp (called in MOD_LOAD).
+ * Returns 1 on success, 0 on failure.
+ */
+int load_certfps(void)
+{
+    sqlite3_stmt *stmt;
+    char certfp[CERTFP_LENGTH + 1];
+
+    free_certfps();
+    if (sqlite3_prepare_v2(db, "SELECT certfp, account_id FROM account_certfp WHERE deleted = 0", -1, &stmt, NULL) != SQLITE_OK)
+    {
+        return 0;
+    }
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        const char *value = (const char *)sqlite3_column_text(stmt, 0);
+        if (value && valid_certfp(value, certfp))
+        {
+            certfp_index_add(certfp, (long int)sqlite3_column_int64(stmt, 1));
+        }
+    }
+    sqlite3_finalize(stmt);
+    return 1;
+}
+
+/**
+ * free_certfps - Empties the fingerprint index (called in MOD_UNLOAD).
+ */
+void free_certfps(void)
+{
+    for (int i = 0; i < CERTFP_HASH_SIZE; i++)
+    {
+        for (CertfpEntry *e = certfps.hash[i], *next; e; e = next)
+        {
+            next = e->next;
+            free(e);
+        }
+    }
+    memset(&certfps, 0, sizeof(certfps));
+}
+
+/**
+ * search_accounts - Finds accounts by name pattern (match_simple() wildcards)
+ * and/or email domain, either may be NULL but not both.
+ * Matches are visited in name order, or domain then name order when a domain is given.
+ * The literal start of the pattern (or the domain) narrows the scan to a range of the
+ * sorted index, only a pattern that starts with a wildcard has to look at every account.
+ * Stores up to max matches, after skipping the first offset ones, in results.
+ * Returns the total number of matches.
+ */
+int search_accounts(const char *pattern, const char *domain, int offset, int max, Account **results)
+{
+    AccountIndex *idx = domain ? &accounts_by_domain : &accounts_by_name;
+    char prefix[MAX_ACCOUNT_NAME_LENGTH + 1];
+    size_t prefixlen;
+    int lo = 0, hi, total = 0;
+
+    if (domain)
+    {
+        strlcpy(prefix, domain, sizeof(prefix));
+    }
+    else
+    {
+        strlcpy(prefix, pattern, sizeof(prefix));
+        prefix[strcspn(prefix, "*?\\")] = '\0';
+    }
+    prefixlen = strlen(prefix);
+
+    // First entry whose key is >= prefix, everything that starts with it follows
+    hi = idx->count;
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+        const char *key = domain ? account_email_domain(idx->items[mid]) : idx->items[mid]->name;
+        if (strcasecmp(key, prefix) < 0)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    for (int i = lo; i < idx->count; i++)
+    {
+        Account *acc = idx->items[i];
+        if (domain ? strcasecmp(account_email_domain(acc), domain) : strncasecmp(acc->name, prefix, prefixlen))
+        {
+            break;
+        }
+        if (pattern && !match_simple(pattern, acc->name))
+        {
+            continue;
+        }
+        if (total >= offset && total - offset < max)
+        {
+            results[total - offset] = acc;
+        }
+        total++;
+    }
+    return total;
+}
+
+/**
+ * account_hash_resize - Rehashes the account index into size buckets, so chains
+ * stay short and a lookup costs the same at any number of accounts.
+ */
+static void account_hash_resize(unsigned int size)
+{
+    Account **table = safe_alloc(sizeof(Account *) * size);
+    Account *acc, *next;
+
+    for (unsigned int i = 0; i < account_hash_size; i++)
+    {
+        for (acc = account_hash[i]; acc; acc = next)
+        {
+            next = acc->hnext;
+            acc->hnext = table[acc->namehash & (size - 1)];
+            table[acc->namehash & (size - 1)] = acc;
+        }
+    }
+    safe_free(account_hash);
+    account_hash = table;
+    account_hash_size = size;
+}
+
+/**
+ * account_hash_link - Puts an Account in its hash bucket, growing the table if needed.
+ */
+static void account_hash_link(Account *acc)
+{
+    if (account_count >= account_hash_size)
+    {
+        account_hash_resize(account_hash_size ? account_hash_size * 2 : ACCOUNT_HASH_SIZE);
+    }
+    acc->namehash = siphash_nocase(acc->name, account_hashkey);
+    acc->hnext = account_hash[acc->namehash & (account_hash_size - 1)];
+    account_hash[acc->namehash & (account_hash_size - 1)] = acc;
+    account_count++;
+}
+
+/**
+ * add_cached_account - Adds an Account to the in-memory index, which takes ownership of it.
+ */
+void add_cached_account(Account *acc)
+{
+    account_hash_link(acc);
+    account_index_add(&accounts_by_id, acc);
+    account_index_add(&accounts_by_name, acc);
+    account_index_add(&accounts_by_domain, acc);
+}
+
+/**
+ * add_cached_accounts - Indexes a list of new Accounts chained on hnext, sorting the
+ * indexes once at the end. Names already in the index are freed instead.
+ */
+void add_cached_accounts(Account *list)
+{
+    loading_accounts = true;
+    for (Account *acc = list, *next; acc; acc = next)
+    {
+        next = acc->hnext;
+        if (find_cached_account(acc->name))
+        {
+            free_account(acc);
+            continue;
+        }
+        add_cached_account(acc);
+    }
+    loading_accounts = false;
+    account_index_sort(&accounts_by_id);
+    account_index_sort(&accounts_by_name);
+    account_index_sort(&accounts_by_domain);
+}
+
+/**
+ * snapshot_index_fill - Fills an AccountIndex from record numbers of a snapshot, already in its order.
+ * Returns 1 on success, 0 if a number is out of range or repeated.
+ */
+static int snapshot_index_fill(AccountIndex *idx, Account **accounts, const uint32_t *order, uint32_t count)
+{
+    unsigned char *seen = safe_alloc(count / 8 + 1);
+
+    idx->items = safe_alloc(sizeof(Account *) * count);
+    idx->size = count;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (order[i] >= count || seen[order[i] / 8] & (1 << (order[i] % 8)))
+        {
+            free(seen);
+            return 0;
+        }
+        seen[order[i] / 8] |= 1 << (order[i] % 8);
+        idx->items[idx->count++] = accounts[order[i]];
+    }
+    free(seen);
+    return 1;
+}
+
+/**
+ * replay_account_row - Brings the cache up to date with one row changed after the snapshot.
+ */
+static void replay_account_row(Account *row)
+{
+    Account *acc = find_cached_account(row->name);
+
+    if (!acc)
+    {
+        add_cached_account(row);
+        return;
+    }
+    if (acc->id == row->id)
+    {
+        if (strcmp(acc->email, row->email))
+        {
+            account_index_remove(&accounts_by_domain, acc);
+            safe_strdup(acc->email, row->email);
+            account_index_add(&accounts_by_domain, acc);
+        }
+        safe_strdup(acc->password, row->password);
+        acc->time_registered = row->time_registered;
+        acc->verified = row->verified;
+        acc->updated_at = row->updated_at;
+    }
+    free_account(row);
+}
+
+/**
+ * load_account_snapshot - Fills the empty in-memory index from a snapshot file, and then reads
+ * only the rows added or changed since from the database. The file is removed after reading
+ * so a crash later on can't leave an outdated one behind.
+ * Returns 1 on success, 0 if there is no usable snapshot (the index is left empty).
+ */
+int load_account_snapshot(const char *path)
+{
+    AccountSnapshotHeader hdr;
+    const AccountSnapshotRecord *records;
+    const uint32_t *by_name, *by_domain;
+    const char *strings;
+    Account **accounts = NULL;
+    sqlite3_stmt *stmt;
+    unsigned char *map;
+    struct stat st;
+    int fd, result, ok = 0;
+    uint32_t i;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+    {
+        return 0;
+    }
+    unlink(path);
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(hdr)
+        || (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+    {
+        close(fd);
+        return 0;
+    }
+    close(fd);
+    memcpy(&hdr, map, sizeof(hdr));
+    if (memcmp(hdr.magic, ACCOUNT_SNAPSHOT_MAGIC, sizeof(ACCOUNT_SNAPSHOT_MAGIC)) || hdr.version != ACCOUNT_SNAPSHOT_VERSION
+        || hdr.strings_size == 0 || hdr.strings_size > UINT32_MAX
+        || (uint64_t)st.st_size != sizeof(hdr) + (uint64_t)hdr.count * (sizeof(AccountSnapshotRecord) + 2 * sizeof(uint32_t)) + hdr.strings_size)
+    {
+        goto done;
+    }
+    records = (const AccountSnapshotRecord *)(map + sizeof(hdr));
+    by_name = (const uint32_t *)(records + hdr.count);
+    by_domain = by_name + hdr.count;
+    strings = (const char *)(by_domain + hdr.count);
+    // Every string ends before the end of the area, so it's enough that the area ends in a NUL
+    if (strings[hdr.strings_size - 1])
+    {
+        goto done;
+    }
+    if (hdr.count > account_hash_size)
+    {
+        unsigned int size = ACCOUNT_HASH_SIZE;
+        while (size < hdr.count)
+        {
+            size *= 2;
+        }
+        account_hash_resize(size);
+    }
+    accounts = safe_alloc(sizeof(Account *) * (hdr.count + 1));
+    loading_accounts = true;
+    for (i = 0; i < hdr.count; i++)
+    {
+        const AccountSnapshotRecord *r = &records[i];
+        if (r->name >= hdr.strings_size || r->email >= hdr.strings_size || r->password >= hdr.strings_size
+            || (i && r->id <= records[i - 1].id))
+        {
+            goto done;
+        }
+        Account *acc = safe_alloc(sizeof(Account));
+        acc->id = (long)r->id;
+        acc->name = strdup(strings + r->name);
+        acc->email = strdup(strings + r->email);
+        acc->password = strdup(strings + r->password);
+        acc->time_registered = (time_t)r->time_registered;
+        acc->updated_at = (time_t)r->updated_at;
+        acc->verified = r->verified;
+        accounts[i] = acc;
+        account_hash_link(acc);
+    }
+    // Sorted when the snapshot was written, so filling the indexes needs no sort
+    accounts_by_id.items = accounts;
+    accounts_by_id.count = hdr.count;
+    accounts_by_id.size = hdr.count + 1;
+    accounts = NULL;
+    ok = snapshot_index_fill(&accounts_by_name, accounts_by_id.items, by_name, hdr.count)
+      && snapshot_index_fill(&accounts_by_domain, accounts_by_id.items, by_domain, hdr.count);
+    if (!ok)
+    {
+        goto done;
+    }
+
+    stmt = stmts.select_accounts_since;
+    account_stats.cache_replayed = 0;
+    sqlite3_bind_int64(stmt, 1, hdr.max_id);
+    sqlite3_bind_int64(stmt, 2, hdr.updated_at);
+    while ((result = sqlite3_step(stmt)) == SQLITE_ROW)
+    {
+        replay_account_row(account_from_row(stmt));
+        account_stats.cache_replayed++;
+    }
+    sqlite3_reset(stmt);
+    if (result != SQLITE_DONE)
+    {
+        ok = 0;
+        goto done;
+    }
+    if (account_stats.cache_replayed)
+    {
+        account_index_sort(&accounts_by_id);
+        account_index_sort(&accounts_by_name);
+        account_index_sort(&accounts_by_domain);
+    }
+    // No account is ever deleted by us, but the database may have been edited while we were down
+    stmt = stmts.count_accounts;
+    ok = sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_int64(stmt, 0) == account_count;
+    sqlite3_reset(stmt);
+
+done:
+    loading_accounts = false;
+    if (!ok)
+    {
+        if (accounts)
+        {
+            // Not handed to accounts_by_id yet, the ones so far are only in the hash
+            accounts_by_id.items = accounts;
+            accounts_by_id.count = 0;
+        }
+        free_account_cache();
+        unreal_log(ULOG_WARNING, "obsidianirc", "SNAPSHOT_UNUSABLE", NULL, "The account snapshot $path is damaged or outdated, reading the whole database instead",
+            log_data_string("path", path));
+    }
+    munmap(map, st.st_size);
+    return ok;
+}
+
+/**
+ * write_account_snapshot - Writes the in-memory index to a snapshot file for the next
+ * load_account_snapshot(). Called in MOD_UNLOAD once the db writer has committed everything.
+ * Returns 1 on success, 0 on failure (errno is set).
+ */
+int write_account_snapshot(const char *path)
+{
+    AccountSnapshotHeader hdr;
+    AccountSnapshotRecord r;
+    char tmp[PATH_MAX];
+    uint64_t offset = 0;
+    FILE *f;
+    int i;
+
+    memset(&hdr, 0, sizeof(hdr));
+    strlcpy(hdr.magic, ACCOUNT_SNAPSHOT_MAGIC, sizeof(hdr.magic));
+    hdr.version = ACCOUNT_SNAPSHOT_VERSION;
+    hdr.count = accounts_by_id.count;
+    for (i = 0; i < accounts_by_id.count; i++)
+    {
+        Account *acc = accounts_by_id.items[i];
+        hdr.max_id = acc->id;
+        if (acc->updated_at > hdr.updated_at)
+        {
+            hdr.updated_at = acc->updated_at;
+        }
+        hdr.strings_size += strlen(acc->name) + strlen(acc->email) + strlen(acc->password) + 3;
+    }
+    if (hdr.strings_size == 0 || hdr.strings_size > UINT32_MAX)
+    {
+        errno = hdr.strings_size ? EFBIG : 0;
+        return hdr.strings_size == 0; // Nothing to save, the next load reads the empty table
+    }
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if (!(f = fopen(tmp, "w")))
+    {
+        return 0;
+    }
+    fwrite(&hdr, sizeof(hdr), 1, f);
+    for (i = 0; i < accounts_by_id.count; i++)
+    {
+        Account *acc = accounts_by_id.items[i];
+        memset(&r, 0, sizeof(r));
+        r.id = acc->id;
+        r.time_registered = acc->time_registered;
+        r.updated_at = acc->updated_at;
+        r.verified = acc->verified;
+        r.name = offset;
+        offset += strlen(acc->name) + 1;
+        r.email = offset;
+        offset += strlen(acc->email) + 1;
+        r.password = offset;
+        offset += strlen(acc->password) + 1;
+        fwrite(&r, sizeof(r), 1, f);
+    }
+    // Record numbers are positions in accounts_by_id, found by id
+    for (AccountIndex *idx = &accounts_by_name; idx; idx = idx == &accounts_by_name ? &accounts_by_domain : NULL)
+    {
+        for (i = 0; i < idx->count; i++)
+        {
+            Account **found = bsearch(&idx->items[i], accounts_by_id.items, accounts_by_id.count, sizeof(Account *), account_compare_id);
+            uint32_t n = found - accounts_by_id.items;
+            fwrite(&n, sizeof(n), 1, f);
+        }
+    }
+    for (i = 0; i < accounts_by_id.count; i++)
+    {
+        Account *acc = accounts_by_id.items[i];
+        fwrite(acc->name, strlen(acc->name) + 1, 1, f);
+        fwrite(acc->email, strlen(acc->email) + 1, 1, f);
+        fwrite(acc->password, strlen(acc->password) + 1, 1, f);
+    }
+    if (ferror(f) || fflush(f) || fsync(fileno(f)))
+    {
+        fclose(f);
+        unlink(tmp);
+        return 0;
+    }
+    if (fclose(f) || rename(tmp, path))
+    {
+        unlink(tmp);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * load_account_cache - Reads every account into the in-memory index, from the snapshot
+ * if there is a usable one and from the database otherwise.
+ * Returns 1 on success, 0 on failure.
+ */
+int load_account_cache(void)
+{
+    sqlite3_stmt *stmt = stmts.select_accounts;
+    uint64_t start = monotonic_nsec();
+
+    if (!db || !stmt)
+    {
+        return 0;
+    }
+    if ((account_stats.cache_from_snapshot = load_account_snapshot(OBSIDIAN_SNAPSHOT)))
+    {
+        account_stats.cache_load_ns = monotonic_nsec() - start;
+        return 1;
+    }
+    loading_accounts = true;
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        Account *acc = account_from_row(stmt);
+        // Databases that predate the unique index may still hold names that only differ in case, keep the oldest
+        if (find_cached_account(acc->name))
+        {
+            free_account(acc);
+            continue;
+        }
+        add_cached_account(acc);
+    }
+    sqlite3_reset(stmt);
+    loading_accounts = false;
+    account_index_sort(&accounts_by_id);
+    account_index_sort(&accounts_by_name);
+    account_index_sort(&accounts_by_domain);
+    account_stats.cache_load_ns = monotonic_nsec() - start;
+    return 1;
+}
+
+/**
+ * free_account_cache - Frees every Account in the in-memory index.
+ */
+void free_account_cache(void)
+{
+    Account *acc, *next;
+
+    for (unsigned int i = 0; i < account_hash_size; i++)
+    {
+        for (acc = account_hash[i]; acc; acc = next)
+        {
+            next = acc->hnext;
+            // The session nodes belong to the clients' ModData, only detach them
+            for (AccountMember *session = acc->members; session; session = session->next)
+            {
+                session->account = NULL;
+            }
+            acc->members = NULL;
+            free_account(acc);
+        }
+    }
+    safe_free(account_hash);
+    account_hash_size = 0;
+    account_count = 0;
+    account_index_clear(&accounts_by_id);
+    account_index_clear(&accounts_by_name);
+    account_index_clear(&accounts_by_domain);
+}
+
+/**
+ * metadata_first - Returns the first key of an AccountMetadata, or NULL if it has none.
+ * Walk them with: for (key = metadata_first(md); key; key = metadata_next(md, key))
+ */
+const char *metadata_first(const AccountMetadata *md)
+{
+    return md && md->count ? md->data : NULL;
+}
+
+/**
+ * metadata_value - Returns the value stored right after a key.
+ */
+const char *metadata_value(const char *key)
+{
+    return key + strlen(key) + 1;
+}
+
+/**
+ * metadata_next - Returns the key after key, or NULL at the end.
+ */
+const char *metadata_next(const AccountMetadata *md, const char *key)
+{
+    const char *value = metadata_value(key);
+    const char *next = value + strlen(value) + 1;
+    return next < md->data + md->used ? next : NULL;
+}
+
+/**
+ * metadata_append - Adds a pair at the end of an AccountMetadata, growing it if needed.
+ * Returns the AccountMetadata, which may have moved.
+ */
+static AccountMetadata *metadata_append(AccountMetadata *md, const char *key, const char *value)
+{
+    unsigned int need = strlen(key) + strlen(value) + 2;
+
+    if (!md || md->used + need > md->size)
+    {
+        unsigned int size = md ? md->size : 0;
+        while (size < (md ? md->used : 0) + need)
+        {
+            size = size ? size * 2 : 64;
+        }
+        AccountMetadata *grown = realloc(md, sizeof(AccountMetadata) + size);
+        if (!grown)
+        {
+            outofmemory(sizeof(AccountMetadata) + size);
+        }
+        if (!md)
+        {
+            grown->count = 0;
+            grown->used = 0;
+        }
+        grown->size = size;
+        md = grown;
+    }
+    char *p = md->data + md->used;
+    strcpy(p, key);
+    strcpy(p + strlen(key) + 1, value);
+    md->used += need;
+    md->count++;
+    return md;
+}
+
+/**
+ * metadata_remove - Removes a key from an AccountMetadata, if it is there.
+ */
+static void metadata_remove(AccountMetadata *md, const char *key)
+{
+    for (const char *k = metadata_first(md); k; k = metadata_next(md, k))
+    {
+        if (!strcmp(k, key))
+        {
+            const char *value = metadata_value(k);
+            unsigned int len = (value + strlen(value) + 1) - k;
+            char *start = (char *)k;
+            memmove(start, start + len, md->data + md->used - (start + len));
+            md->used -= len;
+            md->count--;
+            return;
+        }
+    }
+}
+
+/**
+ * metadata_read - Reads the metadata of an account id from the database.
+ * Returns a new allocation (free() it), never NULL.
+ */
+static AccountMetadata *metadata_read(long int id)
+{
+    sqlite3_stmt *stmt = stmts.select_metadata;
+    AccountMetadata *md = NULL;
+
+    if (stmt)
+    {
+        sqlite3_bind_int64(stmt, 1, id);
+        while (sqlite3_step(stmt) == SQLITE_ROW)
+        {
+            md = metadata_append(md, (const char *)sqlite3_column_text(stmt, 0), (const char *)sqlite3_column_text(stmt, 1));
+        }
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+    }
+    return md ? md : safe_alloc(sizeof(AccountMetadata));
+}
+
+/**
+ * account_metadata - Returns the metadata of a cached account, reading it from
+ * the database the first time anyone asks. NULL only if acc is NULL.
+ */
+AccountMetadata *account_metadata(Account *acc)
+{
+    if (!acc)
+    {
+        return NULL;
+    }
+    if (!acc->metadata)
+    {
+        // Kept, even if nothing is stored, so we don't ask again
+        acc->metadata = metadata_read(acc->id);
+    }
+    return acc->metadata;
+}
+
+/**
+ * account_metadata_peek - Returns the metadata of an account for one read, without loading it
+ * into the account: the loaded copy if there is one, otherwise what the database has, which
+ * is put in *copy for the caller to free(). Listing every account this way doesn't keep
+ * the metadata of all of them in memory.
+ */
+const AccountMetadata *account_metadata_peek(const Account *acc, AccountMetadata **copy)
+{
+    *copy = NULL;
+    if (acc->metadata)
+    {
+        return acc->metadata;
+    }
+    return *copy = metadata_read(acc->id);
+}
+
+/**
+ * account_metadata_get - Returns the value of a metadata key of an account, or NULL.
+ */
+const char *account_metadata_get(Account *acc, const char *key)
+{
+    AccountMetadata *md = account_metadata(acc);
+
+    for (const char *k = metadata_first(md); k; k = metadata_next(md, k))
+    {
+        if (!strcmp(k, key))
+        {
+            return metadata_value(k);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * valid_metadata_key - Keys are lowercase letters, digits and "_-./", like IRCv3 METADATA keys.
+ */
+int valid_metadata_key(const char *key)
+{
+    if (BadPtr(key) || strlen(key) > ACCOUNT_METADATA_MAX_KEY_LENGTH)
+    {
+        return 0;
+    }
+    return strspn(key, "abcdefghijklmnopqrstuvwxyz0123456789_-./") == strlen(key);
+}
+
+/**
+ * valid_metadata_value - Values are up to ACCOUNT_METADATA_MAX_VALUE_LENGTH bytes of text without
+ * control characters, a CR or LF would end the line they are sent in.
+ */
+int valid_metadata_value(const char *value)
+{
+    const unsigned char *p;
+
+    for (p = (const unsigned char *)value; *p; p++)
+    {
+        if (*p < 0x20 || *p == 0x7f || p - (const unsigned char *)value == ACCOUNT_METADATA_MAX_VALUE_LENGTH)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * account_metadata_set - Sets a metadata key of a cached account, or deletes it if value
+ * is NULL, and queues the database write.
+ * Returns 1 on success, 0 if the account already has ACCOUNT_METADATA_MAX_KEYS keys.
+ */
+int account_metadata_set(Account *acc, const char *key, const char *value)
+{
+    AccountMetadata *md = account_metadata(acc);
+
+    if (value && !account_metadata_get(acc, key) && md->count >= ACCOUNT_METADATA_MAX_KEYS)
+    {
+        return 0;
+    }
+    metadata_remove(md, key);
+    if (value)
+    {
+        acc->metadata = metadata_append(md, key, value);
+    }
+    db_write_metadata(acc, key, value);
+    return 1;
+}
+
+/* Auth worker pool: argon2 verify and hash take tens of milliseconds each,
+ * so they run on worker threads and the results are handed back to the
+ * main loop through a pipe. Workers only touch the AuthJob they hold.
+ */
+static struct {
+    pthread_t threads[MAX_AUTH_THREADS];
+    int nthreads;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    AuthJob *queue_head, *queue_tail;
+    int queued;
+    AuthJob *done_head, *done_tail;
+    int pipefd[2];
+    bool shutdown;
+} auth_pool = { .pipefd = { -1, -1 } };
+
+/**
+ * wipe_password - Overwrites and frees a plaintext password.
+ */
+static void wipe_password(char *password)
+{
+    if (!password)
+    {
+        return;
+    }
+    for (volatile char *p = password; *p; p++)
+    {
+        *p = '\0';
+    }
+    free(password);
+}
+
+/**
+ * auth_job_free - Frees an AuthJob and wipes the password it may still hold.
+ */
+static void auth_job_free(AuthJob *job)
+{
+    wipe_password(job->password);
+    free(job->account);
+    free(job->email);
+    free(job->hash);
+    free(job);
+}
+
+/**
+ * auth_job_run - Does the argon2 work of a job (worker thread).
+ */
+static void auth_job_run(AuthJob *job)
+{
+    uint64_t start = monotonic_nsec();
+
+    if (job->origin == AUTH_FOR_REGISTER)
+    {
+        char encoded[AUTH_ARGON2_ENCODED_LENGTH];
+        job->ok = argon2id_hash_encoded(AUTH_ARGON2_TIME_COST, AUTH_ARGON2_MEMORY_COST, AUTH_ARGON2_PARALLELISM,
+                                        job->password, strlen(job->password),
+                                        job->salt, sizeof(job->salt), AUTH_ARGON2_HASH_LENGTH,
+                                        encoded, sizeof(encoded)) == ARGON2_OK;
+        if (job->ok)
+        {
+            job->hash = strdup(encoded);
+            job->ok = job->hash != NULL;
+        }
+    }
+    else
+    {
+        job->ok = argon2_verify(job->hash, job->password, strlen(job->password), Argon2_id) == ARGON2_OK;
+    }
+    job->work_ns = monotonic_nsec() - start;
+    wipe_password(job->password);
+    job->password = NULL;
+}
+
+/**
+ * auth_worker - Worker thread main loop.
+ */
+static void *auth_worker(void *arg)
+{
+    AuthJob *job;
+
+    pthread_mutex_lock(&auth_pool.lock);
+    while (1)
+    {
+        while (!auth_pool.queue_head && !auth_pool.shutdown)
+        {
+            pthread_cond_wait(&auth_pool.wakeup, &auth_pool.lock);
+        }
+        if (auth_pool.shutdown)
+        {
+            break;
+        }
+        job = auth_pool.queue_head;
+        auth_pool.queue_head = job->next;
+        if (!auth_pool.queue_head)
+        {
+            auth_pool.queue_tail = NULL;
+        }
+        auth_pool.queued--;
+        pthread_mutex_unlock(&auth_pool.lock);
+
+        auth_job_run(job);
+
+        pthread_mutex_lock(&auth_pool.lock);
+        job->next = NULL;
+        if (auth_pool.done_tail)
+        {
+            auth_pool.done_tail->next = job;
+        }
+        else
+        {
+            auth_pool.done_head = job;
+        }
+        auth_pool.done_tail = job;
+        notify_wakeup_pipe(auth_pool.pipefd);
+    }
+    pthread_mutex_unlock(&auth_pool.lock);
+    return NULL;
+}
+
+/**
+ * login_limit_unlink - Takes an entry out of the LRU list.
+ */
+static void login_limit_unlink(LoginLimitEntry *e)
+{
+    if (e->prev)
+    {
+        e->prev->next = e->next;
+    }
+    else
+    {
+        login_limits.head = e->next;
+    }
+    if (e->next)
+    {
+        e->next->prev = e->prev;
+    }
+    else
+    {
+        login_limits.tail = e->prev;
+    }
+    e->prev = e->next = NULL;
+}
+
+/**
+ * login_limit_remove - Frees an entry, unlinking it from its bucket and the LRU list.
+ */
+static void login_limit_remove(LoginLimitEntry *e)
+{
+    LoginLimitEntry **ep = &login_limits.hash[e->hashv & (LOGIN_LIMIT_HASH_SIZE - 1)];
+
+    while (*ep != e)
+    {
+        ep = &(*ep)->hnext;
+    }
+    *ep = e->hnext;
+    login_limit_unlink(e);
+    free(e);
+    login_limits.count--;
+}
+
+/**
+ * login_limit_find - Returns the entry of a key, or NULL.
+ */
+static LoginLimitEntry *login_limit_find(const char *key)
+{
+    uint64_t hashv = siphash_nocase(key, account_hashkey);
+
+    for (LoginLimitEntry *e = login_limits.hash[hashv & (LOGIN_LIMIT_HASH_SIZE - 1)]; e; e = e->hnext)
+    {
+        if (e->hashv == hashv && !strcasecmp(e->key, key))
+        {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * login_limit_roll - Moves an entry to the window now is in.
+ */
+static void login_limit_roll(LoginLimitEntry *e, time_t now)
+{
+    time_t window = now - now % MyConf.login_limit_window;
+
+    if (e->window_start == window)
+    {
+        return;
+    }
+    e->prev_count = e->window_start == window - MyConf.login_limit_window ? e->count : 0;
+    e->count = 0;
+    e->window_start = window;
+}
+
+/**
+ * login_limit_over - Checks whether a key has had limit or more failures in the last window.
+ */
+static bool login_limit_over(const char *key, int limit, time_t now)
+{
+    LoginLimitEntry *e;
+    time_t into;
+
+    if (!limit || !(e = login_limit_find(key)))
+    {
+        return false;
+    }
+    login_limit_roll(e, now);
+    into = now - e->window_start;
+    return e->count + (uint64_t)e->prev_count * (MyConf.login_limit_window - into) / MyConf.login_limit_window >= (uint64_t)limit;
+}
+
+/**
+ * login_limit_count - Counts a failure for a key, making room for it if the table is full.
+ */
+static void login_limit_count(const char *key, time_t now)
+{
+    LoginLimitEntry *e = login_limit_find(key);
+
+    if (!e)
+    {
+        if (login_limits.count >= LOGIN_LIMIT_MAX_ENTRIES)
+        {
+            login_limit_remove(login_limits.tail);
+        }
+        e = safe_alloc(sizeof(LoginLimitEntry) + strlen(key) + 1);
+        strcpy(e->key, key);
+        e->hashv = siphash_nocase(key, account_hashkey);
+        e->hnext = login_limits.hash[e->hashv & (LOGIN_LIMIT_HASH_SIZE - 1)];
+        login_limits.hash[e->hashv & (LOGIN_LIMIT_HASH_SIZE - 1)] = e;
+        login_limits.count++;
+    }
+    else
+    {
+        login_limit_unlink(e);
+    }
+    login_limit_roll(e, now);
+    e->count++;
+    e->next = login_limits.head;
+    if (login_limits.head)
+    {
+        login_limits.head->prev = e;
+    }
+    login_limits.head = e;
+    if (!login_limits.tail)
+    {
+        login_limits.tail = e;
+    }
+}
+
+/**
+ * login_limit_ip_key - The "i:" key of a client, its IPv6 /64 or its IPv4 address.
+ */
+static void login_limit_ip_key(Client *client, char *buf, size_t buflen)
+{
+    const char *ip = GetIP(client);
+    unsigned char addr[16];
+    char str[INET6_ADDRSTRLEN];
+
+    if (ip && inet_pton(AF_INET6, ip, addr) == 1 && !IN6_IS_ADDR_V4MAPPED((struct in6_addr *)addr))
+    {
+        memset(addr + LOGIN_LIMIT_IPV6_CIDR / 8, 0, sizeof(addr) - LOGIN_LIMIT_IPV6_CIDR / 8);
+        inet_ntop(AF_INET6, addr, str, sizeof(str));
+        snprintf(buf, buflen, "i:%s/%d", str, LOGIN_LIMIT_IPV6_CIDR);
+        return;
+    }
+    snprintf(buf, buflen, "i:%s", ip ? ip : "*");
+}
+
+/**
+ * login_limited - Checks, before any lookup or hashing, whether a client (and the account
+ * it wants, if given) had too many failed logins lately.
+ * Returns 1 if the attempt should be refused.
+ */
+int login_limited(Client *client, const char *account)
+{
+    char key[MAX_ACCOUNT_NAME_LENGTH + 3];
+    time_t now = TStime();
+
+    login_limit_ip_key(client, key, sizeof(key));
+    if (login_limit_over(key, MyConf.login_limit_ip, now))
+    {
+        return 1;
+    }
+    if (account)
+    {
+        snprintf(key, sizeof(key), "a:%s", account);
+        return login_limit_over(key, MyConf.login_limit_account, now);
+    }
+    return 0;
+}
+
+/**
+ * login_limit_shared - Counts a failure for a key, and tells the other servers if login-limit-sync is on.
+ */
+static void login_limit_shared(const char *key, time_t now)
+{
+    login_limit_count(key, now);
+    if (MyConf.login_limit_sync)
+    {
+        sendto_server(NULL, 0, 0, NULL, ":%s %s %s", me.id, CMD_LOGINFAIL, key);
+    }
+}
+
+/**
+ * login_failed - Counts a failed login of a client, and of the account if it exists.
+ */
+void login_failed(Client *client, const char *account)
+{
+    char key[MAX_ACCOUNT_NAME_LENGTH + 3];
+    time_t now = TStime();
+
+    login_limit_ip_key(client, key, sizeof(key));
+    login_limit_shared(key, now);
+    // Only real accounts, so guessing random names can't flush the table
+    if (account)
+    {
+        snprintf(key, sizeof(key), "a:%s", account);
+        login_limit_shared(key, now);
+    }
+}
+
+/**
+ * login_succeeded - Forgets the failures of an account once someone got its password right.
+ */
+void login_succeeded(const char *account)
+{
+    char key[MAX_ACCOUNT_NAME_LENGTH + 3];
+    LoginLimitEntry *e;
+
+    snprintf(key, sizeof(key), "a:%s", account);
+    if ((e = login_limit_find(key)))
+    {
+        login_limit_remove(e);
+    }
+}
+
+/**
+ * free_login_limits - Forgets all failure counts (called in MOD_UNLOAD).
+ */
+void free_login_limits(void)
+{
+    for (LoginLimitEntry *e = login_limits.head, *next; e; e = next)
+    {
+        next = e->next;
+        free(e);
+    }
+    memset(&login_limits, 0, sizeof(login_limits));
+}
+
+/**
+ * login_limit_expire - Event, every minute. Entries untouched for two windows count for
+ * nothing any more, and the least recently failed ones are at the tail.
+ */
+EVENT(login_limit_expire)
+{
+    time_t cutoff = TStime() - 2 * MyConf.login_limit_window;
+
+    while (login_limits.tail && login_limits.tail->window_start <= cutoff)
+    {
+        login_limit_remove(login_limits.tail);
+    }
+}
+
+/**
+ * cmd_loginfail - LOGINFAIL <key> from another server with login-limit-sync on.
+ * Counted even if ours is off, and passed on so the whole network sees it.
+ */
+CMD_FUNC(cmd_loginfail)
+{
+    if (parc < 2 || BadPtr(parv[1]) || strlen(parv[1]) > MAX_ACCOUNT_NAME_LENGTH + 2
+        || (strncmp(parv[1], "a:", 2) && strncmp(parv[1], "i:", 2)))
+    {
+        return;
+    }
+    login_limit_count(parv[1], TStime());
+    sendto_server(client, 0, 0, NULL, ":%s %s %s", client->id, CMD_LOGINFAIL, parv[1]);
+}
+
+/* Account sync between servers. Every server keeps its own database and
+ * cache, changes go out to the others as OBSACC lines:
+ *   PUT <name> <time_registered> <updated_at> <verified> <password> :<email>
+ *   META <name> <time_registered> <updated_at> <key> :<value>
+ *   METADEL <name> <time_registered> <updated_at> <key>
+ *   CERTFP <name> <time_registered> <updated_at> ADD|DEL <certfp>
+ *   HELLO <seq>, sent on link with the peer's last MARK, answered with every row changed after it
+ *   MARK <seq>, the peer has all our changes up to seq, stored in obsacc_peers for its next HELLO
+ * Each account, metadata key and certfp has its own updated_at and the newer
+ * one wins. Deleted keys and certfps stay as tombstones so the delete wins too.
+ * A name registered on both sides of a split goes to the older registration,
+ * META and CERTFP lines for the other one are dropped. Server links form a
+ * tree, so a change is passed on to every link but the one it came from and
+ * never comes back. The seq is our own change number, the db writer gives one
+ * to every row it writes.
+ */
+
+/**
+ * obsacc_send - Sends an OBSACC line from a server, to one link or (to NULL) to all but skip.
+ */
+static void obsacc_send(Client *from, Client *skip, Client *to, const char *fmt, ...)
+{
+    char buf[BUFSIZE];
+    va_list vl;
+    int len;
+
+    va_start(vl, fmt);
+    len = vsnprintf(buf, sizeof(buf), fmt, vl);
+    va_end(vl);
+    if (len < 0 || len + strlen(from->id) + strlen(CMD_OBSACC) + 5 > BUFSIZE - 2)
+    {
+        unreal_log(ULOG_WARNING, "obsidianirc", "OBSACC_TOO_LONG", NULL, "Not syncing an account change, the line would be too long: $line",
+            log_data_string("line", buf));
+        return;
+    }
+    if (to)
+    {
+        sendto_one(to, NULL, ":%s %s %s", from->id, CMD_OBSACC, buf);
+    }
+    else
+    {
+        sendto_server(skip, 0, 0, NULL, ":%s %s %s", from->id, CMD_OBSACC, buf);
+    }
+}
+
+static void obsacc_send_put(Client *from, Client *skip, Client *to, const Account *acc)
+{
+    obsacc_send(from, skip, to, "PUT %s %lld %lld %d %s :%s", acc->name, (long long)acc->time_registered,
+        (long long)acc->updated_at, acc->verified, acc->password, acc->email ? acc->email : "");
+}
+
+static void obsacc_send_meta(Client *from, Client *skip, Client *to, const Account *acc, time_t updated_at, const char *key, const char *value)
+{
+    // Rows written before values were checked could end the line early
+    if (value && !valid_metadata_value(value))
+    {
+        return;
+    }
+    if (value)
+    {
+        obsacc_send(from, skip, to, "META %s %lld %lld %s :%s", acc->name, (long long)acc->time_registered, (long long)updated_at, key, value);
+    }
+    else
+    {
+        obsacc_send(from, skip, to, "METADEL %s %lld %lld %s", acc->name, (long long)acc->time_registered, (long long)updated_at, key);
+    }
+}
+
+static void obsacc_send_certfp(Client *from, Client *skip, Client *to, const Account *acc, time_t updated_at, const char *certfp, bool add)
+{
+    obsacc_send(from, skip, to, "CERTFP %s %lld %lld %s %s", acc->name, (long long)acc->time_registered, (long long)updated_at,
+                add ? "ADD" : "DEL", certfp);
+}
+
+/**
+ * obsacc_account_register - Hook for HOOKTYPE_ACCOUNT_REGISTER, tells the other servers.
+ */
+int obsacc_account_register(Account *acc, Client *client)
+{
+    obsacc_send_put(&me, NULL, NULL, acc);
+    return 0;
+}
+
+/**
+ * obsacc_row_written - Done callback of every metadata and certfp write. If the row changed,
+ * the cache follows it (it may be a change from another server) and the change is passed on.
+ * Done callbacks run in queue order, so the cache ends up with whatever was written last.
+ */
+void obsacc_row_written(DbWrite *w)
+{
+    Account *acc;
+    Client *source;
+
+    if (w->result != SQLITE_DONE || !w->changed || !(acc = find_cached_account_by_id(w->account_id)))
+    {
+        return;
+    }
+    source = *w->source ? hash_find_id(w->source, NULL) : NULL;
+    if (w->type == DB_WRITE_METADATA_SET)
+    {
+        // Only a loaded copy, account_metadata() reads the rest from the database
+        if (acc->metadata)
+        {
+            metadata_remove(acc->metadata, w->key);
+            if (w->value)
+            {
+                acc->metadata = metadata_append(acc->metadata, w->key, w->value);
+            }
+        }
+        obsacc_send_meta(source ? source : &me, source, NULL, acc, w->updated_at, w->key, w->value);
+        return;
+    }
+    if (w->type == DB_WRITE_CERTFP_ADD)
+    {
+        certfp_index_add(w->key, acc->id);
+    }
+    else
+    {
+        certfp_index_del(w->key, acc->id);
+    }
+    obsacc_send_certfp(source ? source : &me, source, NULL, acc, w->updated_at, w->key, w->type == DB_WRITE_CERTFP_ADD);
+}
+
+/**
+ * obsacc_newer - Whether a remote version of an account should replace ours.
+ * Changes in the same second are settled by the password hash, so every server picks the same one.
+ */
+static bool obsacc_newer(const Account *acc, time_t updated_at, const char *password)
+{
+    if (updated_at != acc->updated_at)
+    {
+        return updated_at > acc->updated_at;
+    }
+    return strcmp(password, acc->password ? acc->password : "") > 0;
+}
+
+/**
+ * obsacc_older_registration - Whether a registration from another server of a name we have
+ * registered at a different time keeps it. The older one does, the same second goes by the password hash.
+ */
+static bool obsacc_older_registration(const Account *acc, time_t time_registered, const char *password)
+{
+    if (time_registered != acc->time_registered)
+    {
+        return time_registered < acc->time_registered;
+    }
+    return strcmp(password, acc->password ? acc->password : "") > 0;
+}
+
+/**
+ * account_name_lost - Empties an account whose name went to an older registration on another server.
+ * Its metadata and certfps go (the database rows with the update that follows, see
+ * db_write_account_update()) and our users logged into it are logged out.
+ */
+static void account_name_lost(Account *acc)
+{
+    free(acc->metadata);
+    acc->metadata = safe_alloc(sizeof(AccountMetadata)); // Known empty, the winner's keys follow
+    certfp_drop_account(acc->id);
+    for (AccountMember *m = acc->members, *next; m; m = next)
+    {
+        Client *client = m->client;
+        next = m->next;
+        if (!MyUser(client))
+        {
+            continue; // Logged out by their own server, which gets the same PUT
+        }
+        strlcpy(client->user->account, "0", sizeof(client->user->account));
+        user_account_login(NULL, client);
+        sendnotice(client, "*** You have been logged out: the account %s was registered earlier on another server, which keeps the name.", acc->name);
+    }
+    unreal_log(ULOG_INFO, "obsidianirc", "OBSACC_NAME_CONFLICT", NULL, "Account $account was also registered on another server, the older registration keeps it",
+        log_data_string("account", acc->name));
+}
+
+static bool obsacc_apply_put(const char *name, time_t time_registered, time_t updated_at, int verified, const char *password, const char *email);
+
+/**
+ * obsacc_written - Done callback of the insert of an account from another server.
+ */
+static void obsacc_written(DbWrite *w)
+{
+    Account *acc = w->acc;
+
+    if (w->result == SQLITE_DONE && !find_cached_account(acc->name))
+    {
+        add_cached_account(acc);
+        w->acc = NULL;
+        return;
+    }
+    // Registered here while the insert was queued, settle it like any other PUT
+    if (find_cached_account(acc->name))
+    {
+        obsacc_apply_put(acc->name, acc->time_registered, acc->updated_at, acc->verified, acc->password, acc->email);
+    }
+}
+
+/**
+ * obsacc_apply_put - Creates or updates an account from another server, if its version is newer.
+ * A different time_registered is a different registration of the name, not an update.
+ * Returns true if it changed anything, and the PUT should be passed on.
+ */
+static bool obsacc_apply_put(const char *name, time_t time_registered, time_t updated_at, int verified, const char *password, const char *email)
+{
+    Account *acc = find_cached_account(name);
+    bool lost = false;
+
+    if (!acc)
+    {
+        // Indexed by obsacc_written() once it has an id, like a REGISTER
+        acc = safe_alloc(sizeof(Account));
+        acc->name = strdup(name);
+        acc->email = strdup(email);
+        acc->password = strdup(password);
+        acc->time_registered = time_registered;
+        acc->updated_at = updated_at;
+        acc->verified = verified;
+        return db_write_account(NULL, acc, obsacc_written);
+    }
+    if (time_registered != acc->time_registered)
+    {
+        if (!obsacc_older_registration(acc, time_registered, password))
+        {
+            return false; // Ours keeps the name, the other side gets our PUT and gives it up
+        }
+        account_name_lost(acc);
+        lost = true;
+    }
+    else if (!obsacc_newer(acc, updated_at, password))
+    {
+        return false;
+    }
+    if (strcmp(acc->email ? acc->email : "", email))
+    {
+        // The email domain is the sort key of accounts_by_domain
+        account_index_remove(&accounts_by_domain, acc);
+        safe_strdup(acc->email, email);
+        account_index_add(&accounts_by_domain, acc);
+    }
+    // A new hash also makes the session tokens of the account stop working
+    safe_strdup(acc->password, password);
+    acc->verified = verified;
+    acc->time_registered = time_registered;
+    acc->updated_at = updated_at;
+    db_write_account_update(acc, lost);
+    return true;
+}
+
+/* Servers that sent us HELLO, while their link is up. A REHASH drops
+ * them, the peer then keeps the last MARK it got and resends it on its
+ * next link.
+ */
+static ObsaccSync *obsacc_syncs = NULL;
+
+/**
+ * obsacc_sync_begin - Starts sending a linked server every row changed after since.
+ * The writes already queued finish first, they were not sent live and need to be in the answer.
+ */
+static void obsacc_sync_begin(ObsaccSync *sync, uint64_t since)
+{
+    sync->stage = OBSACC_SYNC_ACCOUNTS;
+    sync->since = sync->marked = since;
+    sync->wait_for = db_writer_state.queued;
+    sync->cursor_seq = since + 1;
+    sync->cursor_id = -1;
+    *sync->cursor_key = '\0';
+    sync->sent = 0;
+}
+
+/**
+ * obsacc_sync_start - Answers a HELLO from a directly linked server, replacing an earlier one.
+ */
+static void obsacc_sync_start(Client *to, uint64_t since)
+{
+    ObsaccSync *sync;
+
+    for (sync = obsacc_syncs; sync; sync = sync->next)
+    {
+        if (!strcmp(sync->server_id, to->id))
+        {
+            break;
+        }
+    }
+    if (!sync)
+    {
+        sync = safe_alloc(sizeof(ObsaccSync));
+        strlcpy(sync->server_id, to->id, sizeof(sync->server_id));
+        sync->next = obsacc_syncs;
+        obsacc_syncs = sync;
+    }
+    // A mark we never gave out is from another database, a restored backup or a new file
+    obsacc_sync_begin(sync, since > db_writer_state.completed_seq ? 0 : since);
+}
+
+/**
+ * obsacc_resync - Sends every linked server what changed since its last MARK again (after an import).
+ * Imported rows are not sent live, they go out like the answer to a HELLO.
+ */
+void obsacc_resync(void)
+{
+    for (ObsaccSync *sync = obsacc_syncs; sync; sync = sync->next)
+    {
+        obsacc_sync_begin(sync, sync->marked);
+    }
+}
+
+/**
+ * obsacc_sync_row - Sends one row of the current stage and moves the cursor past it.
+ */
+static void obsacc_sync_row(ObsaccSync *sync, Client *to, sqlite3_stmt *stmt)
+{
+    Account row = { 0 };
+
+    if (sync->stage == OBSACC_SYNC_ACCOUNTS)
+    {
+        Account *acc = account_from_row(stmt);
+        sync->cursor_seq = (uint64_t)sqlite3_column_int64(stmt, 7);
+        sync->cursor_id = acc->id;
+        obsacc_send_put(&me, NULL, to, acc);
+        free_account(acc);
+        return;
+    }
+    sync->cursor_seq = (uint64_t)sqlite3_column_int64(stmt, 0);
+    if (sync->stage == OBSACC_SYNC_METADATA)
+    {
+        sync->cursor_id = (long int)sqlite3_column_int64(stmt, 1);
+        strlcpy(sync->cursor_key, (const char *)sqlite3_column_text(stmt, 2), sizeof(sync->cursor_key));
+        row.name = (char *)sqlite3_column_text(stmt, 4);
+        row.time_registered = (time_t)sqlite3_column_int64(stmt, 5);
+        obsacc_send_meta(&me, NULL, to, &row, (time_t)sqlite3_column_int64(stmt, 6), sync->cursor_key,
+                         sqlite3_column_int(stmt, 7) ? NULL : (const char *)sqlite3_column_text(stmt, 3));
+        return;
+    }
+    strlcpy(sync->cursor_key, (const char *)sqlite3_column_text(stmt, 1), sizeof(sync->cursor_key));
+    row.name = (char *)sqlite3_column_text(stmt, 2);
+    row.time_registered = (time_t)sqlite3_column_int64(stmt, 3);
+    obsacc_send_certfp(&me, NULL, to, &row, (time_t)sqlite3_column_int64(stmt, 4), sync->cursor_key, !sqlite3_column_int(stmt, 5));
+}
+
+/**
+ * obsacc_sync_step - Sends the next batch of a sync, stopping early while the link's sendq is full.
+ * The rows come from the database by (seq, key), so a row changed while the sync runs moves
+ * past the cursor and is read again. Returns 1 once the sync is complete, -1 if a read failed.
+ */
+static int obsacc_sync_step(ObsaccSync *sync, Client *to)
+{
+    int n = 0, rc;
+
+    if (db_writer_state.completed < sync->wait_for)
+    {
+        return 0;
+    }
+    while (sync->stage != OBSACC_SYNC_DONE)
+    {
+        sqlite3_stmt *stmt = sync->stage == OBSACC_SYNC_ACCOUNTS ? stmts.sync_accounts
+                           : sync->stage == OBSACC_SYNC_METADATA ? stmts.sync_metadata : stmts.sync_certfps;
+        int param = 1;
+
+        sqlite3_bind_int64(stmt, param++, (sqlite3_int64)sync->cursor_seq);
+        if (sync->stage != OBSACC_SYNC_CERTFPS)
+        {
+            sqlite3_bind_int64(stmt, param++, sync->cursor_id);
+        }
+        if (sync->stage != OBSACC_SYNC_ACCOUNTS)
+        {
+            sqlite3_bind_text(stmt, param++, sync->cursor_key, -1, SQLITE_TRANSIENT);
+        }
+        sqlite3_bind_int(stmt, param, OBSACC_SYNC_BATCH);
+        rc = SQLITE_ROW;
+        while (n < OBSACC_SYNC_BATCH && DBufLength(&to->local->sendQ) <= OBSACC_SYNC_SENDQ
+               && (rc = sqlite3_step(stmt)) == SQLITE_ROW)
+        {
+            obsacc_sync_row(sync, to, stmt);
+            sync->sent++;
+            n++;
+        }
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+        if (rc == SQLITE_ROW)
+        {
+            return 0;
+        }
+        if (rc != SQLITE_DONE)
+        {
+            unreal_log(ULOG_WARNING, "obsidianirc", "OBSACC_SYNC_FAILED", to, "Could not read the changes for $client: $error",
+                log_data_string("error", sqlite3_errmsg(db)));
+            return -1;
+        }
+        sync->stage++;
+        sync->cursor_seq = sync->since + 1;
+        sync->cursor_id = -1;
+        *sync->cursor_key = '\0';
+    }
+    return 1;
+}
+
+/**
+ * obsacc_mark - Tells a synced server how far it has our changes, every OBSACC_MARK_INTERVAL.
+ * Everything up to completed_seq went out live or in the sync. Rows of an unfinished
+ * import did not, so there is no MARK until obsacc_resync() sent them.
+ */
+static void obsacc_mark(ObsaccSync *sync, Client *to)
+{
+    if (db_writer_state.imports || db_writer_state.completed_seq <= sync->marked || TStime() - sync->marked_at < OBSACC_MARK_INTERVAL)
+    {
+        return;
+    }
+    sync->marked = db_writer_state.completed_seq;
+    sync->marked_at = TStime();
+    sendto_one(to, NULL, ":%s %s MARK %llu", me.id, CMD_OBSACC, (unsigned long long)sync->marked);
+}
+
+/**
+ * obsacc_sync - Event that sends the next batch of every unfinished sync, and the MARKs.
+ */
+EVENT(obsacc_sync)
+{
+    for (ObsaccSync **pp = &obsacc_syncs, *sync; (sync = *pp); )
+    {
+        Client *to = hash_find_id(sync->server_id, NULL);
+        int rc = 1;
+
+        if (!to || !MyConnect(to) || IsDead(to))
+        {
+            rc = -1;
+        }
+        else if (sync->stage != OBSACC_SYNC_DONE && (rc = obsacc_sync_step(sync, to)) > 0)
+        {
+            unreal_log(ULOG_INFO, "obsidianirc", "OBSACC_SYNC", to, "Sent $count changed rows to $client",
+                log_data_integer("count", sync->sent));
+        }
+        if (rc < 0)
+        {
+            *pp = sync->next;
+            free(sync);
+            continue;
+        }
+        if (sync->stage == OBSACC_SYNC_DONE)
+        {
+            obsacc_mark(sync, to);
+        }
+        pp = &sync->next;
+    }
+}
+
+/**
+ * free_obsacc_syncs - Drops the syncs (called in MOD_UNLOAD).
+ */
+void free_obsacc_syncs(void)
+{
+    for (ObsaccSync *sync = obsacc_syncs, *next; sync; sync = next)
+    {
+        next = sync->next;
+        free(sync);
+    }
+    obsacc_syncs = NULL;
+}
+
+/**
+ * obsacc_server_sync - Hook for HOOKTYPE_SERVER_SYNC, asks a newly linked server for what we missed.
+ * The mark is kept by server name, the server id may change between links.
+ */
+int obsacc_server_sync(Client *client)
+{
+    sqlite3_stmt *stmt = stmts.select_peer_mark;
+    uint64_t mark = 0;
+
+    if (!MyConnect(client))
+    {
+        return 0;
+    }
+    sqlite3_bind_text(stmt, 1, client->name, -1, SQLITE_STATIC);
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        mark = (uint64_t)sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    sendto_one(client, NULL, ":%s %s HELLO %llu", me.id, CMD_OBSACC, (unsigned long long)mark);
+    return 0;
+}
+
+/**
+ * cmd_obsacc - OBSACC from another server, see the comment above obsacc_send().
+ */
+CMD_FUNC(cmd_obsacc)
+{
+    time_t time_registered, updated_at;
+
+    if (parc < 3 || BadPtr(parv[1]))
+    {
+        return;
+    }
+    if (!strcmp(parv[1], "HELLO"))
+    {
+        // Only ever sent over a direct link, not passed on. Answered in batches by EVENT(obsacc_sync).
+        if (MyConnect(client))
+        {
+            obsacc_sync_start(client, strtoull(parv[2], NULL, 10));
+        }
+        return;
+    }
+    if (!strcmp(parv[1], "MARK"))
+    {
+        // Also only over a direct link, how far we have that server's changes
+        if (MyConnect(client))
+        {
+            db_write_peer_mark(client->name, strtoull(parv[2], NULL, 10));
+        }
+        return;
+    }
+    if (parc < 4 || strlen(parv[2]) > MAX_ACCOUNT_NAME_LENGTH || strpbrk(parv[2], " ,*?!@\r\n\t"))
+    {
+        return;
+    }
+    if (!strcmp(parv[1], "PUT") && parc >= 8)
+    {
+        if (strncmp(parv[6], "$argon2", 7))
+        {
+            return;
+        }
+        if (obsacc_apply_put(parv[2], (time_t)atoll(parv[3]), (time_t)atoll(parv[4]), atoi(parv[5]) > 0, parv[6], parv[7]))
+        {
+            obsacc_send(client, client, NULL, "PUT %s %s %s %s %s :%s", parv[2], parv[3], parv[4], parv[5], parv[6], parv[7]);
+        }
+        return;
+    }
+    // The rest is passed on by obsacc_row_written(), if it is newer than what we have
+    if (parc < 6)
+    {
+        return;
+    }
+    time_registered = (time_t)atoll(parv[3]);
+    updated_at = (time_t)atoll(parv[4]);
+    if ((!strcmp(parv[1], "META") && parc >= 7) || !strcmp(parv[1], "METADEL"))
+    {
+        const char *value = !strcmp(parv[1], "META") ? parv[6] : NULL;
+
+        if (!valid_metadata_key(parv[5]) || (value && !valid_metadata_value(value)))
+        {
+            return;
+        }
+        db_write_by_name(DB_WRITE_METADATA_SET, parv[2], time_registered, parv[5], value, updated_at, client);
+        return;
+    }
+    if (!strcmp(parv[1], "CERTFP") && parc >= 7)
+    {
+        char certfp[CERTFP_LENGTH + 1];
+        bool add = !strcmp(parv[5], "ADD");
+
+        if ((!add && strcmp(parv[5], "DEL")) || !valid_certfp(parv[6], certfp))
+        {
+            return;
+        }
+        db_write_by_name(add ? DB_WRITE_CERTFP_ADD : DB_WRITE_CERTFP_DEL, parv[2], time_registered, certfp, NULL, updated_at, client);
+    }
+}
+
+/**
+ * load_session_tokens - Reads the session token key, creating it on first use, and the
+ * revocations that have not expired yet (called in MOD_LOAD, before the db writer starts).
+ * Returns 1 on success, 0 on failure.
+ */
+int load_session_tokens(void)
+{
+    sqlite3_stmt *stmt;
+    time_t now = time(NULL);
+    int rc;
+
+    free_session_tokens();
+    if (sqlite3_prepare_v2(db, "SELECT secret FROM session_secret WHERE id = 1", -1, &stmt, NULL) != SQLITE_OK)
+    {
+        return 0;
+    }
+    if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_bytes(stmt, 0) == SESSION_SECRET_LENGTH)
+    {
+        memcpy(session_tokens.secret, sqlite3_column_blob(stmt, 0), SESSION_SECRET_LENGTH);
+        session_tokens.loaded = true;
+    }
+    sqlite3_finalize(stmt);
+
+    if (!session_tokens.loaded)
+    {
+        for (int i = 0; i < SESSION_SECRET_LENGTH; i++)
+        {
+            session_tokens.secret[i] = getrandom8();
+        }
+        if (sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO session_secret (id, secret) VALUES (1, ?)", -1, &stmt, NULL) != SQLITE_OK)
+        {
+            return 0;
+        }
+        sqlite3_bind_blob(stmt, 1, session_tokens.secret, SESSION_SECRET_LENGTH, SQLITE_STATIC);
+        rc = sqlite3_step(stmt);
+        sqlite3_finalize(stmt);
+        if (rc != SQLITE_DONE)
+        {
+            return 0;
+        }
+        session_tokens.loaded = true;
+    }
+
+    // Revocations of expired tokens don't matter any more, the expiry check rejects those
+    sqlite3_exec(db, "DELETE FROM session_revocations WHERE expires <= strftime('%s', 'now')", NULL, NULL, NULL);
+    if (sqlite3_prepare_v2(db, "SELECT token_id, expires, account_id FROM session_revocations", -1, &stmt, NULL) != SQLITE_OK)
+    {
+        return 0;
+    }
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        time_t expires = (time_t)sqlite3_column_int64(stmt, 1);
+        if (expires > now)
+        {
+            session_token_revoke((uint64_t)sqlite3_column_int64(stmt, 0), (long int)sqlite3_column_int64(stmt, 2), expires);
+        }
+    }
+    sqlite3_finalize(stmt);
+    return 1;
+}
+
+/**
+ * free_session_tokens - Forgets the key and the revocation set (called in MOD_UNLOAD).
+ */
+void free_session_tokens(void)
+{
+    for (int i = 0; i < SESSION_REVOCATION_HASH_SIZE; i++)
+    {
+        for (RevokedToken *r = session_tokens.revoked[i], *next; r; r = next)
+        {
+            next = r->next;
+            free(r);
+        }
+    }
+    memset(&session_tokens, 0, sizeof(session_tokens));
+}
+
+/**
+ * session_token_revoked - Checks the revocation set, dropping expired entries from the bucket on the way.
+ */
+static bool session_token_revoked(uint64_t token_id, time_t now)
+{
+    RevokedToken **rp = &session_tokens.revoked[token_id & (SESSION_REVOCATION_HASH_SIZE - 1)];
+
+    while (*rp)
+    {
+        RevokedToken *r = *rp;
+        if (r->expires <= now)
+        {
+            *rp = r->next;
+            free(r);
+            session_tokens.revoked_count--;
+            continue;
+        }
+        if (r->token_id == token_id)
+        {
+            return true;
+        }
+        rp = &r->next;
+    }
+    return false;
+}
+
+/**
+ * session_token_revocations - How many tokens of an account are revoked and not expired yet.
+ * Walks the whole set, REVOKE is slowed down by fake lag so this stays rare.
+ */
+int session_token_revocations(long int account_id)
+{
+    time_t now = time(NULL);
+    int count = 0;
+
+    for (int i = 0; i < SESSION_REVOCATION_HASH_SIZE; i++)
+    {
+        for (RevokedToken *r = session_tokens.revoked[i]; r; r = r->next)
+        {
+            if (r->account_id == account_id && r->expires > now)
+            {
+                count++;
+            }
+        }
+    }
+    return count;
+}
+
+/**
+ * session_token_revoke - Adds a token to the revocation set.
+ * Returns 1 if it was added, 0 if it already was revoked.
+ */
+int session_token_revoke(uint64_t token_id, long int account_id, time_t expires)
+{
+    RevokedToken *r;
+
+    if (session_token_revoked(token_id, time(NULL)))
+    {
+        return 0;
+    }
+    r = safe_alloc(sizeof(RevokedToken));
+    r->token_id = token_id;
+    r->account_id = account_id;
+    r->expires = expires;
+    r->next = session_tokens.revoked[token_id & (SESSION_REVOCATION_HASH_SIZE - 1)];
+    session_tokens.revoked[token_id & (SESSION_REVOCATION_HASH_SIZE - 1)] = r;
+    session_tokens.revoked_count++;
+    return 1;
+}
+
+static void put_be64(unsigned char *p, uint64_t v)
+{
+    for (int i = 7; i >= 0; i--, v >>= 8)
+    {
+        p[i] = v & 0xff;
+    }
+}
+
+static uint64_t get_be64(const unsigned char *p)
+{
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+/**
+ * session_token_mac - HMAC-SHA256 of a token header. The key is derived from the
+ * account's password hash, so changing the password invalidates all its tokens.
+ */
+static int session_token_mac(const Account *acc, const unsigned char *header, unsigned char *mac)
+{
+    unsigned char key[SESSION_TOKEN_MAC_LENGTH];
+    unsigned int keylen = sizeof(key), maclen = SESSION_TOKEN_MAC_LENGTH;
+
+    if (!HMAC(EVP_sha256(), session_tokens.secret, SESSION_SECRET_LENGTH,
+              (const unsigned char *)acc->password, strlen(acc->password), key, &keylen)
+        || !HMAC(EVP_sha256(), key, keylen, header, SESSION_TOKEN_HEADER_LENGTH, mac, &maclen))
+    {
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * session_token_issue - Writes a new base64 session token for acc into buf.
+ * Returns 1 on success, 0 if tokens are turned off or buf is too small.
+ */
+int session_token_issue(const Account *acc, char *buf, size_t buflen, time_t *expires)
+{
+    unsigned char token[SESSION_TOKEN_LENGTH];
+    uint64_t token_id = ((uint64_t)getrandom32() << 32) | getrandom32();
+
+    if (!session_tokens.loaded || !MyConf.session_token_lifetime || !acc->id || !acc->password)
+    {
+        return 0;
+    }
+    *expires = TStime() + MyConf.session_token_lifetime;
+    put_be64(token, token_id);
+    put_be64(token + 8, (uint64_t)acc->id);
+    put_be64(token + 16, (uint64_t)*expires);
+    if (!session_token_mac(acc, token, token + SESSION_TOKEN_HEADER_LENGTH))
+    {
+        return 0;
+    }
+    return b64_encode(token, sizeof(token), buf, buflen) > 0;
+}
+
+/**
+ * session_token_verify - Checks a base64 session token: MAC, expiry and revocation.
+ * Returns the account it was issued for, or NULL. On success token_id and expires are set.
+ */
+Account *session_token_verify(const char *token, uint64_t *token_id, time_t *expires)
+{
+    unsigned char raw[SESSION_TOKEN_LENGTH + 3]; // Room to notice trailing garbage
+    unsigned char mac[SESSION_TOKEN_MAC_LENGTH];
+    time_t now = TStime();
+    Account *acc;
+
+    if (!session_tokens.loaded || !token || b64_decode(token, raw, sizeof(raw)) != SESSION_TOKEN_LENGTH)
+    {
+        return NULL;
+    }
+    *token_id = get_be64(raw);
+    *expires = (time_t)get_be64(raw + 16);
+    if (*expires <= now || !(acc = find_cached_account_by_id((long int)get_be64(raw + 8))) || !acc->password
+        || !session_token_mac(acc, raw, mac)
+        || CRYPTO_memcmp(mac, raw + SESSION_TOKEN_HEADER_LENGTH, SESSION_TOKEN_MAC_LENGTH)
+        || session_token_revoked(*token_id, now))
+    {
+        return NULL;
+    }
+    return acc;
+}
+
+/**
+ * sasl_login - Logs the client into an account at the end of a successful SASL exchange.
+ */
+static void sasl_login(Client *client, Account *account)
+{
+    strlcpy(client->user->account, account->name, sizeof(client->user->account));
+    unreal_log(ULOG_INFO, "account", "LOGIN", client,
+        "User $client.details logged in [account: $account] [email: $email]",
+        log_data_string("email", account->email),
+        log_data_string("account", account->name)
+    );
+    user_account_login(NULL, client);
+    if (IsDead(client))
+    {
+        return;
+    }
+    sendnumeric(client, RPL_SASLSUCCESS);
+    client->local->sasl_complete = 1;
+    DelSaslType(client);
+}
+
+/**
+ * sasl_plain_finish - Sends the SASL PLAIN outcome once the password has been verified.
+ */
+static void sasl_plain_finish(Client *client, AuthJob *job)
+{
+    if (GetSaslType(client) != SASL_TYPE_PLAIN)
+    {
+        account_stats.sasl_aborted++;
+        return; // Aborted while we were busy
+    }
+    Account *account = find_cached_account(job->account);
+    if (job->ok && account)
+    {
+        char token[128];
+        time_t expires;
+
+        account_stats.sasl_success++;
+        login_succeeded(account->name);
+        sasl_login(client, account);
+        // Lets the client reconnect with SESSION-COOKIE, skipping argon2
+        if (!IsDead(client) && session_token_issue(account, token, sizeof(token), &expires))
+        {
+            sendto_one(client, NULL, ":%s NOTE SASL SESSION_TOKEN %s %lld :Use this token with SASL SESSION-COOKIE to log in again.",
+                me.name, token, (long long)expires);
+        }
+    }
+    else
+    {
+        account_stats.sasl_bad_password++;
+        login_failed(client, job->account);
+        client->local->sasl_sent_time = 0;
+        sendnumeric(client, ERR_SASLFAIL);
+    }
+}
+
+/**
+ * identify_finish - Sends the IDENTIFY outcome once the password has been verified.
+ */
+static void identify_finish(Client *client, AuthJob *job)
+{
+    Account *acc = find_cached_account(job->account);
+    if (!acc)
+    {
+        account_stats.identify_failed++;
+        sendto_one(client, NULL, ":%s FAIL IDENTIFY ACCOUNT_NOT_FOUND :Account %s not found.", me.name, job->account);
+        return;
+    }
+
+    if (job->ok)
+    {
+        account_stats.identify_success++;
+        login_succeeded(acc->name);
+        sendto_one(client, NULL, ":%s IDENTIFY SUCCESS %s :You have been successfully identified.", me.name, acc->name);
+        strlcpy(client->user->account, acc->name, sizeof(client->user->account));
+        user_account_login(NULL, client);
+        DelSaslType(client);
+        unreal_log(ULOG_INFO, "account", "IDENTIFY", client,
+            "User $client.details identified [account: $account] [email: $email]",
+            log_data_string("email", acc->email),
+            log_data_string("account", acc->name)
+        );
+    }
+    else
+    {
+        account_stats.identify_failed++;
+        login_failed(client, acc->name);
+        sendto_one(client, NULL, ":%s FAIL IDENTIFY INVALID_PASSWORD :Invalid password for account %s.", me.name, acc->name);
+        client->local->sasl_sent_time = 0;
+    }
+}
+
+/**
+ * register_written - Done callback of the account insert queued by register_finish().
+ * The account is indexed even if the client is gone, the row exists either way.
+ */
+static void register_written(DbWrite *w)
+{
+    Account *acc = w->acc;
+    Client *client = hash_find_id(w->client_id, NULL);
+
+    if (client && (!MyConnect(client) || IsDead(client)))
+    {
+        client = NULL;
+    }
+    // write_account_to_db() refuses names that have a row, with or without the unique index
+    if (w->result == SQLITE_DONE)
+    {
+        add_cached_account(acc); // The index owns it from here on
+        w->acc = NULL;
+        account_stats.register_success++;
+        if (!client)
+        {
+            obsacc_account_register(acc, NULL); // The hook needs a client, the other servers don't
+            return;
+        }
+        sendto_one(client, NULL, ":%s REGISTER SUCCESS %s :Account registered successfully.", me.name, acc->name);
+        strlcpy(client->user->account, acc->name, sizeof(client->user->account));
+        user_account_login(NULL, client);
+        unreal_log(ULOG_INFO, "account", "REGISTER", client,
+            "New account registered by $client.details [account: $account] [email: $email]", 
+            log_data_string("account", acc->name),
+            log_data_string("email", acc->email)
+        );
+        RunHook(HOOKTYPE_ACCOUNT_REGISTER, acc, client);
+        return;
+    }
+    account_stats.register_failed++;
+    if (!client)
+    {
+        return;
+    }
+    if ((w->result & 0xff) == SQLITE_CONSTRAINT)
+    {
+        sendto_one(client, NULL, ":%s FAIL REGISTER ACCOUNT_EXISTS %s :That account name is already registered.", me.name, acc->name);
+    }
+    else
+    {
+        sendto_one(client, NULL, ":%s FAIL REGISTER INTERNAL_ERROR :Failed to register account.", me.name);
+    }
+}
+
+/**
+ * register_finish - Stores the new account once its password has been hashed.
+ */
+static void register_finish(Client *client, AuthJob *job)
+{
+    if (!job->ok)
+    {
+        account_stats.register_failed++;
+        sendto_one(client, NULL, ":%s FAIL REGISTER SERVER_BUG %s :The hashing mechanism was not supported. Please contact an administrator.", me.name, job->account);
+        return;
+    }
+    // Someone else may have registered it while we were hashing
+    if (find_cached_account(job->account))
+    {
+        account_stats.register_failed++;
+        sendto_one(client, NULL, ":%s FAIL REGISTER ACCOUNT_EXISTS %s :That account name is already registered.", me.name, job->account);
+        return;
+    }
+    // Create and store new account
+    Account *acc = safe_alloc(sizeof(Account));
+    acc->name = strdup(job->account);
+    acc->email = strdup(job->email);
+    acc->password = strdup(job->hash);
+    acc->time_registered = time(NULL);
+    acc->updated_at = acc->time_registered;
+    acc->verified = 0;
+    acc->channels = NULL;
+    acc->metadata = NULL;
+
+    // register_written() replies once the row is committed
+    if (!db_write_account(client, acc, register_written))
+    {
+        account_stats.register_failed++;
+        sendto_one(client, NULL, ":%s FAIL REGISTER INTERNAL_ERROR :Failed to register account.", me.name);
+    }
+}
+
+/**
+ * auth_job_abort - Tells the client a job of theirs was dropped without an answer.
+ */
+static void auth_job_abort(Client *client, AuthJob *job)
+{
+    if (job->origin == AUTH_FOR_SASL)
+    {
+        account_stats.sasl_aborted++;
+        if (GetSaslType(client) == SASL_TYPE_PLAIN)
+        {
+            sendnumeric(client, ERR_SASLFAIL);
+        }
+    }
+    else if (job->origin == AUTH_FOR_IDENTIFY)
+    {
+        sendto_one(client, NULL, ":%s FAIL IDENTIFY TEMPORARILY_UNAVAILABLE %s :Please try again later.", me.name, job->account);
+    }
+    else
+    {
+        sendto_one(client, NULL, ":%s FAIL REGISTER TEMPORARILY_UNAVAILABLE %s :Please try again later.", me.name, job->account);
+    }
+}
+
+/**
+ * auth_pool_complete - Reads finished jobs off the pipe and replies to their clients (main loop).
+ */
+static void auth_pool_complete(int fd, int revents, void *data)
+{
+    AuthJob *job, *next;
+
+    drain_wakeup_pipe(fd);
+
+    pthread_mutex_lock(&auth_pool.lock);
+    job = auth_pool.done_head;
+    auth_pool.done_head = auth_pool.done_tail = NULL;
+    pthread_mutex_unlock(&auth_pool.lock);
+
+    for (; job; job = next)
+    {
+        next = job->next;
+        histogram_add(job->origin == AUTH_FOR_REGISTER ? &account_stats.argon2_hash_ns : &account_stats.argon2_verify_ns, job->work_ns);
+        histogram_add(&account_stats.auth_wait_ns, monotonic_nsec() - job->queued_ns);
+        Client *client = hash_find_id(job->client_id, NULL);
+        if (client && MyConnect(client) && !IsDead(client))
+        {
+            ClearAuthPending(client);
+            if (job->origin == AUTH_FOR_SASL)
+            {
+                sasl_plain_finish(client, job);
+            }
+            else if (job->origin == AUTH_FOR_IDENTIFY)
+            {
+                identify_finish(client, job);
+            }
+            else
+            {
+                register_finish(client, job);
+            }
+        }
+        auth_job_free(job);
+    }
+}
+
+/**
+ * auth_pool_submit - Queues a job for the workers.
+ * Returns 1 on success, 0 if the pool is not running or its queue is full.
+ */
+static int auth_pool_submit(Client *client, AuthJob *job)
+{
+    int queued = 0;
+
+    strlcpy(job->client_id, client->id, sizeof(job->client_id));
+    job->queued_ns = monotonic_nsec();
+    pthread_mutex_lock(&auth_pool.lock);
+    if (auth_pool.nthreads && auth_pool.queued < MyConf.auth_queue_depth)
+    {
+        if (auth_pool.queue_tail)
+        {
+            auth_pool.queue_tail->next = job;
+        }
+        else
+        {
+            auth_pool.queue_head = job;
+        }
+        auth_pool.queue_tail = job;
+        auth_pool.queued++;
+        queued = 1;
+        pthread_cond_signal(&auth_pool.wakeup);
+    }
+    pthread_mutex_unlock(&auth_pool.lock);
+
+    if (!queued)
+    {
+        auth_job_free(job);
+        return 0;
+    }
+    SetAuthPending(client);
+    return 1;
+}
+
+/**
+ * auth_pool_verify - Hands a password to the workers to verify against an account.
+ * The reply is sent by sasl_plain_finish() or identify_finish().
+ * Returns 1 if queued, 0 if the client already has a job pending or the queue is full.
+ */
+int auth_pool_verify(Client *client, AuthJobOrigin origin, const Account *acc, const char *password)
+{
+    if (IsAuthPending(client))
+    {
+        return 0;
+    }
+    AuthJob *job = safe_alloc(sizeof(AuthJob));
+    job->origin = origin;
+    job->account = strdup(acc->name);
+    job->hash = strdup(acc->password);
+    job->password = strdup(password);
+    return auth_pool_submit(client, job);
+}
+
+/**
+ * auth_pool_hash - Hands a password to the workers to hash for a new account.
+ * The reply is sent by register_finish().
+ * Returns 1 if queued, 0 if the client already has a job pending or the queue is full.
+ */
+int auth_pool_hash(Client *client, const char *name, const char *email, const char *password)
+{
+    if (IsAuthPending(client))
+    {
+        return 0;
+    }
+    AuthJob *job = safe_alloc(sizeof(AuthJob));
+    job->origin = AUTH_FOR_REGISTER;
+    job->account = strdup(name);
+    job->email = strdup(email);
+    job->password = strdup(password);
+    for (size_t i = 0; i < sizeof(job->salt); i++)
+    {
+        job->salt[i] = getrandom8();
+    }
+    return auth_pool_submit(client, job);
+}
+
+/**
+ * auth_pool_start - Starts the auth worker threads (called in MOD_LOAD).
+ * Returns 1 on success, 0 on failure.
+ */
+int auth_pool_start(void)
+{
+    int nthreads = MyConf.auth_threads;
+
+    if (nthreads < MIN_AUTH_THREADS || nthreads > MAX_AUTH_THREADS)
+    {
+        nthreads = DEFAULT_AUTH_THREADS;
+    }
+    if (!open_wakeup_pipe(auth_pool.pipefd, "obsidianirc auth pool", auth_pool_complete))
+    {
+        return 0;
+    }
+
+    pthread_mutex_init(&auth_pool.lock, NULL);
+    pthread_cond_init(&auth_pool.wakeup, NULL);
+    auth_pool.shutdown = false;
+    for (auth_pool.nthreads = 0; auth_pool.nthreads < nthreads; auth_pool.nthreads++)
+    {
+        if (pthread_create(&auth_pool.threads[auth_pool.nthreads], NULL, auth_worker, NULL))
+        {
+            break;
+        }
+    }
+    return auth_pool.nthreads > 0;
+}
+
+/**
+ * auth_pool_stop - Stops the workers and drops unfinished jobs (called in MOD_UNLOAD).
+ */
+void auth_pool_stop(void)
+{
+    AuthJob *lists[2], *job, *next;
+
+    if (auth_pool.pipefd[0] < 0)
+    {
+        return;
+    }
+    pthread_mutex_lock(&auth_pool.lock);
+    auth_pool.shutdown = true;
+    pthread_cond_broadcast(&auth_pool.wakeup);
+    pthread_mutex_unlock(&auth_pool.lock);
+    for (int i = 0; i < auth_pool.nthreads; i++)
+    {
+        pthread_join(auth_pool.threads[i], NULL);
+    }
+    auth_pool.nthreads = 0;
+
+    lists[0] = auth_pool.queue_head;
+    lists[1] = auth_pool.done_head;
+    for (int i = 0; i < 2; i++)
+    {
+        for (job = lists[i]; job; job = next)
+        {
+            next = job->next;
+            Client *client = hash_find_id(job->client_id, NULL);
+            if (client && MyConnect(client) && !IsDead(client))
+            {
+                ClearAuthPending(client);
+                auth_job_abort(client, job);
+            }
+            auth_job_free(job);
+        }
+    }
+    auth_pool.queue_head = auth_pool.queue_tail = auth_pool.done_head = auth_pool.done_tail = NULL;
+    auth_pool.queued = 0;
+    pthread_cond_destroy(&auth_pool.wakeup);
+    pthread_mutex_destroy(&auth_pool.lock);
+
+    close_wakeup_pipe(auth_pool.pipefd);
+}
+
+/**
+ * authenticate_attempt - Hook to handle authentication attempts.
+ * This is called when a client attempts to authenticate when we
+ * are the SASL server.
+ */
+int authenticate_attempt(Client *client, int first, const char *param)
+{
+    if (!SASL_SERVER || !MyConnect(client) || !param || !*param)
+    {
+        return 0;
+    }
+    if (!strcmp(param, "*")) // abort
+    {
+        if (GetSaslType(client))
+        {
+            DelSaslType(client);
+            return 0;
+        }
+    }
+    else if (!strcmp(param,"PLAIN"))
+    {
+        SetSaslType(client, SASL_TYPE_PLAIN);
+        sendto_one(client, NULL, ":%s AUTHENTICATE +", me.name);
+        return 0;
+    }
+    else if (!strcmp(param, "ANONYMOUS"))
+    {
+        strlcpy(client->user->account, "0", sizeof("0"));
+        user_account_login(NULL, client);
+
+        if (IsDead(client)) // Can be dead at this point
+        {
+            return 0;
+        }
+
+        if (GetSaslType(client))
+        {
+            client->local->sasl_complete = 0;
+            sendnumeric(client, RPL_SASLSUCCESS);
+            DelSaslType(client);
+        }
+
+        return 0;
+    }
+    else if (!strcmp(param, "EXTERNAL"))
+    {
+        SetSaslType(client, SASL_TYPE_EXTERNAL);
+        sendto_one(client, NULL, ":%s AUTHENTICATE +", me.name);
+        return 0;
+    }
+    else if (!strcmp(param, "SESSION-COOKIE"))
+    {
+        SetSaslType(client, SASL_TYPE_SESSION_COOKIE);
+        sendto_one(client, NULL, ":%s AUTHENTICATE +", me.name);
+        return 0;
+    }
+
+    if (!GetSaslType(client) || GetSaslType(client) == SASL_TYPE_NONE)
+    {
+        return 0;
+    }
+    else if (GetSaslType(client) == SASL_TYPE_PLAIN)
+    {
+        char *auth, *username, *password;
+
+        // The first payload is still being verified and gets the answer, a FAIL now would contradict it
+        if (IsAuthPending(client))
+        {
+            account_stats.sasl_busy++;
+            return 0;
+        }
+        if (!decode_authenticate_plain(param, &auth, &username, &password))
+        {
+            sendnumeric(client, ERR_SASLFAIL);
+            return 0;
+        }
+
+        if (BadPtr(username) || BadPtr(password))
+        {
+            sendnumeric(client, ERR_SASLFAIL);
+            return 0;
+        }
+
+        // Refused before the lookup and the argon2 verify, that's what the limiter saves
+        if (login_limited(client, username))
+        {
+            account_stats.login_rate_limited++;
+            client->local->sasl_sent_time = 0;
+            sendnumeric(client, ERR_SASLFAIL);
+            return 0;
+        }
+
+        Account *account = find_cached_account(username);
+        if (!account)
+        {
+            account_stats.sasl_unknown_account++;
+            login_failed(client, NULL);
+            client->local->sasl_sent_time = 0;
+            sendnumeric(client, ERR_SASLFAIL);
+        }
+        // Verified by the auth worker pool, sasl_plain_finish() replies. Only fails if the queue is full.
+        else if (!auth_pool_verify(client, AUTH_FOR_SASL, account, password))
+        {
+            account_stats.sasl_busy++;
+            sendnumeric(client, ERR_SASLFAIL);
+        }
+        return 0;
+    }
+    else if (GetSaslType(client) == SASL_TYPE_EXTERNAL)
+    {
+        const char *fp = moddata_client_get(client, "certfp");
+        char certfp[CERTFP_LENGTH + 1];
+        char authzid[NICKLEN + MAX_ACCOUNT_NAME_LENGTH + 1];
+        Account *account;
+
+        if (login_limited(client, NULL))
+        {
+            account_stats.login_rate_limited++;
+            client->local->sasl_sent_time = 0;
+            sendnumeric(client, ERR_SASLFAIL);
+            return 0;
+        }
+        account = fp && valid_certfp(fp, certfp) ? find_certfp(certfp) : NULL;
+
+        // "+" is an empty authzid, anything else must name the account the certificate belongs to
+        if (account && strcmp(param, "+"))
+        {
+            int n = b64_decode(param, (unsigned char *)authzid, sizeof(authzid) - 1);
+            if (n < 0)
+            {
+                account = NULL;
+            }
+            else
+            {
+                authzid[n] = '\0';
+                if (*authzid && strcasecmp(authzid, account->name))
+                {
+                    account = NULL;
+                }
+            }
+        }
+        if (!account)
+        {
+            account_stats.sasl_external_failed++;
+            login_failed(client, NULL);
+            client->local->sasl_sent_time = 0;
+            sendnumeric(client, ERR_SASLFAIL);
+            return 0;
+        }
+        account_stats.sasl_external_success++;
+        sasl_login(client, account);
+    }
+    else if (GetSaslType(client) == SASL_TYPE_SESSION_COOKIE)
+    {
+        // Two HMACs and a hash lookup, cheap enough for the main loop
+        uint64_t start, token_id;
+        time_t expires;
+        Account *account;
+
+        if (login_limited(client, NULL))
+        {
+            account_stats.login_rate_limited++;
+            client->local->sasl_sent_time = 0;
+            sendnumeric(client, ERR_SASLFAIL);
+            return 0;
+        }
+        start = monotonic_nsec();
+        account = session_token_verify(param, &token_id, &expires);
+        histogram_add(&account_stats.session_token_verify_ns, monotonic_nsec() - start);
+        if (!account)
+        {
+            account_stats.sasl_token_failed++;
+            login_failed(client, NULL);
+            client->local->sasl_sent_time = 0;
+            sendnumeric(client, ERR_SASLFAIL);
+            return 0;
+        }
+        account_stats.sasl_token_success++;
+        sasl_login(client, account);
+    }
+
+    return 0;
+}
+
+const char *saslmechs(Client *client)
+{
+    return SASL_MECHS;
+}
+
+const char *sat_serialize(ModData *m)
+{
+    static char buf[32];
+    if (m->i == 0)
+    {
+        return NULL; /* not set */
+    }
+    snprintf(buf, sizeof(buf), "%d", m->i);
+    return buf;
+}
+
+void sat_free(ModData *m)
+{
+    m->i = 0;
+}
+
+void sat_unserialize(const char *str, ModData *m)
+{
+    m->i = atoi(str);
+}
+
+/**
+ * monotonic_nsec - Returns a monotonic clock in nanoseconds, for timing operations.
+ */
+uint64_t monotonic_nsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * histogram_stats_line - Sends one STATS line summarizing a histogram, values divided by scale.
+ */
+static void histogram_stats_line(Client *client, const char *name, const StatsHistogram *h, uint64_t scale, const char *unit)
+{
+    sendtxtnumeric(client, "%s: %lu (avg %llu%s, p50 %llu%s, p99 %llu%s)", name, h->count,
+                   (unsigned long long)(h->count ? h->sum / h->count / scale : 0), unit,
+                   (unsigned long long)(histogram_percentile(h, 50) / scale), unit,
+                   (unsigned long long)(histogram_percentile(h, 99) / scale), unit);
+}
+
+/**
+ * obsidian_stats - STATS accounts, shows the account counters and timings to opers.
+ * Percentiles are bucket bounds, so they are only right to within a factor of two.
+ */
+int obsidian_stats(Client *client, const char *flag)
+{
+    if (strcmp(flag, "accounts"))
+    {
+        return 0;
+    }
+    if (!ValidatePermissionsForPath("server:info:stats", client, NULL, NULL, NULL))
+    {
+        return 0;
+    }
+    if (account_stats.cache_from_snapshot)
+    {
+        sendtxtnumeric(client, "accounts: %d (loaded in %llums from the snapshot, %lu rows replayed)", account_count,
+            (unsigned long long)(account_stats.cache_load_ns / 1000000), account_stats.cache_replayed);
+    }
+    else
+    {
+        sendtxtnumeric(client, "accounts: %d (loaded in %llums)", account_count, (unsigned long long)(account_stats.cache_load_ns / 1000000));
+    }
+    sendtxtnumeric(client, "lookup-hits: %lu", account_stats.lookup_hits);
+    sendtxtnumeric(client, "lookup-misses: %lu", account_stats.lookup_misses);
+    histogram_stats_line(client, "lookup-latency", &account_stats.lookup_ns, 1, "ns");
+    histogram_stats_line(client, "auth-wait", &account_stats.auth_wait_ns, 1000, "us");
+    histogram_stats_line(client, "argon2-verify", &account_stats.argon2_verify_ns, 1000, "us");
+    histogram_stats_line(client, "argon2-hash", &account_stats.argon2_hash_ns, 1000, "us");
+    histogram_stats_line(client, "db-commit", &account_stats.db_commit_ns, 1000, "us");
+    histogram_stats_line(client, "db-batch-size", &account_stats.db_batch_size, 1, "");
+    sendtxtnumeric(client, "db-write-errors: %lu", account_stats.db_write_errors);
+    sendtxtnumeric(client, "sasl-success: %lu", account_stats.sasl_success);
+    sendtxtnumeric(client, "sasl-bad-password: %lu", account_stats.sasl_bad_password);
+    sendtxtnumeric(client, "sasl-unknown-account: %lu", account_stats.sasl_unknown_account);
+    sendtxtnumeric(client, "sasl-busy: %lu", account_stats.sasl_busy);
+    sendtxtnumeric(client, "sasl-aborted: %lu", account_stats.sasl_aborted);
+    sendtxtnumeric(client, "sasl-token-success: %lu", account_stats.sasl_token_success);
+    sendtxtnumeric(client, "sasl-token-failed: %lu", account_stats.sasl_token_failed);
+    sendtxtnumeric(client, "sasl-external-success: %lu", account_stats.sasl_external_success);
+    sendtxtnumeric(client, "sasl-external-failed: %lu", account_stats.sasl_external_failed);
+    sendtxtnumeric(client, "certfps: %d", certfps.count);
+    sendtxtnumeric(client, "login-rate-limited: %lu", account_stats.login_rate_limited);
+    sendtxtnumeric(client, "login-limit-entries: %d", login_limits.count);
+    histogram_stats_line(client, "session-token-verify", &account_stats.session_token_verify_ns, 1000, "us");
+    sendtxtnumeric(client, "session-tokens-revoked: %d", session_tokens.revoked_count);
+    sendtxtnumeric(client, "identify-success: %lu", account_stats.identify_success);
+    sendtxtnumeric(client, "identify-failed: %lu", account_stats.identify_failed);
+    sendtxtnumeric(client, "register-success: %lu", account_stats.register_success);
+    sendtxtnumeric(client, "register-failed: %lu", account_stats.register_failed);
+    sendtxtnumeric(client, "nick-enforce-pending: %d", nick_wheel.pending);
+    sendtxtnumeric(client, "nick-enforce-warned: %lu", account_stats.nick_enforce_warned);
+    sendtxtnumeric(client, "nick-enforce-renamed: %lu", account_stats.nick_enforce_renamed);
+    return 1;
+}
+
+
+/**
+ * account2json - Converts an Account struct to a JSON object.
+ * Returns a new json_t* object.
+ */
+json_t* account2json(const Account *acc) {
+    return account2json_fields(acc, ACCOUNT_FIELDS_ALL);
+}
+
+/**
+ * account2json_fields - Like account2json(), but only with the ACCOUNT_FIELD_* bits in fields.
+ * Returns a new json_t* object.
+ */
+json_t* account2json_fields(const Account *acc, int fields)
+{
+    json_t *j = json_object();
+    if (fields & ACCOUNT_FIELD_ID)
+        json_object_set_new(j, "id", acc->id ? json_integer(acc->id) : 0);
+    if (fields & ACCOUNT_FIELD_NAME)
+        json_object_set_new(j, "name", json_string(acc->name));
+    if (fields & ACCOUNT_FIELD_EMAIL)
+        json_object_set_new(j, "email", json_string(acc->email));
+    if (fields & ACCOUNT_FIELD_PASSWORD)
+        json_object_set_new(j, "password", json_string(acc->password));
+    if (fields & ACCOUNT_FIELD_TIME_REGISTERED)
+        json_object_set_new(j, "time_registered", json_integer(acc->time_registered));
+    if (fields & ACCOUNT_FIELD_VERIFIED)
+        json_object_set_new(j, "verified", json_integer(acc->verified));
+
+    // Channels array
+    if (fields & ACCOUNT_FIELD_CHANNELS)
+    {
+        json_t *jchannels = json_array();
+        if (acc->channels) {
+            for (char **c = acc->channels; *c; ++c)
+                json_array_append_new(jchannels, json_string(*c));
+        }
+        json_object_set_new(j, "channels", jchannels);
+    }
+
+    // Metadata array
+    if (fields & ACCOUNT_FIELD_METADATA)
+    {
+        json_t *jmeta = json_array();
+        AccountMetadata *copy;
+        const AccountMetadata *md = account_metadata_peek(acc, &copy);
+        for (const char *key = metadata_first(md); key; key = metadata_next(md, key))
+        {
+            json_t *mj = json_object();
+            json_object_set_new(mj, "key", json_string(key));
+            json_object_set_new(mj, "value", json_string(metadata_value(key)));
+            json_array_append_new(jmeta, mj);
+        }
+        free(copy);
+        json_object_set_new(j, "metadata", jmeta);
+    }
+    
+    if (fields & ACCOUNT_FIELD_ONLINE_CLIENTS)
+    {
+        json_t *jmembers = json_object();
+        for (AccountMember *m = acc->members; m; m = m->next)
+            json_expand_client(jmembers, m->client->id, m->client, 2);
+        
+        json_object_set_new(j, "online_clients", jmembers);
+    }
+    
+    return j;
+}
+
+/**
+ * rpc_account_fields - Parses the optional "fields" parameter, an array of field names.
+ * Returns the ACCOUNT_FIELD_* bits, ACCOUNT_FIELDS_ALL if it is absent, or -1 if it is invalid.
+ */
+static int rpc_account_fields(json_t *params)
+{
+    static const struct {
+        const char *name;
+        int field;
+    } names[] = {
+        { "id", ACCOUNT_FIELD_ID },
+        { "name", ACCOUNT_FIELD_NAME },
+        { "email", ACCOUNT_FIELD_EMAIL },
+        { "password", ACCOUNT_FIELD_PASSWORD },
+        { "time_registered", ACCOUNT_FIELD_TIME_REGISTERED },
+        { "verified", ACCOUNT_FIELD_VERIFIED },
+        { "channels", ACCOUNT_FIELD_CHANNELS },
+        { "metadata", ACCOUNT_FIELD_METADATA },
+        { "online_clients", ACCOUNT_FIELD_ONLINE_CLIENTS },
+    };
+    json_t *jfields = json_object_get(params, "fields");
+    json_t *jfield;
+    size_t index;
+    int fields = 0;
+
+    if (!jfields)
+    {
+        return ACCOUNT_FIELDS_ALL;
+    }
+    if (!json_is_array(jfields))
+    {
+        return -1;
+    }
+    json_array_foreach(jfields, index, jfield)
+    {
+        const char *name = json_string_value(jfield);
+        size_t i;
+
+        for (i = 0; name && i < ARRAY_SIZEOF(names); i++)
+        {
+            if (!strcmp(names[i].name, name))
+            {
+                break;
+            }
+        }
+        if (!name || i == ARRAY_SIZEOF(names))
+        {
+            return -1;
+        }
+        fields |= names[i].field;
+    }
+    return fields;
+}
+
+/**
+ * rpc_list_accounts - obsidianirc.accounts.list, one page of accounts in id order.
+ * Parameters (all optional):
+ * - after_id: only return accounts with a higher id, pass the previous page's next_after_id
+ * - limit: page size, at most ACCOUNT_LIST_MAX_LIMIT
+ * - fields: array of fields to include, all of them by default
+ * The result has "accounts", "total" and "next_after_id", which is null on the last page.
+ */
+RPC_CALL_FUNC(rpc_list_accounts)
+{
+    json_int_t after_id, limit;
+    int fields;
+
+    OPTIONAL_PARAM_INTEGER("after_id", after_id, 0);
+    OPTIONAL_PARAM_INTEGER("limit", limit, ACCOUNT_LIST_DEFAULT_LIMIT);
+    if (limit < 1 || limit > ACCOUNT_LIST_MAX_LIMIT)
+    {
+        rpc_error_fmt(client, request, JSON_RPC_ERROR_INVALID_PARAMS, "Parameter 'limit' must be between 1 and %d", ACCOUNT_LIST_MAX_LIMIT);
+        return;
+    }
+    if ((fields = rpc_account_fields(params)) < 0)
+    {
+        rpc_error(client, request, JSON_RPC_ERROR_INVALID_PARAMS, "Parameter 'fields' must be an array of account field names");
+        return;
+    }
+    if (!account_count)
+    {
+        rpc_error(client, request, JSON_RPC_ERROR_NOT_FOUND, "No accounts registered.");
+        return;
+    }
+
+    json_t *jaccounts = json_array(), *result = json_object();
+    int i = accounts_by_id_search(after_id);
+    int n;
+    for (n = 0; n < limit && i < accounts_by_id.count; n++, i++)
+    {
+        json_array_append_new(jaccounts, account2json_fields(accounts_by_id.items[i], fields));
+    }
+    json_object_set_new(result, "accounts", jaccounts);
+    json_object_set_new(result, "total", json_integer(account_count));
+    json_object_set_new(result, "next_after_id", i < accounts_by_id.count ? json_integer(accounts_by_id.items[i - 1]->id) : json_null());
+    rpc_response(client, request, result);
+    json_decref(result);
+}
+
+/**
+ * rpc_accounts_search - obsidianirc.accounts.search, accounts matching a name pattern and/or email domain.
+ * Parameters:
+ * - name: pattern with * and ? wildcards (optional)
+ * - email_domain: exact email domain (optional), at least one of these two is required
+ * - offset, limit: which page of the matches to return, limit at most ACCOUNT_LIST_MAX_LIMIT
+ * - fields: like obsidianirc.accounts.list
+ * The result has "accounts" and "count", the total number of matches.
+ */
+RPC_CALL_FUNC(rpc_accounts_search)
+{
+    const char *pattern, *domain;
+    json_int_t offset, limit;
+    int fields;
+
+    OPTIONAL_PARAM_STRING("name", pattern);
+    OPTIONAL_PARAM_STRING("email_domain", domain);
+    OPTIONAL_PARAM_INTEGER("offset", offset, 0);
+    OPTIONAL_PARAM_INTEGER("limit", limit, ACCOUNT_LIST_DEFAULT_LIMIT);
+    if (!pattern && !domain)
+    {
+        rpc_error(client, request, JSON_RPC_ERROR_INVALID_PARAMS, "Missing parameter: 'name' or 'email_domain'");
+        return;
+    }
+    if (offset < 0 || offset > INT_MAX - ACCOUNT_LIST_MAX_LIMIT)
+    {
+        rpc_error(client, request, JSON_RPC_ERROR_INVALID_PARAMS, "Parameter 'offset' is out of range");
+        return;
+    }
+    if (limit < 1 || limit > ACCOUNT_LIST_MAX_LIMIT)
+    {
+        rpc_error_fmt(client, request, JSON_RPC_ERROR_INVALID_PARAMS, "Parameter 'limit' must be between 1 and %d", ACCOUNT_LIST_MAX_LIMIT);
+        return;
+    }
+    if ((fields = rpc_account_fields(params)) < 0)
+    {
+        rpc_error(client, request, JSON_RPC_ERROR_INVALID_PARAMS, "Parameter 'fields' must be an array of account field names");
+        return;
+    }
+
+    Account **accounts = safe_alloc(sizeof(Account *) * limit);
+    int total = search_accounts(pattern, domain, (int)offset, (int)limit, accounts);
+    json_t *jaccounts = json_array(), *result = json_object();
+    for (int i = 0; i < total - offset && i < limit; i++)
+    {
+        json_array_append_new(jaccounts, account2json_fields(accounts[i], fields));
+    }
+    safe_free(accounts);
+    json_object_set_new(result, "accounts", jaccounts);
+    json_object_set_new(result, "count", json_integer(total));
+    rpc_response(client, request, result);
+    json_decref(result);
+}
+
+RPC_CALL_FUNC(rpc_accounts_find)
+{
+    if (!db)
+    {
+        rpc_error(client, request, JSON_RPC_ERROR_INTERNAL_ERROR, "Database is not available.");
+        return;
+    }
+    const char *name;
+    REQUIRE_PARAM_STRING("name", name);
+
+    Account *acc = find_account(name);
+    if (!acc)
+    {
+        rpc_error(client, request, JSON_RPC_ERROR_NOT_FOUND, "Account not found.");
+        return;
+    }
+    json_t *jacc = account2json(acc);
+    rpc_response(client, request, jacc);
+    json_decref(jacc);
+}
+
+/**
+ * rpc_accounts_metadata_set - obsidianirc.accounts.metadata.set, sets (or without "value" deletes) a metadata key.
+ */
+RPC_CALL_FUNC(rpc_accounts_metadata_set)
+{
+    const char *name, *key, *value;
+    Account *acc;
+    REQUIRE_PARAM_STRING("name", name);
+    REQUIRE_PARAM_STRING("key", key);
+    OPTIONAL_PARAM_STRING("value", value);
+
+    if (!(acc = find_cached_account(name)))
+    {
+        rpc_error(client, request, JSON_RPC_ERROR_NOT_FOUND, "Account not found.");
+        return;
+    }
+    if (!valid_metadata_key(key))
+    {
+        rpc_error(client, request, JSON_RPC_ERROR_INVALID_PARAMS, "Invalid key, keys are lowercase letters, digits and _-./");
+        return;
+    }
+    if (value && !valid_metadata_value(value))
+    {
+        rpc_error_fmt(client, request, JSON_RPC_ERROR_INVALID_PARAMS, "Invalid value, values are at most %d characters without control characters.", ACCOUNT_METADATA_MAX_VALUE_LENGTH);
+        return;
+    }
+    if (!account_metadata_set(acc, key, value))
+    {
+        rpc_error(client, request, JSON_RPC_ERROR_INVALID_PARAMS, "Too many metadata keys on this account.");
+        return;
+    }
+    json_t *jacc = account2json_fields(acc, ACCOUNT_FIELD_ID|ACCOUNT_FIELD_NAME|ACCOUNT_FIELD_METADATA);
+    rpc_response(client, request, jacc);
+    json_decref(jacc);
+}
+
+/**
+ * certfp2json - The fingerprints of an account as a JSON array.
+ */
+static json_t *certfp2json(Account *acc)
+{
+    const char *list[ACCOUNT_MAX_CERTFPS];
+    json_t *j = json_array();
+    int n = certfp_list(acc, list, ACCOUNT_MAX_CERTFPS);
+
+    for (int i = 0; i < n && i < ACCOUNT_MAX_CERTFPS; i++)
+    {
+        json_array_append_new(j, json_string(list[i]));
+    }
+    return j;
+}
+
+/**
+ * rpc_certfp_params - Gets the account and normalized fingerprint of a certfp add or del request.
+ * Returns the account, or NULL after sending an error.
+ */
+static Account *rpc_certfp_params(Client *client, json_t *request, json_t *params, char *certfp)
+{
+    const char *name, *fp;
+    Account *acc;
+
+    name = json_object_get_string(params, "name");
+    fp = json_object_get_string(params, "certfp");
+    if (!name || !fp)
+    {
+        rpc_error(client, request, JSON_RPC_ERROR_INVALID_PARAMS, "Missing parameter: 'name' and 'certfp' are required.");
+        return NULL;
+    }
+    if (!(acc = find_cached_account(name)))
+    {
+        rpc_error(client, request, JSON_RPC_ERROR_NOT_FOUND, "Account not found.");
+        return NULL;
+    }
+    if (!valid_certfp(fp, certfp))
+    {
+        rpc_error(client, request, JSON_RPC_ERROR_INVALID_PARAMS, "Invalid certfp, expected a SHA256 fingerprint in hex.");
+        return NULL;
+    }
+    return acc;
+}
+
+RPC_CALL_FUNC(rpc_accounts_certfp_add)
+{
+    char certfp[CERTFP_LENGTH + 1];
+    Account *acc = rpc_certfp_params(client, request, params, certfp);
+    int result;
+
+    if (!acc)
+    {
+        return;
+    }
+    result = certfp_add(acc, certfp);
+    if (result == 0)
+    {
+        rpc_error(client, request, JSON_RPC_ERROR_ALREADY_EXISTS, "That certfp belongs to another account.");
+        return;
+    }
+    if (result < 0)
+    {
+        rpc_error(client, request, JSON_RPC_ERROR_INVALID_PARAMS, "Too many certfps on this account.");
+        return;
+    }
+    json_t *j = certfp2json(acc);
+    rpc_response(client, request, j);
+    json_decref(j);
+}
+
+RPC_CALL_FUNC(rpc_accounts_certfp_del)
+{
+    char certfp[CERTFP_LENGTH + 1];
+    Account *acc = rpc_certfp_params(client, request, params, certfp);
+
+    if (!acc)
+    {
+        return;
+    }
+    if (!certfp_del(acc, certfp))
+    {
+        rpc_error(client, request, JSON_RPC_ERROR_NOT_FOUND, "That certfp is not on this account.");
+        return;
+    }
+    json_t *j = certfp2json(acc);
+    rpc_response(client, request, j);
+    json_decref(j);
+}
+
+RPC_CALL_FUNC(rpc_accounts_certfp_list)
+{
+    const char *name;
+    Account *acc;
+    REQUIRE_PARAM_STRING("name", name);
+
+    if (!(acc = find_cached_account(name)))
+    {
+        rpc_error(client, request, JSON_RPC_ERROR_NOT_FOUND, "Account not found.");
+        return;
+    }
+    json_t *j = certfp2json(acc);
+    rpc_response(client, request, j);
+    json_decref(j);
+}
+
+/**
+ * rpc_obsidian_stats - obsidianirc.stats, the STATS accounts counters with full histograms.
+ * Timings are in nanoseconds.
+ */
+RPC_CALL_FUNC(rpc_obsidian_stats)
+{
+    json_t *result = json_object(), *j;
+    int queued = 0;
+
+    if (auth_pool.pipefd[0] >= 0)
+    {
+        pthread_mutex_lock(&auth_pool.lock);
+        queued = auth_pool.queued;
+        pthread_mutex_unlock(&auth_pool.lock);
+    }
+
+    j = json_object();
+    json_object_set_new(j, "count", json_integer(account_count));
+    json_object_set_new(j, "load_ns", json_integer((json_int_t)account_stats.cache_load_ns));
+    json_object_set_new(j, "load_from_snapshot", json_boolean(account_stats.cache_from_snapshot));
+    json_object_set_new(j, "load_replayed", json_integer(account_stats.cache_replayed));
+    json_object_set_new(j, "lookup_hits", json_integer(account_stats.lookup_hits));
+    json_object_set_new(j, "lookup_misses", json_integer(account_stats.lookup_misses));
+    json_object_set_new(j, "lookup_ns", histogram2json(&account_stats.lookup_ns));
+    json_object_set_new(result, "accounts", j);
+
+    j = json_object();
+    json_object_set_new(j, "threads", json_integer(auth_pool.nthreads));
+    json_object_set_new(j, "queued", json_integer(queued));
+    json_object_set_new(j, "wait_ns", histogram2json(&account_stats.auth_wait_ns));
+    json_object_set_new(j, "argon2_verify_ns", histogram2json(&account_stats.argon2_verify_ns));
+    json_object_set_new(j, "argon2_hash_ns", histogram2json(&account_stats.argon2_hash_ns));
+    json_object_set_new(result, "auth", j);
+
+    j = json_object();
+    json_object_set_new(j, "commit_ns", histogram2json(&account_stats.db_commit_ns));
+    json_object_set_new(j, "batch_size", histogram2json(&account_stats.db_batch_size));
+    json_object_set_new(j, "write_errors", json_integer(account_stats.db_write_errors));
+    json_object_set_new(result, "database", j);
+
+    j = json_object();
+    json_object_set_new(j, "success", json_integer(account_stats.sasl_success));
+    json_object_set_new(j, "bad_password", json_integer(account_stats.sasl_bad_password));
+    json_object_set_new(j, "unknown_account", json_integer(account_stats.sasl_unknown_account));
+    json_object_set_new(j, "busy", json_integer(account_stats.sasl_busy));
+    json_object_set_new(j, "aborted", json_integer(account_stats.sasl_aborted));
+    json_object_set_new(j, "token_success", json_integer(account_stats.sasl_token_success));
+    json_object_set_new(j, "token_failed", json_integer(account_stats.sasl_token_failed));
+    json_object_set_new(j, "token_verify_ns", histogram2json(&account_stats.session_token_verify_ns));
+    json_object_set_new(j, "tokens_revoked", json_integer(session_tokens.revoked_count));
+    json_object_set_new(j, "external_success", json_integer(account_stats.sasl_external_success));
+    json_object_set_new(j, "external_failed", json_integer(account_stats.sasl_external_failed));
+    json_object_set_new(j, "certfps", json_integer(certfps.count));
+    json_object_set_new(j, "rate_limited", json_integer(account_stats.login_rate_limited));
+    json_object_set_new(j, "limit_entries", json_integer(login_limits.count));
+    json_object_set_new(result, "sasl", j);
+
+    j = json_object();
+    json_object_set_new(j, "success", json_integer(account_stats.identify_success));
+    json_object_set_new(j, "failed", json_integer(account_stats.identify_failed));
+    json_object_set_new(result, "identify", j);
+
+    j = json_object();
+    json_object_set_new(j, "success", json_integer(account_stats.register_success));
+    json_object_set_new(j, "failed", json_integer(account_stats.register_failed));
+    json_object_set_new(result, "register", j);
+
+    j = json_object();
+    json_object_set_new(j, "pending", json_integer(nick_wheel.pending));
+    json_object_set_new(j, "warned", json_integer(account_stats.nick_enforce_warned));
+    json_object_set_new(j, "renamed", json_integer(account_stats.nick_enforce_renamed));
+    json_object_set_new(result, "nick_enforce", j);
+
+    rpc_response(client, request, result);
+    json_decref(result);
+}
+
+// For users who don't support SASL, we provide a way to identify to an account
+// using the IDENTIFY command. This is a fallback for those who cannot use SASL.
+CMD_FUNC(cmd_identify)
+{
+    if (!db && open_database(OBSIDIAN_DB) != SQLITE_OK)
+    {
+        sendto_one(client, NULL, ":%s FAIL IDENTIFY SERVER_BUG :Database unavailable.", me.name);
+        return;
+    }
+    if (parc < 3)
+    {
+        sendto_one(client, NULL, ":%s NOTE IDENTIFY INVALID_PARAMS :Syntax: /IDENTIFY <account> <password>", me.name);
+        return;
+    }
+    const char *account_name = parv[1];
+    if (!account_name || !*account_name)
+    {
+        sendto_one(client, NULL, ":%s FAIL IDENTIFY INVALID_ACCOUNT :Account name cannot be empty.", me.name);
+        return;
+    }
+    if (!strcasecmp(account_name, client->user->account))
+    {
+        sendto_one(client, NULL, ":%s FAIL IDENTIFY ALREADY_IDENTIFIED :You are already identified to account %s.", me.name, account_name);
+        return;
+    }
+    if (strlen(account_name) < 4)
+    {
+        sendto_one(client, NULL, ":%s FAIL IDENTIFY INVALID_ACCOUNT :Account name must be at least 4 characters long.", me.name);
+        return;
+    }
+    if (login_limited(client, account_name))
+    {
+        account_stats.login_rate_limited++;
+        sendto_one(client, NULL, ":%s FAIL IDENTIFY RATE_LIMITED %s :Too many failed logins, please try again later.", me.name, account_name);
+        return;
+    }
+    // Unknown names are most of what brute-forcing sends, fail them before anything costlier
+    Account *acc = find_cached_account(account_name);
+    if (!acc)
+    {
+        login_failed(client, NULL);
+        sendto_one(client, NULL, ":%s FAIL IDENTIFY ACCOUNT_NOT_FOUND :Account %s not found.", me.name, account_name);
+        return;
+    }
+    Client *found_user = find_client(account_name, NULL);
+    if (found_user && found_user != client)
+    {
+        sendto_one(client, NULL, ":%s FAIL IDENTIFY INVALID_ACCOUNT :That account name is currently in use.", me.name);
+        return;
+    }
+    TKL *ban = my_find_tkl_nameban(account_name);
+    if (ban)
+    {
+        sendto_one(client, NULL, ":%s FAIL IDENTIFY INVALID_ACCOUNT :That account name is banned.", me.name);
+        return;
+    }
+
+    const char *password = parv[2];
+    if (!password || !*password)
+    {
+        sendto_one(client, NULL, ":%s FAIL IDENTIFY INVALID_PASSWORD :Password cannot be empty.", me.name);
+        return;
+    }
+
+    if (!client->user || !client->user->account || !*client->user->account)
+    {
+        sendto_one(client, NULL, ":%s FAIL IDENTIFY NOT_LOGGED_IN :You must be logged in to identify.", me.name);
+        return;
+    }
+
+    // Verified by the auth worker pool, identify_finish() replies
+    if (!auth_pool_verify(client, AUTH_FOR_IDENTIFY, acc, password))
+    {
+        sendto_one(client, NULL, ":%s FAIL IDENTIFY TEMPORARILY_UNAVAILABLE %s :Please try again later.", me.name, acc->name);
+    }
+}
+
+CMD_FUNC(cmd_logout)
+{
+    if (!IsLoggedIn(client))
+    {
+        sendto_one(client, NULL, ":%s FAIL LOGOUT NOT_LOGGED_IN :You are not logged in.", me.name);
+        return;
+    }
+    strlcpy(client->user->account, "0", sizeof(client->user->account));
+    user_account_login(NULL, client);
+    sendto_one(client, NULL, ":%s LOGOUT SUCCESS :You have been logged out successfully.", me.name);
+}
+
+// Session tokens for SASL SESSION-COOKIE: SESSIONTOKEN ISSUE gives you a new one for
+// the account you are logged into, SESSIONTOKEN REVOKE <token> stops one from working.
+CMD_FUNC(cmd_sessiontoken)
+{
+    Account *acc;
+    char token[128];
+    time_t expires;
+
+    if (parc >= 2 && !strcasecmp(parv[1], "ISSUE"))
+    {
+        if (!IsLoggedIn(client) || !(acc = find_cached_account(client->user->account)))
+        {
+            sendto_one(client, NULL, ":%s FAIL SESSIONTOKEN NOT_LOGGED_IN :You must be logged in to get a session token.", me.name);
+            return;
+        }
+        if (!session_token_issue(acc, token, sizeof(token), &expires))
+        {
+            sendto_one(client, NULL, ":%s FAIL SESSIONTOKEN DISABLED :Session tokens are not available on this server.", me.name);
+            return;
+        }
+        sendto_one(client, NULL, ":%s SESSIONTOKEN SUCCESS %s %lld :Use this token with SASL SESSION-COOKIE to log in again.", me.name, token, (long long)expires);
+        return;
+    }
+    if (parc >= 3 && !strcasecmp(parv[1], "REVOKE"))
+    {
+        uint64_t token_id;
+
+        add_fake_lag(client, SESSION_REVOKE_FAKE_LAG);
+        // Only the owner of a token, or an oper, can revoke it
+        if (!(acc = session_token_verify(parv[2], &token_id, &expires))
+            || (!IsOper(client) && (!IsLoggedIn(client) || strcasecmp(client->user->account, acc->name))))
+        {
+            sendto_one(client, NULL, ":%s FAIL SESSIONTOKEN INVALID_TOKEN :That token is not valid or not yours.", me.name);
+            return;
+        }
+        // Each revocation is kept until the token expires, a password change drops all tokens at once
+        if (session_token_revocations(acc->id) >= SESSION_MAX_REVOCATIONS)
+        {
+            sendto_one(client, NULL, ":%s FAIL SESSIONTOKEN TOO_MANY_REVOCATIONS :Too many revoked tokens on this account, change the password to revoke all of them.", me.name);
+            return;
+        }
+        session_token_revoke(token_id, acc->id, expires);
+        if (!db_write_session_revoke(token_id, acc->id, expires))
+        {
+            sendto_one(client, NULL, ":%s FAIL SESSIONTOKEN INTERNAL_ERROR :The token was revoked until the next restart only.", me.name);
+            return;
+        }
+        sendto_one(client, NULL, ":%s SESSIONTOKEN REVOKED :The token can no longer be used.", me.name);
+        return;
+    }
+    sendto_one(client, NULL, ":%s FAIL SESSIONTOKEN INVALID_PARAMS :Usage: SESSIONTOKEN ISSUE | SESSIONTOKEN REVOKE <token>", me.name);
+}
+
+// Certificate fingerprints for SASL EXTERNAL, on the account you are logged into:
+// CERTFP ADD (the certificate you are connected with, opers may give any <fingerprint>),
+// CERTFP DEL <fingerprint> and CERTFP LIST.
+CMD_FUNC(cmd_certfp)
+{
+    char certfp[CERTFP_LENGTH + 1];
+    const char *list[ACCOUNT_MAX_CERTFPS];
+    Account *acc;
+
+    if (parc < 2 || BadPtr(parv[1]))
+    {
+        sendto_one(client, NULL, ":%s FAIL CERTFP INVALID_PARAMS :Usage: CERTFP ADD [<fingerprint>] | CERTFP DEL <fingerprint> | CERTFP LIST", me.name);
+        return;
+    }
+    if (!IsLoggedIn(client) || !(acc = find_cached_account(client->user->account)))
+    {
+        sendto_one(client, NULL, ":%s FAIL CERTFP NOT_LOGGED_IN :You must be logged in to manage certificate fingerprints.", me.name);
+        return;
+    }
+    if (!strcasecmp(parv[1], "LIST"))
+    {
+        int n = certfp_list(acc, list, ACCOUNT_MAX_CERTFPS);
+        for (int i = 0; i < n && i < ACCOUNT_MAX_CERTFPS; i++)
+        {
+            sendto_one(client, NULL, ":%s CERTFP %s %s", me.name, acc->name, list[i]);
+        }
+        sendto_one(client, NULL, ":%s CERTFP %s * :End of certificate fingerprints", me.name, acc->name);
+        return;
+    }
+    if (!strcasecmp(parv[1], "ADD"))
+    {
+        const char *connected = moddata_client_get(client, "certfp");
+        const char *fp = parc >= 3 && !BadPtr(parv[2]) ? parv[2] : connected;
+        int result;
+
+        if (!fp || !valid_certfp(fp, certfp))
+        {
+            sendto_one(client, NULL, ":%s FAIL CERTFP INVALID_FINGERPRINT :Connect with the client certificate you want to add.", me.name);
+            return;
+        }
+        // A fingerprint is a login, only whoever holds the certificate may add it
+        if (!IsOper(client) && (!connected || strcasecmp(connected, certfp)))
+        {
+            sendto_one(client, NULL, ":%s FAIL CERTFP NOT_YOUR_CERTIFICATE %s :You can only add the certificate you are connected with.", me.name, certfp);
+            return;
+        }
+        result = certfp_add(acc, certfp);
+        if (result == 0)
+        {
+            sendto_one(client, NULL, ":%s FAIL CERTFP FINGERPRINT_IN_USE %s :That fingerprint belongs to another account.", me.name, certfp);
+        }
+        else if (result < 0)
+        {
+            sendto_one(client, NULL, ":%s FAIL CERTFP TOO_MANY_FINGERPRINTS :An account can have at most %d fingerprints.", me.name, ACCOUNT_MAX_CERTFPS);
+        }
+        else
+        {
+            sendto_one(client, NULL, ":%s CERTFP ADDED %s :You can now log in with SASL EXTERNAL using this certificate.", me.name, certfp);
+        }
         return;
     }
-
-    Account **accounts = read_accounts_from_db(NULL);
-    if (!accounts || !accounts[0])
+    if (!strcasecmp(parv[1], "DEL"))
     {
-        free(accounts);
-        rpc_error(client, request, JSON_RPC_ERROR_NOT_FOUND, "No accounts registered.");
+        if (parc < 3 || BadPtr(parv[2]) || !valid_certfp(parv[2], certfp) || !certfp_del(acc, certfp))
+        {
+            sendto_one(client, NULL, ":%s FAIL CERTFP NOT_FOUND :That fingerprint is not on your account.", me.name);
+            return;
+        }
+        sendto_one(client, NULL, ":%s CERTFP REMOVED %s :The certificate can no longer be used to log in.", me.name, certfp);
         return;
     }
-
-    json_t *jaccounts = json_array(), *result = json_object();
-    for (size_t i = 0; accounts[i]; i++)
-    {
-        json_t *jacc = account2json(accounts[i]);
-        json_array_append_new(jaccounts, jacc);
-        free_account(accounts[i]);
-    }
-    free(accounts);
-    json_object_set_new(result, "accounts", jaccounts);
-    rpc_response(client, request, result);
-    json_decref(result);
+    sendto_one(client, NULL, ":%s FAIL CERTFP INVALID_PARAMS :Usage: CERTFP ADD [<fingerprint>] | CERTFP DEL <fingerprint> | CERTFP LIST", me.name);
 }
 
-RPC_CALL_FUNC(rpc_accounts_find)
+// Account metadata: ACCOUNTMETA GET <account> [<key>] for anyone,
+// ACCOUNTMETA SET <key> [:<value>] on your own account (no value deletes the key).
+CMD_FUNC(cmd_accountmeta)
 {
-    if (!db)
+    Account *acc;
+
+    if (parc >= 3 && !strcasecmp(parv[1], "GET"))
     {
-        rpc_error(client, request, JSON_RPC_ERROR_INTERNAL_ERROR, "Database is not available.");
+        if (!(acc = find_cached_account(parv[2])))
+        {
+            sendto_one(client, NULL, ":%s FAIL ACCOUNTMETA ACCOUNT_NOT_FOUND %s :Account not found.", me.name, parv[2]);
+            return;
+        }
+        AccountMetadata *copy;
+        const AccountMetadata *md = account_metadata_peek(acc, &copy);
+        for (const char *key = metadata_first(md); key; key = metadata_next(md, key))
+        {
+            if (parc < 4 || BadPtr(parv[3]) || !strcmp(parv[3], key))
+            {
+                sendto_one(client, NULL, ":%s ACCOUNTMETA %s %s :%s", me.name, acc->name, key, metadata_value(key));
+            }
+        }
+        free(copy);
+        sendto_one(client, NULL, ":%s ACCOUNTMETA %s * :End of metadata", me.name, acc->name);
         return;
     }
-    const char *name;
-    REQUIRE_PARAM_STRING("name", name);
-
-    Account *acc = find_account(name);
-    if (!acc)
+    if (parc >= 3 && !strcasecmp(parv[1], "SET"))
     {
-        rpc_error(client, request, JSON_RPC_ERROR_NOT_FOUND, "Account not found.");
+        const char *value = parc >= 4 && !BadPtr(parv[3]) ? parv[3] : NULL;
+
+        if (!IsLoggedIn(client) || !(acc = find_cached_account(client->user->account)))
+        {
+            sendto_one(client, NULL, ":%s FAIL ACCOUNTMETA NOT_LOGGED_IN :You must be logged in to set account metadata.", me.name);
+            return;
+        }
+        if (!valid_metadata_key(parv[2]))
+        {
+            sendto_one(client, NULL, ":%s FAIL ACCOUNTMETA INVALID_KEY %s :Keys are up to %d lowercase letters, digits and _-./", me.name, parv[2], ACCOUNT_METADATA_MAX_KEY_LENGTH);
+            return;
+        }
+        if (value && !valid_metadata_value(value))
+        {
+            sendto_one(client, NULL, ":%s FAIL ACCOUNTMETA INVALID_VALUE %s :Values are at most %d characters, without control characters.", me.name, parv[2], ACCOUNT_METADATA_MAX_VALUE_LENGTH);
+            return;
+        }
+        if (!account_metadata_set(acc, parv[2], value))
+        {
+            sendto_one(client, NULL, ":%s FAIL ACCOUNTMETA LIMIT_REACHED %s :An account can have at most %d metadata keys.", me.name, parv[2], ACCOUNT_METADATA_MAX_KEYS);
+            return;
+        }
+        sendto_one(client, NULL, ":%s ACCOUNTMETA %s %s :%s", me.name, acc->name, parv[2], value ? value : "");
         return;
     }
-
-    json_t *jacc = account2json(acc);
-    rpc_response(client, request, jacc);
-    json_decref(jacc);
-    free_account(acc);
+    sendto_one(client, NULL, ":%s NOTE ACCOUNTMETA INVALID_PARAMS :Syntax: /ACCOUNTMETA GET <account> [<key>] or /ACCOUNTMETA SET <key> [:<value>]", me.name);
 }
 
-// For users who don't support SASL, we provide a way to identify to an account
-// using the IDENTIFY command. This is a fallback for those who cannot use SASL.
-CMD_FUNC(cmd_identify)
+
+
+/**
+ * accountdb_path - Builds the path of an ACCOUNTDB file, which always lives in the data directory.
+ * Returns 1 on success, 0 if the name is not a plain file name.
+ */
+static int accountdb_path(const char *file, char *buf, size_t len)
 {
-    if (!db && open_database(OBSIDIAN_DB) != SQLITE_OK)
-    {
-        sendto_one(client, NULL, ":%s FAIL IDENTIFY SERVER_BUG :Database unavailable.", me.name);
-        return;
-    }
-    if (parc < 3)
+    if (BadPtr(file) || *file == '.' || strchr(file, '/') || strlen(file) > 200)
     {
-        sendto_one(client, NULL, ":%s NOTE IDENTIFY INVALID_PARAMS :Syntax: /IDENTIFY <account> <password>", me.name);
-        return;
+        return 0;
     }
-    const char *account_name = parv[1];
-    if (!account_name || !*account_name)
+    snprintf(buf, len, "%s/%s", PERMDATADIR, file);
+    return 1;
+}
+
+/**
+ * accountdb_done - Done callback of ACCOUNTDB imports and exports.
+ */
+static void accountdb_done(DbWrite *w)
+{
+    Client *client = *w->client_id ? hash_find_id(w->client_id, NULL) : NULL;
+    const char *what = w->type == DB_WRITE_IMPORT ? "IMPORT" : "EXPORT";
+
+    if (client && (!MyConnect(client) || IsDead(client)))
     {
-        sendto_one(client, NULL, ":%s FAIL IDENTIFY INVALID_ACCOUNT :Account name cannot be empty.", me.name);
-        return;
+        client = NULL;
     }
-    if (!strcasecmp(account_name, client->user->account))
+    if (w->type == DB_WRITE_IMPORT)
     {
-        sendto_one(client, NULL, ":%s FAIL IDENTIFY ALREADY_IDENTIFIED :You are already identified to account %s.", me.name, account_name);
-        return;
+        add_cached_accounts(w->imported);
+        w->imported = NULL;
+        obsacc_resync();
     }
-    if (strlen(account_name) < 4)
+    unreal_log(w->result == SQLITE_DONE ? ULOG_INFO : ULOG_ERROR, "account", w->type == DB_WRITE_IMPORT ? "ACCOUNT_IMPORT" : "ACCOUNT_EXPORT", client,
+        "Account $what of $file: $rows accounts, $skipped already registered, $invalid invalid lines [result: $result]",
+        log_data_string("what", w->type == DB_WRITE_IMPORT ? "import" : "export"),
+        log_data_string("file", w->path),
+        log_data_integer("rows", w->rows),
+        log_data_integer("skipped", w->skipped),
+        log_data_integer("invalid", w->invalid),
+        log_data_string("result", sqlite3_errstr(w->result))
+    );
+    if (!client)
     {
-        sendto_one(client, NULL, ":%s FAIL IDENTIFY INVALID_ACCOUNT :Account name must be at least 4 characters long.", me.name);
         return;
     }
-    Client *found_user = find_client(account_name, NULL);
-    if (found_user && found_user != client)
+    if (w->result == SQLITE_DONE)
     {
-        sendto_one(client, NULL, ":%s FAIL IDENTIFY INVALID_ACCOUNT :That account name is currently in use.", me.name);
-        return;
+        sendto_one(client, NULL, ":%s ACCOUNTDB %s %lu %lu %lu :Done, %lu accounts, %lu already registered, %lu invalid lines.", me.name, what,
+                   w->rows, w->skipped, w->invalid, w->rows, w->skipped, w->invalid);
     }
-    TKL *ban = my_find_tkl_nameban(account_name);
-    if (ban)
+    else
     {
-        sendto_one(client, NULL, ":%s FAIL IDENTIFY INVALID_ACCOUNT :That account name is banned.", me.name);
-        return;
+        sendto_one(client, NULL, ":%s FAIL ACCOUNTDB %s :Stopped after %lu accounts: %s", me.name, what, w->rows, sqlite3_errstr(w->result));
     }
+}
 
-    const char *password = parv[2];
-    if (!password || !*password)
+// Bulk account moves: ACCOUNTDB IMPORT|EXPORT <file>, with <file> in the data directory.
+// Imports take NDJSON lines of pre-hashed accounts, the format EXPORT writes.
+CMD_FUNC(cmd_accountdb)
+{
+    char path[PATH_MAX];
+    DbWriteType type;
+
+    if (parc < 3 || (strcasecmp(parv[1], "IMPORT") && strcasecmp(parv[1], "EXPORT")))
     {
-        sendto_one(client, NULL, ":%s FAIL IDENTIFY INVALID_PASSWORD :Password cannot be empty.", me.name);
+        sendto_one(client, NULL, ":%s NOTE ACCOUNTDB INVALID_PARAMS :Syntax: /ACCOUNTDB IMPORT|EXPORT <file>", me.name);
         return;
     }
-
-    if (!client->user || !client->user->account || !*client->user->account)
+    type = !strcasecmp(parv[1], "IMPORT") ? DB_WRITE_IMPORT : DB_WRITE_EXPORT;
+    if (!accountdb_path(parv[2], path, sizeof(path)))
     {
-        sendto_one(client, NULL, ":%s FAIL IDENTIFY NOT_LOGGED_IN :You must be logged in to identify.", me.name);
+        sendto_one(client, NULL, ":%s FAIL ACCOUNTDB INVALID_FILE %s :Give the name of a file in the data directory.", me.name, parv[2]);
         return;
     }
-    Account *acc = find_account(account_name);
-    if (!acc)
+    if (!db_write_transfer(client, type, path, accountdb_done))
     {
-        sendto_one(client, NULL, ":%s FAIL IDENTIFY ACCOUNT_NOT_FOUND :Account %s not found.", me.name, account_name);
+        sendto_one(client, NULL, ":%s FAIL ACCOUNTDB TEMPORARILY_UNAVAILABLE :The database writer is not running.", me.name);
         return;
     }
+    sendto_one(client, NULL, ":%s NOTE ACCOUNTDB STARTED %s :Working in the background, you'll be told when it is done.", me.name, path);
+}
+
+/**
+ * rpc_accounts_transfer - Shared by obsidianirc.accounts.import and .export. The call only
+ * starts the job, the outcome is logged (ACCOUNT_IMPORT / ACCOUNT_EXPORT).
+ */
+static void rpc_accounts_transfer(Client *client, json_t *request, json_t *params, DbWriteType type)
+{
+    const char *file;
+    char path[PATH_MAX];
+    REQUIRE_PARAM_STRING("file", file);
 
-    if (argon2_verify(acc->password, password, strlen(password), Argon2_id) == ARGON2_OK)
+    if (!accountdb_path(file, path, sizeof(path)))
     {
-        sendto_one(client, NULL, ":%s IDENTIFY SUCCESS %s :You have been successfully identified.", me.name, acc->name);
-        strlcpy(client->user->account, acc->name, sizeof(client->user->account));
-        user_account_login(NULL, client);
-        DelSaslType(client);
-        unreal_log(ULOG_INFO, "account", "IDENTIFY", client,
-            "User $client.details identified [account: $account] [email: $email]",
-            log_data_string("email", acc->email),
-            log_data_string("account", acc->name)
-        );
+        rpc_error(client, request, JSON_RPC_ERROR_INVALID_PARAMS, "Parameter 'file' must be the name of a file in the data directory.");
+        return;
     }
-    else
+    if (!db_write_transfer(NULL, type, path, accountdb_done))
     {
-        sendto_one(client, NULL, ":%s FAIL IDENTIFY INVALID_PASSWORD :Invalid password for account %s.", me.name, acc->name);
-        client->local->sasl_sent_time = 0;
-        add_fake_lag(client, 7000);
+        rpc_error(client, request, JSON_RPC_ERROR_INTERNAL_ERROR, "The database writer is not running.");
+        return;
     }
-    
-    free_account(acc);
+    json_t *result = json_object();
+    json_object_set_new(result, "started", json_true());
+    json_object_set_new(result, "path", json_string(path));
+    rpc_response(client, request, result);
+    json_decref(result);
 }
 
-CMD_FUNC(cmd_logout)
+RPC_CALL_FUNC(rpc_accounts_import)
 {
-    if (!IsLoggedIn(client))
-    {
-        sendto_one(client, NULL, ":%s FAIL LOGOUT NOT_LOGGED_IN :You are not logged in.", me.name);
-        return;
-    }
-    strlcpy(client->user->account, "0", sizeof(client->user->account));
-    user_account_login(NULL, client);
-    sendto_one(client, NULL, ":%s LOGOUT SUCCESS :You have been logged out successfully.", me.name);
+    rpc_accounts_transfer(client, request, params, DB_WRITE_IMPORT);
 }
 
-
+RPC_CALL_FUNC(rpc_accounts_export)
+{
+    rpc_accounts_transfer(client, request, params, DB_WRITE_EXPORT);
+}
 
 // Set defaults for the configuration settings here (called in MOD_INIT)
 void set_accreg_conf(void)
@@ -893,7 +6247,15 @@ void set_accreg_conf(void)
     MyConf.allow_username_changes = 1;
     MyConf.allow_password_changes = 1;
     MyConf.allow_email_changes = 1;
-    safe_strdup(MyConf.guest_nick_format, "Guest$d$d$d$d")
+    safe_strdup(MyConf.guest_nick_format, "Guest$d$d$d$d");
+    MyConf.auth_threads = DEFAULT_AUTH_THREADS;
+    MyConf.auth_queue_depth = DEFAULT_AUTH_QUEUE_DEPTH;
+    MyConf.nick_enforce_delay = DEFAULT_NICK_ENFORCE_DELAY;
+    MyConf.session_token_lifetime = DEFAULT_SESSION_TOKEN_LIFETIME;
+    MyConf.login_limit_account = DEFAULT_LOGIN_LIMIT_ACCOUNT;
+    MyConf.login_limit_ip = DEFAULT_LOGIN_LIMIT_IP;
+    MyConf.login_limit_window = DEFAULT_LOGIN_LIMIT_WINDOW;
+    MyConf.login_limit_sync = 0;
 }
 
 // Free the memory allocated for the configuration settings here (called in MOD_UNLOAD)
@@ -1058,6 +6420,121 @@ int accreg_configtest(ConfigFile *cf, ConfigEntry *ce, int type, int *errs)
             MyConf.got_guest_nick_format = true;
             continue;
         }
+        if (!strcmp(cep->name, "auth-threads"))
+        {
+            if (MyConf.got_auth_threads)
+            {
+                config_error("%s:%i: duplicate %s::%s", cep->file->filename, cep->line_number, CONF_ACCOUNT_BLOCK, cep->name);
+                errors++;
+            }
+            if (atoi(cep->value) < MIN_AUTH_THREADS || atoi(cep->value) > MAX_AUTH_THREADS)
+            {
+                config_error("%s:%i: %s::%s must be between %d and %d", cep->file->filename, cep->line_number, CONF_ACCOUNT_BLOCK, cep->name, MIN_AUTH_THREADS, MAX_AUTH_THREADS);
+                errors++;
+            }
+            MyConf.got_auth_threads = true;
+            continue;
+        }
+        if (!strcmp(cep->name, "auth-queue-depth"))
+        {
+            if (MyConf.got_auth_queue_depth)
+            {
+                config_error("%s:%i: duplicate %s::%s", cep->file->filename, cep->line_number, CONF_ACCOUNT_BLOCK, cep->name);
+                errors++;
+            }
+            if (atoi(cep->value) < MIN_AUTH_QUEUE_DEPTH || atoi(cep->value) > MAX_AUTH_QUEUE_DEPTH)
+            {
+                config_error("%s:%i: %s::%s must be between %d and %d", cep->file->filename, cep->line_number, CONF_ACCOUNT_BLOCK, cep->name, MIN_AUTH_QUEUE_DEPTH, MAX_AUTH_QUEUE_DEPTH);
+                errors++;
+            }
+            MyConf.got_auth_queue_depth = true;
+            continue;
+        }
+        if (!strcmp(cep->name, "nick-enforce-delay"))
+        {
+            if (MyConf.got_nick_enforce_delay)
+            {
+                config_error("%s:%i: duplicate %s::%s", cep->file->filename, cep->line_number, CONF_ACCOUNT_BLOCK, cep->name);
+                errors++;
+            }
+            if (BadPtr(cep->value) || config_checkval(cep->value, CFG_TIME) < 0 || config_checkval(cep->value, CFG_TIME) > MAX_NICK_ENFORCE_DELAY)
+            {
+                config_error("%s:%i: %s::%s must be a time between 0 (off) and %d seconds", cep->file->filename, cep->line_number, CONF_ACCOUNT_BLOCK, cep->name, MAX_NICK_ENFORCE_DELAY);
+                errors++;
+            }
+            MyConf.got_nick_enforce_delay = true;
+            continue;
+        }
+        if (!strcmp(cep->name, "session-token-lifetime"))
+        {
+            if (MyConf.got_session_token_lifetime)
+            {
+                config_error("%s:%i: duplicate %s::%s", cep->file->filename, cep->line_number, CONF_ACCOUNT_BLOCK, cep->name);
+                errors++;
+            }
+            if (BadPtr(cep->value) || config_checkval(cep->value, CFG_TIME) < 0 || config_checkval(cep->value, CFG_TIME) > MAX_SESSION_TOKEN_LIFETIME)
+            {
+                config_error("%s:%i: %s::%s must be a time between 0 (off) and %d seconds", cep->file->filename, cep->line_number, CONF_ACCOUNT_BLOCK, cep->name, MAX_SESSION_TOKEN_LIFETIME);
+                errors++;
+            }
+            MyConf.got_session_token_lifetime = true;
+            continue;
+        }
+        if (!strcmp(cep->name, "login-limit-account"))
+        {
+            if (MyConf.got_login_limit_account)
+            {
+                config_error("%s:%i: duplicate %s::%s", cep->file->filename, cep->line_number, CONF_ACCOUNT_BLOCK, cep->name);
+                errors++;
+            }
+            if (atoi(cep->value) < 0 || atoi(cep->value) > MAX_LOGIN_LIMIT)
+            {
+                config_error("%s:%i: %s::%s must be between 0 (off) and %d", cep->file->filename, cep->line_number, CONF_ACCOUNT_BLOCK, cep->name, MAX_LOGIN_LIMIT);
+                errors++;
+            }
+            MyConf.got_login_limit_account = true;
+            continue;
+        }
+        if (!strcmp(cep->name, "login-limit-ip"))
+        {
+            if (MyConf.got_login_limit_ip)
+            {
+                config_error("%s:%i: duplicate %s::%s", cep->file->filename, cep->line_number, CONF_ACCOUNT_BLOCK, cep->name);
+                errors++;
+            }
+            if (atoi(cep->value) < 0 || atoi(cep->value) > MAX_LOGIN_LIMIT)
+            {
+                config_error("%s:%i: %s::%s must be between 0 (off) and %d", cep->file->filename, cep->line_number, CONF_ACCOUNT_BLOCK, cep->name, MAX_LOGIN_LIMIT);
+                errors++;
+            }
+            MyConf.got_login_limit_ip = true;
+            continue;
+        }
+        if (!strcmp(cep->name, "login-limit-window"))
+        {
+            if (MyConf.got_login_limit_window)
+            {
+                config_error("%s:%i: duplicate %s::%s", cep->file->filename, cep->line_number, CONF_ACCOUNT_BLOCK, cep->name);
+                errors++;
+            }
+            if (BadPtr(cep->value) || config_checkval(cep->value, CFG_TIME) < 1 || config_checkval(cep->value, CFG_TIME) > MAX_LOGIN_LIMIT_WINDOW)
+            {
+                config_error("%s:%i: %s::%s must be a time between 1 and %d seconds", cep->file->filename, cep->line_number, CONF_ACCOUNT_BLOCK, cep->name, MAX_LOGIN_LIMIT_WINDOW);
+                errors++;
+            }
+            MyConf.got_login_limit_window = true;
+            continue;
+        }
+        if (!strcmp(cep->name, "login-limit-sync"))
+        {
+            if (MyConf.got_login_limit_sync)
+            {
+                config_error("%s:%i: duplicate %s::%s", cep->file->filename, cep->line_number, CONF_ACCOUNT_BLOCK, cep->name);
+                errors++;
+            }
+            MyConf.got_login_limit_sync = true;
+            continue;
+        }
         // Unknown directive, warn about it
         config_warn("%s:%i: unknown item %s::%s", cep->file->filename, cep->line_number, CONF_ACCOUNT_BLOCK, cep->name);
     }
@@ -1128,7 +6605,7 @@ int accreg_configrun(ConfigFile *cf, ConfigEntry *ce, int type)
             MyConf.allow_email_changes = config_checkval(cep->value, CFG_YESNO);
             continue;
         }
-        if (!strcmp(cep->name, "guest-prefix"))
+        if (!strcmp(cep->name, "guest-nick-format"))
         {
             if (MyConf.guest_nick_format)
             {
@@ -1137,47 +6614,108 @@ int accreg_configrun(ConfigFile *cf, ConfigEntry *ce, int type)
             MyConf.guest_nick_format = strdup(cep->value);
             continue;
         }
+        // Thread count is only read when the pool starts (MOD_LOAD), the queue depth applies right away
+        if (!strcmp(cep->name, "auth-threads"))
+        {
+            MyConf.auth_threads = atoi(cep->value);
+            continue;
+        }
+        if (!strcmp(cep->name, "auth-queue-depth"))
+        {
+            MyConf.auth_queue_depth = atoi(cep->value);
+            continue;
+        }
+        // Takes effect for nick changes from now on, running countdowns keep their deadline
+        if (!strcmp(cep->name, "nick-enforce-delay"))
+        {
+            MyConf.nick_enforce_delay = config_checkval(cep->value, CFG_TIME);
+            continue;
+        }
+        // Only new tokens get the new lifetime, the expiry is part of the signed token
+        if (!strcmp(cep->name, "session-token-lifetime"))
+        {
+            MyConf.session_token_lifetime = config_checkval(cep->value, CFG_TIME);
+            continue;
+        }
+        if (!strcmp(cep->name, "login-limit-account"))
+        {
+            MyConf.login_limit_account = atoi(cep->value);
+            continue;
+        }
+        if (!strcmp(cep->name, "login-limit-ip"))
+        {
+            MyConf.login_limit_ip = atoi(cep->value);
+            continue;
+        }
+        if (!strcmp(cep->name, "login-limit-window"))
+        {
+            MyConf.login_limit_window = config_checkval(cep->value, CFG_TIME);
+            continue;
+        }
+        if (!strcmp(cep->name, "login-limit-sync"))
+        {
+            MyConf.login_limit_sync = config_checkval(cep->value, CFG_YESNO);
+            continue;
+        }
     }
 
     return 1;
 }
 
-// Convert $d to a random digit and $n to a users nick
-char *convert_guest_nick_format(const char *format, Client *client)
+/**
+ * convert_guest_nick_format - Writes a guest nick into buf (at most buflen - 1 characters).
+ * $d takes the digits of seq, the last $d being the lowest one, $n the current nick of the client.
+ * Returns the length written.
+ */
+size_t convert_guest_nick_format(const char *format, Client *client, unsigned long seq, char *buf, size_t buflen)
 {
-    if (!format || !*format)
+    char digits[NICKLEN + 1];
+    int ndigits = 0, d = 0;
+    size_t j = 0;
+    const char *p;
+
+    if (!buflen)
     {
-        return NULL;
+        return 0;
+    }
+    if (!format)
+    {
+        format = "";
+    }
+    for (p = format; *p; p++)
+    {
+        if (p[0] == '$' && p[1] == 'd' && ndigits < NICKLEN)
+        {
+            ndigits++;
+            p++;
+        }
+    }
+    for (int i = ndigits - 1; i >= 0; i--, seq /= 10)
+    {
+        digits[i] = '0' + (seq % 10);
     }
-    size_t len = strlen(format);
-    char *result = safe_alloc(len + 1);
-    size_t j = 0;
 
-    for (size_t i = 0; i < len; i++)
+    for (p = format; *p && j < buflen - 1; p++)
     {
-        if (format[i] == '$')
+        if (p[0] == '$' && p[1] == 'd')
         {
-            i++;
-            if (i < len && format[i] == 'd') // Random digit
-            {
-                result[j++] = '0' + (rand() % 10);
-            }
-            else if (i < len && format[i] == 'n' && client && client->name) // User's nick
-            {
-                strlcpy(result + j, client->name, len - j + 1);
-                j += strlen(client->name);
-            }
-            else
+            buf[j++] = d < ndigits ? digits[d++] : '0';
+            p++;
+        }
+        else if (p[0] == '$' && p[1] == 'n')
+        {
+            j += strlcpy(buf + j, client ? client->name : "", buflen - j);
+            if (j > buflen - 1)
             {
-                result[j++] = '$'; // Just a literal $
-                if (i < len) result[j++] = format[i];
+                j = buflen - 1;
             }
+            p++;
         }
         else
         {
-            result[j++] = format[i];
+            buf[j++] = *p; // Including a $ that isn't followed by d or n
         }
     }
-    result[j] = '\0';
-    return result;
+    buf[j] = '\0';
+    return j;
 }
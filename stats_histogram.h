@@ -0,0 +1,73 @@
+#ifndef STATS_HISTOGRAM_H
+#define STATS_HISTOGRAM_H
+
+// Log2 histograms for the STATS and JSON-RPC stats of obsidianirc.c and o-filehost.c.
+// Both modules include this after unrealircd.h, so there is one copy and the same JSON layout in both.
+
+// Buckets, enough for nanosecond timings of about a minute
+#define STATS_HISTOGRAM_BUCKETS 36
+
+// Bucket i counts values in [2^i, 2^(i+1)) and bucket 0 also counts 0.
+// Only updated on the main loop, worker threads hand their timings back.
+typedef struct StatsHistogram {
+    unsigned long count;
+    uint64_t sum;
+    unsigned long buckets[STATS_HISTOGRAM_BUCKETS];
+} StatsHistogram;
+
+/**
+ * histogram_add - Counts a value in the log2 bucket it falls in.
+ */
+static inline void histogram_add(StatsHistogram *h, uint64_t value)
+{
+    int bucket = value ? 63 - __builtin_clzll(value) : 0;
+
+    h->count++;
+    h->sum += value;
+    h->buckets[MIN(bucket, STATS_HISTOGRAM_BUCKETS - 1)]++;
+}
+
+/**
+ * histogram_percentile - Returns the upper bound of the bucket the given percentile falls in,
+ * so only right to within a factor of two.
+ */
+static inline uint64_t histogram_percentile(const StatsHistogram *h, int percent)
+{
+    unsigned long seen = 0, wanted = (h->count * percent + 99) / 100;
+
+    for (int i = 0; i < STATS_HISTOGRAM_BUCKETS; i++)
+    {
+        seen += h->buckets[i];
+        if (seen && seen >= wanted)
+        {
+            return (2ULL << i) - 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * histogram2json - Converts a StatsHistogram to a JSON object with cumulative
+ * buckets, the way Prometheus histograms are exposed ("le" is inclusive).
+ * Returns a new json_t* object.
+ */
+static inline json_t *histogram2json(const StatsHistogram *h)
+{
+    json_t *j = json_object(), *jbuckets = json_array();
+    unsigned long cumulative = 0;
+
+    for (int i = 0; i < STATS_HISTOGRAM_BUCKETS; i++)
+    {
+        json_t *jbucket = json_object();
+        cumulative += h->buckets[i];
+        json_object_set_new(jbucket, "le", json_integer((json_int_t)((2ULL << i) - 1)));
+        json_object_set_new(jbucket, "count", json_integer(cumulative));
+        json_array_append_new(jbuckets, jbucket);
+    }
+    json_object_set_new(j, "count", json_integer(h->count));
+    json_object_set_new(j, "sum", json_integer((json_int_t)h->sum));
+    json_object_set_new(j, "buckets", jbuckets);
+    return j;
+}
+
+#endif